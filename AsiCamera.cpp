@@ -22,6 +22,9 @@
 //                limitations under the License.
 
 #include "ASICamera.h"
+
+#include <chrono>
+#include <thread>
 using namespace std;
 
 const char* cameraName = "ASICamera";
@@ -57,78 +60,213 @@ const char* g_Keyword_Flip = "Flip";
 const char* g_Keyword_HighSpeedMode = "High Speed Mode";
 const char* g_Keyword_HardwareBin = "Hardware Bin";
 const char* g_Keyword_USBHost = "USB Host";
-
-
-
-
-
-#include <fstream>
-#include <iostream>
-#include <cstdarg>
-#include <string>
-#include <ctime>
-
-void LogToFile(const char* format, ...) {
-	std::ofstream logFile;
-	logFile.open("ASICamera_mg_log.txt", std::ios_base::app); // Открываем файл для добавления
-
-	if (!logFile.is_open()) return;
-
-	// Получаем текущее время
-	std::time_t now = std::time(nullptr);
-	logFile << std::asctime(std::localtime(&now)) << " - ";
-
-	// Форматируем строку
-	char buffer[256];
-	va_list args;
-	va_start(args, format);
-	vsnprintf(buffer, sizeof(buffer), format, args);
-	va_end(args);
-
-	// Записываем строку в файл
-	logFile << buffer << std::endl;
-	logFile.close();
+const char* g_Keyword_FrameQueueDepth = "Frame Queue Depth";
+const char* g_Keyword_FrameQueueOccupancy = "Frame Queue Occupancy";
+const char* g_Keyword_FrameQueueHighWater = "Frame Queue High Water Mark";
+const char* g_Keyword_SdkCallsPerFrame = "SDK Calls Per Frame";
+const char* g_Keyword_OverflowPolicy = "Buffer Overflow Policy";
+const char* g_Keyword_OverflowTimeout = "Buffer Overflow Block Timeout ms";
+const char* g_Keyword_ConversionKernel = "Conversion Kernel";
+const char* g_Keyword_WorkerThreads = "Worker Threads";
+const char* g_Keyword_WorkerAffinity = "Worker CPU Affinity Mask";
+const char* g_Keyword_SoftBin = "Software Binning";
+const char* g_Keyword_SoftBinMode = "Software Binning Mode";
+const char* g_Keyword_SoftBinOutput = "Software Binning Sum Output";
+const char* g_SoftBinMode_Sum = "sum";
+const char* g_SoftBinMode_Average = "average";
+const char* g_SoftBinOutput_Saturate = "saturate";
+const char* g_SoftBinOutput_Widen = "widen 8-bit to 16-bit";
+const char* g_Keyword_Debayer = "Debayer";
+const char* g_Debayer[] = { "SDK (RGB24)", "host bilinear", "host edge-aware" };
+const char* g_Keyword_StackFrames = "Stack Frames";
+const char* g_Keyword_StackOperator = "Stack Operator";
+const char* g_Keyword_StackKappa = "Stack Sigma Clip Kappa";
+const char* g_StackOperator[] = { "sum", "mean", "min", "max", "sigma-clipped mean" };
+const char* g_Keyword_Calibration = "Calibration";
+const char* g_Keyword_CalibrationFile[] = { "Calibration Dark File", "Calibration Flat File" };
+const char* g_Keyword_CaptureMaster = "Calibration Capture Master";
+const char* g_Keyword_MasterFrames = "Calibration Master Frames";
+const char* g_Keyword_CalibrationStatus = "Calibration Status";
+const char* g_CaptureMaster_Idle = "idle";
+const char* g_CaptureMaster[] = { "dark", "flat" };
+const char* g_CalibrationStatus[] = { "applied", "no master loaded", "pixel type is not RAW8/RAW16", "master binning differs", "ROI outside the master" };
+const char* g_Keyword_DarkLibrary = "Dark Library";
+const char* g_Keyword_DarkLibraryDir = "Dark Library Directory";
+const char* g_Keyword_DarkLibraryTempStep = "Dark Library Temperature Step C";
+const char* g_Keyword_DarkLibraryInfo[] = { "Dark Library Entries", "Dark Library Selected", "Dark Library Cache Hits", "Dark Library Cache Misses" };
+const char* g_Keyword_HotPixels = "Hot Pixel Correction";
+const char* g_Keyword_HotPixelDir = "Hot Pixel Directory";
+const char* g_Keyword_HotPixelDetect = "Hot Pixel Detect";
+const char* g_Keyword_HotPixelMode = "Hot Pixel Detection Mode";
+const char* g_Keyword_HotPixelSigma = "Hot Pixel Sigma";
+const char* g_Keyword_HotPixelThreshold = "Hot Pixel Threshold ADU";
+const char* g_Keyword_HotPixelCount = "Hot Pixel Count";
+const char* g_HotPixelDetect_Idle = "idle";
+const char* g_HotPixelDetect_Run = "detect from dark";
+const char* g_HotPixelMode[] = { "sigma", "threshold" };
+const char* g_Keyword_Statistics = "Statistics";
+const char* g_Keyword_StatsRowStride = "Statistics Row Stride";
+const char* g_Keyword_StatsRegions = "Statistics Regions";
+const char* g_Keyword_StatsInfo[] = { "Statistics Min", "Statistics Max", "Statistics Mean", "Statistics StdDev", "Statistics Saturated", "Statistics Histogram", "Statistics Region Results" };
+const char* g_StatsField[] = { "Min", "Max", "Mean", "StdDev", "Saturated" };
+const char* g_Keyword_SnapPollInterval = "Snap Poll Interval us";
+const char* g_Keyword_SnapInfo[] = { "Snap Latency ms", "Snap Status Polls", "Snap Readout Estimate ms" };
+const char* g_Keyword_SnapMode = "Snap Mode";
+const char* g_SnapMode[] = { "auto", "single exposure", "stream" };
+const char* g_Keyword_SnapStreamMaxExposure = "Snap Stream Max Exposure ms";
+const char* g_Keyword_SnapArm = "Snap Arm Next";
+const char* g_SnapArm_Idle = "idle";
+const char* g_SnapArm_Arm = "arm";
+
+// a snap gives up this long after exposure plus readout should have ended
+const double g_SnapTimeoutSlackMs = 2000;
+// polling starts this far ahead of the expected end, at least
+const double g_SnapPollLeadMs = 5;
+// a sequence frame is given up this long after exposure plus readout should have ended
+const double g_FrameTimeoutSlackMs = 500;
+// usable link rate at ASI_BANDWIDTHOVERLOAD 100, bytes per ms
+const double g_Usb3BytesPerMs = 350e3;
+const double g_Usb2BytesPerMs = 40e3;
+
+// refresh rates of the control cache for values that change on their own
+const int g_TemperaturePollMs = 1000;
+const int g_CoolerPowerPollMs = 1000;
+
+// ASI_EXPOSURE is in microseconds
+static long ExposureToUs(double ms)
+{
+	return (long)(ms * 1000 + 0.5);
 }
 
-inline static void OutputDbgPrint(const char* strOutPutString, ...)
+static unsigned long long LatencyNowUs()
 {
-	//return; // лог только для отладки..
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// longest exposure sequence MMCore may load
+const long g_MaxExposureSequence = 1024;
+
+// frames below this are converted on the calling thread, waking the pool costs more
+const size_t g_MinParallelPixels = 1 << 19;
+
+// fps and ASIGetDroppedFrames are sampled once per window
+const double g_TelemetryWindowMs = 500;
+const char* g_Keyword_Telemetry[] = { "Delivered FPS", "Dropped Frames (SDK)", "Dropped Frames (pipeline)", "Dropped Frames (core overflow)" };
+
+const char* g_Keyword_ControlCacheAge = "Control Cache Age ms";
+const char* g_Keyword_SettingsTransaction = "Settings Transaction";
+const char* g_Transaction_Idle = "idle";
+const char* g_Transaction_Begin = "begin";
+const char* g_Transaction_Commit = "commit";
+const char* g_Transaction_Abort = "abort";
+const char* g_Keyword_PresetName = "Preset Name";
+const char* g_Keyword_Preset = "Preset";
+const char* g_Keyword_PresetList = "Presets";
+const char* g_Preset_Idle = "idle";
+const char* g_Preset_Save = "save";
+const char* g_Preset_Apply = "apply";
+const char* g_Preset_Delete = "delete";
+
+// the controls a preset holds besides the format, in the order they are applied
+static const ASI_CONTROL_TYPE g_PresetControls[] = { ASI_HIGH_SPEED_MODE, ASI_BANDWIDTHOVERLOAD, ASI_FLIP, ASI_GAIN, ASI_BRIGHTNESS };
+const char* g_Keyword_LogLevel = "Log Level";
+const char* g_LogLevel[] = { "error", "warning", "info", "debug" };
+const char* g_Keyword_Latency = "Latency Histograms";
+const char* g_Keyword_LatencyReset = "Latency Reset";
+const char* g_LatencyReset_Idle = "idle";
+const char* g_LatencyReset_Run = "reset";
+const char* g_LatencyStage[] = { "SDK Wait", "Conversion", "Metadata", "Core Insert", "SDK To Core" };
+const char* g_LatencyStat[] = { "p50", "p99", "p99.9", "max" };
+const double g_LatencyQuantile[] = { 0.5, 0.99, 0.999, 1.0 };
+
+const char* g_OverflowPolicy[] = { "clear-all", "drop-newest", "block", "stop" };
+const char* g_Keyword_OverflowCounter[] = {
+	"Overflow Clears (clear-all)",
+	"Overflow Dropped (drop-newest)",
+	"Overflow Dropped (block)",
+	"Overflow Dropped (stop)"
+};
+
 
-	char strBuf[128] = { 0 };
-	sprintf(strBuf, "<%s> ", "MM_ASI");
-	va_list vlArgs;
-	va_start(vlArgs, strOutPutString);
-	vsnprintf((char*)(strBuf + strlen(strBuf)), sizeof(strBuf) - strlen(strBuf), strOutPutString, vlArgs);
-	va_end(vlArgs);
-#ifdef _DEBUG
 
-	#ifdef _WINDOWS
-		OutputDebugStringA(strBuf);
-	#elif defined _LIN
-		printf("%s", strBuf);
-	#endif
 
-#endif
-	// Добавляем запись в файл
-	LogToFile("%s", strBuf);
-}
 
 ASICamera::ASICamera() :
-	iBin(1),
+	Status(closed),
 	initialized_(false),
+	uc_pImg(0),
+	iBufSize(0),
+	pSnapImg(0),
+	bSnapConverted(false),
+	dSnapReadoutMs(0),
+	lSnapPollUs(500),
+	dSnapLatencyMs(0),
+	lSnapPolls(0),
+	eSnapMode(SNAP_SINGLE),
+	dSnapStreamMaxExpMs(100),
+	bSnapStream(false),
+	armThd_(0),
+	bSnapArmed(false),
+	uc_pArmedImg(0),
+	lArmedControlWrites(0),
+	lWorkerThreads(1),
+	ullWorkerAffinity(0),
+	iSoftBin(1),
+	bSoftBinAverage(false),
+	bSoftBinWiden(false),
+	iDebayer(0),
+	bHostDebayer(false),
+	lStackDepth(1),
+	eStackOp(STACK_MEAN),
+	dStackKappa(3.0),
 	iROIWidth(0),
 	iROIHeight(0),
-	Status(closed),
+	iBin(1),
 	ImgType(ASI_IMG_RAW8),
-	uc_pImg(0),
-	imageCounter_(0),
 	thd_(0),
+	insThd_(0),
+	lQueueDepth(8),
+	lPipelineDropped(0),
 	pControlCaps(0),
-	pRGB32(0),
-	pRGB64(0),
+	bTransactionOpen(false),
+	lSettingsGeneration(0),
+	bSettingsMixed(false),
+	lGrabSdkCalls(0),
+	lGrabFrames(0),
+	dDeliveredFps(0),
+	lSdkDropped(0),
+	iSdkDroppedBase(0),
+	dFpsWindowStartMs(0),
+	lFpsWindowFrames(0),
+	lDroppedReported(0),
+	bLatency(false),
+	iExposureSeqPos(0),
+	dFrameTimeoutExtraMs(0),
+	dExposingMs(0),
+	dNextExposureMs(0),
+	bExposureSeqApplied(false),
 	b12RAW(false),
 	bRGB48(false),
-	ImgFlip(ASI_FLIP_NONE)
+	bMetadataDirty(true),
+	dSeqStartMs(0),
+	lStackedCount(0),
+	bCalibrate(false),
+	iCalStatus(CAL_NO_MASTER),
+	lMasterFrames(16),
+	bDarkLibrary(false),
+	dDarkTempStep(2.0),
+	bHotPixels(false),
+	eHotPixelMode(HOTPIX_SIGMA),
+	dHotPixelSigma(5.0),
+	lHotPixelThreshold(100),
+	bStats(false),
+	lStatsRowStride(1),
+	iMdStats(-1),
+	iMdStatsRegions(0),
+	eOverflowPolicy(OVERFLOW_CLEAR_ALL),
+	lOverflowTimeoutMs(500),
+	bStopOnOverflow(false),
+	imageCounter_(0)
 {
 	// call the base class method to set-up default error codes/messages
 	InitializeDefaultErrorMessages();
@@ -171,10 +309,22 @@ ASICamera::ASICamera() :
 	strcpy(FlipArr[ASI_FLIP_HORIZ], "horz");
 	strcpy(FlipArr[ASI_FLIP_VERT], "vert");
 	strcpy(FlipArr[ASI_FLIP_NONE], "none");
+	for (int i = 0; i < OVERFLOW_POLICY_NUM; i++)
+		lOverflowCount[i] = 0;
+
+	FrameGeometry* pGeo = new FrameGeometry();
+	pGeo->Bin = 1;
+	pGeo->SoftBin = 1;
+	pGeo->ImgType = ImgType;
+	pGeo->Flip = ASI_FLIP_NONE;
+	pGeometry.reset(pGeo);
 	// camera type pre-initialization property
 
 	//  create live video thread
 	thd_ = new SequenceThread(this);
+	insThd_ = new InsertThread(this);
+	armThd_ = new ArmedSnapThread(this);
+	AsyncLog::Acquire();
 }
 
 
@@ -187,11 +337,16 @@ ASICamera::~ASICamera()
 	DeleteImgBuf();
 	if (thd_)
 		delete thd_;
+	if (insThd_)
+		delete insThd_;
+	if (armThd_)
+		delete armThd_;
+	AsyncLog::Release();
 }
 
 int ASICamera::Initialize()
 {
-	OutputDbgPrint("open camera ID: %d\n", ASICameraInfo.CameraID);
+	ASI_LOG_INFO("open camera ID: %d", ASICameraInfo.CameraID);
 	if (ASICameraInfo.CameraID < 0)
 		return DEVICE_NOT_CONNECTED;
 	if (ASICameraInfo.CameraID >= 0)
@@ -210,6 +365,17 @@ int ASICamera::Initialize()
 		int nRet = CreateStringProperty(MM::g_Keyword_CameraName, sz_Name, true);
 		assert(nRet == DEVICE_OK);
 
+		ASI_SN sn;
+		sCameraSerial = sz_Name;
+		if (ASIGetSerialNumber(ASICameraInfo.CameraID, &sn) == ASI_SUCCESS)
+		{
+			char szSN[2 * sizeof(sn.id) + 1];
+			for (size_t i = 0; i < sizeof(sn.id); i++)
+				sprintf(szSN + 2 * i, "%02X", sn.id[i]);
+			if (strspn(szSN, "0") != strlen(szSN))
+				sCameraSerial = szSN;
+		}
+
 
 		iROIWidth = ASICameraInfo.MaxWidth / iBin / 8 * 8;// 2->1, *2
 		iROIHeight = ASICameraInfo.MaxHeight / iBin / 2 * 2;//1->2. *0.5
@@ -221,11 +387,6 @@ int ASICamera::Initialize()
 		iSetX = 0;
 		iSetY = 0;
 
-		long lVal;
-		ASI_BOOL bAuto;
-
-
-		lExpMs = GetExposure();
 
 		Status = opened;
 
@@ -233,12 +394,17 @@ int ASICamera::Initialize()
 		ASIGetNumOfControls(ASICameraInfo.CameraID, &iCtrlNum);
 		DeletepControlCaps(ASICameraInfo.CameraID);
 		MallocControlCaps(ASICameraInfo.CameraID);
+		controls.SetPollInterval(ASI_TEMPERATURE, g_TemperaturePollMs);
+		controls.SetPollInterval(ASI_COOLER_POWER_PERC, g_CoolerPowerPollMs);
+		controls.Start(ASICameraInfo.CameraID, pControlCaps, iCtrlNum);
+		lExpUs = ExposureToUs(GetExposure());
+		PublishGeometry();
 	}
 
 	if (initialized_)
 		return DEVICE_OK;
 
-	OutputDbgPrint("Init property\n");
+	ASI_LOG_DEBUG("Init property");
 	// set property list
 	// -----------------
 	vector<string> boolValues;
@@ -263,6 +429,29 @@ int ASICamera::Initialize()
 	ret = SetAllowedValues(MM::g_Keyword_Binning, binningValues);
 	assert(ret == DEVICE_OK);
 
+	//software binning, on its own or stacked on the SDK binning above
+	pAct = new CPropertyAction(this, &ASICamera::OnSoftBin);
+	ret = CreateProperty(g_Keyword_SoftBin, "1", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	vector<string> softBinValues;
+	softBinValues.push_back("1");
+	softBinValues.push_back("2");
+	softBinValues.push_back("3");
+	softBinValues.push_back("4");
+	SetAllowedValues(g_Keyword_SoftBin, softBinValues);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnSoftBinMode);
+	ret = CreateProperty(g_Keyword_SoftBinMode, g_SoftBinMode_Sum, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_SoftBinMode, g_SoftBinMode_Sum);
+	AddAllowedValue(g_Keyword_SoftBinMode, g_SoftBinMode_Average);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnSoftBinOutput);
+	ret = CreateProperty(g_Keyword_SoftBinOutput, g_SoftBinOutput_Saturate, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_SoftBinOutput, g_SoftBinOutput_Saturate);
+	AddAllowedValue(g_Keyword_SoftBinOutput, g_SoftBinOutput_Widen);
+
 	// pixel type
 	pAct = new CPropertyAction(this, &ASICamera::OnPixelType);
 	ret = CreateProperty(MM::g_Keyword_PixelType, g_PixelType_Y8, MM::String, false, pAct);
@@ -278,7 +467,7 @@ int ASICamera::Initialize()
 	}
 	if (isImgTypeSupported(ASI_IMG_Y8))
 		pixelTypeValues.push_back(g_PixelType_Y8);
-	if (isImgTypeSupported(ASI_IMG_RGB24))
+	if (isImgTypeSupported(ASI_IMG_RGB24) || (ASICameraInfo.IsColorCam && isImgTypeSupported(ASI_IMG_RAW8)))
 	{
 		pixelTypeValues.push_back(g_PixelType_RGB24);
 		pixelTypeValues.push_back(g_PixelType_RGB48);
@@ -287,6 +476,182 @@ int ASICamera::Initialize()
 	ret = SetAllowedValues(MM::g_Keyword_PixelType, pixelTypeValues);
 	assert(ret == DEVICE_OK);
 
+	//RGB from the SDK or RAW over USB and demosaiced here. With the host
+	//variants the SDK white balance does not apply.
+	if (ASICameraInfo.IsColorCam && isImgTypeSupported(ASI_IMG_RAW8))
+	{
+		if (!isImgTypeSupported(ASI_IMG_RGB24))
+			iDebayer = DEBAYER_BILINEAR + 1;
+		pAct = new CPropertyAction(this, &ASICamera::OnDebayer);
+		ret = CreateProperty(g_Keyword_Debayer, g_Debayer[iDebayer], MM::String, false, pAct);
+		assert(ret == DEVICE_OK);
+		if (isImgTypeSupported(ASI_IMG_RGB24))
+			AddAllowedValue(g_Keyword_Debayer, g_Debayer[0]);
+		AddAllowedValue(g_Keyword_Debayer, g_Debayer[DEBAYER_BILINEAR + 1]);
+		AddAllowedValue(g_Keyword_Debayer, g_Debayer[DEBAYER_EDGE_AWARE + 1]);
+	}
+
+	//stacking of sequence frames, only every Stack Frames-th frame reaches MMCore
+	pAct = new CPropertyAction(this, &ASICamera::OnStackFrames);
+	ret = CreateProperty(g_Keyword_StackFrames, "1", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_StackFrames, 1, 1024);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnStackOperator);
+	ret = CreateProperty(g_Keyword_StackOperator, g_StackOperator[STACK_MEAN], MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	vector<string> stackValues;
+	for (int i = 0; i < STACK_OPERATOR_NUM; i++)
+		stackValues.push_back(g_StackOperator[i]);
+	SetAllowedValues(g_Keyword_StackOperator, stackValues);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnStackKappa);
+	ret = CreateProperty(g_Keyword_StackKappa, "3.0", MM::Float, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_StackKappa, 0.5, 10.0);
+
+	//dark/flat calibration of RAW8/RAW16, masters from FITS files or captured here
+	pAct = new CPropertyAction(this, &ASICamera::OnCalibration);
+	ret = CreateProperty(g_Keyword_Calibration, g_Keyword_off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetAllowedValues(g_Keyword_Calibration, boolValues);
+
+	for (int i = 0; i < 2; i++)
+	{
+		CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ASICamera::OnCalibrationFile, i);
+		ret = CreateProperty(g_Keyword_CalibrationFile[i], "", MM::String, false, pActEx);
+		assert(ret == DEVICE_OK);
+	}
+
+	pAct = new CPropertyAction(this, &ASICamera::OnCaptureMaster);
+	ret = CreateProperty(g_Keyword_CaptureMaster, g_CaptureMaster_Idle, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_CaptureMaster, g_CaptureMaster_Idle);
+	AddAllowedValue(g_Keyword_CaptureMaster, g_CaptureMaster[0]);
+	AddAllowedValue(g_Keyword_CaptureMaster, g_CaptureMaster[1]);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnMasterFrames);
+	ret = CreateProperty(g_Keyword_MasterFrames, "16", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_MasterFrames, 1, 256);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnCalibrationStatus);
+	ret = CreateProperty(g_Keyword_CalibrationStatus, g_Keyword_off, MM::String, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	//library of master darks, the nearest one follows exposure, gain, offset, binning and temperature
+	pAct = new CPropertyAction(this, &ASICamera::OnDarkLibrary);
+	ret = CreateProperty(g_Keyword_DarkLibrary, g_Keyword_off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetAllowedValues(g_Keyword_DarkLibrary, boolValues);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnDarkLibraryDir);
+	ret = CreateProperty(g_Keyword_DarkLibraryDir, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnDarkLibraryTempStep);
+	ret = CreateProperty(g_Keyword_DarkLibraryTempStep, "2.0", MM::Float, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_DarkLibraryTempStep, 0.1, 20.0);
+
+	for (int i = 0; i < 4; i++)
+	{
+		CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ASICamera::OnDarkLibraryInfo, i);
+		ret = CreateProperty(g_Keyword_DarkLibraryInfo[i], i == 1 ? "" : "0", i == 1 ? MM::String : MM::Integer, true, pActEx);
+		assert(ret == DEVICE_OK);
+	}
+
+	//hot/dead pixel map per camera, detected from averaged darks
+	pAct = new CPropertyAction(this, &ASICamera::OnHotPixels);
+	ret = CreateProperty(g_Keyword_HotPixels, g_Keyword_off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetAllowedValues(g_Keyword_HotPixels, boolValues);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnHotPixelDir);
+	ret = CreateProperty(g_Keyword_HotPixelDir, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnHotPixelDetect);
+	ret = CreateProperty(g_Keyword_HotPixelDetect, g_HotPixelDetect_Idle, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_HotPixelDetect, g_HotPixelDetect_Idle);
+	AddAllowedValue(g_Keyword_HotPixelDetect, g_HotPixelDetect_Run);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnHotPixelMode);
+	ret = CreateProperty(g_Keyword_HotPixelMode, g_HotPixelMode[HOTPIX_SIGMA], MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_HotPixelMode, g_HotPixelMode[HOTPIX_SIGMA]);
+	AddAllowedValue(g_Keyword_HotPixelMode, g_HotPixelMode[HOTPIX_THRESHOLD]);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnHotPixelSigma);
+	ret = CreateProperty(g_Keyword_HotPixelSigma, "5.0", MM::Float, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_HotPixelSigma, 2.0, 50.0);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnHotPixelThreshold);
+	ret = CreateProperty(g_Keyword_HotPixelThreshold, "100", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_HotPixelThreshold, 1, 65535);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnHotPixelCount);
+	ret = CreateProperty(g_Keyword_HotPixelCount, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	//histogram, min/max/mean/deviation and saturation of every frame, also for regions
+	PublishStatsConfig();
+	pAct = new CPropertyAction(this, &ASICamera::OnStatistics);
+	ret = CreateProperty(g_Keyword_Statistics, g_Keyword_off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetAllowedValues(g_Keyword_Statistics, boolValues);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnStatsRowStride);
+	ret = CreateProperty(g_Keyword_StatsRowStride, "1", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_StatsRowStride, 1, 64);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnStatsRegions);
+	ret = CreateProperty(g_Keyword_StatsRegions, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	for (int i = 0; i < 7; i++)
+	{
+		CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ASICamera::OnStatsInfo, i);
+		ret = CreateProperty(g_Keyword_StatsInfo[i], "0", i == STATS_MEAN || i == STATS_STDDEV ? MM::Float : (i < STATS_FIELD_NUM ? MM::Integer : MM::String), true, pActEx);
+		assert(ret == DEVICE_OK);
+	}
+
+	//snap wait
+	pAct = new CPropertyAction(this, &ASICamera::OnSnapPollInterval);
+	ret = CreateProperty(g_Keyword_SnapPollInterval, "500", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_SnapPollInterval, 50, 10000);
+
+	for (int i = 0; i < 3; i++)
+	{
+		CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ASICamera::OnSnapInfo, i);
+		ret = CreateProperty(g_Keyword_SnapInfo[i], "0", i == 1 ? MM::Integer : MM::Float, true, pActEx);
+		assert(ret == DEVICE_OK);
+	}
+
+	pAct = new CPropertyAction(this, &ASICamera::OnSnapMode);
+	ret = CreateProperty(g_Keyword_SnapMode, g_SnapMode[SNAP_SINGLE], MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	vector<string> snapModeValues;
+	for (int i = 0; i < SNAP_MODE_NUM; i++)
+		snapModeValues.push_back(g_SnapMode[i]);
+	SetAllowedValues(g_Keyword_SnapMode, snapModeValues);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnSnapStreamMaxExposure);
+	ret = CreateProperty(g_Keyword_SnapStreamMaxExposure, "100", MM::Float, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_SnapStreamMaxExposure, 1, 10000);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnSnapArm);
+	ret = CreateProperty(g_Keyword_SnapArm, g_SnapArm_Idle, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_SnapArm, g_SnapArm_Idle);
+	AddAllowedValue(g_Keyword_SnapArm, g_SnapArm_Arm);
+
 	//gain
 	int iMin, iMax;
 
@@ -495,21 +860,145 @@ int ASICamera::Initialize()
 	ret = CreateProperty(g_Keyword_USBHost, USBHost, MM::String, true);
 	assert(ret == DEVICE_OK);
 
+	//pixel conversion kernel picked for this CPU
+	ret = CreateProperty(g_Keyword_ConversionKernel, GetPixelKernels().Name, MM::String, true);
+	assert(ret == DEVICE_OK);
+
+	//worker pool for stripe-parallel conversion, the calling thread counts as one
+	long lCores = (long)std::thread::hardware_concurrency();
+	if (lCores < 1)
+		lCores = 1;
+	if (lCores > 64)
+		lCores = 64;
+	lWorkerThreads = lCores < 8 ? lCores : 8;
+	workerPool.Start(lWorkerThreads, ullWorkerAffinity);
+	pAct = new CPropertyAction(this, &ASICamera::OnWorkerThreads);
+	ret = CreateProperty(g_Keyword_WorkerThreads, "1", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_WorkerThreads, 1, lCores);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnWorkerAffinity);
+	ret = CreateProperty(g_Keyword_WorkerAffinity, "0x0", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	//frame queue between the grab and insert threads
+	pAct = new CPropertyAction(this, &ASICamera::OnFrameQueueDepth);
+	ret = CreateProperty(g_Keyword_FrameQueueDepth, "8", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_FrameQueueDepth, 2, 64);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnFrameQueueOccupancy);
+	ret = CreateProperty(g_Keyword_FrameQueueOccupancy, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnFrameQueueHighWater);
+	ret = CreateProperty(g_Keyword_FrameQueueHighWater, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnSdkCallsPerFrame);
+	ret = CreateProperty(g_Keyword_SdkCallsPerFrame, "0", MM::Float, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	//circular buffer overflow
+	pAct = new CPropertyAction(this, &ASICamera::OnOverflowPolicy);
+	ret = CreateProperty(g_Keyword_OverflowPolicy, g_OverflowPolicy[OVERFLOW_CLEAR_ALL], MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	vector<string> policyValues;
+	for (int i = 0; i < OVERFLOW_POLICY_NUM; i++)
+		policyValues.push_back(g_OverflowPolicy[i]);
+	SetAllowedValues(g_Keyword_OverflowPolicy, policyValues);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnOverflowTimeout);
+	ret = CreateProperty(g_Keyword_OverflowTimeout, "500", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_Keyword_OverflowTimeout, 0, 60000);
+
+	for (int i = 0; i < OVERFLOW_POLICY_NUM; i++)
+	{
+		CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ASICamera::OnOverflowCounter, i);
+		ret = CreateProperty(g_Keyword_OverflowCounter[i], "0", MM::Integer, true, pActEx);
+		assert(ret == DEVICE_OK);
+	}
+
+	for (int i = 0; i < TELEMETRY_FIELD_NUM; i++)
+	{
+		CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ASICamera::OnTelemetry, i);
+		ret = CreateProperty(g_Keyword_Telemetry[i], "0", i == TELEMETRY_FPS ? MM::Float : MM::Integer, true, pActEx);
+		assert(ret == DEVICE_OK);
+	}
+
+	pAct = new CPropertyAction(this, &ASICamera::OnSettingsTransaction);
+	ret = CreateProperty(g_Keyword_SettingsTransaction, g_Transaction_Idle, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_SettingsTransaction, g_Transaction_Idle);
+	AddAllowedValue(g_Keyword_SettingsTransaction, g_Transaction_Begin);
+	AddAllowedValue(g_Keyword_SettingsTransaction, g_Transaction_Commit);
+	AddAllowedValue(g_Keyword_SettingsTransaction, g_Transaction_Abort);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnPresetName);
+	ret = CreateProperty(g_Keyword_PresetName, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnPreset);
+	ret = CreateProperty(g_Keyword_Preset, g_Preset_Idle, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_Preset, g_Preset_Idle);
+	AddAllowedValue(g_Keyword_Preset, g_Preset_Save);
+	AddAllowedValue(g_Keyword_Preset, g_Preset_Apply);
+	AddAllowedValue(g_Keyword_Preset, g_Preset_Delete);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnPresetList);
+	ret = CreateProperty(g_Keyword_PresetList, "", MM::String, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnControlCacheAge);
+	ret = CreateProperty(g_Keyword_ControlCacheAge, "", MM::String, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnLogLevel);
+	ret = CreateProperty(g_Keyword_LogLevel, g_LogLevel[AsyncLog::GetLevel()], MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	for (int i = 0; i < LOG_LEVEL_NUM; i++)
+		AddAllowedValue(g_Keyword_LogLevel, g_LogLevel[i]);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnLatency);
+	ret = CreateProperty(g_Keyword_Latency, g_Keyword_off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetAllowedValues(g_Keyword_Latency, boolValues);
+
+	pAct = new CPropertyAction(this, &ASICamera::OnLatencyReset);
+	ret = CreateProperty(g_Keyword_LatencyReset, g_LatencyReset_Idle, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	AddAllowedValue(g_Keyword_LatencyReset, g_LatencyReset_Idle);
+	AddAllowedValue(g_Keyword_LatencyReset, g_LatencyReset_Run);
+
+	for (int i = 0; i < LATENCY_STAGE_NUM * LATENCY_STAT_NUM; i++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "Latency %s %s us", g_LatencyStage[i / LATENCY_STAT_NUM], g_LatencyStat[i % LATENCY_STAT_NUM]);
+		CPropertyActionEx* pActEx = new CPropertyActionEx(this, &ASICamera::OnLatencyInfo, i);
+		ret = CreateProperty(name, "0", MM::Integer, true, pActEx);
+		assert(ret == DEVICE_OK);
+	}
+
 
 	// synchronize all properties
 	// --------------------------
 	ret = UpdateStatus();
 	if (ret != DEVICE_OK)
 		return ret;
-	OutputDbgPrint("Init initialized_ true\n");
+	ASI_LOG_INFO("Init initialized_ true");
 	initialized_ = true;
 	return DEVICE_OK;
 }
 
 int ASICamera::Shutdown()
 {
+	StopSnapActivity();
+	workerPool.Stop();
+	controls.Stop();
 	initialized_ = false;
-	OutputDbgPrint("Shutdown initialized_ false\n");
+	ASI_LOG_INFO("Shutdown initialized_ false");
 	return DEVICE_OK;
 }
 
@@ -521,52 +1010,99 @@ void ASICamera::GetName(char * name) const
 long ASICamera::GetImageBufferSize() const
 {
 	 
-	OutputDbgPrint("GetImageBufferSize\n");
-	return iROIWidth * iROIHeight * iPixBytes;
+	ASI_LOG_DEBUG("GetImageBufferSize");
+	return GetImageWidth() * GetImageHeight() * iPixBytes;
 }
 
 unsigned ASICamera::GetBitDepth() const//��ɫ�ķ�Χ 8bit �� 16bit
 {
-	if (ImgType == ASI_IMG_RAW16)
-	{
-		if (b12RAW)
-			return 12;
-		else
-			return 16;
-	}
+	unsigned depth;
+	if (bHostDebayer)
+		depth = bRGB48 ? 16 : 8;
+	else if (ImgType == ASI_IMG_RAW16)
+		depth = b12RAW ? 12 : 16;
+	else if (ImgType == ASI_IMG_RGB24 && bRGB48)
+		depth = 16;
 	else
+		depth = 8;
+
+	// summed mono bins need 2 (2x2) or 4 (3x3, 4x4) more bits, as far as the
+	// output sample holds them
+	if (iSoftBin > 1 && !bSoftBinAverage && iComponents == 1)
 	{
-		if (ImgType == ASI_IMG_RGB24 && bRGB48)
-			return 16;
-		else
-			return 8;
+		depth += iSoftBin == 2 ? 2 : 4;
+		if (depth > (unsigned)iPixBytes * 8)
+			depth = iPixBytes * 8;
 	}
+	return depth;
 }
 
+/**
+* Effective binning of the image MMCore gets: SDK binning times software binning.
+*/
 int ASICamera::GetBinning() const
 {
-	return 1;
+	return iBin * iSoftBin;
 }
 
-int ASICamera::SetBinning(int)
+/**
+* Uses the largest SDK binning that divides binF and leaves a software
+* factor of at most 4, so hardware binning is preferred where it exists.
+*/
+int ASICamera::SetBinning(int binF)
 {
-	return DEVICE_OK;
+	int hwBin = 0;
+	for (int i = 0; i < 16 && ASICameraInfo.SupportedBins[i] > 0; i++)
+	{
+		int b = ASICameraInfo.SupportedBins[i];
+		if (binF % b == 0 && binF / b <= 4 && b > hwBin)
+			hwBin = b;
+	}
+	if (hwBin == 0)
+		return DEVICE_INVALID_PROPERTY_VALUE;
+
+	char buf[16];
+	sprintf(buf, "%d", hwBin);
+	int ret = SetProperty(MM::g_Keyword_Binning, buf);
+	if (ret != DEVICE_OK)
+		return ret;
+	sprintf(buf, "%d", binF / hwBin);
+	return SetProperty(g_Keyword_SoftBin, buf);
 }
 
 void ASICamera::SetExposure(double exp)
 {
-	lExpMs = exp;
-	ASISetControlValue(ASICameraInfo.CameraID, ASI_EXPOSURE, exp * 1000, ASI_FALSE);
+	long lUs = ExposureToUs(exp);
+	if (!bTransactionOpen)
+		lExpUs = lUs;//otherwise when the transaction is applied
+	SetControl(ASI_EXPOSURE, lUs, ASI_FALSE);
+	SelectLibraryDark();
 }
 
 double ASICamera::GetExposure() const
 {
-	//	return lExpMs;
 	long lVal;
 	ASI_BOOL bAuto;
-	ASIGetControlValue(ASICameraInfo.CameraID, ASI_EXPOSURE, &lVal, &bAuto);
-	return lVal / 1000;
+	controls.Get(ASI_EXPOSURE, &lVal, &bAuto);
+	return lVal / 1000.0;
+
+}
 
+/*
+* Time from the end of an exposure until the frame is in, as far as the
+* link decides it: the SDK frame over the USB rate, scaled by
+* ASI_BANDWIDTHOVERLOAD. Sensor readout can be slower, callers allow for
+* twice this plus a margin.
+*/
+double ASICamera::EstimateReadoutMs(const FrameGeometry& geo) const
+{
+	long lVal = 100;
+	ASI_BOOL bAuto;
+	if (controls.Get(ASI_BANDWIDTHOVERLOAD, &lVal, &bAuto) != ASI_SUCCESS || lVal <= 0)
+		lVal = 100;
+	bool bUsb3 = ASICameraInfo.IsUSB3Camera == ASI_TRUE && ASICameraInfo.IsUSB3Host == ASI_TRUE;
+	double dBytesPerMs = (bUsb3 ? g_Usb3BytesPerMs : g_Usb2BytesPerMs) * lVal / 100;
+	return geo.SdkFrameSize() / dBytesPerMs;
 }
 
 
@@ -617,23 +1153,35 @@ int ASICamera::GetComponentName(unsigned component, char* name)
 */
 void ASICamera::DeleteImgBuf()
 {
+	StopSnapActivity();//an armed snap reads into uc_pArmedImg
 	if (uc_pImg)
 	{
 		delete[] uc_pImg;
 		uc_pImg = 0;
 		iBufSize = 0;
-		OutputDbgPrint("clr\n");
-	}
-	if (pRGB32)
-	{
-		delete[] pRGB32;
-		pRGB32 = 0;
-	}
-	if (pRGB64)
-	{
-		delete[] pRGB64;
-		pRGB64 = 0;
+		ASI_LOG_DEBUG("clr");
 	}
+	delete[] uc_pArmedImg;
+	uc_pArmedImg = 0;
+	std::vector<unsigned char>().swap(snapOut.Out);
+	std::vector<unsigned char>().swap(snapOut.Stage);
+	pSnapImg = 0;
+	bSnapConverted = false;
+}
+
+/**
+* Sizes uc_pImg for the SDK layout of the current geometry. That is smaller
+* than GetImageBufferSize() for RGB, which MMCore sees after expansion.
+*/
+void ASICamera::AllocImgBuf()
+{
+	if (uc_pImg != 0)
+		return;
+	pSnapGeometry = GetGeometry();
+	iBufSize = pSnapGeometry->SdkFrameSize();
+	uc_pImg = new unsigned char[iBufSize];
+	memset(uc_pImg, 0, iBufSize);
+	bSnapConverted = false;
 }
 
 int ASICamera::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
@@ -647,7 +1195,14 @@ int ASICamera::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
 		�ߴ����ʼ�㶼��ImgBin/iSetBin����, iSetBin��Ҫ���õ�binֵ
 		����з�ת, ��Ҫ������������������
 		*/
-		switch (ImgFlip)
+		FrameGeometryPtr geo = GetGeometry();
+		int ImgBin = geo->Bin;
+		//displayed pixels are software binned, the SDK works in its own binned pixels
+		x *= geo->SoftBin;
+		y *= geo->SoftBin;
+		xSize *= geo->SoftBin;
+		ySize *= geo->SoftBin;
+		switch (geo->Flip)
 		{
 		case ASI_FLIP_NONE:
 			break;
@@ -674,13 +1229,15 @@ int ASICamera::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
 		iSetX = iSetX / 4 * 4;
 		iSetY = iSetY / 2 * 2;
 
+		StopSnapActivity();
 		if (ASISetROIFormat(ASICameraInfo.CameraID, iSetWid, iSetHei, iSetBin, ImgType) == ASI_SUCCESS)//������óɹ�
 		{
-			OutputDbgPrint("wid:%d hei:%d bin:%d\n", xSize, ySize, iBin);
+			ASI_LOG_DEBUG("wid:%d hei:%d bin:%d", xSize, ySize, iBin);
 			DeleteImgBuf();//buff��С�ı�
 			ASISetStartPos(ASICameraInfo.CameraID, iSetX, iSetY);
 		}
 		ASIGetROIFormat(ASICameraInfo.CameraID, &iROIWidth, &iROIHeight, &iBin, &ImgType);
+		PublishGeometry();
 	}
 	return DEVICE_OK;
 }
@@ -691,26 +1248,36 @@ int ASICamera::GetROI(unsigned & x, unsigned & y, unsigned & xSize, unsigned & y
 	�õ���ʾͼ���ROI��Ϣ
 		����з�ת, Ҫ����ɷ�����ߵ�����, ���������ӵõ���ROI,�ٻ�����������������*/
 
-	x = ImgStartX;
-	y = ImgStartY;
-	switch (ImgFlip)
+	GetDisplayROI(*GetGeometry(), x, y, xSize, ySize);
+	return DEVICE_OK;
+}
+
+/**
+* ROI of a geometry snapshot in the coordinates of the displayed (flipped) image.
+*/
+void ASICamera::GetDisplayROI(const FrameGeometry& geo, unsigned& x, unsigned& y, unsigned& xSize, unsigned& ySize) const
+{
+	x = geo.StartX;
+	y = geo.StartY;
+	switch (geo.Flip)
 	{
 	case ASI_FLIP_NONE:
 		break;
 	case ASI_FLIP_HORIZ:
-		x = ASICameraInfo.MaxWidth / ImgBin - ImgStartX - ImgWid;
+		x = ASICameraInfo.MaxWidth / geo.Bin - geo.StartX - geo.Width;
 		break;
 	case ASI_FLIP_VERT:
-		y = ASICameraInfo.MaxHeight / ImgBin - ImgStartY - ImgHei;
+		y = ASICameraInfo.MaxHeight / geo.Bin - geo.StartY - geo.Height;
 		break;
 	case ASI_FLIP_BOTH:
-		x = ASICameraInfo.MaxWidth / ImgBin - ImgStartX - ImgWid;
-		y = ASICameraInfo.MaxHeight / ImgBin - ImgStartY - ImgHei;
+		x = ASICameraInfo.MaxWidth / geo.Bin - geo.StartX - geo.Width;
+		y = ASICameraInfo.MaxHeight / geo.Bin - geo.StartY - geo.Height;
 		break;
 	}
-	xSize = ImgWid;
-	ySize = ImgHei;
-	return DEVICE_OK;
+	x /= geo.SoftBin;
+	y /= geo.SoftBin;
+	xSize = geo.ImageWidth;
+	ySize = geo.ImageHeight;
 }
 
 int ASICamera::ClearROI()
@@ -719,876 +1286,3016 @@ int ASICamera::ClearROI()
 	iSetWid = iROIWidth = ASICameraInfo.MaxWidth / iBin / 8 * 8;
 	iSetHei = iROIHeight = ASICameraInfo.MaxHeight / iBin / 2 * 2;
 
+	StopSnapActivity();
 	if (ASISetROIFormat(ASICameraInfo.CameraID, iROIWidth, iROIHeight, iBin, ImgType) == ASI_SUCCESS)
 	{
 		ASISetStartPos(ASICameraInfo.CameraID, 0, 0);
 		iSetX = iSetY = 0;
 		DeleteImgBuf();
 	}
+	PublishGeometry();
 	return DEVICE_OK;
 }
 
 int ASICamera::IsExposureSequenceable(bool & isSequenceable) const
 {
-	isSequenceable = false;
+	isSequenceable = true;
 
 	return DEVICE_OK;
 }
 
+int ASICamera::GetExposureSequenceMaxLength(long& nrEvents) const
+{
+	nrEvents = g_MaxExposureSequence;
+	return DEVICE_OK;
+}
 
+/**
+* Runs the loaded sequence with the next sequence acquisition: frame i is
+* exposed with entry i modulo the length.
+*/
+int ASICamera::StartExposureSequence()
+{
+	if (IsCapturing())
+		return DEVICE_CAMERA_BUSY_ACQUIRING;
+	if (exposureSequence.empty())
+		return DEVICE_ERR;
+	std::atomic_store(&pExposureSeq, ExposureSequencePtr(new std::vector<double>(exposureSequence)));
+	return DEVICE_OK;
+}
 
-/*
-* Inserts Image and MetaData into MMCore circular Buffer
+/**
+* Back to the single exposure. A running acquisition switches at the
+* next frame boundary.
 */
-int ASICamera::InsertImage()
+int ASICamera::StopExposureSequence()
 {
-	//OutputDbgPrint("InsertImage\n");
-	MM::MMTime timeStamp = this->GetCurrentMMTime();
-	char label[MM::MaxStrLength];
-	this->GetLabel(label);
+	std::atomic_store(&pExposureSeq, ExposureSequencePtr());
+	if (!IsCapturing())
+		controls.Set(ASI_EXPOSURE, lExpUs, ASI_FALSE);
+	return DEVICE_OK;
+}
 
-	// Important:  metadata about the image are generated here:
-	Metadata md;
-	md.put("Camera", label);
+int ASICamera::ClearExposureSequence()
+{
+	exposureSequence.clear();
+	return DEVICE_OK;
+}
 
-	char buf[MM::MaxStrLength];
-	GetProperty(MM::g_Keyword_Binning, buf);
-	md.put(MM::g_Keyword_Binning, buf);
+int ASICamera::AddToExposureSequence(double exposureTime_ms)
+{
+	if ((long)exposureSequence.size() >= g_MaxExposureSequence)
+		return DEVICE_SEQUENCE_TOO_LARGE;
+	exposureSequence.push_back(exposureTime_ms);
+	return DEVICE_OK;
+}
 
-	//   MMThreadGuard g(imgPixelsLock_);
+// the list stays with the adapter until StartExposureSequence()
+int ASICamera::SendExposureSequence() const
+{
+	return exposureSequence.empty() ? DEVICE_ERR : DEVICE_OK;
+}
 
-	const unsigned char* pI;
-	pI = GetImageBuffer();
-	int ret = 0;
-	ret = GetCoreCallback()->InsertImage(this, pI, iROIWidth, iROIHeight, iPixBytes, md.Serialize().c_str());
-	if (ret == DEVICE_BUFFER_OVERFLOW)//����������Ҫ���, �����ܼ�������ͼ�����ס
+/*
+* In video mode a new ASI_EXPOSURE does not reach the frame being exposed,
+* only the one after it. So while frame i exposes the entry for frame i + 1
+* is set, and each frame carries the value it was actually exposed with.
+* Outside a sequence SetExposure() writes the SDK and is only tracked here,
+* after one the plain exposure is restored.
+*/
+void ASICamera::StepExposureSequence()
+{
+	ExposureSequencePtr seq = std::atomic_load(&pExposureSeq);
+	double next = seq ? (*seq)[iExposureSeqPos++ % seq->size()] : lExpUs / 1000.0;
+	bool bSet = seq || bExposureSeqApplied;
+	bExposureSeqApplied = (bool)seq;
+	if (bSet && next != dNextExposureMs)
 	{
-		// do not stop on overflow - just reset the buffer
-		GetCoreCallback()->ClearImageBuffer(this);
-		// don't process this same image again...
-		return GetCoreCallback()->InsertImage(this, pI, iROIWidth, iROIHeight, iPixBytes, md.Serialize().c_str(), false);
+		lGrabSdkCalls += 2;//write and read back
+		controls.Set(ASI_EXPOSURE, ExposureToUs(next), ASI_FALSE);
 	}
-	else
-		return ret;
+	dNextExposureMs = next;
 }
 
 
-unsigned ASICamera::GetImageWidth() const
-{
-	 
 
-	return iROIWidth;
+/*
+* All control writes of the property handlers come here: while a settings
+* transaction is open they are collected, a later write of the same
+* control replacing the earlier one.
+*/
+ASI_ERROR_CODE ASICamera::SetControl(ASI_CONTROL_TYPE type, long lVal, ASI_BOOL bAuto)
+{
+	if (!bTransactionOpen)
+		return controls.Set(type, lVal, bAuto);
+	SettingsChange change = { type, lVal, bAuto };
+	for (size_t i = 0; i < transactionChanges.size(); i++)
+	{
+		if (transactionChanges[i].Type == type)
+		{
+			transactionChanges[i] = change;
+			return ASI_SUCCESS;
+		}
+	}
+	transactionChanges.push_back(change);
+	return ASI_SUCCESS;
 }
 
-unsigned ASICamera::GetImageHeight() const
+/*
+* Ends the open transaction. Outside a sequence its changes are written at
+* once. During one they are handed to the grab thread, which writes them
+* between two ASIGetVideoData() calls; the geometry a new flip gives and
+* the library dark for the new settings are worked out here, so the grab
+* thread only publishes them. A commit the grab thread has not taken yet
+* is merged into this one.
+*/
+int ASICamera::CommitSettings()
 {
-	 
+	bTransactionOpen = false;
+	if (transactionChanges.empty())
+		return DEVICE_OK;
+	SettingsTransaction* pT = new SettingsTransaction();
+	SettingsTransactionPtr prev = std::atomic_exchange(&pCommittedSettings, SettingsTransactionPtr());
+	if (prev)
+		*pT = *prev;
+	pT->Changes.insert(pT->Changes.end(), transactionChanges.begin(), transactionChanges.end());
+	transactionChanges.clear();
+	if (Status != capturing)
+	{
+		ApplySettings(*pT);
+		delete pT;
+		PublishGeometry();
+		return DEVICE_OK;
+	}
 
-	return iROIHeight;
+	long lVal;
+	ASI_BOOL bAuto;
+	long lFlip = -1;
+	if (GetOneCtrlCap(ASI_FLIP))
+		controls.Get(ASI_FLIP, &lVal, &bAuto);
+	else
+		lVal = ASI_FLIP_NONE;
+	DarkKey key = CurrentDarkKey(*GetGeometry());
+	for (size_t i = 0; i < pT->Changes.size(); i++)
+	{
+		const SettingsChange& c = pT->Changes[i];
+		if (c.Type == ASI_FLIP)
+			lFlip = c.Value;
+		else if (c.Type == ASI_EXPOSURE)
+			key.Exposure = c.Value;
+		else if (c.Type == ASI_GAIN)
+			key.Gain = c.Value;
+		else if (c.Type == ASI_BRIGHTNESS)
+			key.Offset = c.Value;
+	}
+	if (lFlip >= 0 && lFlip != lVal)
+		pT->Geometry = FrameGeometryPtr(BuildGeometry(lFlip));
+	FrameGeometryPtr geo = pT->Geometry ? pT->Geometry : GetGeometry();
+	if (bDarkLibrary && darkLibrary.IsOpen())
+	{
+		pLibraryDark = darkLibrary.Select(key, *geo, sLibraryDark);
+		pT->bDark = true;
+		pT->Dark = pLibraryDark ? pLibraryDark : pFileDark;
+	}
+	std::atomic_store(&pCommittedSettings, SettingsTransactionPtr(pT));
+	return DEVICE_OK;
 }
 
-unsigned ASICamera::GetImageBytesPerPixel() const
+void ASICamera::ApplySettings(const SettingsTransaction& t)
 {
-	return iPixBytes;
+	for (size_t i = 0; i < t.Changes.size(); i++)
+	{
+		const SettingsChange& c = t.Changes[i];
+		controls.Set(c.Type, c.Value, c.Auto);
+		if (c.Type == ASI_EXPOSURE)
+			lExpUs = c.Value;
+	}
+	bMetadataDirty = true;
 }
 
-int ASICamera::SnapImage()
+/*
+* Grab thread, before each ASIGetVideoData(). The frame being exposed
+* while the controls change is marked mixed; the one after it is the
+* first of the new settings generation.
+*/
+void ASICamera::ApplyCommittedSettings()
 {
-	//  GenerateImage();
-//	ASIGetStartPos(iCamIndex, &iStartXImg, &iStartYImg);
-	ASIStartExposure(ASICameraInfo.CameraID, ASI_FALSE);
-	Status = snaping;
-	unsigned long time = GetTickCount(), deltaTime = 0;
-	ASI_EXPOSURE_STATUS exp_status;
-	do
+	if (!std::atomic_load(&pCommittedSettings))
+		return;
+	SettingsTransactionPtr t = std::atomic_exchange(&pCommittedSettings, SettingsTransactionPtr());
+	if (!t)
+		return;
+	lGrabSdkCalls += 2 * (long)t->Changes.size();//write and read back
+	ApplySettings(*t);
+	if (t->Geometry)
+		std::atomic_store(&pGeometry, t->Geometry);
+	if (t->bDark)
 	{
-		ASIGetExpStatus(ASICameraInfo.CameraID, &exp_status);
-		//OutputDbgPrint("SnapImage do exp_status %d\n", (int)exp_status);
-		deltaTime = GetTickCount() - time;
-		if (deltaTime > 10000 && GetTickCount() - time > 3 * lExpMs)
+		CalibrationMastersPtr cur = std::atomic_load(&pCalMasters);
+		if (cur ? cur->Dark != t->Dark : (bool)t->Dark)
+			PublishMaster(false, t->Dark);
+	}
+	lSettingsGeneration++;
+	bSettingsMixed = true;
+}
+
+/*
+* The current format from the members and the controls from the cache,
+* so saving a preset calls the SDK not at all.
+*/
+void ASICamera::SavePreset(CameraPreset& p)
+{
+	FrameGeometryPtr geo = GetGeometry();
+	p.Width = iROIWidth;
+	p.Height = iROIHeight;
+	p.Bin = iBin;
+	p.StartX = geo->StartX;
+	p.StartY = geo->StartY;
+	p.ImgType = ImgType;
+	p.b12RAW = b12RAW;
+	p.bRGB48 = bRGB48;
+	p.bHostDebayer = bHostDebayer;
+	for (int i = 0; i < PRESET_CONTROL_NUM; i++)
+	{
+		p.Controls[i] = 0;
+		p.ControlAuto[i] = ASI_FALSE;
+		if (GetOneCtrlCap(g_PresetControls[i]))
+			controls.Get(g_PresetControls[i], &p.Controls[i], &p.ControlAuto[i]);
+	}
+}
+
+/*
+* Writes only what differs from the current state. High speed mode and
+* bandwidth go first, as the SDK may re-check the format against them.
+* Size, bin and pixel type change with one ASISetROIFormat() and one
+* DeleteImgBuf(), where the property handlers would take one of each per
+* property; a start position alone needs neither. The geometry is
+* published once at the end.
+*
+* Refused while a settings transaction is open: the format cannot wait
+* for its commit, and the controls would overtake the queued ones. An
+* armed snap is aborted, its exposure has the old settings.
+*/
+int ASICamera::ApplyPreset(const CameraPreset& p)
+{
+	if (Status == capturing || bTransactionOpen)
+		return DEVICE_CAMERA_BUSY_ACQUIRING;
+	StopSnapActivity();
+	int iCalls = 0;
+	bool bChanged = false;
+	for (int i = 0; i < PRESET_CONTROL_NUM; i++)
+	{
+		long lVal;
+		ASI_BOOL bAuto;
+		if (!GetOneCtrlCap(g_PresetControls[i]) || controls.Get(g_PresetControls[i], &lVal, &bAuto) != ASI_SUCCESS)
+			continue;
+		if (lVal == p.Controls[i] && bAuto == p.ControlAuto[i])
+			continue;
+		SetControl(g_PresetControls[i], p.Controls[i], p.ControlAuto[i]);
+		iCalls += 2;//write and read back
+		bChanged = true;
+	}
+
+	FrameGeometryPtr geo = GetGeometry();
+	bool bFormat = p.Width != iROIWidth || p.Height != iROIHeight || p.Bin != iBin || p.ImgType != ImgType;
+	if (bFormat)
+	{
+		iCalls++;
+		if (ASISetROIFormat(ASICameraInfo.CameraID, p.Width, p.Height, p.Bin, p.ImgType) != ASI_SUCCESS)
 		{
-			OutputDbgPrint("SnapImage delta %d ms, stop snap\n", deltaTime);
-			ASIStopExposure(ASICameraInfo.CameraID);
-			break;
+			PublishGeometry();
+			return DEVICE_INVALID_PROPERTY_VALUE;
 		}
+		DeleteImgBuf();
+		ASIGetROIFormat(ASICameraInfo.CameraID, &iROIWidth, &iROIHeight, &iBin, &ImgType);
+		iCalls++;
+	}
+	// a new format moves the start to the centre
+	if (bFormat || p.StartX != geo->StartX || p.StartY != geo->StartY)
+	{
+		ASISetStartPos(ASICameraInfo.CameraID, p.StartX, p.StartY);
+		iCalls++;
+		bChanged = true;
+	}
+	iSetWid = iROIWidth;
+	iSetHei = iROIHeight;
+	iSetBin = iBin;
+	iSetX = p.StartX;
+	iSetY = p.StartY;
+	if (p.b12RAW != b12RAW || p.bRGB48 != bRGB48 || p.bHostDebayer != bHostDebayer)
+	{
+		b12RAW = p.b12RAW;
+		bRGB48 = p.bRGB48;
+		bHostDebayer = p.bHostDebayer;
+		if (!bFormat)
+			DeleteImgBuf();//same SDK frames, other output
+		bChanged = true;
+	}
+	RefreshImgType();
+	if (bChanged || bFormat)
+		PublishGeometry();
+	ASI_LOG_DEBUG("preset %s: %d SDK calls", sPresetName.c_str(), iCalls);
+	return DEVICE_OK;
+}
 
-		Sleep(1);
-	} while (exp_status == ASI_EXP_WORKING);
+/*
+* Inserts Image and MetaData into MMCore circular Buffer
+* Called from the insert thread with a frame popped from frameQueue
+*/
+int ASICamera::InsertImage(FrameSlot& frame)
+{
+	//ASI_LOG_DEBUG("InsertImage");
+	const FrameGeometry& geo = *frame.pGeometry;
+	unsigned long long ullStageUs = frame.ullSdkReturnUs && bLatency ? LatencyNowUs() : 0;
 
-	Status = opened;
+	// Important:  metadata about the image are generated here:
+	// the static part is serialized once per configuration, only the
+	// per-frame fields are written into the prebuilt buffer
+	if (bMetadataDirty.exchange(false) || frame.pGeometry != pMdGeometry || !mdTemplate.IsBuilt())
+		BuildMetadataTemplate(frame.pGeometry);
+	mdTemplate.SetInt(MD_IMAGE_NUMBER, frame.lFrameNumber);
+	mdTemplate.SetFloat(MD_ELAPSED_TIME, frame.dTimestampMs - dSeqStartMs, 3);
+	mdTemplate.SetFloat(MD_EXPOSURE, frame.dExposureMs, 3);
+	mdTemplate.SetInt(MD_OVERFLOW_DROPPED, lOverflowCount[OVERFLOW_DROP_NEWEST] + lOverflowCount[OVERFLOW_BLOCK] + lOverflowCount[OVERFLOW_STOP]);
+	mdTemplate.SetInt(MD_FRAME_NUMBER, frame.lCameraFrame);
+	mdTemplate.SetInt(MD_DROPPED_SINCE_LAST, frame.lDroppedSinceLast);
+	mdTemplate.SetInt(MD_SETTINGS_GENERATION, frame.lSettingsGeneration);
+	mdTemplate.SetInt(MD_SETTINGS_MIXED, frame.bSettingsMixed ? 1 : 0);
+	if (ullStageUs)
+		ullStageUs = RecordLatency(LATENCY_METADATA, ullStageUs);
+
+	//   MMThreadGuard g(imgPixelsLock_);
 
-	if (uc_pImg == 0)
+	// the slot is ours until the next pop, so calibration works in place
+	const char* pCal = g_Keyword_off;
+	if (bCalibrate)
+		pCal = CalibrateFrame(frame.pData, frame.pGeometry, insertCal) ? g_CalibrationStatus[CAL_APPLIED] : "skipped";
+	mdTemplate.SetText(MD_CALIBRATION, pCal);
+	if (iMdStats >= 0)
+		SetStatsMetadata(frame.Stats);
+	if (frame.Stats.IsValid())
 	{
-		iBufSize = GetImageBufferSize();
-		uc_pImg = new unsigned char[iBufSize];
+		MMThreadGuard g(statsLock);
+		lastStats.CopyResults(frame.Stats);
 	}
-	if (exp_status == ASI_EXP_SUCCESS)
+	if (bHotPixels)
+		CorrectHotPixels(frame.pData, frame.pGeometry, insertHot);
+
+	const unsigned char* pI;
+	if (ullStageUs)
+		ullStageUs = LatencyNowUs();//calibration and hot pixels are not timed
+	pI = ConvertFrame(frame.pData, geo, insertOut);
+	if (ullStageUs)
+		ullStageUs = RecordLatency(LATENCY_CONVERSION, ullStageUs);
+	if (lStackDepth > 1)
 	{
-		OutputDbgPrint("ASI_EXP_SUCCESS exp_status %d\n", (int)exp_status);
-		ASIGetDataAfterExp(ASICameraInfo.CameraID, uc_pImg, iBufSize);
-		ASI_BOOL bAuto;
-		long lVal;
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_FLIP, &lVal, &bAuto);
-		ImgFlip = (ASI_FLIP_STATUS)lVal;
-		ASI_IMG_TYPE imgType;
-		ASIGetROIFormat(ASICameraInfo.CameraID, &ImgWid, &ImgHei, &ImgBin, &imgType);
-		ASIGetStartPos(ASICameraInfo.CameraID, &ImgStartX, &ImgStartY);
+		pI = StackFrame(frame, pI);
+		if (pI == 0)
+			return DEVICE_OK;//in the stack, nothing to insert yet
+		if (ullStageUs)
+			ullStageUs = LatencyNowUs();
 	}
+	int ret = 0;
+	ret = GetCoreCallback()->InsertImage(this, pI, geo.ImageWidth, geo.ImageHeight, geo.PixBytes, mdTemplate.c_str());
+	if (ullStageUs)
+	{
+		RecordLatency(LATENCY_CORE_INSERT, ullStageUs);
+		RecordLatency(LATENCY_SDK_TO_CORE, frame.ullSdkReturnUs);
+	}
+	if (ret != DEVICE_BUFFER_OVERFLOW)
+		return ret;
 
-	OutputDbgPrint("exp_status %d\n", (int)exp_status);
-	if (exp_status == ASI_EXP_SUCCESS)
+	//����������Ҫ���, �����ܼ�������ͼ�����ס
+	switch (bStopOnOverflow ? OVERFLOW_STOP : eOverflowPolicy)
+	{
+	case OVERFLOW_DROP_NEWEST:
+		// keep what the core already holds, lose this frame only
+		lOverflowCount[OVERFLOW_DROP_NEWEST]++;
+		return DEVICE_OK;
+
+	case OVERFLOW_BLOCK:
+	{
+		// wait for the application to read frames out; meanwhile the grab
+		// thread keeps filling frameQueue
+		MM::MMTime tEnd = GetCurrentMMTime() + MM::MMTime(lOverflowTimeoutMs * 1000.0);
+		while (GetCurrentMMTime() < tEnd && !insThd_->IsFinishing())
+		{
+			CDeviceUtils::SleepMs(1);
+			// don't process this same image again...
+			ret = GetCoreCallback()->InsertImage(this, pI, geo.ImageWidth, geo.ImageHeight, geo.PixBytes, mdTemplate.c_str(), false);
+			if (ret != DEVICE_BUFFER_OVERFLOW)
+				return ret;
+		}
+		lOverflowCount[OVERFLOW_BLOCK]++;
 		return DEVICE_OK;
+	}
+
+	case OVERFLOW_STOP:
+		// InsertThread stops the grab thread and discards the queue
+		lOverflowCount[OVERFLOW_STOP]++;
+		return DEVICE_BUFFER_OVERFLOW;
+
+	default:
+		// do not stop on overflow - just reset the buffer
+		lOverflowCount[OVERFLOW_CLEAR_ALL]++;
+		GetCoreCallback()->ClearImageBuffer(this);
+		// don't process this same image again...
+		return GetCoreCallback()->InsertImage(this, pI, geo.ImageWidth, geo.ImageHeight, geo.PixBytes, mdTemplate.c_str(), false);
+	}
+}
+
+/*
+* Adds a converted frame to the current stack. Returns the reduced frame
+* once lStackDepth frames are in, 0 before that. The stacked frame is
+* numbered by stack; the elapsed time and exposure are those of its last
+* frame and the stack fields name the frames it was built from.
+*/
+const unsigned char* ASICamera::StackFrame(const FrameSlot& frame, const unsigned char* pImg)
+{
+	const FrameGeometry& geo = *frame.pGeometry;
+	size_t pixels = (size_t)geo.ImageWidth * geo.ImageHeight;
+
+	//a geometry change drops the partial stack, its frames do not add up
+	if (stacker.GetCount() == 0 || frame.pGeometry != pStackGeometry)
+	{
+		stacker.Begin(eStackOp, (float)dStackKappa, pixels * geo.Components, geo.PixBytes / geo.Components);
+		pStackGeometry = frame.pGeometry;
+		stackFrames.clear();
+	}
+
+	StackJob job;
+	job.pStacker = &stacker;
+	job.pSrc = pImg;
+	job.pDst = 0;
+	job.RowSamples = (size_t)geo.ImageWidth * geo.Components;
+	RunStripes(geo.ImageHeight, pixels, StackAccumulateStripe, &job);
+	stacker.EndFrame();
+	stackFrames.push_back(frame.lFrameNumber);
+	if (stacker.GetCount() < lStackDepth)
+		return 0;
+
+	stackOut.resize(geo.FrameSize());
+	job.pDst = &stackOut[0];
+	RunStripes(geo.ImageHeight, pixels, StackReduceStripe, &job);
+	stacker.Reset();
+
+	stackFrameList.clear();
+	for (size_t i = 0; i < stackFrames.size(); i++)
+	{
+		char buf[16];
+		snprintf(buf, sizeof(buf), i == 0 ? "%ld" : ",%ld", stackFrames[i]);
+		stackFrameList += buf;
+	}
+	mdTemplate.SetInt(MD_IMAGE_NUMBER, lStackedCount++);
+	mdTemplate.SetInt(MD_STACK_COUNT, (long long)stackFrames.size());
+	mdTemplate.SetInt(MD_STACK_FIRST, stackFrames.front());
+	mdTemplate.SetInt(MD_STACK_LAST, stackFrames.back());
+	mdTemplate.SetText(MD_STACK_FRAMES, stackFrameList.c_str());
+	return &stackOut[0];
+}
+
+void ASICamera::StackAccumulateStripe(void* pCtx, int rowBegin, int rowEnd)
+{
+	const StackJob* pJob = (const StackJob*)pCtx;
+	pJob->pStacker->Accumulate(pJob->pSrc, rowBegin * pJob->RowSamples, rowEnd * pJob->RowSamples);
+}
+
+void ASICamera::StackReduceStripe(void* pCtx, int rowBegin, int rowEnd)
+{
+	const StackJob* pJob = (const StackJob*)pCtx;
+	pJob->pStacker->Reduce(pJob->pDst, rowBegin * pJob->RowSamples, rowEnd * pJob->RowSamples);
+}
+
+/*
+* Applies the current masters to an SDK frame in place. The masters are
+* prepared for the frame geometry on first use after either changed.
+* Returns false, leaving the frame as is, when they do not fit the frame.
+*/
+bool ASICamera::CalibrateFrame(unsigned char* pData, const FrameGeometryPtr& geo, PreparedCalibration& cal)
+{
+	CalibrationMastersPtr masters = std::atomic_load(&pCalMasters);
+	if (!cal.IsPreparedFor(masters, geo))
+		cal.Prepare(masters, geo, ASICameraInfo.IsColorCam == ASI_TRUE);
+	iCalStatus = cal.GetStatus();
+	if (cal.GetStatus() != CAL_APPLIED)
+		return false;
+
+	CalibrationJob job;
+	job.pCal = &cal;
+	job.pFrame = pData;
+	RunStripes(geo->Height, (size_t)geo->Width * geo->Height, CalibrateStripe, &job);
+	return true;
+}
+
+void ASICamera::CalibrateStripe(void* pCtx, int rowBegin, int rowEnd)
+{
+	const CalibrationJob* pJob = (const CalibrationJob*)pCtx;
+	pJob->pCal->Apply(pJob->pFrame, rowBegin, rowEnd);
+}
+
+/*
+* Replaces the dark or the flat. The insert thread picks the new set up
+* with the next frame.
+*/
+void ASICamera::PublishMaster(bool bFlat, const CalibrationFramePtr& master)
+{
+	CalibrationMasters* pMasters = new CalibrationMasters();
+	CalibrationMastersPtr cur = std::atomic_load(&pCalMasters);
+	if (cur)
+		*pMasters = *cur;
+	if (bFlat)
+		pMasters->Flat = master;
 	else
-		return DEVICE_SNAP_IMAGE_FAILED;
+		pMasters->Dark = master;
+	std::atomic_store(&pCalMasters, CalibrationMastersPtr(pMasters));
+}
+
+/*
+* Settings the current dark has to match, read back from the SDK.
+*/
+DarkKey ASICamera::CurrentDarkKey(const FrameGeometry& geo)
+{
+	DarkKey key;
+	long lVal;
+	ASI_BOOL bAuto;
+	key.Camera = sCameraSerial;
+	key.Exposure = controls.Get(ASI_EXPOSURE, &lVal, &bAuto) == ASI_SUCCESS ? lVal : 0;
+	key.Gain = GetOneCtrlCap(ASI_GAIN) && controls.Get(ASI_GAIN, &lVal, &bAuto) == ASI_SUCCESS ? lVal : 0;
+	key.Offset = GetOneCtrlCap(ASI_BRIGHTNESS) && controls.Get(ASI_BRIGHTNESS, &lVal, &bAuto) == ASI_SUCCESS ? lVal : 0;
+	key.Temperature = GetOneCtrlCap(ASI_TEMPERATURE) && controls.Get(ASI_TEMPERATURE, &lVal, &bAuto) == ASI_SUCCESS ? lVal : 0;
+	key.Bin = geo.Bin;
+	key.ImgType = geo.ImgType;
+	return key;
 }
 
+/*
+* Looks up the library dark for the current settings. Called whenever one
+* of them changes; the file is only mapped here, its pages come in in the
+* background and on first use by the insert thread.
+*/
+void ASICamera::SelectLibraryDark()
+{
+	if (!bDarkLibrary || !darkLibrary.IsOpen())
+		return;
+	FrameGeometryPtr geo = GetGeometry();
+	pLibraryDark = darkLibrary.Select(CurrentDarkKey(*geo), *geo, sLibraryDark);
+	PublishDark();
+}
 
-int ASICamera::PrepareSequenceAcqusition()
+/*
+* Publishes the library dark, or the file dark when the library is off or
+* has no match. Unchanged darks are not published again, which would
+* throw away the prepared calibration.
+*/
+void ASICamera::PublishDark()
 {
-	if (IsCapturing())
-		return DEVICE_CAMERA_BUSY_ACQUIRING;
-	/*   int ret = GetCoreCallback()->PrepareForAcq(this);
+	CalibrationFramePtr dark = bDarkLibrary && pLibraryDark ? pLibraryDark : pFileDark;
+	CalibrationMastersPtr cur = std::atomic_load(&pCalMasters);
+	if (cur ? cur->Dark != dark : (bool)dark)
+		PublishMaster(false, dark);
+}
+
+/*
+* Averages lMasterFrames snaps of the current geometry into a new master,
+* and writes it to the calibration file if one is named. A dark also goes
+* into the dark library when one is open.
+*/
+int ASICamera::CaptureMaster(bool bFlat)
+{
+	CalibrationFramePtr master;
+	int ret = AverageSnaps(master);
 	if (ret != DEVICE_OK)
-	return ret;*/
+		return ret;
+	bool bSaved = true;
+	if (bFlat)
+	{
+		PublishMaster(true, master);
+	}
+	else
+	{
+		pFileDark = master;
+		std::string name;
+		if (darkLibrary.IsOpen())
+		{
+			// the selected library dark may be the file Add() replaces; the
+			// new master takes its place in the published set first
+			pLibraryDark.reset();
+			sLibraryDark.clear();
+			PublishDark();
+			bSaved = darkLibrary.Add(CurrentDarkKey(*GetGeometry()), master, name);
+		}
+		SelectLibraryDark();
+		PublishDark();
+	}
+
+	const std::string& path = sCalFile[bFlat ? 1 : 0];
+	if (!path.empty() && !SaveCalibrationFrame(path.c_str(), *master, bFlat ? "Flat Field" : "Dark Frame"))
+		bSaved = false;
+	return bSaved ? DEVICE_OK : DEVICE_ERR;
+}
+
+/*
+* Snaps lMasterFrames frames with the current settings and averages them.
+*/
+int ASICamera::AverageSnaps(CalibrationFramePtr& master)
+{
+	MasterBuilder builder;
+	if (!builder.Begin(GetGeometry()))
+		return DEVICE_INVALID_PROPERTY_VALUE;
+	for (long i = 0; i < lMasterFrames; i++)
+	{
+		int ret = SnapImage();
+		if (ret != DEVICE_OK)
+			return ret;
+		builder.Add(uc_pImg);
+	}
+	master = builder.Finish();
 	return DEVICE_OK;
 }
 
+std::string ASICamera::HotPixelPath() const
+{
+	return sHotPixelDir + "/" + sCameraSerial + ".hotpix";
+}
 
 /*
-* Do actual capturing
-* Called from inside the thread
+* Replaces the listed pixels of an SDK frame in place. Runs on the calling
+* thread, the work is a few neighbours per defect.
 */
-int ASICamera::RunSequenceOnThread(MM::MMTime startTime)
+void ASICamera::CorrectHotPixels(unsigned char* pData, const FrameGeometryPtr& geo, PreparedHotPixels& hot)
 {
-	int ret = DEVICE_ERR;
+	HotPixelMapPtr map = std::atomic_load(&pHotMap);
+	if (!hot.IsPreparedFor(map, geo))
+		hot.Prepare(map, geo, ASICameraInfo.IsColorCam == ASI_TRUE && geo->ImgType != ASI_IMG_Y8);
+	hot.Apply(pData);
+}
+
+/*
+* Builds the map from an averaged dark of the current settings and saves
+* it to the hot pixel directory if one is set. Averaging first keeps
+* random noise from being taken for defects.
+*/
+int ASICamera::DetectHotPixelMap()
+{
+	if (GetGeometry()->ImgType == ASI_IMG_RGB24)
+		return DEVICE_INVALID_PROPERTY_VALUE;
+	CalibrationFramePtr dark;
+	int ret = AverageSnaps(dark);
+	if (ret != DEVICE_OK)
+		return ret;
+	HotPixelMapPtr map = DetectHotPixels(*dark, eHotPixelMode,
+		eHotPixelMode == HOTPIX_SIGMA ? dHotPixelSigma : (double)lHotPixelThreshold);
+	std::atomic_store(&pHotMap, map);
+	if (!sHotPixelDir.empty() && !SaveHotPixelMap(HotPixelPath().c_str(), *map))
+		return DEVICE_ERR;
+	return DEVICE_OK;
+}
+
+/*
+* Hands stride and regions to the grab thread as one snapshot; the
+* metadata fields follow the regions.
+*/
+void ASICamera::PublishStatsConfig()
+{
+	StatsConfig* pConfig = new StatsConfig();
+	pConfig->RowStride = (int)lStatsRowStride;
+	pConfig->Regions = statsRegions;
+	std::atomic_store(&pStatsConfig, StatsConfigPtr(pConfig));
+	bMetadataDirty = true;
+}
 
-	if (ASIGetVideoData(ASICameraInfo.CameraID, uc_pImg, iBufSize, 2 * lExpMs) == ASI_SUCCESS)
+/*
+* Writes the frame statistics, then those of each region, into the
+* per-frame fields. A frame grabbed before statistics were switched on,
+* or a region the template has no fields for yet, is left at zero.
+*/
+void ASICamera::SetStatsMetadata(const FrameStatistics& stats)
+{
+	SampleStats none;
+	memset(&none, 0, sizeof(none));
+	for (int r = 0; r <= iMdStatsRegions; r++)
 	{
-		ret = InsertImage();
-		ASI_BOOL bAuto;
-		long lVal;
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_FLIP, &lVal, &bAuto);
-		ImgFlip = (ASI_FLIP_STATUS)lVal;
+		const SampleStats* s = &none;
+		if (stats.IsValid() && r == 0)
+			s = &stats.GetFrame();
+		else if (stats.IsValid() && r <= (int)stats.GetRegions().size())
+			s = &stats.GetRegions()[r - 1];
+		int field = iMdStats + r * STATS_FIELD_NUM;
+		mdTemplate.SetInt(field + STATS_MIN, s->Min);
+		mdTemplate.SetInt(field + STATS_MAX, s->Max);
+		mdTemplate.SetFloat(field + STATS_MEAN, s->Mean, 3);
+		mdTemplate.SetFloat(field + STATS_STDDEV, s->StdDev, 3);
+		mdTemplate.SetInt(field + STATS_SATURATED, (long long)s->Saturated);
+	}
+}
+
+/*
+* Serializes the static part of the frame metadata: camera label, binning,
+* pixel type, ROI, gain and offset. Runs on the insert thread whenever the
+* geometry snapshot changes or a handler marked the metadata dirty.
+*/
+void ASICamera::BuildMetadataTemplate(const FrameGeometryPtr& geo)
+{
+	char label[MM::MaxStrLength];
+	char buf[MM::MaxStrLength];
+	long lVal;
+	ASI_BOOL bAuto;
+	Metadata md;
 
-		ASI_IMG_TYPE imgType;
-		ASIGetROIFormat(ASICameraInfo.CameraID, &ImgWid, &ImgHei, &ImgBin, &imgType);
-		ASIGetStartPos(ASICameraInfo.CameraID, &ImgStartX, &ImgStartY);
+	GetLabel(label);
+	md.put("Camera", label);
+
+	snprintf(buf, sizeof(buf), "%d", geo->Bin * geo->SoftBin);
+	md.put(MM::g_Keyword_Binning, buf);
+	md.put(MM::g_Keyword_PixelType, PixelTypeName(*geo));
+	if (geo->bDebayer)
+		md.put("Debayer", g_Debayer[geo->DebayerAlgo + 1]);
+
+	unsigned x, y, xSize, ySize;
+	GetDisplayROI(*geo, x, y, xSize, ySize);
+	snprintf(buf, sizeof(buf), "%u-%u-%u-%u", x, y, xSize, ySize);
+	md.put("ROI", buf);
+
+	if (GetOneCtrlCap(ASI_GAIN) && controls.Get(ASI_GAIN, &lVal, &bAuto) == ASI_SUCCESS)
+	{
+		snprintf(buf, sizeof(buf), "%ld", lVal);
+		md.put(MM::g_Keyword_Gain, buf);
 	}
-	return ret;
+	if (GetOneCtrlCap(ASI_BRIGHTNESS) && controls.Get(ASI_BRIGHTNESS, &lVal, &bAuto) == ASI_SUCCESS)
+	{
+		snprintf(buf, sizeof(buf), "%ld", lVal);
+		md.put(MM::g_Keyword_Offset, buf);
+	}
+
+	mdTemplate.Clear();
+	mdTemplate.AddField(MM::g_Keyword_Metadata_ImageNumber, 10);
+	mdTemplate.AddField(MM::g_Keyword_Elapsed_Time_ms, 14);
+	mdTemplate.AddField("Exposure-ms", 12);
+	mdTemplate.AddField("OverflowDropped", 10);
+	mdTemplate.AddField("FrameNumber", 10);
+	mdTemplate.AddField("DroppedSinceLast", 10);
+	mdTemplate.AddField("SettingsGeneration", 10);
+	mdTemplate.AddField("SettingsMixed", 1);
+	mdTemplate.AddField("Calibration", 7);
+	if (lStackDepth > 1)
+	{
+		md.put("StackOperator", g_StackOperator[eStackOp]);
+		mdTemplate.AddField("StackCount", 6);
+		mdTemplate.AddField("StackFirstFrame", 10);
+		mdTemplate.AddField("StackLastFrame", 10);
+		mdTemplate.AddField("StackFrames", 11 * lStackDepth);
+	}
+	iMdStats = -1;
+	iMdStatsRegions = 0;
+	if (bStats)
+	{
+		StatsConfigPtr config = std::atomic_load(&pStatsConfig);
+		iMdStatsRegions = (int)config->Regions.size();
+		for (int r = 0; r <= iMdStatsRegions; r++)
+		{
+			for (int i = 0; i < STATS_FIELD_NUM; i++)
+			{
+				if (r == 0)
+					snprintf(buf, sizeof(buf), "Stats%s", g_StatsField[i]);
+				else
+					snprintf(buf, sizeof(buf), "StatsRegion%d%s", r, g_StatsField[i]);
+				int field = mdTemplate.AddField(buf, i == STATS_MIN || i == STATS_MAX ? 5 : (i == STATS_SATURATED ? 10 : 12));
+				if (iMdStats < 0)
+					iMdStats = field;
+			}
+		}
+	}
+	mdTemplate.Build(md);
+	pMdGeometry = geo;
 }
 
 
+unsigned ASICamera::GetImageWidth() const
+{
+	 
 
-/**
-* Required by the MM::Camera API
-* Please implement this yourself and do not rely on the base class implementation
-* The Base class implementation is deprecated and will be removed shortly
-*/
-int ASICamera::StartSequenceAcquisition(double interval) {
-	return StartSequenceAcquisition(LONG_MAX, interval, false);
+	return iROIWidth / iSoftBin;
 }
 
-/**
-* Simple implementation of Sequence Acquisition
-* A sequence acquisition should run on its own thread and transport new images
-* coming of the camera into the MMCore circular buffer.
-*/
-int ASICamera::StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow)
+unsigned ASICamera::GetImageHeight() const
 {
-	if (IsCapturing())
-		return DEVICE_CAMERA_BUSY_ACQUIRING;
+	 
 
-	OutputDbgPrint("StartCap\n");
+	return iROIHeight / iSoftBin;
+}
 
-	ASIStartVideoCapture(ASICameraInfo.CameraID);
-	Status = capturing;
+unsigned ASICamera::GetImageBytesPerPixel() const
+{
+	return iPixBytes;
+}
 
-	OutputDbgPrint("StartSeqAcq\n");
-	thd_->Start(numImages, interval_ms);//��ʼ�߳�
+int ASICamera::SnapImage()
+{
+	//  GenerateImage();
+//	ASIGetStartPos(iCamIndex, &iStartXImg, &iStartYImg);
+	SelectLibraryDark();//the sensor temperature may have moved to another bucket
+	AllocImgBuf();
+	bool bOk = bSnapArmed && TakeArmedSnap();
+	if (!bOk)
+		bOk = UseSnapStream() ? SnapFromStream() : SnapSingleExposure(uc_pImg);
+	if (bOk)
+	{
+		//converted on the first GetImageBuffer() after this
+		pSnapGeometry = GetGeometry();
+		bSnapConverted = false;
+		if (bStats)
+		{
+			MMThreadGuard g(statsLock);
+			lastStats.Compute(uc_pImg, *pSnapGeometry, *std::atomic_load(&pStatsConfig));
+		}
+	}
+	return bOk ? DEVICE_OK : DEVICE_SNAP_IMAGE_FAILED;
+}
+
+/*
+* One ASIStartExposure() into pDst, for long exposures and whenever snaps
+* are not streamed.
+*/
+bool ASICamera::SnapSingleExposure(unsigned char* pDst)
+{
+	StopSnapStream();
+	SingleSnap s = BeginSingleSnap(pDst);
+	Status = snaping;
+	ExposeSingleSnap(s);
+	Status = opened;
+	EndSingleSnap(s);
+	return s.bOk;
+}
+
+/*
+* The inputs of a single-exposure snap with the current settings.
+*/
+ASICamera::SingleSnap ASICamera::BeginSingleSnap(unsigned char* pDst)
+{
+	SingleSnap s;
+	s.pDst = pDst;
+	s.Geometry = GetGeometry();
+	s.ExpUs = lExpUs;
+	// another frame size reads out in another time
+	s.ReadoutMs = s.Geometry == pReadoutGeometry ? dSnapReadoutMs : 0;
+	// until the first snap of a geometry is measured, the link estimate bounds it
+	s.ReadoutBoundMs = s.ReadoutMs > 0 ? s.ReadoutMs : EstimateReadoutMs(*s.Geometry);
+	s.PollUs = lSnapPollUs;
+	s.bOk = false;
+	s.LatencyMs = 0;
+	s.Polls = 0;
+	return s;
+}
+
+/*
+* Exposes and reads out s. Touches nothing of the camera but the SDK, so
+* it also runs on the armed snap thread.
+*/
+bool ASICamera::ExposeSingleSnap(SingleSnap& s) const
+{
+	typedef std::chrono::steady_clock Clock;
+	typedef std::chrono::duration<double, std::milli> Ms;
+	double dExpMs = s.ExpUs / 1000.0;
+	double dLeadMs = s.ReadoutMs / 5 > g_SnapPollLeadMs ? s.ReadoutMs / 5 : g_SnapPollLeadMs;
+	Clock::time_point start = Clock::now();
+	Clock::time_point wake = start + std::chrono::duration_cast<Clock::duration>(Ms(dExpMs + s.ReadoutMs - dLeadMs));
+	Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(Ms(dExpMs + 2 * s.ReadoutBoundMs + g_SnapTimeoutSlackMs));
 
+	ASIStartExposure(ASICameraInfo.CameraID, ASI_FALSE);
+	// nothing to ask the SDK before the exposure can have ended
+	std::this_thread::sleep_until(wake);
+	ASI_EXPOSURE_STATUS exp_status;
+	s.Polls = 0;
+	while (true)
+	{
+		ASIGetExpStatus(ASICameraInfo.CameraID, &exp_status);
+		s.Polls++;
+		if (exp_status != ASI_EXP_WORKING)
+			break;
+		if (Clock::now() > deadline)
+		{
+			ASI_LOG_WARNING("SnapImage %.0f ms, stop snap", Ms(Clock::now() - start).count());
+			ASIStopExposure(ASICameraInfo.CameraID);
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(s.PollUs));
+	}
+	s.LatencyMs = Ms(Clock::now() - start).count() - dExpMs;
+
+	if (exp_status == ASI_EXP_SUCCESS)
+	{
+		ASI_LOG_DEBUG("ASI_EXP_SUCCESS exp_status %d", (int)exp_status);
+		ASIGetDataAfterExp(ASICameraInfo.CameraID, s.pDst, s.Geometry->SdkFrameSize());
+	}
+
+	ASI_LOG_DEBUG("exp_status %d", (int)exp_status);
+	s.bOk = exp_status == ASI_EXP_SUCCESS;
+	return s.bOk;
+}
+
+/*
+* Takes the timing of a finished snap into the readout estimate and the
+* snap telemetry.
+*/
+void ASICamera::EndSingleSnap(const SingleSnap& s)
+{
+	lSnapPolls = s.Polls;
+	dSnapLatencyMs = s.LatencyMs;
+	if (!s.bOk)
+		return;
+	double dReadoutMs = s.LatencyMs > 0 ? s.LatencyMs : 0;
+	dSnapReadoutMs = s.ReadoutMs == 0 ? dReadoutMs : 0.75 * s.ReadoutMs + 0.25 * dReadoutMs;
+	pReadoutGeometry = s.Geometry;
+}
+
+bool ASICamera::UseSnapStream() const
+{
+	if (eSnapMode == SNAP_AUTO)
+		return lExpUs / 1000.0 <= dSnapStreamMaxExpMs;
+	return eSnapMode == SNAP_STREAM;
+}
+
+/*
+* Returns the first complete frame whose exposure started after the call.
+* A stream started here qualifies with its first frame. On a running one,
+* the frames queued in the SDK and the one being exposed all started
+* earlier: the queue is drained without waiting, the frame in flight is
+* dropped and the next one kept.
+*/
+bool ASICamera::SnapFromStream()
+{
+	typedef std::chrono::steady_clock Clock;
+	typedef std::chrono::duration<double, std::milli> Ms;
+	Clock::time_point start = Clock::now();
+	double dExpMs = lExpUs / 1000.0;
+	long lWaitMs = (long)(dExpMs + 2 * EstimateReadoutMs(*GetGeometry()) + g_SnapTimeoutSlackMs + 1);
+	int iDrop = 0;
+	lSnapPolls = 0;
+	if (!bSnapStream)
+	{
+		ASIStartVideoCapture(ASICameraInfo.CameraID);
+		bSnapStream = true;
+	}
+	else
+	{
+		ASI_ERROR_CODE err;
+		do
+		{
+			lSnapPolls++;
+			err = ASIGetVideoData(ASICameraInfo.CameraID, uc_pImg, iBufSize, 0);
+		} while (err == ASI_SUCCESS);
+		iDrop = 1;
+	}
+	bool bOk = true;
+	for (int i = 0; i <= iDrop && bOk; i++)
+	{
+		lSnapPolls++;
+		bOk = ASIGetVideoData(ASICameraInfo.CameraID, uc_pImg, iBufSize, lWaitMs) == ASI_SUCCESS;
+	}
+	dSnapLatencyMs = Ms(Clock::now() - start).count() - dExpMs;
+	if (!bOk)
+		StopSnapStream();//start over with the next snap
+	return bOk;
+}
+
+/*
+* Ends the snap stream, see StopSnapActivity(); also before a
+* single-exposure snap.
+*/
+void ASICamera::StopSnapStream()
+{
+	if (!bSnapStream)
+		return;
+	ASIStopVideoCapture(ASICameraInfo.CameraID);
+	bSnapStream = false;
+}
+
+/*
+* Starts the next single-exposure snap now, with the current settings,
+* while GetImageBuffer() keeps serving the last one. The exposure and its
+* readout overlap whatever MMCore does with the last image; the next
+* SnapImage() only waits for what is left. Call it once stage, filter and
+* the like are in place for the next image. Does nothing while snaps are
+* streamed, those are taken fresh anyway.
+*/
+int ASICamera::ArmSnap()
+{
+	if (Status == capturing)
+		return DEVICE_CAMERA_BUSY_ACQUIRING;
+	if (bSnapArmed || UseSnapStream())
+		return DEVICE_OK;
+	StopSnapStream();
+	AllocImgBuf();
+	if (uc_pArmedImg == 0)
+		uc_pArmedImg = new unsigned char[iBufSize];
+	armedSnap = BeginSingleSnap(uc_pArmedImg);
+	lArmedControlWrites = controls.GetWriteCount();
+	bSnapArmed = true;
+	armThd_->Start();
+	return DEVICE_OK;
+}
+
+/*
+* Waits for the armed snap and makes it the current one. False when it
+* failed, or when the geometry changed or any control was written after
+* arming (gain, offset, flip, a preset, a committed transaction); the
+* caller snaps again.
+*/
+bool ASICamera::TakeArmedSnap()
+{
+	armThd_->wait();
+	bSnapArmed = false;
+	EndSingleSnap(armedSnap);
+	if (!armedSnap.bOk || armedSnap.Geometry != GetGeometry() || armedSnap.ExpUs != lExpUs
+		|| lArmedControlWrites != controls.GetWriteCount())
+		return false;
+	std::swap(uc_pImg, uc_pArmedImg);
+	return true;
+}
+
+/*
+* Puts the camera back to idle before anything that needs it: ROI,
+* binning and pixel type changes, a sequence acquisition, shutdown. An
+* armed exposure is aborted, a snap stream stopped.
+*/
+void ASICamera::StopSnapActivity()
+{
+	if (bSnapArmed)
+	{
+		ASIStopExposure(ASICameraInfo.CameraID);
+		armThd_->wait();
+		bSnapArmed = false;
+	}
+	StopSnapStream();
+}
+
+
+int ASICamera::PrepareSequenceAcqusition()
+{
+	if (IsCapturing())
+		return DEVICE_CAMERA_BUSY_ACQUIRING;
+	StopSnapActivity();
+	/*   int ret = GetCoreCallback()->PrepareForAcq(this);
+	if (ret != DEVICE_OK)
+	return ret;*/
+	return DEVICE_OK;
+}
+
+
+/*
+* Do actual capturing
+* Called from inside the grab thread, only pulls frames from the SDK into
+* frameQueue. InsertThread does the conversion and the core copy.
+*/
+int ASICamera::RunSequenceOnThread(MM::MMTime startTime)
+{
+	int ret = DEVICE_ERR;
+
+	// if the insert thread is behind, keep draining the SDK into the scratch
+	// buffer so the SDK's own ring does not overrun
+	FrameSlot* pSlot = frameQueue.AcquireWrite();
+	unsigned char* pDst = pSlot ? pSlot->pData : uc_pImg;
+	long lSize = pSlot ? (long)pSlot->lSize : (long)iBufSize;
+
+	ApplyCommittedSettings();
+	StepExposureSequence();
+
+	// the only SDK call per frame outside an exposure sequence, geometry comes from the published snapshot
+	lGrabSdkCalls++;
+	double dFrameExpMs = dExposingMs;
+	long lWaitMs = (long)((dExposingMs > dNextExposureMs ? dExposingMs : dNextExposureMs) + dFrameTimeoutExtraMs + 1);
+	unsigned long long ullWaitUs = bLatency ? LatencyNowUs() : 0;
+	if (ASIGetVideoData(ASICameraInfo.CameraID, pDst, lSize, lWaitMs) == ASI_SUCCESS)
+	{
+		unsigned long long ullSdkReturnUs = ullWaitUs ? RecordLatency(LATENCY_SDK_WAIT, ullWaitUs) : 0;
+		lGrabFrames++;
+		dExposingMs = dNextExposureMs;
+		double dNowMs = GetCurrentMMTime().getMsec();
+		UpdateTelemetry(dNowMs);
+		if (pSlot)
+		{
+			long lDropped = lSdkDropped + lPipelineDropped;
+			pSlot->lFrameNumber = imageCounter_++;
+			pSlot->lCameraFrame = lGrabFrames - 1 + lSdkDropped;
+			pSlot->lDroppedSinceLast = lDropped - lDroppedReported;
+			pSlot->lSettingsGeneration = bSettingsMixed ? lSettingsGeneration - 1 : lSettingsGeneration;
+			pSlot->bSettingsMixed = bSettingsMixed;
+			lDroppedReported = lDropped;
+			pSlot->dTimestampMs = dNowMs;
+			pSlot->ullSdkReturnUs = ullSdkReturnUs;
+			pSlot->dExposureMs = dFrameExpMs;
+			pSlot->pGeometry = GetGeometry();
+			if (bStats)
+				pSlot->Stats.Compute(pSlot->pData, *pSlot->pGeometry, *std::atomic_load(&pStatsConfig));
+			else
+				pSlot->Stats.Invalidate();
+			frameQueue.CommitWrite();
+		}
+		else
+			lPipelineDropped++;
+		bSettingsMixed = false;//the next frame is exposed with the new settings only
+		ret = DEVICE_OK;
+	}
+	return ret;
+}
+
+/*
+* Records the time since ullSinceUs for a stage and returns the current
+* time, the start of the next stage.
+*/
+unsigned long long ASICamera::RecordLatency(LatencyStage stage, unsigned long long ullSinceUs)
+{
+	unsigned long long ullNowUs = LatencyNowUs();
+	latency[stage].Record(ullNowUs - ullSinceUs);
+	return ullNowUs;
+}
+
+/*
+* Counts a frame delivered by the SDK into the fps window; once per window
+* updates the rate and the SDK's dropped count. Frames the SDK dropped in
+* a window show up in DroppedSinceLast of the first frame queued after
+* the window closes, pipeline drops in that of the next queued frame.
+*/
+void ASICamera::UpdateTelemetry(double dNowMs)
+{
+	lFpsWindowFrames++;
+	double dWindowMs = dNowMs - dFpsWindowStartMs;
+	if (dWindowMs < g_TelemetryWindowMs)
+		return;
+	dDeliveredFps = lFpsWindowFrames * 1000.0 / dWindowMs;
+	dFpsWindowStartMs = dNowMs;
+	lFpsWindowFrames = 0;
+	int iDropped;
+	lGrabSdkCalls++;
+	if (ASIGetDroppedFrames(ASICameraInfo.CameraID, &iDropped) == ASI_SUCCESS)
+		lSdkDropped = iDropped - iSdkDroppedBase;
+}
+
+
+
+/**
+* Required by the MM::Camera API
+* Please implement this yourself and do not rely on the base class implementation
+* The Base class implementation is deprecated and will be removed shortly
+*/
+int ASICamera::StartSequenceAcquisition(double interval) {
+	return StartSequenceAcquisition(LONG_MAX, interval, false);
+}
+
+/**
+* Simple implementation of Sequence Acquisition
+* A sequence acquisition should run on its own thread and transport new images
+* coming of the camera into the MMCore circular buffer.
+*/
+int ASICamera::StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow)
+{
+	if (IsCapturing())
+		return DEVICE_CAMERA_BUSY_ACQUIRING;
+	// an armed exposure must not run into the exposure and video start below
+	StopSnapActivity();
+
+	ASI_LOG_DEBUG("StartCap");
+
+	// slots hold the SDK layout, conversion happens on the insert thread
+	if (!frameQueue.Allocate(lQueueDepth, GetGeometry()->SdkFrameSize()))
+		return DEVICE_OUT_OF_MEMORY;
+	AllocImgBuf();
+	imageCounter_ = 0;
+	lPipelineDropped = 0;
+	lGrabSdkCalls = 0;
+	lGrabFrames = 0;
+	bMetadataDirty = true;
+	dSeqStartMs = GetCurrentMMTime().getMsec();
+	SelectLibraryDark();
+	stacker.Reset();
+	lStackedCount = 0;
+	bStopOnOverflow = stopOnOverflow;
+	for (int i = 0; i < OVERFLOW_POLICY_NUM; i++)
+		lOverflowCount[i] = 0;
+
+	// the first frame of an exposure sequence is set before the capture starts
+	ExposureSequencePtr seq = std::atomic_load(&pExposureSeq);
+	iExposureSeqPos = 0;
+	bExposureSeqApplied = (bool)seq;
+	dExposingMs = dNextExposureMs = seq ? (*seq)[iExposureSeqPos++] : lExpUs / 1000.0;
+	if (seq)
+		controls.Set(ASI_EXPOSURE, ExposureToUs(dExposingMs), ASI_FALSE);
+	// the geometry and bandwidth are fixed for the run, the exposure is added per frame
+	dFrameTimeoutExtraMs = 2 * EstimateReadoutMs(*GetGeometry()) + g_FrameTimeoutSlackMs;
+
+	bSettingsMixed = false;
+	ASIStartVideoCapture(ASICameraInfo.CameraID);
+	Status = capturing;
+	if (ASIGetDroppedFrames(ASICameraInfo.CameraID, &iSdkDroppedBase) != ASI_SUCCESS)
+		iSdkDroppedBase = 0;
+	lSdkDropped = 0;
+	lDroppedReported = 0;
+	dDeliveredFps = 0;
+	lFpsWindowFrames = 0;
+	dFpsWindowStartMs = GetCurrentMMTime().getMsec();
+
+	ASI_LOG_INFO("StartSeqAcq");
+	insThd_->Start();
+	thd_->Start(numImages, interval_ms);//��ʼ�߳�
+
+	return DEVICE_OK;
+}
+
+/**
+* Stop and wait for the Sequence thread finished
+*/
+int ASICamera::StopSequenceAcquisition()
+{
+	if (!thd_->IsStopped())
+		thd_->Stop();//ֹͣ�߳�
+	ASI_LOG_DEBUG("StopSeqAcq bf wait");
+	// also a grab thread that stopped itself, e.g. on overflow
+	thd_->Join();//�ȴ��߳��˳�
+	ASI_LOG_DEBUG("StopSeqAcq af wait");
+	// frames already grabbed are still inserted before the core is told we are done
+	insThd_->Stop();
+	//	if(Status == capturing)
+	//	{
+	ASIStopVideoCapture(ASICameraInfo.CameraID);
+	Status = opened;
+	//	}
+
+	// committed after the last frame
+	SettingsTransactionPtr t = std::atomic_exchange(&pCommittedSettings, SettingsTransactionPtr());
+	if (t)
+	{
+		ApplySettings(*t);
+		PublishGeometry();
+	}
+	return DEVICE_OK;
+}
+
+
+
+/**
+* Returns pixel data.
+* Required by the MM::Camera API.
+* The calling program will assume the size of the buffer based on the values
+* obtained from GetImageBufferSize(), which in turn should be consistent with
+* values returned by GetImageWidth(), GetImageHight() and GetImageBytesPerPixel().
+* The calling program allso assumes that camera never changes the size of
+* the pixel buffer on its own. In other words, the buffer can change only if
+* appropriate properties are set (such as binning, pixel type, etc.)
+*/
+const unsigned char* ASICamera::GetImageBuffer()
+{
+	//  return const_cast<unsigned char*>(img_.GetPixels());
+	// each snap is converted once, repeated calls return the same pixels
+	if (!bSnapConverted)
+	{
+		AllocImgBuf();
+		if (bCalibrate)
+			CalibrateFrame(uc_pImg, pSnapGeometry, snapCal);
+		if (bHotPixels)
+			CorrectHotPixels(uc_pImg, pSnapGeometry, snapHot);
+		pSnapImg = ConvertFrame(uc_pImg, *pSnapGeometry, snapOut);
+		bSnapConverted = true;
+	}
+	return pSnapImg;
+}
+
+/**
+* Converts a frame as delivered by the SDK into the layout MMCore expects.
+* The source is never modified; whenever the layouts differ the result is
+* written to out in the same pass that reads the SDK buffer.
+* Used by GetImageBuffer() for snaps and by the insert thread for sequences.
+*/
+const unsigned char* ASICamera::ConvertFrame(const unsigned char* pSrc, const FrameGeometry& geo, ConvertBuffers& bufs)
+{
+	if (geo.IsPassThrough())
+		return pSrc;
+
+	bool bExpand = geo.ImgType == ASI_IMG_RGB24;
+	int width = geo.Width, height = geo.Height;
+	const unsigned char* pIn = pSrc;
+	bufs.Out.resize(geo.FrameSize());
+
+	if (geo.bDebayer)
+	{
+		// demosaic at full resolution, software binning then works on the
+		// RGBA result channel by channel
+		std::vector<unsigned char>& rgba = geo.SoftBin > 1 ? bufs.Stage : bufs.Out;
+		rgba.resize((size_t)geo.Width * geo.Height * geo.PixBytes);
+		DebayerJob db;
+		db.pSrc = pSrc;
+		db.pDst = &rgba[0];
+		db.Width = geo.Width;
+		db.Height = geo.Height;
+		db.Bytes = geo.SdkPixBytes;
+		db.RedX = geo.RedX;
+		db.RedY = geo.RedY;
+		db.Algorithm = (DebayerAlgorithm)geo.DebayerAlgo;
+		RunStripes(geo.Height, (size_t)geo.Width * geo.Height, DebayerRows, &db);
+		if (geo.SoftBin == 1)
+			return &bufs.Out[0];
+
+		SoftBinJob bin;
+		bin.pSrc = &bufs.Stage[0];
+		bin.pDst = &bufs.Out[0];
+		bin.SrcWidth = geo.Width;
+		bin.Channels = 4;
+		bin.InBytes = bin.OutBytes = geo.PixBytes / 4;
+		bin.Shift = 0;
+		bin.Bin = geo.SoftBin;
+		bin.bAverage = geo.bSoftBinAverage;
+		RunStripes(geo.ImageHeight, (size_t)geo.Width * geo.Height, SoftBinRows, &bin);
+		return &bufs.Out[0];
+	}
+
+	if (geo.SoftBin > 1)
+	{
+		// binning reads the SDK layout; the 12-bit shift happens while
+		// summing, RGB is expanded afterwards on the smaller frame
+		SoftBinJob bin;
+		bin.pSrc = pSrc;
+		bin.SrcWidth = geo.Width;
+		bin.Channels = bExpand ? 3 : 1;
+		bin.InBytes = geo.ImgType == ASI_IMG_RAW16 ? 2 : 1;
+		bin.OutBytes = bExpand ? 1 : geo.PixBytes;
+		bin.Shift = geo.ImgType == ASI_IMG_RAW16 && geo.b12RAW ? 4 : 0;
+		bin.Bin = geo.SoftBin;
+		bin.bAverage = geo.bSoftBinAverage;
+		if (bExpand)
+		{
+			bufs.Stage.resize((size_t)geo.ImageWidth * geo.ImageHeight * 3);
+			bin.pDst = &bufs.Stage[0];
+		}
+		else
+			bin.pDst = &bufs.Out[0];
+		RunStripes(geo.ImageHeight, (size_t)geo.Width * geo.Height, SoftBinRows, &bin);
+		if (!bExpand)
+			return &bufs.Out[0];
+
+		pIn = &bufs.Stage[0];
+		width = geo.ImageWidth;
+		height = geo.ImageHeight;
+	}
+
+	const PixelKernels& kernels = GetPixelKernels();
+	ConvertJob job;
+	if (bExpand)
+		job.Kernel = geo.bRGB48 ? kernels.RGB24ToRGBA64 : kernels.RGB24ToRGBA32;
+	else
+		job.Kernel = kernels.Raw16To12;
+	job.pSrc = pIn;
+	job.pDst = &bufs.Out[0];
+	job.SrcLineBytes = (size_t)width * geo.SdkPixBytes;
+	job.DstLineBytes = (size_t)width * geo.PixBytes;
+	job.Width = width;
+	RunStripes(height, (size_t)width * height, ConvertStripe, &job);
+	return &bufs.Out[0];
+}
+
+/**
+* Runs func over the rows on the worker pool when the frame is large enough
+* to pay for waking it, otherwise on the calling thread.
+*/
+void ASICamera::RunStripes(int rows, size_t pixels, WorkerPool::StripeFunc func, void* pCtx)
+{
+	int parallelism = workerPool.GetParallelism();
+	if (parallelism > 1 && pixels >= g_MinParallelPixels)
+	{
+		// a few stripes per thread leaves room for stealing
+		int stripeRows = rows / (parallelism * 4);
+		workerPool.Run(rows, stripeRows < 8 ? 8 : stripeRows, func, pCtx);
+	}
+	else
+		func(pCtx, 0, rows);
+}
+
+void ASICamera::ConvertStripe(void* pCtx, int rowBegin, int rowEnd)
+{
+	const ConvertJob* pJob = (const ConvertJob*)pCtx;
+	pJob->Kernel(pJob->pSrc + rowBegin * pJob->SrcLineBytes, pJob->pDst + rowBegin * pJob->DstLineBytes,
+		(size_t)(rowEnd - rowBegin) * pJob->Width);
+}
+
+
+
+
+bool ASICamera::IsCapturing()
+{
+	ASI_LOG_DEBUG("IsCapturing");
+	//  return !thd_->IsStopped();
+	if (Status == capturing || Status == snaping)
+		return true;
+	else
+		return false;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ASICamera Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+* Handles "Binning" property.
+*/
+int ASICamera::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		long binSize;
+		pProp->Get(binSize);
+		char binF;
+		binF = binSize;
+
+		if (!thd_->IsStopped())//micro manager�������binʱ�����ɳ���ֹͣ�����ã�����property������bin����ֹͣ�����´������Բ�ֹͣʱ��������
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		/* bin��� ��ʼ��ͳߴ��� ������ֵ���� old Bin/new Bin ���ŵ�*/
+		iSetWid = iSetWid * iSetBin / binF;// 2->1, *2
+		iSetHei = iSetHei * iSetBin / binF;//1->2. *0.5
+		iSetWid = iSetWid / 8 * 8;
+		iSetHei = iSetHei / 2 * 2;
+
+		iSetX = iSetX * iSetBin / binF;//bin�ı��, startpos�������bin��Ļ���ģ�ҲҪ���ձ����ı�
+		iSetY = iSetY * iSetBin / binF;
+
+		StopSnapActivity();
+		if (ASISetROIFormat(ASICameraInfo.CameraID, iSetWid, iSetHei, binF, ImgType) == ASI_SUCCESS)
+		{
+			DeleteImgBuf();
+			ASISetStartPos(ASICameraInfo.CameraID, iSetX, iSetY);//�����¼���startx ��starty������ѡ����ͬ�����Ҫ��������
+		}
+		ASIGetROIFormat(ASICameraInfo.CameraID, &iROIWidth, &iROIHeight, &iBin, &ImgType);
+		iSetBin = binF;
+		PublishGeometry();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)iBin);
+	}
+
+	return DEVICE_OK;
+}
+
+/**
+* Handles "PixelType" property.
+*/
+int ASICamera::OnPixelType(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	{
+		string val;
+		pProp->Get(val);
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		bHostDebayer = false;
+		if (val.compare(g_PixelType_RAW8) == 0)
+			ImgType = ASI_IMG_RAW8;
+		else if (val.compare(g_PixelType_RAW16) == 0)
+		{
+			ImgType = ASI_IMG_RAW16;
+			b12RAW = false;
+		}
+		else if (val.compare(g_PixelType_RAW12) == 0)
+		{
+			ImgType = ASI_IMG_RAW16;
+			b12RAW = true;
+		}
+		else if (val.compare(g_PixelType_Y8) == 0)
+			ImgType = ASI_IMG_Y8;
+		else if (val.compare(g_PixelType_RGB24) == 0)
+		{
+			bHostDebayer = iDebayer != 0;
+			ImgType = bHostDebayer ? ASI_IMG_RAW8 : ASI_IMG_RGB24;
+			bRGB48 = false;
+		}
+		else if (val.compare(g_PixelType_RGB48) == 0)
+		{
+			//host debayering gives real 16 bits per channel from RAW16
+			bHostDebayer = iDebayer != 0;
+			ImgType = bHostDebayer ? ASI_IMG_RAW16 : ASI_IMG_RGB24;
+			bRGB48 = true;
+		}
+		RefreshImgType();
+		ASI_LOG_DEBUG("w%d h%d b%d t%d", iROIWidth, iROIHeight, iBin, ImgType);
+		int iStartX, iStartY;
+		ASIGetStartPos(ASICameraInfo.CameraID, &iStartX, &iStartY);
+		StopSnapActivity();
+		if (ASISetROIFormat(ASICameraInfo.CameraID, iROIWidth, iROIHeight, iBin, ImgType) == ASI_SUCCESS)
+		{
+			ASISetStartPos(ASICameraInfo.CameraID, iStartX, iStartY);
+			DeleteImgBuf();
+		}
+		// read back once here, reads of the property use the members
+		ASIGetROIFormat(ASICameraInfo.CameraID, &iROIWidth, &iROIHeight, &iBin, &ImgType);
+		PublishGeometry();
+
+
+	}
+	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	{
+		if (bHostDebayer)
+			pProp->Set(bRGB48 ? g_PixelType_RGB48 : g_PixelType_RGB24);
+		else if (ImgType == ASI_IMG_RAW8)
+			pProp->Set(g_PixelType_RAW8);
+		else if (ImgType == ASI_IMG_RAW16)
+		{
+			if (b12RAW)
+				pProp->Set(g_PixelType_RAW12);
+			else
+				pProp->Set(g_PixelType_RAW16);
+		}
+		else if (ImgType == ASI_IMG_Y8)
+			pProp->Set(g_PixelType_Y8);
+		else if (ImgType == ASI_IMG_RGB24)
+		{
+			if (bRGB48)
+				pProp->Set(g_PixelType_RGB48);
+			else
+				pProp->Set(g_PixelType_RGB24);
+		}
+		else
+			assert(false); // this should never happen
+
+		RefreshImgType();
+
+	}
+
+	return DEVICE_OK;
+}
+
+/**
+* Handles "Gain" property.
+*/
+int ASICamera::OnGain(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	ASI_LOG_DEBUG("OnGain");
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(lVal);
+		SetControl(ASI_GAIN, lVal, ASI_FALSE);
+		bMetadataDirty = true;
+		SelectLibraryDark();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		controls.Get(ASI_GAIN, &lVal, &bAuto);
+		pProp->Set(lVal);
+	}
+
+	return DEVICE_OK;
+}
+
+/**
+* Handles "CamIndex" property.
+*/
+int ASICamera::OnSelectCamIndex(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	string str;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	{
+		pProp->Get(str);
+		for (int i = 0; i < iConnectedCamNum; i++)
+		{
+			if (!str.compare(ConnectedCamName[i]))
+			{
+				//	iCamIndex = i;
+				ASIGetCameraProperty(&ASICameraInfo, i);
+				strcpy(sz_ModelIndex, ConnectedCamName[i]);
+				break;
+			}
+		}
+	}
+	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	{
+		pProp->Set(sz_ModelIndex);
+	}
+
+	return DEVICE_OK;
+}
+/**
+* Handles "Temperature" property.
+*/
+int ASICamera::OnTemperature(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	ASI_LOG_DEBUG("OnTemperature");
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(lVal);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		controls.Get(ASI_TEMPERATURE, &lVal, &bAuto);
+		pProp->Set((double)lVal / 10);
+	}
+
+
+	return DEVICE_OK;
+}
+/**
+* Handles "Brightness" property.
+*/
+int ASICamera::OnBrightness(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	{
+		pProp->Get(lVal);
+		SetControl(ASI_BRIGHTNESS, lVal, ASI_FALSE);
+		bMetadataDirty = true;
+		SelectLibraryDark();
+	}
+	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	{
+		controls.Get(ASI_BRIGHTNESS, &lVal, &bAuto);
+		pProp->Set(lVal);
+	}
+
+	return DEVICE_OK;
+}
+
+/**
+* Handles "USBTraffic" property.
+*/
+int ASICamera::OnUSBTraffic(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	{
+		pProp->Get(lVal);
+		SetControl(ASI_BANDWIDTHOVERLOAD, lVal, ASI_FALSE);
+	}
+	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	{
+		controls.Get(ASI_BANDWIDTHOVERLOAD, &lVal, &bAuto);
+		pProp->Set(lVal);
+	}
+
+	return DEVICE_OK;
+}
+
+/**
+* Handles "USBTraffic Auto" property.
+*/
+int ASICamera::OnUSB_Auto(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	{
+		controls.Get(ASI_BANDWIDTHOVERLOAD, &lVal, &bAuto);
+		string strVal;
+		pProp->Get(strVal);
+		bAuto = strVal.compare(g_Keyword_on) ? ASI_FALSE : ASI_TRUE;
+		SetControl(ASI_BANDWIDTHOVERLOAD, lVal, bAuto);
+		//		SetPropertyReadOnly(g_Keyword_USBTraffic, bAuto);
+	}
+	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	{
+		controls.Get(ASI_BANDWIDTHOVERLOAD, &lVal, &bAuto);
+		pProp->Set(bAuto == ASI_TRUE ? g_Keyword_on : g_Keyword_off);
+		//		SetPropertyReadOnly(g_Keyword_USBTraffic,bAuto);
+	}
+
+	return DEVICE_OK;
+}
+/**
+* Handles "Cooler switch" property.
+*/
+int ASICamera::OnCoolerOn(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	ASI_LOG_DEBUG("OnCoolerOn");
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		//	ASIGetControlValue(iCamIndex, ASI_TARGET_TEMP, &lVal, &bAuto);
+		string strVal;
+		pProp->Get(strVal);//�ӿؼ��õ�ѡ����ֵ
+		lVal = !strVal.compare(g_Keyword_on);
+		SetControl(ASI_COOLER_ON, lVal, ASI_FALSE);
+	}
+	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	{
+		controls.Get(ASI_COOLER_ON, &lVal, &bAuto);
+		pProp->Set(lVal > 0 ? g_Keyword_on : g_Keyword_off);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Heater switch" property.
+*/
+int ASICamera::OnHeater(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		//	ASIGetControlValue(iCamIndex, ASI_TARGET_TEMP, &lVal, &bAuto);
+		string strVal;
+		pProp->Get(strVal);//�ӿؼ��õ�ѡ����ֵ
+		lVal = !strVal.compare(g_Keyword_on);
+		SetControl(ASI_ANTI_DEW_HEATER, lVal, ASI_FALSE);
+	}
+	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	{
+		controls.Get(ASI_ANTI_DEW_HEATER, &lVal, &bAuto);
+		pProp->Set(lVal > 0 ? g_Keyword_on : g_Keyword_off);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Target Temperature" property.
+*/
+int ASICamera::OnTargetTemp(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		controls.Get(ASI_TARGET_TEMP, &lVal, &bAuto);
+		pProp->Get(lVal);//�ӿؼ��õ�ѡ����ֵ->����
+		SetControl(ASI_TARGET_TEMP, lVal, bAuto);
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_TARGET_TEMP, &lVal, &bAuto);
+		pProp->Set(lVal);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "power percentage" property.
+*/
+int ASICamera::OnCoolerPowerPerc(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(lVal);//�ӿؼ��õ�ѡ����ֵ->����
+
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_COOLER_POWER_PERC, &lVal, &bAuto);
+		pProp->Set(lVal);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "white balance red" property.
+*/
+int ASICamera::OnWB_R(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(lVal);//�ӿؼ��õ�ѡ����ֵ->����
+		SetControl(ASI_WB_R, lVal, ASI_FALSE);
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_WB_R, &lVal, &bAuto);
+		pProp->Set(lVal);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "white balance blue" property.
+*/
+int ASICamera::OnWB_B(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(lVal);//�ӿؼ��õ�ѡ����ֵ->����
+		SetControl(ASI_WB_B, lVal, ASI_FALSE);
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_WB_B, &lVal, &bAuto);
+		pProp->Set(lVal);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "auto white balance" property.
+*/
+int ASICamera::OnAutoWB(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	string strVal;
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)
+	{
+		controls.Get(ASI_WB_B, &lVal, &bAuto);
+		pProp->Get(strVal);//�ӿؼ��õ�ѡ����ֵ->����
+		bAuto = strVal.compare(g_Keyword_on) ? ASI_FALSE : ASI_TRUE;
+		SetControl(ASI_WB_B, lVal, bAuto);
+		//	SetPropertyReadOnly(g_Keyword_WB_R,bAuto );
+		//	SetPropertyReadOnly(g_Keyword_WB_B,bAuto );
+
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_WB_B, &lVal, &bAuto);
+		pProp->Set(bAuto ? g_Keyword_on : g_Keyword_off);
+		//		SetPropertyReadOnly(g_Keyword_WB_R,bAuto );
+		//		SetPropertyReadOnly(g_Keyword_WB_B,bAuto );
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "auto white balance" property.
+*/
+int ASICamera::OnGamma(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	{
+
+		pProp->Get(lVal);
+		SetControl(ASI_GAMMA, lVal, ASI_FALSE);
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_GAMMA, &lVal, &bAuto);
+		pProp->Set(lVal);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "auto exposure" property.
+*/
+int ASICamera::OnAutoExp(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	{
+		controls.Get(ASI_EXPOSURE, &lVal, &bAuto);
+		string strVal;
+		pProp->Get(strVal);
+		bAuto = strVal.compare(g_Keyword_on) ? ASI_FALSE : ASI_TRUE;
+		SetControl(ASI_EXPOSURE, lVal, bAuto);
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_EXPOSURE, &lVal, &bAuto);
+		pProp->Set(bAuto ? g_Keyword_on : g_Keyword_off);
+		//		SetPropertyReadOnly(MM::g_Keyword_Exposure,bAuto );
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "auto gain" property.
+*/
+int ASICamera::OnAutoGain(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	{
+		controls.Get(ASI_GAIN, &lVal, &bAuto);
+		string strVal;
+		pProp->Get(strVal);
+		bAuto = strVal.compare(g_Keyword_on) ? ASI_FALSE : ASI_TRUE;
+		SetControl(ASI_GAIN, lVal, bAuto);
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_GAIN, &lVal, &bAuto);
+		pProp->Set(bAuto ? g_Keyword_on : g_Keyword_off);
+		//	SetPropertyReadOnly(MM::g_Keyword_Gain,bAuto );
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "flip" property.
+*/
+int ASICamera::OnFlip(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	{
+		controls.Get(ASI_FLIP, &lVal, &bAuto);
+		string strVal;
+		pProp->Get(strVal);
+		for (int i = 0; i < 4; i++)
+		{
+			if (!strVal.compare(FlipArr[i]))
+			{
+				SetControl(ASI_FLIP, (long)i, ASI_FALSE);
+				break;
+			}
+		}
+		PublishGeometry();
+
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_FLIP, &lVal, &bAuto);
+		pProp->Set(FlipArr[lVal]);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "hight speed mode" property.
+*/
+int ASICamera::OnHighSpeedMod(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	{
+		string strVal;
+		pProp->Get(strVal);
+		lVal = strVal.compare(g_Keyword_on) ? 0 : 1;
+		SetControl(ASI_HIGH_SPEED_MODE, lVal, ASI_FALSE);
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_HIGH_SPEED_MODE, &lVal, &bAuto);
+		pProp->Set(lVal ? g_Keyword_on : g_Keyword_off);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "hardware bin" property.
+*/
+int ASICamera::OnHardwareBin(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	{
+		string strVal;
+		pProp->Get(strVal);
+		lVal = strVal.compare(g_Keyword_on) ? 0 : 1;
+		SetControl(ASI_HARDWARE_BIN, lVal, ASI_FALSE);
+	}
+	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	{
+		controls.Get(ASI_HARDWARE_BIN, &lVal, &bAuto);
+		pProp->Set(lVal ? g_Keyword_on : g_Keyword_off);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Frame Queue Depth" property.
+*/
+int ASICamera::OnFrameQueueDepth(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		pProp->Get(lQueueDepth);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(lQueueDepth);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "SDK Calls Per Frame" property.
+*/
+int ASICamera::OnSdkCallsPerFrame(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		long lFrames = lGrabFrames;
+		pProp->Set(lFrames > 0 ? (double)lGrabSdkCalls / lFrames : 0.0);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles the read-only telemetry of the current or last sequence:
+* delivered fps, frames dropped by the SDK, by a full frame queue, and
+* by MMCore's buffer overflowing.
+*/
+int ASICamera::OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct, long lField)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		switch (lField)
+		{
+		case TELEMETRY_FPS:
+			pProp->Set((double)dDeliveredFps);
+			break;
+		case TELEMETRY_SDK_DROPPED:
+			pProp->Set((long)lSdkDropped);
+			break;
+		case TELEMETRY_PIPELINE_DROPPED:
+			pProp->Set((long)lPipelineDropped);
+			break;
+		default:
+			pProp->Set((long)(lOverflowCount[OVERFLOW_DROP_NEWEST] + lOverflowCount[OVERFLOW_BLOCK] + lOverflowCount[OVERFLOW_STOP]));
+			break;
+		}
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Settings Transaction" property: begin collects the control
+* changes that follow, commit applies them together at the next frame
+* boundary, abort drops them. Reads show begin while one is open.
+*/
+int ASICamera::OnSettingsTransaction(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string val;
+		pProp->Get(val);
+		if (val.compare(g_Transaction_Begin) == 0)
+			bTransactionOpen = true;
+		else if (val.compare(g_Transaction_Commit) == 0)
+			return CommitSettings();
+		else if (val.compare(g_Transaction_Abort) == 0)
+		{
+			bTransactionOpen = false;
+			transactionChanges.clear();
+		}
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(bTransactionOpen ? g_Transaction_Begin : g_Transaction_Idle);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Preset Name" property: the preset the "Preset" actions work on.
+*/
+int ASICamera::OnPresetName(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(sPresetName);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(sPresetName.c_str());
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Preset" property: save keeps ROI, binning, pixel type, flip,
+* gain, offset, bandwidth and high speed mode under "Preset Name", apply
+* goes back to them with only the SDK calls needed, delete forgets them.
+*/
+int ASICamera::OnPreset(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string val;
+		pProp->Get(val);
+		pProp->Set(g_Preset_Idle);
+		if (val.compare(g_Preset_Save) == 0)
+		{
+			if (sPresetName.empty())
+				return DEVICE_INVALID_PROPERTY_VALUE;
+			SavePreset(presets[sPresetName]);
+		}
+		else if (val.compare(g_Preset_Apply) == 0)
+		{
+			std::map<std::string, CameraPreset>::const_iterator it = presets.find(sPresetName);
+			if (it == presets.end())
+				return DEVICE_INVALID_PROPERTY_VALUE;
+			return ApplyPreset(it->second);
+		}
+		else if (val.compare(g_Preset_Delete) == 0)
+			presets.erase(sPresetName);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_Preset_Idle);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Presets" property: the saved preset names, comma separated.
+*/
+int ASICamera::OnPresetList(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		string names;
+		for (std::map<std::string, CameraPreset>::const_iterator it = presets.begin(); it != presets.end(); ++it)
+		{
+			if (!names.empty())
+				names += ",";
+			names += it->first;
+		}
+		pProp->Set(names.c_str());
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Control Cache Age ms" property: "name:age;..." for every
+* control of the camera, the time since the cached value was read.
+*/
+int ASICamera::OnControlCacheAge(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		string ages;
+		char buf[96];
+		for (int i = 0; i < iCtrlNum; i++)
+		{
+			snprintf(buf, sizeof(buf), "%s%s:%.0f", i ? ";" : "", pControlCaps[i].Name, controls.GetAgeMs(pControlCaps[i].ControlType));
+			ages += buf;
+		}
+		pProp->Set(ages.c_str());
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Log Level" property, shared by all devices of the adapter.
+* Debug messages exist only in builds with ASI_LOG_DEBUG_BUILD.
+*/
+int ASICamera::OnLogLevel(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string val;
+		pProp->Get(val);
+		for (int i = 0; i < LOG_LEVEL_NUM; i++)
+		{
+			if (val.compare(g_LogLevel[i]) == 0)
+				AsyncLog::SetLevel((LogLevel)i);
+		}
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_LogLevel[AsyncLog::GetLevel()]);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Latency Histograms" property: times the stages of each
+* sequence frame. Off, the grab and insert threads skip the clock reads.
+*/
+int ASICamera::OnLatency(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string val;
+		pProp->Get(val);
+		bLatency = val.compare(g_Keyword_on) == 0;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(bLatency ? g_Keyword_on : g_Keyword_off);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Latency Reset" property: reset empties all stage histograms,
+* also during a sequence.
+*/
+int ASICamera::OnLatencyReset(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string val;
+		pProp->Get(val);
+		pProp->Set(g_LatencyReset_Idle);
+		if (val.compare(g_LatencyReset_Run) == 0)
+		{
+			for (int i = 0; i < LATENCY_STAGE_NUM; i++)
+				latency[i].Reset();
+		}
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_LatencyReset_Idle);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles the read-only "Latency <stage> <statistic> us" properties,
+* lInfo = stage * LATENCY_STAT_NUM + statistic.
+*/
+int ASICamera::OnLatencyInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long lInfo)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		const LatencyHistogram& h = latency[lInfo / LATENCY_STAT_NUM];
+		int stat = lInfo % LATENCY_STAT_NUM;
+		pProp->Set((long)(stat == LATENCY_MAX ? h.GetMax() : h.GetPercentile(g_LatencyQuantile[stat])));
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Buffer Overflow Policy" property.
+*/
+int ASICamera::OnOverflowPolicy(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string strVal;
+		pProp->Get(strVal);
+		for (int i = 0; i < OVERFLOW_POLICY_NUM; i++)
+		{
+			if (!strVal.compare(g_OverflowPolicy[i]))
+			{
+				eOverflowPolicy = (OverflowPolicy)i;
+				break;
+			}
+		}
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_OverflowPolicy[eOverflowPolicy]);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Buffer Overflow Block Timeout ms" property.
+*/
+int ASICamera::OnOverflowTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+		pProp->Get(lOverflowTimeoutMs);
+	else if (eAct == MM::BeforeGet)
+		pProp->Set(lOverflowTimeoutMs);
+	return DEVICE_OK;
+}
+/**
+* Handles the read-only "Overflow ..." counters, one per policy.
+*/
+int ASICamera::OnOverflowCounter(MM::PropertyBase* pProp, MM::ActionType eAct, long policy)
+{
+	if (eAct == MM::BeforeGet)
+		pProp->Set((long)lOverflowCount[policy]);
+	return DEVICE_OK;
+}
+/**
+* Handles "Worker Threads" property.
+*/
+int ASICamera::OnWorkerThreads(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		pProp->Get(lWorkerThreads);
+		workerPool.Start(lWorkerThreads, ullWorkerAffinity);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(lWorkerThreads);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Worker CPU Affinity Mask" property, a hex or decimal bit mask of
+* cores. Worker threads are pinned to the set bits in turn, 0 turns pinning off.
+*/
+int ASICamera::OnWorkerAffinity(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		std::string val;
+		pProp->Get(val);
+		char* pEnd = 0;
+		unsigned long long mask = strtoull(val.c_str(), &pEnd, 0);
+		if (val.empty() || *pEnd != 0)
+			return DEVICE_INVALID_PROPERTY_VALUE;
+		ullWorkerAffinity = mask;
+		workerPool.Start(lWorkerThreads, ullWorkerAffinity);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		char buf[24];
+		snprintf(buf, sizeof(buf), "0x%llX", ullWorkerAffinity);
+		pProp->Set(buf);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Software Binning" property.
+*/
+int ASICamera::OnSoftBin(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		long lBin;
+		pProp->Get(lBin);
+		iSoftBin = lBin;
+		DeleteImgBuf();
+		PublishGeometry();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)iSoftBin);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Software Binning Mode" property.
+*/
+int ASICamera::OnSoftBinMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		string val;
+		pProp->Get(val);
+		bSoftBinAverage = val.compare(g_SoftBinMode_Average) == 0;
+		DeleteImgBuf();
+		PublishGeometry();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(bSoftBinAverage ? g_SoftBinMode_Average : g_SoftBinMode_Sum);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Software Binning Sum Output" property: sums either saturate at
+* the input sample size or 8-bit input is widened to 16-bit. 16-bit input
+* and RGB channels always saturate.
+*/
+int ASICamera::OnSoftBinOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		string val;
+		pProp->Get(val);
+		bSoftBinWiden = val.compare(g_SoftBinOutput_Widen) == 0;
+		DeleteImgBuf();
+		PublishGeometry();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(bSoftBinWiden ? g_SoftBinOutput_Widen : g_SoftBinOutput_Saturate);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Debayer" property. If an RGB pixel type is active it is applied
+* again, which switches the SDK between RGB24 and RAW8/RAW16.
+*/
+int ASICamera::OnDebayer(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		string val;
+		pProp->Get(val);
+		for (int i = 0; i <= DEBAYER_EDGE_AWARE + 1; i++)
+		{
+			if (val.compare(g_Debayer[i]) == 0)
+				iDebayer = i;
+		}
+		if (bHostDebayer || ImgType == ASI_IMG_RGB24)
+			return SetProperty(MM::g_Keyword_PixelType, bRGB48 ? g_PixelType_RGB48 : g_PixelType_RGB24);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_Debayer[iDebayer]);
+	}
 	return DEVICE_OK;
 }
-
 /**
-* Stop and wait for the Sequence thread finished
+* Handles "Stack Frames" property: number of sequence frames reduced into
+* each frame MMCore gets, 1 turns stacking off. Snaps are not stacked.
 */
-int ASICamera::StopSequenceAcquisition()
+int ASICamera::OnStackFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	if (!thd_->IsStopped())
+	if (eAct == MM::AfterSet)
 	{
-		thd_->Stop();//ֹͣ�߳�
-		OutputDbgPrint("StopSeqAcq bf wait\n");
-		//		if(!thd_->IsStopped())
-		thd_->wait();//�ȴ��߳��˳�
-		OutputDbgPrint("StopSeqAcq af wait\n");
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		pProp->Get(lStackDepth);
+		bMetadataDirty = true;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(lStackDepth);
 	}
-	//	if(Status == capturing)
-	//	{
-	ASIStopVideoCapture(ASICameraInfo.CameraID);
-	Status = opened;
-	//	}
-
 	return DEVICE_OK;
 }
-
-
-
-void ASICamera::Conv16RAWTo12RAW()
+/**
+* Handles "Stack Operator" property.
+*/
+int ASICamera::OnStackOperator(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	unsigned long line0;
-	//	unsigned int *pBuf16 = (unsigned int*)uc_pImg;
-#ifdef _WINDOWS
-	UINT16* pBuf16 = (UINT16*)uc_pImg;//unsigned short
-#else
-	uint16_t* pBuf16 = (uint16_t*)uc_pImg;//unsigned short
-#endif
-
-	for (int y = 0; y < iROIHeight; y++)
+	if (eAct == MM::AfterSet)
 	{
-		line0 = iROIWidth * y;
-		for (int x = 0; x < iROIWidth; x++)
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		string val;
+		pProp->Get(val);
+		for (int i = 0; i < STACK_OPERATOR_NUM; i++)
 		{
-			pBuf16[line0 + x] /= 16;
+			if (val.compare(g_StackOperator[i]) == 0)
+				eStackOp = (StackOperator)i;
 		}
+		bMetadataDirty = true;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_StackOperator[eStackOp]);
 	}
+	return DEVICE_OK;
 }
-void ASICamera::ConvRGB2RGBA32()
+/**
+* Handles "Stack Sigma Clip Kappa" property: samples further than kappa
+* standard deviations from the running mean are left out of the
+* sigma-clipped mean.
+*/
+int ASICamera::OnStackKappa(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	if (!pRGB32)
+	if (eAct == MM::AfterSet)
 	{
-		pRGB32 = new unsigned char[iROIWidth * iROIHeight * 4];
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		pProp->Get(dStackKappa);
 	}
-	unsigned long index32, index24, line0;
-	for (int y = 0; y < iROIHeight; y++)
+	else if (eAct == MM::BeforeGet)
 	{
-		line0 = iROIWidth * y;
-		for (int x = 0; x < iROIWidth; x++)
-		{
-			index32 = (line0 + x) * 4;
-			index24 = (line0 + x) * 3;
-			pRGB32[index32 + 0] = uc_pImg[index24 + 0];
-			pRGB32[index32 + 1] = uc_pImg[index24 + 1];
-			pRGB32[index32 + 2] = uc_pImg[index24 + 2];
-			pRGB32[index32 + 3] = 0;
-		}
+		pProp->Set(dStackKappa);
 	}
+	return DEVICE_OK;
 }
-
-void ASICamera::ConvRGB2RGBA64()
+/**
+* Handles "Calibration" property; takes effect with the next frame, also
+* while a sequence runs. A snap already read out is not calibrated again.
+*/
+int ASICamera::OnCalibration(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	if (!pRGB64)
+	if (eAct == MM::AfterSet)
 	{
-		pRGB64 = new unsigned char[iROIWidth * iROIHeight * 4 * 2];
-		memset(pRGB64, 0, iROIWidth * iROIHeight * 4 * 2);
+		string val;
+		pProp->Get(val);
+		bCalibrate = val.compare(g_Keyword_on) == 0;
 	}
-	unsigned long index64, index24, line0;
-	for (int y = 0; y < iROIHeight; y++)
+	else if (eAct == MM::BeforeGet)
 	{
-		line0 = iROIWidth * y;
-		for (int x = 0; x < iROIWidth; x++)
-		{
-			index64 = (line0 + x) * 8;
-			index24 = (line0 + x) * 3;
-			pRGB64[index64 + 1] = uc_pImg[index24 + 0];
-			pRGB64[index64 + 3] = uc_pImg[index24 + 1];
-			pRGB64[index64 + 5] = uc_pImg[index24 + 2];
-			//			pRGB64[index64 + 6] = 0;
-		}
+		pProp->Set(bCalibrate ? g_Keyword_on : g_Keyword_off);
 	}
+	return DEVICE_OK;
 }
 /**
-* Returns pixel data.
-* Required by the MM::Camera API.
-* The calling program will assume the size of the buffer based on the values
-* obtained from GetImageBufferSize(), which in turn should be consistent with
-* values returned by GetImageWidth(), GetImageHight() and GetImageBytesPerPixel().
-* The calling program allso assumes that camera never changes the size of
-* the pixel buffer on its own. In other words, the buffer can change only if
-* appropriate properties are set (such as binning, pixel type, etc.)
+* Handles "Calibration Dark File" and "Calibration Flat File" properties.
+* An existing file is loaded as the master, a path that does not exist yet
+* only names where the next captured master goes. Empty drops the master.
 */
-const unsigned char* ASICamera::GetImageBuffer()
+int ASICamera::OnCalibrationFile(MM::PropertyBase* pProp, MM::ActionType eAct, long lFlat)
 {
-	//  return const_cast<unsigned char*>(img_.GetPixels());
-	if (ImgType == ASI_IMG_RGB24)
+	if (eAct == MM::AfterSet)
 	{
-		if (bRGB48)
+		string path;
+		pProp->Get(path);
+		CalibrationFramePtr master;
+		FILE* fp = path.empty() ? 0 : fopen(path.c_str(), "rb");
+		if (fp != 0)
+		{
+			fclose(fp);
+			CalibrationFrame* pFrame = new CalibrationFrame();
+			master.reset(pFrame);
+			string error;
+			if (!LoadCalibrationFrame(path.c_str(), *pFrame, error))
+			{
+				ASI_LOG_WARNING("Calibration file %s: %s", path.c_str(), error.c_str());
+				return DEVICE_INVALID_PROPERTY_VALUE;
+			}
+		}
+		sCalFile[lFlat] = path;
+		if (lFlat)
 		{
-			ConvRGB2RGBA64();
-			return pRGB64;
+			PublishMaster(true, master);
 		}
 		else
 		{
-			ConvRGB2RGBA32();
-			return pRGB32;
+			pFileDark = master;
+			PublishDark();
 		}
-
 	}
-	else if (ImgType == ASI_IMG_RAW16 && b12RAW)
-		Conv16RAWTo12RAW();
-	return uc_pImg;
-}
-
-
-
-
-bool ASICamera::IsCapturing()
-{
-	OutputDbgPrint("IsCapturing\n");
-	//  return !thd_->IsStopped();
-	if (Status == capturing || Status == snaping)
-		return true;
-	else
-		return false;
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(sCalFile[lFlat].c_str());
+	}
+	return DEVICE_OK;
 }
-
-
-
-///////////////////////////////////////////////////////////////////////////////
-// ASICamera Action handlers
-///////////////////////////////////////////////////////////////////////////////
-
 /**
-* Handles "Binning" property.
+* Handles "Calibration Capture Master" property: setting dark or flat
+* snaps and averages "Calibration Master Frames" frames with the current
+* settings, then falls back to idle. Covering the optics for the dark is
+* up to the user.
 */
-int ASICamera::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnCaptureMaster(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	if (eAct == MM::AfterSet)
 	{
-		long binSize;
-		pProp->Get(binSize);
-		char binF;
-		binF = binSize;
-
-		if (!thd_->IsStopped())//micro manager�������binʱ�����ɳ���ֹͣ�����ã�����property������bin����ֹͣ�����´������Բ�ֹͣʱ��������
+		if (Status == capturing)
 			return DEVICE_CAMERA_BUSY_ACQUIRING;
-		/* bin��� ��ʼ��ͳߴ��� ������ֵ���� old Bin/new Bin ���ŵ�*/
-		iSetWid = iSetWid * iSetBin / binF;// 2->1, *2
-		iSetHei = iSetHei * iSetBin / binF;//1->2. *0.5
-		iSetWid = iSetWid / 8 * 8;
-		iSetHei = iSetHei / 2 * 2;
-
-		iSetX = iSetX * iSetBin / binF;//bin�ı��, startpos�������bin��Ļ���ģ�ҲҪ���ձ����ı�
-		iSetY = iSetY * iSetBin / binF;
-
-		if (ASISetROIFormat(ASICameraInfo.CameraID, iSetWid, iSetHei, binF, ImgType) == ASI_SUCCESS)
-		{
-			DeleteImgBuf();
-			ASISetStartPos(ASICameraInfo.CameraID, iSetX, iSetY);//�����¼���startx ��starty������ѡ����ͬ�����Ҫ��������
-		}
-		ASIGetROIFormat(ASICameraInfo.CameraID, &iROIWidth, &iROIHeight, &iBin, &ImgType);
-		iSetBin = binF;
+		string val;
+		pProp->Get(val);
+		pProp->Set(g_CaptureMaster_Idle);
+		if (val.compare(g_CaptureMaster[0]) == 0)
+			return CaptureMaster(false);
+		if (val.compare(g_CaptureMaster[1]) == 0)
+			return CaptureMaster(true);
 	}
 	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetROIFormat(ASICameraInfo.CameraID, &iROIWidth, &iROIHeight, &iBin, &ImgType);
-		pProp->Set((long)iBin);
+		pProp->Set(g_CaptureMaster_Idle);
 	}
-
 	return DEVICE_OK;
 }
-
 /**
-* Handles "PixelType" property.
+* Handles "Calibration Master Frames" property.
 */
-int ASICamera::OnPixelType(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnMasterFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	if (eAct == MM::AfterSet)
 	{
-		string val;
-		pProp->Get(val);
-		if (Status == capturing)
-			return DEVICE_CAMERA_BUSY_ACQUIRING;
-		if (val.compare(g_PixelType_RAW8) == 0)
-			ImgType = ASI_IMG_RAW8;
-		else if (val.compare(g_PixelType_RAW16) == 0)
-		{
-			ImgType = ASI_IMG_RAW16;
-			b12RAW = false;
-		}
-		else if (val.compare(g_PixelType_RAW12) == 0)
-		{
-			ImgType = ASI_IMG_RAW16;
-			b12RAW = true;
-		}
-		else if (val.compare(g_PixelType_Y8) == 0)
-			ImgType = ASI_IMG_Y8;
-		else if (val.compare(g_PixelType_RGB24) == 0)
-		{
-			ImgType = ASI_IMG_RGB24;
-			bRGB48 = false;
-		}
-		else if (val.compare(g_PixelType_RGB48) == 0)
-		{
-			ImgType = ASI_IMG_RGB24;
-			bRGB48 = true;
-		}
-		RefreshImgType();
-		OutputDbgPrint("w%d h%d b%d t%d\n", iROIWidth, iROIHeight, iBin, ImgType);
-		int iStartX, iStartY;
-		ASIGetStartPos(ASICameraInfo.CameraID, &iStartX, &iStartY);
-		if (ASISetROIFormat(ASICameraInfo.CameraID, iROIWidth, iROIHeight, iBin, ImgType) == ASI_SUCCESS)
-		{
-			ASISetStartPos(ASICameraInfo.CameraID, iStartX, iStartY);
-			DeleteImgBuf();
-		}
-
-
+		pProp->Get(lMasterFrames);
 	}
-	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetROIFormat(ASICameraInfo.CameraID, &iROIWidth, &iROIHeight, &iBin, &ImgType);
-
-		if (ImgType == ASI_IMG_RAW8)
-			pProp->Set(g_PixelType_RAW8);
-		else if (ImgType == ASI_IMG_RAW16)
-		{
-			if (b12RAW)
-				pProp->Set(g_PixelType_RAW12);
-			else
-				pProp->Set(g_PixelType_RAW16);
-		}
-		else if (ImgType == ASI_IMG_Y8)
-			pProp->Set(g_PixelType_Y8);
-		else if (ImgType == ASI_IMG_RGB24)
-		{
-			if (bRGB48)
-				pProp->Set(g_PixelType_RGB48);
-			else
-				pProp->Set(g_PixelType_RGB24);
-		}
-		else
-			assert(false); // this should never happen
-
-		RefreshImgType();
-
+		pProp->Set(lMasterFrames);
 	}
-
 	return DEVICE_OK;
 }
-
 /**
-* Handles "Gain" property.
+* Handles "Calibration Status" property: why the last frame was or was not
+* calibrated.
 */
-int ASICamera::OnGain(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnCalibrationStatus(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+		pProp->Set(bCalibrate ? g_CalibrationStatus[iCalStatus] : g_Keyword_off);
+	return DEVICE_OK;
+}
+/**
+* Handles "Dark Library" property: on, the dark follows the settings from
+* the library and the dark file is only the fallback.
+*/
+int ASICamera::OnDarkLibrary(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	OutputDbgPrint("OnGain\n");
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		pProp->Get(lVal);
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_GAIN, lVal, ASI_FALSE);
+		string val;
+		pProp->Get(val);
+		bDarkLibrary = val.compare(g_Keyword_on) == 0;
+		SelectLibraryDark();
+		PublishDark();
 	}
 	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_GAIN, &lVal, &bAuto);
-		pProp->Set(lVal);
+		pProp->Set(bDarkLibrary ? g_Keyword_on : g_Keyword_off);
 	}
-
 	return DEVICE_OK;
 }
-
 /**
-* Handles "CamIndex" property.
+* Handles "Dark Library Directory" property; indexes the *.asidark files
+* in it. Captured darks are added to it.
 */
-int ASICamera::OnSelectCamIndex(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnDarkLibraryDir(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	string str;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	if (eAct == MM::AfterSet)
 	{
-		pProp->Get(str);
-		for (int i = 0; i < iConnectedCamNum; i++)
-		{
-			if (!str.compare(ConnectedCamName[i]))
-			{
-				//	iCamIndex = i;
-				ASIGetCameraProperty(&ASICameraInfo, i);
-				strcpy(sz_ModelIndex, ConnectedCamName[i]);
-				break;
-			}
-		}
+		string dir;
+		pProp->Get(dir);
+		pLibraryDark.reset();
+		sLibraryDark.clear();
+		if (dir.empty())
+			darkLibrary.Close();
+		else if (darkLibrary.Open(dir.c_str()) < 0)
+			return DEVICE_INVALID_PROPERTY_VALUE;
+		sDarkLibraryDir = dir;
+		SelectLibraryDark();
+		PublishDark();
 	}
-	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		pProp->Set(sz_ModelIndex);
+		pProp->Set(sDarkLibraryDir.c_str());
 	}
-
 	return DEVICE_OK;
 }
 /**
-* Handles "Temperature" property.
+* Handles "Dark Library Temperature Step C" property: sensor temperatures
+* within one step count as the same for dark selection.
 */
-int ASICamera::OnTemperature(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnDarkLibraryTempStep(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	OutputDbgPrint("OnTemperature\n");
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		pProp->Get(lVal);
+		pProp->Get(dDarkTempStep);
+		darkLibrary.SetTemperatureStep((long)(dDarkTempStep * 10 + 0.5));
+		SelectLibraryDark();
 	}
 	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_TEMPERATURE, &lVal, &bAuto);
-		pProp->Set((double)lVal / 10);
+		pProp->Set(dDarkTempStep);
 	}
-
-
 	return DEVICE_OK;
 }
 /**
-* Handles "Brightness" property.
+* Handles the read-only dark library properties: entries, selected file,
+* mapping cache hits and misses.
 */
-int ASICamera::OnBrightness(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnDarkLibraryInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long lInfo)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
-	{
-		pProp->Get(lVal);
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_BRIGHTNESS, lVal, ASI_FALSE);
-	}
-	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_BRIGHTNESS, &lVal, &bAuto);
-		pProp->Set(lVal);
+		if (lInfo == 0)
+			pProp->Set((long)darkLibrary.GetEntries());
+		else if (lInfo == 1)
+			pProp->Set(sLibraryDark.c_str());
+		else if (lInfo == 2)
+			pProp->Set(darkLibrary.GetHits());
+		else
+			pProp->Set(darkLibrary.GetMisses());
 	}
-
 	return DEVICE_OK;
 }
-
 /**
-* Handles "USBTraffic" property.
+* Handles "Hot Pixel Correction" property; takes effect with the next
+* frame, also while a sequence runs.
 */
-int ASICamera::OnUSBTraffic(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnHotPixels(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	if (eAct == MM::AfterSet)
 	{
-		pProp->Get(lVal);
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_BANDWIDTHOVERLOAD, lVal, ASI_FALSE);
+		string val;
+		pProp->Get(val);
+		bHotPixels = val.compare(g_Keyword_on) == 0;
 	}
-	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_BANDWIDTHOVERLOAD, &lVal, &bAuto);
-		pProp->Set(lVal);
+		pProp->Set(bHotPixels ? g_Keyword_on : g_Keyword_off);
 	}
-
 	return DEVICE_OK;
 }
-
 /**
-* Handles "USBTraffic Auto" property.
+* Handles "Hot Pixel Directory" property; loads the map of this camera,
+* <serial>.hotpix, if the directory has one. Detected maps are saved there.
 */
-int ASICamera::OnUSB_Auto(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnHotPixelDir(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ
+	if (eAct == MM::AfterSet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_BANDWIDTHOVERLOAD, &lVal, &bAuto);
-		string strVal;
-		pProp->Get(strVal);
-		bAuto = strVal.compare(g_Keyword_on) ? ASI_FALSE : ASI_TRUE;
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_BANDWIDTHOVERLOAD, lVal, bAuto);
-		//		SetPropertyReadOnly(g_Keyword_USBTraffic, bAuto);
+		string dir;
+		pProp->Get(dir);
+		sHotPixelDir = dir;
+		HotPixelMapPtr map;
+		FILE* fp = dir.empty() ? 0 : fopen(HotPixelPath().c_str(), "r");
+		if (fp != 0)
+		{
+			fclose(fp);
+			HotPixelMap* pMap = new HotPixelMap();
+			map.reset(pMap);
+			if (!LoadHotPixelMap(HotPixelPath().c_str(), *pMap))
+				return DEVICE_INVALID_PROPERTY_VALUE;
+		}
+		std::atomic_store(&pHotMap, map);
 	}
-	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_BANDWIDTHOVERLOAD, &lVal, &bAuto);
-		pProp->Set(bAuto == ASI_TRUE ? g_Keyword_on : g_Keyword_off);
-		//		SetPropertyReadOnly(g_Keyword_USBTraffic,bAuto);
+		pProp->Set(sHotPixelDir.c_str());
 	}
-
 	return DEVICE_OK;
 }
 /**
-* Handles "Cooler switch" property.
+* Handles "Hot Pixel Detect" property: snaps and averages "Calibration
+* Master Frames" darks with the current settings and builds the map from
+* them, then falls back to idle. Covering the optics is up to the user.
 */
-int ASICamera::OnCoolerOn(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnHotPixelDetect(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	OutputDbgPrint("OnCoolerOn\n");
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		//	ASIGetControlValue(iCamIndex, ASI_TARGET_TEMP, &lVal, &bAuto);
-		string strVal;
-		pProp->Get(strVal);//�ӿؼ��õ�ѡ����ֵ
-		lVal = !strVal.compare(g_Keyword_on);
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_COOLER_ON, lVal, ASI_FALSE);
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		string val;
+		pProp->Get(val);
+		pProp->Set(g_HotPixelDetect_Idle);
+		if (val.compare(g_HotPixelDetect_Run) == 0)
+			return DetectHotPixelMap();
 	}
-	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_COOLER_ON, &lVal, &bAuto);
-		pProp->Set(lVal > 0 ? g_Keyword_on : g_Keyword_off);
+		pProp->Set(g_HotPixelDetect_Idle);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "Heater switch" property.
+* Handles "Hot Pixel Detection Mode" property: sigma flags pixels more
+* than "Hot Pixel Sigma" robust deviations from the dark median, threshold
+* more than "Hot Pixel Threshold ADU".
 */
-int ASICamera::OnHeater(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnHotPixelMode(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		//	ASIGetControlValue(iCamIndex, ASI_TARGET_TEMP, &lVal, &bAuto);
-		string strVal;
-		pProp->Get(strVal);//�ӿؼ��õ�ѡ����ֵ
-		lVal = !strVal.compare(g_Keyword_on);
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_ANTI_DEW_HEATER, lVal, ASI_FALSE);
+		string val;
+		pProp->Get(val);
+		eHotPixelMode = val.compare(g_HotPixelMode[HOTPIX_THRESHOLD]) == 0 ? HOTPIX_THRESHOLD : HOTPIX_SIGMA;
 	}
-	else if (eAct == MM::BeforeGet)//ֵ���ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_ANTI_DEW_HEATER, &lVal, &bAuto);
-		pProp->Set(lVal > 0 ? g_Keyword_on : g_Keyword_off);
+		pProp->Set(g_HotPixelMode[eHotPixelMode]);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "Target Temperature" property.
+* Handles "Hot Pixel Sigma" property.
 */
-int ASICamera::OnTargetTemp(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnHotPixelSigma(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_TARGET_TEMP, &lVal, &bAuto);
-		pProp->Get(lVal);//�ӿؼ��õ�ѡ����ֵ->����
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_TARGET_TEMP, lVal, bAuto);
+		pProp->Get(dHotPixelSigma);
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_TARGET_TEMP, &lVal, &bAuto);
-		pProp->Set(lVal);
+		pProp->Set(dHotPixelSigma);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "power percentage" property.
+* Handles "Hot Pixel Threshold ADU" property, in SDK units of the dark.
 */
-int ASICamera::OnCoolerPowerPerc(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnHotPixelThreshold(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		pProp->Get(lVal);//�ӿؼ��õ�ѡ����ֵ->����
-
+		pProp->Get(lHotPixelThreshold);
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_COOLER_POWER_PERC, &lVal, &bAuto);
-		pProp->Set(lVal);
+		pProp->Set(lHotPixelThreshold);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "white balance red" property.
+* Handles "Hot Pixel Count" property: defects in the current map.
 */
-int ASICamera::OnWB_R(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnHotPixelCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		HotPixelMapPtr map = std::atomic_load(&pHotMap);
+		pProp->Set(map ? (long)map->Pixels.size() : 0L);
+	}
+	return DEVICE_OK;
+}
+/**
+* Handles "Statistics" property; takes effect with the next frame, also
+* while a sequence runs. Statistics are taken from the frame as the SDK
+* delivers it, before calibration and conversion.
+*/
+int ASICamera::OnStatistics(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		pProp->Get(lVal);//�ӿؼ��õ�ѡ����ֵ->����
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_WB_R, lVal, ASI_FALSE);
+		string val;
+		pProp->Get(val);
+		bStats = val.compare(g_Keyword_on) == 0;
+		bMetadataDirty = true;
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_WB_R, &lVal, &bAuto);
-		pProp->Set(lVal);
+		pProp->Set(bStats ? g_Keyword_on : g_Keyword_off);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "white balance blue" property.
+* Handles "Statistics Row Stride" property: only every n-th row is
+* counted. An odd stride keeps both Bayer row types in the sample.
 */
-int ASICamera::OnWB_B(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnStatsRowStride(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		pProp->Get(lVal);//�ӿؼ��õ�ѡ����ֵ->����
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_WB_B, lVal, ASI_FALSE);
+		pProp->Get(lStatsRowStride);
+		PublishStatsConfig();
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_WB_B, &lVal, &bAuto);
-		pProp->Set(lVal);
+		pProp->Set(lStatsRowStride);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "auto white balance" property.
+* Handles "Statistics Regions" property: "x,y,w,h;x,y,w,h" in pixels of
+* the frame as the SDK delivers it, before software binning. Each region
+* gets its own metadata fields.
 */
-int ASICamera::OnAutoWB(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnStatsRegions(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	string strVal;
-	long lVal;
-	ASI_BOOL bAuto;
 	if (eAct == MM::AfterSet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_WB_B, &lVal, &bAuto);
-		pProp->Get(strVal);//�ӿؼ��õ�ѡ����ֵ->����
-		bAuto = strVal.compare(g_Keyword_on) ? ASI_FALSE : ASI_TRUE;
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_WB_B, lVal, bAuto);
-		//	SetPropertyReadOnly(g_Keyword_WB_R,bAuto );
-		//	SetPropertyReadOnly(g_Keyword_WB_B,bAuto );
-
+		string val;
+		pProp->Get(val);
+		std::vector<StatsRegion> regions;
+		if (!ParseStatsRegions(val, regions))
+			return DEVICE_INVALID_PROPERTY_VALUE;
+		statsRegions = regions;
+		sStatsRegions = val;
+		PublishStatsConfig();
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_WB_B, &lVal, &bAuto);
-		pProp->Set(bAuto ? g_Keyword_on : g_Keyword_off);
-		//		SetPropertyReadOnly(g_Keyword_WB_R,bAuto );
-		//		SetPropertyReadOnly(g_Keyword_WB_B,bAuto );
+		pProp->Set(sStatsRegions.c_str());
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "auto white balance" property.
+* Handles the read-only statistics properties of the last frame: min,
+* max, mean, standard deviation, saturated samples, the histogram as
+* comma separated counts (bins of 1 value for 8-bit, 16 for 16-bit) and
+* "mean,stddev,min,max,saturated" per region separated by semicolons.
 */
-int ASICamera::OnGamma(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnStatsInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long lInfo)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
-	{
-
-		pProp->Get(lVal);
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_GAMMA, lVal, ASI_FALSE);
-	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_GAMMA, &lVal, &bAuto);
-		pProp->Set(lVal);
+		MMThreadGuard g(statsLock);
+		const SampleStats& s = lastStats.GetFrame();
+		switch (lInfo)
+		{
+		case STATS_MIN:
+			pProp->Set((long)s.Min);
+			break;
+		case STATS_MAX:
+			pProp->Set((long)s.Max);
+			break;
+		case STATS_MEAN:
+			pProp->Set(s.Mean);
+			break;
+		case STATS_STDDEV:
+			pProp->Set(s.StdDev);
+			break;
+		case STATS_SATURATED:
+			pProp->Set((long)s.Saturated);
+			break;
+		case STATS_FIELD_NUM:
+		{
+			const std::vector<unsigned int>& hist = lastStats.GetHistogram();
+			string text;
+			char buf[16];
+			for (size_t i = 0; i < hist.size(); i++)
+			{
+				snprintf(buf, sizeof(buf), i ? ",%u" : "%u", hist[i]);
+				text += buf;
+			}
+			pProp->Set(text.c_str());
+			break;
+		}
+		default:
+		{
+			const std::vector<SampleStats>& regions = lastStats.GetRegions();
+			string text;
+			char buf[96];
+			for (size_t i = 0; i < regions.size(); i++)
+			{
+				const SampleStats& r = regions[i];
+				snprintf(buf, sizeof(buf), "%s%.3f,%.3f,%u,%u,%llu", i ? ";" : "", r.Mean, r.StdDev, r.Min, r.Max, r.Saturated);
+				text += buf;
+			}
+			pProp->Set(text.c_str());
+			break;
+		}
+		}
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "auto exposure" property.
+* Handles "Snap Poll Interval us" property: how often the exposure status
+* is asked for once the snap is near its expected end.
 */
-int ASICamera::OnAutoExp(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnSnapPollInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	if (eAct == MM::AfterSet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_EXPOSURE, &lVal, &bAuto);
-		string strVal;
-		pProp->Get(strVal);
-		bAuto = strVal.compare(g_Keyword_on) ? ASI_FALSE : ASI_TRUE;
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_EXPOSURE, lVal, bAuto);
+		pProp->Get(lSnapPollUs);
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_EXPOSURE, &lVal, &bAuto);
-		pProp->Set(bAuto ? g_Keyword_on : g_Keyword_off);
-		//		SetPropertyReadOnly(MM::g_Keyword_Exposure,bAuto );
+		pProp->Set(lSnapPollUs);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "auto gain" property.
+* Handles the read-only snap properties: time of the last snap beyond its
+* exposure, its status polls, and the readout time the wait plans with.
 */
-int ASICamera::OnAutoGain(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnSnapInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long lInfo)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_GAIN, &lVal, &bAuto);
-		string strVal;
-		pProp->Get(strVal);
-		bAuto = strVal.compare(g_Keyword_on) ? ASI_FALSE : ASI_TRUE;
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_GAIN, lVal, bAuto);
-	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
-	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_GAIN, &lVal, &bAuto);
-		pProp->Set(bAuto ? g_Keyword_on : g_Keyword_off);
-		//	SetPropertyReadOnly(MM::g_Keyword_Gain,bAuto );
+		if (lInfo == 0)
+			pProp->Set(dSnapLatencyMs);
+		else if (lInfo == 1)
+			pProp->Set(lSnapPolls);
+		else
+			pProp->Set(dSnapReadoutMs);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "flip" property.
+* Handles "Snap Mode" property: single exposure starts one exposure per
+* snap, stream keeps video capture running and takes the next fresh frame,
+* auto streams up to "Snap Stream Max Exposure ms".
 */
-int ASICamera::OnFlip(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnSnapMode(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	if (eAct == MM::AfterSet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_FLIP, &lVal, &bAuto);
-		string strVal;
-		pProp->Get(strVal);
-		for (int i = 0; i < 4; i++)
+		if (Status == capturing)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+		string val;
+		pProp->Get(val);
+		for (int i = 0; i < SNAP_MODE_NUM; i++)
 		{
-			if (!strVal.compare(FlipArr[i]))
-			{
-				ASISetControlValue(ASICameraInfo.CameraID, ASI_FLIP, i, ASI_FALSE);
-				break;
-			}
+			if (val.compare(g_SnapMode[i]) == 0)
+				eSnapMode = (SnapMode)i;
 		}
-
+		if (!UseSnapStream())
+			StopSnapStream();
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_FLIP, &lVal, &bAuto);
-		pProp->Set(FlipArr[lVal]);
+		pProp->Set(g_SnapMode[eSnapMode]);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "hight speed mode" property.
+* Handles "Snap Stream Max Exposure ms" property.
 */
-int ASICamera::OnHighSpeedMod(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnSnapStreamMaxExposure(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	if (eAct == MM::AfterSet)
 	{
-		string strVal;
-		pProp->Get(strVal);
-		lVal = strVal.compare(g_Keyword_on) ? 0 : 1;
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_HIGH_SPEED_MODE, lVal, ASI_FALSE);
+		pProp->Get(dSnapStreamMaxExpMs);
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_HIGH_SPEED_MODE, &lVal, &bAuto);
-		pProp->Set(lVal ? g_Keyword_on : g_Keyword_off);
+		pProp->Set(dSnapStreamMaxExpMs);
 	}
 	return DEVICE_OK;
 }
 /**
-* Handles "hardware bin" property.
+* Handles "Snap Arm Next" property: arm starts the exposure of the next
+* snap right away, see ArmSnap(). Reads armed until that snap is taken.
 */
-int ASICamera::OnHardwareBin(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ASICamera::OnSnapArm(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	long lVal;
-	ASI_BOOL bAuto;
-	if (eAct == MM::AfterSet)//�ӿؼ��õ�ѡ����ֵ->����
+	if (eAct == MM::AfterSet)
 	{
-		string strVal;
-		pProp->Get(strVal);
-		lVal = strVal.compare(g_Keyword_on) ? 0 : 1;
-		ASISetControlValue(ASICameraInfo.CameraID, ASI_HARDWARE_BIN, lVal, ASI_FALSE);
+		string val;
+		pProp->Get(val);
+		if (val.compare(g_SnapArm_Arm) == 0)
+			return ArmSnap();
 	}
-	else if (eAct == MM::BeforeGet)//����ֵ->�ؼ���ʾ
+	else if (eAct == MM::BeforeGet)
 	{
-		ASIGetControlValue(ASICameraInfo.CameraID, ASI_HARDWARE_BIN, &lVal, &bAuto);
-		pProp->Set(lVal ? g_Keyword_on : g_Keyword_off);
+		pProp->Set(bSnapArmed ? g_SnapArm_Arm : g_SnapArm_Idle);
 	}
 	return DEVICE_OK;
 }
+/**
+* Handles "Frame Queue Occupancy" property.
+*/
+int ASICamera::OnFrameQueueOccupancy(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+		pProp->Set((long)frameQueue.GetOccupancy());
+	return DEVICE_OK;
+}
+/**
+* Handles "Frame Queue High Water Mark" property.
+*/
+int ASICamera::OnFrameQueueHighWater(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+		pProp->Set((long)frameQueue.GetHighWaterMark());
+	return DEVICE_OK;
+}
 
 
 
@@ -1644,9 +4351,93 @@ ASI_CONTROL_CAPS* ASICamera::GetOneCtrlCap(int CtrlID)
 	}
 	return 0;
 }
+/**
+* Name of the MM pixel type a geometry snapshot corresponds to.
+*/
+const char* ASICamera::PixelTypeName(const FrameGeometry& geo)
+{
+	if (geo.bDebayer)
+		return geo.bRGB48 ? g_PixelType_RGB48 : g_PixelType_RGB24;
+	switch (geo.ImgType)
+	{
+	case ASI_IMG_RAW16:
+		return geo.b12RAW ? g_PixelType_RAW12 : g_PixelType_RAW16;
+	case ASI_IMG_Y8:
+		return g_PixelType_Y8;
+	case ASI_IMG_RGB24:
+		return geo.bRGB48 ? g_PixelType_RGB48 : g_PixelType_RGB24;
+	default:
+		return g_PixelType_RAW8;
+	}
+}
+
+/**
+* Reads back what the SDK applied and publishes it as the geometry the grab
+* and insert threads use from the next frame on. Called only when a property
+* handler changes the ROI, binning, pixel type or flip, never per frame.
+*/
+void ASICamera::PublishGeometry()
+{
+	long lVal = ASI_FLIP_NONE;
+	ASI_BOOL bAuto;
+	if (GetOneCtrlCap(ASI_FLIP))
+		controls.Get(ASI_FLIP, &lVal, &bAuto);
+	std::atomic_store(&pGeometry, FrameGeometryPtr(BuildGeometry(lVal)));
+	SelectLibraryDark();
+}
+
+/*
+* Geometry of the current settings with the given flip, which a settings
+* transaction may not have applied yet.
+*/
+FrameGeometry* ASICamera::BuildGeometry(long lFlip)
+{
+	FrameGeometry* pGeo = new FrameGeometry();
+
+	ASIGetROIFormat(ASICameraInfo.CameraID, &pGeo->Width, &pGeo->Height, &pGeo->Bin, &pGeo->ImgType);
+	ASIGetStartPos(ASICameraInfo.CameraID, &pGeo->StartX, &pGeo->StartY);
+	pGeo->Flip = (ASI_FLIP_STATUS)lFlip;
+	pGeo->b12RAW = b12RAW;
+	pGeo->bRGB48 = bRGB48;
+
+	RefreshImgType();
+	pGeo->PixBytes = iPixBytes;
+	pGeo->Components = iComponents;
+	pGeo->SoftBin = iSoftBin;
+	pGeo->bSoftBinAverage = bSoftBinAverage;
+	pGeo->bSoftBinWiden = bSoftBinWiden;
+	pGeo->ImageWidth = pGeo->Width / iSoftBin;
+	pGeo->ImageHeight = pGeo->Height / iSoftBin;
+
+	// red site of the delivered frame: the sensor pattern, moved by an odd
+	// ROI offset and mirrored by the flip
+	static const int redX[4] = { 0, 1, 1, 0 };//ASI_BAYER_RG, BG, GR, GB
+	static const int redY[4] = { 0, 1, 0, 1 };
+	pGeo->bDebayer = bHostDebayer;
+	pGeo->DebayerAlgo = iDebayer > 0 ? iDebayer - 1 : 0;
+	pGeo->RedX = (redX[ASICameraInfo.BayerPattern & 3] ^ pGeo->StartX) & 1;
+	pGeo->RedY = (redY[ASICameraInfo.BayerPattern & 3] ^ pGeo->StartY) & 1;
+	if (pGeo->Flip == ASI_FLIP_HORIZ || pGeo->Flip == ASI_FLIP_BOTH)
+		pGeo->RedX = (pGeo->Width - 1 - pGeo->RedX) & 1;
+	if (pGeo->Flip == ASI_FLIP_VERT || pGeo->Flip == ASI_FLIP_BOTH)
+		pGeo->RedY = (pGeo->Height - 1 - pGeo->RedY) & 1;
+	if (pGeo->ImgType == ASI_IMG_RAW16)
+		pGeo->SdkPixBytes = 2;
+	else if (pGeo->ImgType == ASI_IMG_RGB24)
+		pGeo->SdkPixBytes = 3;
+	else
+		pGeo->SdkPixBytes = 1;
+	return pGeo;
+}
+
 void ASICamera::RefreshImgType()
 {
-	if (ImgType == ASI_IMG_RAW16)
+	if (bHostDebayer)
+	{
+		iPixBytes = bRGB48 ? 8 : 4;
+		iComponents = 4;
+	}
+	else if (ImgType == ASI_IMG_RAW16)
 	{
 		iPixBytes = 2;
 		iComponents = 1;
@@ -1670,6 +4461,9 @@ void ASICamera::RefreshImgType()
 		iPixBytes = 1;
 		iComponents = 1;
 	}
+	//8-bit sums can be handed over as 16-bit so they do not clip
+	if (iSoftBin > 1 && !bSoftBinAverage && bSoftBinWiden && iPixBytes == 1)
+		iPixBytes = 2;
 }
 
 
@@ -1716,11 +4510,13 @@ CMyEFW::CMyEFW() :
 	ret = CreateProperty(g_DeviceIndex, sz_ModelIndex, MM::String, false, pAct, true); //ѡ������ͷ���
 	SetAllowedValues(g_DeviceIndex, EFWIndexValues);
 	assert(ret == DEVICE_OK);
+	AsyncLog::Acquire();
 }
 
 CMyEFW::~CMyEFW()
 {
 	Shutdown();
+	AsyncLog::Release();
 }
 
 void CMyEFW::GetName(char* Name) const
@@ -1731,13 +4527,13 @@ void CMyEFW::GetName(char* Name) const
 
 int CMyEFW::Initialize()
 {
-	OutputDbgPrint("CMyEFW::Initialize\n");
+	ASI_LOG_DEBUG("CMyEFW::Initialize");
 	if (initialized_)
 		return DEVICE_OK;
 	if (EFWInfo.ID < 0)
 		return DEVICE_NOT_CONNECTED;
 
-	if (EFWOpen(EFWInfo.ID) != ASI_SUCCESS)
+	if (EFWOpen(EFWInfo.ID) != EFW_SUCCESS)
 		return DEVICE_NOT_CONNECTED;
 
 	EFWGetProperty(EFWInfo.ID, &EFWInfo);
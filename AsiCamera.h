@@ -23,15 +23,34 @@
 
 #pragma once
 
+#include <map>
 #include <string>
+#include <vector>
 
 #include "DeviceBase.h"
 #include "DeviceThreads.h"
+#include "AsyncLog.h"
+#include "ControlCache.h"
 #include "ASICamera2.h"
 #include "EFW_filter.h"
+#include "FrameGeometry.h"
+#include "FrameQueue.h"
+#include "MetadataTemplate.h"
+#include "PixelKernels.h"
+#include "WorkerPool.h"
+#include "SoftBinning.h"
+#include "Debayer.h"
+#include "FrameStacker.h"
+#include "Calibration.h"
+#include "DarkLibrary.h"
+#include "HotPixels.h"
+#include "FrameStats.h"
+#include "LatencyHistogram.h"
 
 
 class SequenceThread;
+class InsertThread;
+class ArmedSnapThread;
 
 #include "error_code.h"
 
@@ -73,6 +92,12 @@ public:
 	int SetBinning(int binSize);
 
 	int IsExposureSequenceable(bool& seq) const;
+	int GetExposureSequenceMaxLength(long& nrEvents) const;
+	int StartExposureSequence();
+	int StopExposureSequence();
+	int ClearExposureSequence();
+	int AddToExposureSequence(double exposureTime_ms);
+	int SendExposureSequence() const;
 	int PrepareSequenceAcqusition();
 	int StartSequenceAcquisition(double interval);
 	int StartSequenceAcquisition(long numImages, double interval_ms, bool stopOnOverflow);
@@ -102,6 +127,57 @@ public:
 	int OnFlip(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnHighSpeedMod(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnHardwareBin(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameQueueDepth(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameQueueOccupancy(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameQueueHighWater(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSdkCallsPerFrame(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct, long lField);
+	int OnLatency(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLogLevel(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnControlCacheAge(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSettingsTransaction(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPresetName(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPreset(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPresetList(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLatencyReset(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLatencyInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long lInfo);
+	int OnOverflowPolicy(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnOverflowTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnWorkerThreads(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnWorkerAffinity(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSoftBin(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSoftBinMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSoftBinOutput(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDebayer(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStackFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStackOperator(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStackKappa(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnCalibration(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnCalibrationFile(MM::PropertyBase* pProp, MM::ActionType eAct, long lFlat);
+	int OnCaptureMaster(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnMasterFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnCalibrationStatus(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDarkLibrary(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDarkLibraryDir(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDarkLibraryTempStep(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDarkLibraryInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long lInfo);
+	int OnHotPixels(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHotPixelDir(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHotPixelDetect(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHotPixelMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHotPixelSigma(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHotPixelThreshold(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnHotPixelCount(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStatistics(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStatsRowStride(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStatsRegions(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStatsInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long lInfo);
+	int OnSnapPollInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSnapInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long lInfo);
+	int OnSnapMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSnapStreamMaxExposure(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSnapArm(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnOverflowCounter(MM::PropertyBase* pProp, MM::ActionType eAct, long policy);
 
 private:
 
@@ -109,7 +185,7 @@ private:
 	static const int MAX_BIT_DEPTH = 16;
 
 
-	long lExpMs;
+	std::atomic<long> lExpUs;//ASI_EXPOSURE as last set, in the SDK's microseconds
 
 	enum CamStatus {
 		closed = 0,
@@ -126,9 +202,69 @@ private:
 	int iConnectedCamNum;
 
 	//variable of a camera
-	unsigned char* uc_pImg;
-	unsigned char* pRGB32, * pRGB64;
+	unsigned char* uc_pImg;//raw SDK frame, snap and sequence scratch
 	unsigned long iBufSize;
+	struct ConvertBuffers
+	{
+		std::vector<unsigned char> Out;//what MMCore gets, used when the SDK layout is not MMCore's
+		std::vector<unsigned char> Stage;//between two stages: binned RGB before expansion, debayered RGBA before binning
+	};
+	ConvertBuffers snapOut, insertOut;
+	FrameGeometryPtr pSnapGeometry;
+	const unsigned char* pSnapImg;
+	bool bSnapConverted;//uc_pImg already converted for the current snap
+	// snap wait: sleep through the exposure, poll only around its expected end
+	double dSnapReadoutMs;//learned time from the end of the exposure to the data, 0 until measured
+	FrameGeometryPtr pReadoutGeometry;//the estimate was learned with
+	long lSnapPollUs;
+	double dSnapLatencyMs;//last snap, beyond the exposure
+	long lSnapPolls;//SDK status or frame calls of the last snap
+	// one ASIStartExposure(): inputs taken and results folded in on the
+	// MMCore thread, so the exposure itself may run on the armed snap thread
+	struct SingleSnap
+	{
+		unsigned char* pDst;
+		FrameGeometryPtr Geometry;
+		long ExpUs;
+		double ReadoutMs;//learned for Geometry, 0 until measured
+		double ReadoutBoundMs;
+		long PollUs;
+		bool bOk;
+		double LatencyMs;
+		long Polls;
+	};
+	SingleSnap BeginSingleSnap(unsigned char* pDst);
+	bool ExposeSingleSnap(SingleSnap& s) const;
+	void EndSingleSnap(const SingleSnap& s);
+	bool SnapSingleExposure(unsigned char* pDst);
+	// snaps taken from a video stream left running between them
+	enum SnapMode { SNAP_AUTO = 0, SNAP_SINGLE, SNAP_STREAM, SNAP_MODE_NUM };
+	SnapMode eSnapMode;
+	double dSnapStreamMaxExpMs;//auto streams up to this exposure
+	bool bSnapStream;//video capture running for snaps
+	bool UseSnapStream() const;
+	bool SnapFromStream();
+	void StopSnapStream();
+	// next snap exposed and read out into a second buffer while the last one is served
+	friend class ArmedSnapThread;
+	ArmedSnapThread* armThd_;
+	bool bSnapArmed;
+	unsigned char* uc_pArmedImg;//iBufSize, swapped with uc_pImg when taken
+	SingleSnap armedSnap;//written by the thread until it is joined
+	long lArmedControlWrites;//controls.GetWriteCount() when armed
+	int ArmSnap();
+	bool TakeArmedSnap();
+	void StopSnapActivity();
+	WorkerPool workerPool;//splits conversion of large frames into row stripes
+	long lWorkerThreads;
+	unsigned long long ullWorkerAffinity;//0: no pinning
+	int iSoftBin;//software binning on top of iBin
+	bool bSoftBinAverage, bSoftBinWiden;
+	int iDebayer;//0: SDK RGB24, otherwise DebayerAlgorithm + 1
+	bool bHostDebayer;//RGB pixel type streamed as RAW8/RAW16 and demosaiced here
+	long lStackDepth;//sequence frames per inserted frame, 1: stacking off
+	StackOperator eStackOp;
+	double dStackKappa;
 
 
 	int iPixBytes;//ÿ�������ֽ���	  
@@ -138,12 +274,87 @@ private:
 
 	ASI_IMG_TYPE ImgType;
 	friend class SequenceThread;
+	friend class InsertThread;
 	SequenceThread* thd_;
+	InsertThread* insThd_;
+	FrameQueue frameQueue;
+	long lQueueDepth;
+	std::atomic<long> lPipelineDropped;
 	ASI_CONTROL_CAPS* pControlCaps;
 	ASI_CAMERA_INFO ASICameraInfo;
 	int iCtrlNum;
-	ASI_FLIP_STATUS ImgFlip;
-	int ImgStartX, ImgStartY, ImgBin, ImgWid, ImgHei;//����ʾͼ�������ߴ���Ϣ
+	ControlCache controls;//what property reads see, see ControlCache
+	ASI_ERROR_CODE SetControl(ASI_CONTROL_TYPE type, long lVal, ASI_BOOL bAuto);
+
+	// control changes applied together between two frames, see CommitSettings()
+	struct SettingsChange
+	{
+		ASI_CONTROL_TYPE Type;
+		long Value;
+		ASI_BOOL Auto;
+	};
+	struct SettingsTransaction
+	{
+		std::vector<SettingsChange> Changes;
+		FrameGeometryPtr Geometry;//set when the flip changes
+		bool bDark;//Dark is the dark for the new settings
+		CalibrationFramePtr Dark;
+	};
+	typedef std::shared_ptr<const SettingsTransaction> SettingsTransactionPtr;
+	bool bTransactionOpen;
+	std::vector<SettingsChange> transactionChanges;//collected until commit
+	SettingsTransactionPtr pCommittedSettings;//for the grab thread, atomic_store/atomic_exchange
+	long lSettingsGeneration;//grab thread while capturing
+	bool bSettingsMixed;//the frame in flight was exposed across the last change
+	int CommitSettings();
+	void ApplySettings(const SettingsTransaction& t);
+	void ApplyCommittedSettings();
+
+	// named camera configurations, see ApplyPreset()
+	enum { PRESET_CONTROL_NUM = 5 };
+	struct CameraPreset
+	{
+		int Width, Height, Bin, StartX, StartY;
+		ASI_IMG_TYPE ImgType;
+		bool b12RAW, bRGB48, bHostDebayer;
+		long Controls[PRESET_CONTROL_NUM];//g_PresetControls
+		ASI_BOOL ControlAuto[PRESET_CONTROL_NUM];
+	};
+	std::map<std::string, CameraPreset> presets;
+	std::string sPresetName;
+	void SavePreset(CameraPreset& p);
+	int ApplyPreset(const CameraPreset& p);
+	FrameGeometryPtr pGeometry;//geometry of the frames being produced, see PublishGeometry()
+	std::atomic<long> lGrabSdkCalls, lGrabFrames;
+
+	// drop and rate telemetry of a sequence, written by the grab thread
+	enum TelemetryField { TELEMETRY_FPS = 0, TELEMETRY_SDK_DROPPED, TELEMETRY_PIPELINE_DROPPED, TELEMETRY_CORE_DROPPED, TELEMETRY_FIELD_NUM };
+	std::atomic<double> dDeliveredFps;//over the last window
+	std::atomic<long> lSdkDropped;//ASIGetDroppedFrames since the sequence started
+	int iSdkDroppedBase;
+	double dFpsWindowStartMs;
+	long lFpsWindowFrames;
+	long lDroppedReported;//already carried by a frame's DroppedSinceLast
+	void UpdateTelemetry(double dNowMs);
+
+	// per-stage latency of a sequence frame, only timed while bLatency
+	enum LatencyStage { LATENCY_SDK_WAIT = 0, LATENCY_CONVERSION, LATENCY_METADATA, LATENCY_CORE_INSERT, LATENCY_SDK_TO_CORE, LATENCY_STAGE_NUM };
+	enum LatencyStat { LATENCY_P50 = 0, LATENCY_P99, LATENCY_P999, LATENCY_MAX, LATENCY_STAT_NUM };
+	std::atomic<bool> bLatency;
+	LatencyHistogram latency[LATENCY_STAGE_NUM];
+	unsigned long long RecordLatency(LatencyStage stage, unsigned long long ullSinceUs);
+
+	// exposure sequence, stepped by the grab thread one frame ahead
+	typedef std::shared_ptr<const std::vector<double> > ExposureSequencePtr;
+	std::vector<double> exposureSequence;//being loaded by MMCore
+	ExposureSequencePtr pExposureSeq;//running, replaced as a whole with atomic_store
+	size_t iExposureSeqPos;//grab thread only from here on
+	double EstimateReadoutMs(const FrameGeometry& geo) const;
+	double dFrameTimeoutExtraMs;//beyond the exposure, per ASIGetVideoData() of a sequence
+	double dExposingMs;//of the frame the next ASIGetVideoData() returns
+	double dNextExposureMs;//set in the SDK, for the frame after that
+	bool bExposureSeqApplied;
+	void StepExposureSequence();
 
 
 	//	int iCamIndex;
@@ -151,17 +362,141 @@ private:
 	bool b12RAW, bRGB48;
 	void DeleteImgBuf();
 	int RunSequenceOnThread(MM::MMTime startTime);
-	int InsertImage();
+	int InsertImage(FrameSlot& frame);
+
+	// per-frame fields of mdTemplate, in the order BuildMetadataTemplate() adds them
+	enum MetadataField {
+		MD_IMAGE_NUMBER = 0,
+		MD_ELAPSED_TIME,
+		MD_EXPOSURE,
+		MD_OVERFLOW_DROPPED,
+		MD_FRAME_NUMBER,
+		MD_DROPPED_SINCE_LAST,
+		MD_SETTINGS_GENERATION,
+		MD_SETTINGS_MIXED,
+		MD_CALIBRATION,
+		MD_STACK_COUNT,//stack fields only while stacking
+		MD_STACK_FIRST,
+		MD_STACK_LAST,
+		MD_STACK_FRAMES
+	};
+	MetadataTemplate mdTemplate;//only touched by the insert thread
+	FrameGeometryPtr pMdGeometry;
+	std::atomic<bool> bMetadataDirty;
+	double dSeqStartMs;
+	void BuildMetadataTemplate(const FrameGeometryPtr& geo);
+
+	// stacking on the insert thread, see StackFrame()
+	FrameStacker stacker;
+	FrameGeometryPtr pStackGeometry;
+	std::vector<unsigned char> stackOut;
+	std::vector<long> stackFrames;//frame numbers in the current stack
+	std::string stackFrameList;
+	long lStackedCount;
+	const unsigned char* StackFrame(const FrameSlot& frame, const unsigned char* pImg);
+	struct StackJob
+	{
+		FrameStacker* pStacker;
+		const unsigned char* pSrc;
+		unsigned char* pDst;
+		size_t RowSamples;
+	};
+	static void StackAccumulateStripe(void* pCtx, int rowBegin, int rowEnd);
+	static void StackReduceStripe(void* pCtx, int rowBegin, int rowEnd);
+
+	// dark/flat calibration of RAW frames before conversion
+	std::atomic<bool> bCalibrate;//switched while streaming
+	CalibrationMastersPtr pCalMasters;//replaced as a whole with atomic_store
+	PreparedCalibration snapCal, insertCal;
+	std::atomic<int> iCalStatus;//CalibrationStatus of the last calibrated frame
+	std::string sCalFile[2];//dark, flat
+	long lMasterFrames;
+	bool CalibrateFrame(unsigned char* pData, const FrameGeometryPtr& geo, PreparedCalibration& cal);
+	void PublishMaster(bool bFlat, const CalibrationFramePtr& master);
+	int CaptureMaster(bool bFlat);
+	int AverageSnaps(CalibrationFramePtr& master);
+	struct CalibrationJob
+	{
+		const PreparedCalibration* pCal;
+		unsigned char* pFrame;
+	};
+	static void CalibrateStripe(void* pCtx, int rowBegin, int rowEnd);
+
+	// master darks picked from a library by the current settings
+	DarkLibrary darkLibrary;
+	bool bDarkLibrary;
+	std::string sDarkLibraryDir;
+	double dDarkTempStep;//C
+	std::string sCameraSerial;//library key, the model name if the camera has no serial number
+	CalibrationFramePtr pFileDark;//from the dark file or a capture, used when the library has no match
+	CalibrationFramePtr pLibraryDark;
+	std::string sLibraryDark;//file name of pLibraryDark
+	DarkKey CurrentDarkKey(const FrameGeometry& geo);
+	void SelectLibraryDark();
+	void PublishDark();
+
+	// hot/dead pixels replaced by the median of their neighbours
+	std::atomic<bool> bHotPixels;//switched while streaming
+	HotPixelMapPtr pHotMap;//replaced as a whole with atomic_store
+	PreparedHotPixels snapHot, insertHot;
+	std::string sHotPixelDir;//holds <serial>.hotpix
+	HotPixelDetection eHotPixelMode;
+	double dHotPixelSigma;
+	long lHotPixelThreshold;//ADU
+	std::string HotPixelPath() const;
+	void CorrectHotPixels(unsigned char* pData, const FrameGeometryPtr& geo, PreparedHotPixels& hot);
+	int DetectHotPixelMap();
+
+	// statistics of the SDK frames, taken on the grab thread while the frame is in cache
+	std::atomic<bool> bStats;//switched while streaming
+	StatsConfigPtr pStatsConfig;//replaced as a whole with atomic_store
+	long lStatsRowStride;
+	std::vector<StatsRegion> statsRegions;
+	std::string sStatsRegions;
+	FrameStatistics lastStats;//of the last frame inserted or snapped
+	MMThreadLock statsLock;//guards lastStats
+	enum StatsField { STATS_MIN = 0, STATS_MAX, STATS_MEAN, STATS_STDDEV, STATS_SATURATED, STATS_FIELD_NUM };
+	int iMdStats;//first statistics field of mdTemplate, -1 without
+	int iMdStatsRegions;
+	void PublishStatsConfig();
+	void SetStatsMetadata(const FrameStatistics& stats);
+
+	// what InsertImage does when MMCore reports DEVICE_BUFFER_OVERFLOW
+	enum OverflowPolicy {
+		OVERFLOW_CLEAR_ALL = 0,
+		OVERFLOW_DROP_NEWEST,
+		OVERFLOW_BLOCK,
+		OVERFLOW_STOP,
+		OVERFLOW_POLICY_NUM
+	};
+	OverflowPolicy eOverflowPolicy;
+	long lOverflowTimeoutMs;
+	bool bStopOnOverflow;
+	std::atomic<long> lOverflowCount[OVERFLOW_POLICY_NUM];//clears for clear-all, dropped frames otherwise
 	long imageCounter_;
 	void MallocControlCaps(int iCamindex);
 	void DeletepControlCaps(int iCamindex);
 	bool isImgTypeSupported(ASI_IMG_TYPE ImgType);
 
 	ASI_CONTROL_CAPS* GetOneCtrlCap(int CtrlID);
-	void ConvRGB2RGBA32();
-	void ConvRGB2RGBA64();
-	void Conv16RAWTo12RAW();
+	void AllocImgBuf();
+	const unsigned char* ConvertFrame(const unsigned char* pSrc, const FrameGeometry& geo, ConvertBuffers& bufs);
+	void RunStripes(int rows, size_t pixels, WorkerPool::StripeFunc func, void* pCtx);
+	struct ConvertJob
+	{
+		void (*Kernel)(const unsigned char* pSrc, unsigned char* pDst, size_t pixels);
+		const unsigned char* pSrc;
+		unsigned char* pDst;
+		size_t SrcLineBytes, DstLineBytes;
+		int Width;
+	};
+	static void ConvertStripe(void* pCtx, int rowBegin, int rowEnd);
 	void RefreshImgType();
+	void PublishGeometry();
+	FrameGeometry* BuildGeometry(long lFlip);
+	static const char* PixelTypeName(const FrameGeometry& geo);
+	void GetDisplayROI(const FrameGeometry& geo, unsigned& x, unsigned& y, unsigned& xSize, unsigned& ySize) const;
+	FrameGeometryPtr GetGeometry() const { return std::atomic_load(&pGeometry); }
 };
 
 
@@ -176,6 +511,7 @@ public:
 	void Stop();
 	void Start(long numImages, double intervalMs);
 	bool IsStopped();
+	void Join();
 	double GetIntervalMs() { return intervalMs_; }
 	void SetLength(long images) { numImages_ = images; }
 	long GetLength() const { return numImages_; }
@@ -185,15 +521,54 @@ private:
 	int svc(void) throw();
 	ASICamera* camera_;
 	bool stop_;
+	bool active_;//activated and not joined yet
 	long numImages_;
 	long imageCounter_;
 	double intervalMs_;
 };
 
+/**
+* Drains FrameQueue into the MMCore circular buffer so that conversion,
+* metadata and the core copy never hold up ASIGetVideoData.
+*/
+class InsertThread : public MMDeviceThreadBase
+{
+public:
+	InsertThread(ASICamera* pCam);
+	~InsertThread();
+	void Start();
+	void Finish();
+	void Stop();
+	bool IsStopped();
+	bool IsFinishing() { return finish_; }
+
+private:
+	int svc(void) throw();
+	ASICamera* camera_;
+	std::atomic<bool> finish_;
+	std::atomic<bool> stop_;
+};
+
+
 
 
 
 
+/**
+* Runs one armed single-exposure snap: waits for the exposure and reads it
+* out into the second snap buffer.
+*/
+class ArmedSnapThread : public MMDeviceThreadBase
+{
+public:
+	ArmedSnapThread(ASICamera* pCam);
+	~ArmedSnapThread();
+	void Start();
+
+private:
+	int svc(void) throw();
+	ASICamera* camera_;
+};
 
 class CMyEFW : public CStateDeviceBase<CMyEFW>
 {
@@ -0,0 +1,206 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AsyncLog.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Leveled, rate-limited log written through a lock-free ring and
+//                flushed to the log file by a background thread
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "AsyncLog.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+
+#ifdef _WINDOWS
+#include <windows.h>
+#endif
+
+static const char* g_LogLevelTag[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+bool LogRateLimit::Allow(int& suppressedBefore)
+{
+	long long now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	long long w = window.load(std::memory_order_relaxed);
+	// a racing reset may let a message or two more through, never fewer
+	if (w != now && window.compare_exchange_strong(w, now, std::memory_order_relaxed))
+		count.store(0, std::memory_order_relaxed);
+	if (count.fetch_add(1, std::memory_order_relaxed) >= LOG_SITE_BURST)
+	{
+		suppressed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	suppressedBefore = suppressed.exchange(0, std::memory_order_relaxed);
+	return true;
+}
+
+AsyncLog::AsyncLog() :
+	head(0),
+	tail(0),
+	level(LOG_DEBUG),
+	dropped(0),
+	iUsers(0),
+	bQuit(false),
+	fp(0),
+	thread(0)
+{
+	for (size_t i = 0; i < LOG_RING_SIZE; i++)
+		ring[i].seq.store(i, std::memory_order_relaxed);
+}
+
+AsyncLog& AsyncLog::Instance()
+{
+	static AsyncLog log;
+	return log;
+}
+
+void AsyncLog::Acquire()
+{
+	AsyncLog& log = Instance();
+	std::lock_guard<std::mutex> g(log.lock);
+	if (log.iUsers++ > 0)
+		return;
+	log.bQuit = false;
+	log.thread = new LogFlushThread(&log);
+	log.thread->activate();
+}
+
+void AsyncLog::Release()
+{
+	AsyncLog& log = Instance();
+	LogFlushThread* pThd;
+	{
+		std::lock_guard<std::mutex> g(log.lock);
+		if (log.iUsers == 0 || --log.iUsers > 0)
+			return;
+		log.bQuit = true;
+		pThd = log.thread;
+		log.thread = 0;
+	}
+	log.wake.notify_all();
+	pThd->wait();
+	delete pThd;
+}
+
+/**
+* Claims the next ring slot the way a bounded MPMC queue does: a slot
+* whose sequence equals the position is free, the CAS on head makes it
+* ours. The text is formatted in place, publishing is one release store.
+*/
+void AsyncLog::Write(LogLevel lvl, int suppressed, const char* format, ...)
+{
+	AsyncLog& log = Instance();
+	size_t pos = log.head.load(std::memory_order_relaxed);
+	Record* r;
+	while (true)
+	{
+		r = &log.ring[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = r->seq.load(std::memory_order_acquire);
+		if (seq == pos)
+		{
+			if (log.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (seq < pos)
+		{
+			log.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else
+			pos = log.head.load(std::memory_order_relaxed);
+	}
+
+	r->timeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	r->level = lvl;
+	r->suppressed = suppressed;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(r->text, sizeof(r->text), format, args);
+	va_end(args);
+	r->seq.store(pos + 1, std::memory_order_release);
+}
+
+void AsyncLog::FlushLoop()
+{
+	std::unique_lock<std::mutex> g(lock);
+	fp = fopen("ASICamera_mg_log.txt", "a");
+	while (true)
+	{
+		bool bLast = bQuit;
+		Flush();
+		if (bLast)
+			break;
+		wake.wait_for(g, std::chrono::milliseconds(LOG_FLUSH_MS));
+	}
+	if (fp)
+		fclose(fp);
+	fp = 0;
+}
+
+// flush thread only
+void AsyncLog::Flush()
+{
+	long lDropped = dropped.exchange(0, std::memory_order_relaxed);
+	if (lDropped && fp)
+		fprintf(fp, "<MM_ASI> %ld log messages dropped, ring full\n", lDropped);
+	while (true)
+	{
+		Record& r = ring[tail & (LOG_RING_SIZE - 1)];
+		if (r.seq.load(std::memory_order_acquire) != tail + 1)
+			break;
+		size_t n = strlen(r.text);
+		while (n > 0 && r.text[n - 1] == '\n')
+			r.text[--n] = 0;
+
+		time_t sec = (time_t)(r.timeUs / 1000000);
+		struct tm t;
+#ifdef _WINDOWS
+		localtime_s(&t, &sec);
+#else
+		localtime_r(&sec, &t);
+#endif
+		char stamp[32];
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &t);
+		if (fp)
+		{
+			fprintf(fp, "%s.%06d %s <MM_ASI> %s", stamp, (int)(r.timeUs % 1000000), g_LogLevelTag[r.level], r.text);
+			if (r.suppressed)
+				fprintf(fp, " (%d similar suppressed)", r.suppressed);
+			fputc('\n', fp);
+		}
+#ifdef _DEBUG
+#ifdef _WINDOWS
+		OutputDebugStringA(r.text);
+		OutputDebugStringA("\n");
+#elif defined _LIN
+		printf("<MM_ASI> %s\n", r.text);
+#endif
+#endif
+		r.seq.store(tail + LOG_RING_SIZE, std::memory_order_release);
+		tail++;
+	}
+	if (fp)
+		fflush(fp);
+}
+
+int LogFlushThread::svc(void) throw()
+{
+	log_->FlushLoop();
+	return 0;
+}
@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AsyncLog.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Leveled, rate-limited log written through a lock-free ring and
+//                flushed to the log file by a background thread
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+
+#include "DeviceThreads.h"
+
+enum LogLevel
+{
+	LOG_ERROR = 0,
+	LOG_WARNING,
+	LOG_INFO,
+	LOG_DEBUG,
+	LOG_LEVEL_NUM
+};
+
+// debug messages are compiled in only with ASI_LOG_DEBUG_BUILD, by default in debug builds
+#ifndef ASI_LOG_DEBUG_BUILD
+#ifdef _DEBUG
+#define ASI_LOG_DEBUG_BUILD 1
+#else
+#define ASI_LOG_DEBUG_BUILD 0
+#endif
+#endif
+
+/**
+* Per call site limit of LOG_SITE_BURST messages a second. Lives as a
+* zero-initialized static in the ASI_LOG macro, so it needs no guard.
+*/
+struct LogRateLimit
+{
+	static const int LOG_SITE_BURST = 10;
+
+	std::atomic<long long> window;	// second the count is for
+	std::atomic<int> count;
+	std::atomic<int> suppressed;	// since the last message let through
+
+	// true when the message may go out; then suppressed is what was held back before it
+	bool Allow(int& suppressedBefore);
+};
+
+class LogFlushThread;
+
+/**
+* Process-wide log. Write() formats into a slot of a bounded lock-free
+* ring (many producers, the flush thread the only consumer) and never
+* blocks or touches the file; a full ring drops the message and counts it.
+* The flush thread appends what is queued to ASICamera_mg_log.txt every
+* LOG_FLUSH_MS, keeping the file open meanwhile.
+*
+* It runs while at least one device holds a reference, see Acquire() and
+* Release(); the last release flushes what is left.
+*/
+class AsyncLog
+{
+public:
+	static void Acquire();
+	static void Release();
+
+	static void SetLevel(LogLevel level) { Instance().level.store(level, std::memory_order_relaxed); }
+	static LogLevel GetLevel() { return (LogLevel)Instance().level.load(std::memory_order_relaxed); }
+	static bool IsEnabled(LogLevel level) { return level <= GetLevel(); }
+
+	static void Write(LogLevel level, int suppressed, const char* format, ...);
+
+private:
+	static const int LOG_RING_SIZE = 1024;	// power of two
+	static const int LOG_TEXT_SIZE = 232;
+	static const int LOG_FLUSH_MS = 200;
+
+	struct Record
+	{
+		std::atomic<size_t> seq;	// == position when free, position + 1 when filled
+		long long timeUs;			// system clock
+		int level;
+		int suppressed;
+		char text[LOG_TEXT_SIZE];
+	};
+
+	AsyncLog();
+	static AsyncLog& Instance();
+
+	friend class LogFlushThread;
+	void FlushLoop();
+	void Flush();
+
+	Record ring[LOG_RING_SIZE];
+	std::atomic<size_t> head;			// next position to claim
+	size_t tail;						// next position to flush, flush side only
+	std::atomic<int> level;
+	std::atomic<long> dropped;			// ring full
+
+	std::mutex lock;					// users, thread and file
+	std::condition_variable wake;
+	int iUsers;
+	bool bQuit;
+	FILE* fp;
+	LogFlushThread* thread;
+};
+
+class LogFlushThread : public MMDeviceThreadBase
+{
+public:
+	LogFlushThread(AsyncLog* pLog) : log_(pLog) {}
+
+private:
+	int svc(void) throw();
+	AsyncLog* log_;
+};
+
+#define ASI_LOG(lvl, ...) \
+	do { \
+		if (AsyncLog::IsEnabled(lvl)) \
+		{ \
+			static LogRateLimit rateLimit_; \
+			int suppressed_; \
+			if (rateLimit_.Allow(suppressed_)) \
+				AsyncLog::Write(lvl, suppressed_, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define ASI_LOG_ERROR(...) ASI_LOG(LOG_ERROR, __VA_ARGS__)
+#define ASI_LOG_WARNING(...) ASI_LOG(LOG_WARNING, __VA_ARGS__)
+#define ASI_LOG_INFO(...) ASI_LOG(LOG_INFO, __VA_ARGS__)
+#if ASI_LOG_DEBUG_BUILD
+#define ASI_LOG_DEBUG(...) ASI_LOG(LOG_DEBUG, __VA_ARGS__)
+#else
+#define ASI_LOG_DEBUG(...) ((void)0)
+#endif
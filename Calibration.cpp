@@ -0,0 +1,412 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          Calibration.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Dark-frame subtraction and flat-field correction of RAW8/RAW16
+//                frames, master frames and their FITS files
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "Calibration.h"
+#include "PixelKernels.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+static const size_t g_FitsBlock = 2880;
+static const size_t g_FitsCard = 80;
+
+///////////////////////////////////////////////////////////////////////////////
+// FITS
+///////////////////////////////////////////////////////////////////////////////
+
+// value part of a header card: quotes and trailing blanks removed, comment cut
+static std::string CardValue(const char* pCard)
+{
+	std::string val(pCard + 10, g_FitsCard - 10);
+	size_t b = val.find_first_not_of(' ');
+	if (b == std::string::npos)
+		return "";
+	if (val[b] == '\'')
+	{
+		size_t e = val.find('\'', b + 1);
+		val = val.substr(b + 1, e == std::string::npos ? std::string::npos : e - b - 1);
+	}
+	else
+	{
+		val = val.substr(b, val.find('/', b) - b);
+	}
+	size_t e = val.find_last_not_of(' ');
+	return e == std::string::npos ? "" : val.substr(0, e + 1);
+}
+
+static long CardInt(const std::map<std::string, std::string>& cards, const char* key, long def)
+{
+	std::map<std::string, std::string>::const_iterator it = cards.find(key);
+	return it == cards.end() ? def : strtol(it->second.c_str(), 0, 10);
+}
+
+static double CardFloat(const std::map<std::string, std::string>& cards, const char* key, double def)
+{
+	std::map<std::string, std::string>::const_iterator it = cards.find(key);
+	return it == cards.end() ? def : strtod(it->second.c_str(), 0);
+}
+
+// big-endian sample i of the data unit as double
+static double FitsSample(const unsigned char* p, int bitpix, size_t i)
+{
+	switch (bitpix)
+	{
+	case 8:
+		return p[i];
+	case 16:
+		p += i * 2;
+		return (short)((p[0] << 8) | p[1]);
+	case 32:
+		p += i * 4;
+		return (int)(((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3]);
+	case -32:
+	{
+		p += i * 4;
+		unsigned u = ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3];
+		float f;
+		memcpy(&f, &u, 4);
+		return f;
+	}
+	default:
+	{
+		p += i * 8;
+		unsigned long long u = 0;
+		for (int k = 0; k < 8; k++)
+			u = (u << 8) | p[k];
+		double d;
+		memcpy(&d, &u, 8);
+		return d;
+	}
+	}
+}
+
+bool LoadCalibrationFrame(const char* path, CalibrationFrame& frame, std::string& error)
+{
+	error.clear();
+	FILE* fp = fopen(path, "rb");
+	if (fp == 0)
+	{
+		error = "cannot open file";
+		return false;
+	}
+
+	std::map<std::string, std::string> cards;
+	std::vector<char> block(g_FitsBlock);
+	bool bEnd = false;
+	bool bFirst = true, bSimple = false;
+	while (!bEnd && fread(&block[0], 1, g_FitsBlock, fp) == g_FitsBlock)
+	{
+		for (size_t c = 0; c < g_FitsBlock && !bEnd; c += g_FitsCard)
+		{
+			const char* pCard = &block[c];
+			std::string key(pCard, 8);
+			key = key.substr(0, key.find(' '));
+			if (key == "END")
+				bEnd = true;
+			else if (pCard[8] == '=' && !key.empty())
+				cards[key] = CardValue(pCard);
+			if (bFirst)
+				bSimple = key == "SIMPLE" && cards[key] == "T";
+			bFirst = false;
+		}
+	}
+
+	long bitpix = CardInt(cards, "BITPIX", 0);
+	long naxis = CardInt(cards, "NAXIS", 0);
+	long w = CardInt(cards, "NAXIS1", 0);
+	long h = CardInt(cards, "NAXIS2", 0);
+	if (!bEnd || !bSimple)
+		error = "not a FITS file";
+	else if (bitpix != 8 && bitpix != 16 && bitpix != 32 && bitpix != -32 && bitpix != -64)
+		error = "unsupported BITPIX";
+	else if (naxis < 2 || naxis > 3 || (naxis == 3 && CardInt(cards, "NAXIS3", 1) != 1) || w <= 0 || h <= 0)
+		error = "not a single 2-D image";
+	if (!error.empty())
+	{
+		fclose(fp);
+		return false;
+	}
+
+	size_t samples = (size_t)w * h;
+	size_t bytes = samples * (abs((int)bitpix) / 8);
+	std::vector<unsigned char> data(bytes);
+	bool bRead = fread(&data[0], 1, bytes, fp) == bytes;
+	fclose(fp);
+	if (!bRead)
+	{
+		error = "data unit truncated";
+		return false;
+	}
+
+	double bzero = CardFloat(cards, "BZERO", 0.0);
+	double bscale = CardFloat(cards, "BSCALE", 1.0);
+	bool bBottomUp = cards["ROWORDER"] == "BOTTOM-UP";
+	frame.Width = (int)w;
+	frame.Height = (int)h;
+	frame.Bin = (int)CardInt(cards, "XBINNING", 1);
+	frame.StartX = (int)CardInt(cards, "XORGSUBF", 0);
+	frame.StartY = (int)CardInt(cards, "YORGSUBF", 0);
+	frame.Data.resize(samples);
+	for (long y = 0; y < h; y++)
+	{
+		size_t src = (size_t)(bBottomUp ? h - 1 - y : y) * w;
+		float* pOut = &frame.Data[(size_t)y * w];
+		for (long x = 0; x < w; x++)
+			pOut[x] = (float)(bzero + bscale * FitsSample(&data[0], (int)bitpix, src + x));
+	}
+	return true;
+}
+
+static void PutCard(std::string& header, const char* key, const char* value)
+{
+	// numbers right aligned to column 30, strings start at column 11
+	char card[g_FitsCard + 1];
+	snprintf(card, sizeof(card), value[0] == '\'' ? "%-8.8s= %s" : "%-8.8s= %20s", key, value);
+	std::string s(card);
+	s.resize(g_FitsCard, ' ');
+	header += s;
+}
+
+static void PutCard(std::string& header, const char* key, long value)
+{
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%ld", value);
+	PutCard(header, key, buf);
+}
+
+bool SaveCalibrationFrame(const char* path, const CalibrationFrame& frame, const char* imageType)
+{
+	std::string header;
+	char type[72];
+	snprintf(type, sizeof(type), "'%-8s'", imageType);
+	PutCard(header, "SIMPLE", "T");
+	PutCard(header, "BITPIX", -32);
+	PutCard(header, "NAXIS", 2);
+	PutCard(header, "NAXIS1", frame.Width);
+	PutCard(header, "NAXIS2", frame.Height);
+	PutCard(header, "XBINNING", frame.Bin);
+	PutCard(header, "YBINNING", frame.Bin);
+	PutCard(header, "XORGSUBF", frame.StartX);
+	PutCard(header, "YORGSUBF", frame.StartY);
+	PutCard(header, "ROWORDER", "'TOP-DOWN'");
+	PutCard(header, "IMAGETYP", type);
+	header += std::string("END").append(g_FitsCard - 3, ' ');
+	header.resize((header.size() + g_FitsBlock - 1) / g_FitsBlock * g_FitsBlock, ' ');
+
+	size_t samples = (size_t)frame.Width * frame.Height;
+	const float* pSamples = frame.Samples();
+	std::vector<unsigned char> data((samples * 4 + g_FitsBlock - 1) / g_FitsBlock * g_FitsBlock, 0);
+	for (size_t i = 0; i < samples; i++)
+	{
+		unsigned u;
+		memcpy(&u, &pSamples[i], 4);
+		data[i * 4] = (unsigned char)(u >> 24);
+		data[i * 4 + 1] = (unsigned char)(u >> 16);
+		data[i * 4 + 2] = (unsigned char)(u >> 8);
+		data[i * 4 + 3] = (unsigned char)u;
+	}
+
+	FILE* fp = fopen(path, "wb");
+	if (fp == 0)
+		return false;
+	bool bOk = fwrite(header.data(), 1, header.size(), fp) == header.size();
+	bOk = bOk && (data.empty() || fwrite(&data[0], 1, data.size(), fp) == data.size());
+	return fclose(fp) == 0 && bOk;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Masters
+///////////////////////////////////////////////////////////////////////////////
+
+MasterBuilder::MasterBuilder() :
+	iCount(0)
+{
+}
+
+bool MasterBuilder::Begin(const FrameGeometryPtr& geo)
+{
+	if (geo->ImgType != ASI_IMG_RAW8 && geo->ImgType != ASI_IMG_RAW16)
+		return false;
+	pGeometry = geo;
+	sum.assign((size_t)geo->Width * geo->Height, 0.0f);
+	iCount = 0;
+	return true;
+}
+
+void MasterBuilder::Add(const unsigned char* pSdk)
+{
+	size_t n = sum.size();
+	if (pGeometry->SdkPixBytes == 1)
+	{
+		for (size_t i = 0; i < n; i++)
+			sum[i] += pSdk[i];
+	}
+	else
+	{
+		const unsigned short* p = (const unsigned short*)pSdk;
+		for (size_t i = 0; i < n; i++)
+			sum[i] += p[i];
+	}
+	iCount++;
+}
+
+CalibrationFramePtr MasterBuilder::Finish()
+{
+	const FrameGeometry& geo = *pGeometry;
+	CalibrationFrame* pFrame = new CalibrationFrame();
+	pFrame->Width = geo.Width;
+	pFrame->Height = geo.Height;
+	pFrame->Bin = geo.Bin;
+	pFrame->StartX = geo.StartX;
+	pFrame->StartY = geo.StartY;
+	pFrame->Data.resize(sum.size());
+
+	// back to sensor orientation
+	bool bFlipH = geo.Flip == ASI_FLIP_HORIZ || geo.Flip == ASI_FLIP_BOTH;
+	bool bFlipV = geo.Flip == ASI_FLIP_VERT || geo.Flip == ASI_FLIP_BOTH;
+	float scale = iCount > 0 ? 1.0f / iCount : 0.0f;
+	for (int y = 0; y < geo.Height; y++)
+	{
+		const float* pIn = &sum[(size_t)y * geo.Width];
+		float* pOut = &pFrame->Data[(size_t)(bFlipV ? geo.Height - 1 - y : y) * geo.Width];
+		for (int x = 0; x < geo.Width; x++)
+			pOut[bFlipH ? geo.Width - 1 - x : x] = pIn[x] * scale;
+	}
+	std::vector<float>().swap(sum);
+	return CalibrationFramePtr(pFrame);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Applying
+///////////////////////////////////////////////////////////////////////////////
+
+// offset of the frame ROI inside the master; false when it is not inside
+static CalibrationStatus Locate(const CalibrationFrame& m, const FrameGeometry& geo, int& x0, int& y0)
+{
+	if (m.Bin != geo.Bin)
+		return CAL_BINNING;
+	x0 = geo.StartX - m.StartX;
+	y0 = geo.StartY - m.StartY;
+	if (x0 < 0 || y0 < 0 || x0 + geo.Width > m.Width || y0 + geo.Height > m.Height)
+		return CAL_ROI;
+	return CAL_APPLIED;
+}
+
+// Bayer phase of a master sample, in sensor coordinates
+static inline int Phase(const CalibrationFrame& m, int x, int y)
+{
+	return (((m.StartY + y) & 1) << 1) | ((m.StartX + x) & 1);
+}
+
+PreparedCalibration::PreparedCalibration() :
+	eStatus(CAL_NO_MASTER)
+{
+}
+
+CalibrationStatus PreparedCalibration::Prepare(const CalibrationMastersPtr& masters, const FrameGeometryPtr& geo, bool bBayer)
+{
+	pMasters = masters;
+	pGeometry = geo;
+	std::vector<float>().swap(gain);
+	std::vector<float>().swap(offset);
+
+	const CalibrationFrame* pDark = masters ? masters->Dark.get() : 0;
+	const CalibrationFrame* pFlat = masters ? masters->Flat.get() : 0;
+	if (pDark == 0 && pFlat == 0)
+		return eStatus = CAL_NO_MASTER;
+	if (geo->ImgType != ASI_IMG_RAW8 && geo->ImgType != ASI_IMG_RAW16)
+		return eStatus = CAL_PIXEL_TYPE;
+	int dx0 = 0, dy0 = 0, fx0 = 0, fy0 = 0;
+	if (pDark && (eStatus = Locate(*pDark, *geo, dx0, dy0)) != CAL_APPLIED)
+		return eStatus;
+	if (pFlat && (eStatus = Locate(*pFlat, *geo, fx0, fy0)) != CAL_APPLIED)
+		return eStatus;
+
+	// flat level over the whole master, so every ROI gets the same scale
+	double mean[4] = { 1.0, 1.0, 1.0, 1.0 };
+	if (pFlat)
+	{
+		double sums[4] = { 0.0, 0.0, 0.0, 0.0 };
+		size_t counts[4] = { 0, 0, 0, 0 };
+		for (int y = 0; y < pFlat->Height; y++)
+		{
+			const float* p = pFlat->Samples() + (size_t)y * pFlat->Width;
+			for (int x = 0; x < pFlat->Width; x++)
+			{
+				int ph = bBayer ? Phase(*pFlat, x, y) : 0;
+				sums[ph] += p[x];
+				counts[ph]++;
+			}
+		}
+		for (int i = 0; i < 4; i++)
+		{
+			if (counts[i] > 0 && sums[i] > 0.0)
+				mean[i] = sums[i] / counts[i];
+		}
+	}
+
+	const float* pDarkData = pDark ? pDark->Samples() : 0;
+	const float* pFlatData = pFlat ? pFlat->Samples() : 0;
+	int w = geo->Width, h = geo->Height;
+	bool bFlipH = geo->Flip == ASI_FLIP_HORIZ || geo->Flip == ASI_FLIP_BOTH;
+	bool bFlipV = geo->Flip == ASI_FLIP_VERT || geo->Flip == ASI_FLIP_BOTH;
+	gain.resize((size_t)w * h);
+	offset.resize((size_t)w * h);
+	for (int y = 0; y < h; y++)
+	{
+		int sy = bFlipV ? h - 1 - y : y;
+		float* pGain = &gain[(size_t)y * w];
+		float* pOffset = &offset[(size_t)y * w];
+		for (int x = 0; x < w; x++)
+		{
+			int sx = bFlipH ? w - 1 - x : x;
+			float g = 1.0f;
+			if (pFlat)
+			{
+				float f = pFlatData[(size_t)(fy0 + sy) * pFlat->Width + fx0 + sx];
+				int ph = bBayer ? Phase(*pFlat, fx0 + sx, fy0 + sy) : 0;
+				// dead flat pixels are left alone rather than blown up
+				g = f > 0.0f ? (float)(mean[ph] / f) : 1.0f;
+			}
+			float d = pDark ? pDarkData[(size_t)(dy0 + sy) * pDark->Width + dx0 + sx] : 0.0f;
+			pGain[x] = g;
+			pOffset[x] = -d * g;
+		}
+	}
+	return eStatus = CAL_APPLIED;
+}
+
+void PreparedCalibration::Apply(unsigned char* pFrame, int rowBegin, int rowEnd) const
+{
+	if (eStatus != CAL_APPLIED)
+		return;
+	const PixelKernels& kernels = GetPixelKernels();
+	size_t w = pGeometry->Width;
+	size_t begin = rowBegin * w, samples = (rowEnd - rowBegin) * w;
+	if (pGeometry->SdkPixBytes == 1)
+		kernels.Calibrate8(pFrame + begin, &gain[begin], &offset[begin], samples);
+	else
+		kernels.Calibrate16((unsigned short*)pFrame + begin, &gain[begin], &offset[begin], samples);
+}
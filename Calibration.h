@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          Calibration.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Dark-frame subtraction and flat-field correction of RAW8/RAW16
+//                frames, master frames and their FITS files
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FrameGeometry.h"
+
+class MappedFile;
+
+/**
+* A master dark or flat in SDK units and sensor orientation (flip undone),
+* at the binning and ROI it was taken with. A master applies to every frame
+* of the same binning whose ROI lies inside its own.
+*
+* The samples live in Data, or in a mapped dark library file that stays
+* open as long as the frame does.
+*/
+struct CalibrationFrame
+{
+	int Width, Height, Bin;
+	int StartX, StartY;			// in binned sensor pixels, like FrameGeometry
+	std::vector<float> Data;
+	std::shared_ptr<const MappedFile> pMapping;
+	const float* pMapped;
+
+	CalibrationFrame() : Width(0), Height(0), Bin(1), StartX(0), StartY(0), pMapped(0) {}
+	const float* Samples() const { return pMapped ? pMapped : &Data[0]; }
+};
+typedef std::shared_ptr<const CalibrationFrame> CalibrationFramePtr;
+
+// either may be empty; published as a whole so the insert thread never sees half a change
+struct CalibrationMasters
+{
+	CalibrationFramePtr Dark, Flat;
+};
+typedef std::shared_ptr<const CalibrationMasters> CalibrationMastersPtr;
+
+enum CalibrationStatus
+{
+	CAL_APPLIED = 0,
+	CAL_NO_MASTER,
+	CAL_PIXEL_TYPE,		// only RAW8/RAW16 are calibrated
+	CAL_BINNING,		// master taken at another binning
+	CAL_ROI,			// frame not inside the master
+	CAL_STATUS_NUM
+};
+
+/**
+* 2-D FITS image, BITPIX 8/16/32/-32/-64 with BZERO/BSCALE. Binning and
+* ROI origin come from XBINNING and XORGSUBF/YORGSUBF. Rows are read top
+* down unless ROWORDER says BOTTOM-UP. Returns false and sets error when
+* the file cannot be used.
+*/
+bool LoadCalibrationFrame(const char* path, CalibrationFrame& frame, std::string& error);
+// writes 32-bit float FITS with the keywords LoadCalibrationFrame() reads
+bool SaveCalibrationFrame(const char* path, const CalibrationFrame& frame, const char* imageType);
+
+/**
+* Averages SDK frames of one geometry into a master.
+*/
+class MasterBuilder
+{
+public:
+	MasterBuilder();
+
+	bool Begin(const FrameGeometryPtr& geo);
+	void Add(const unsigned char* pSdk);
+	CalibrationFramePtr Finish();
+
+private:
+	FrameGeometryPtr pGeometry;
+	std::vector<float> sum;		// exact up to 256 frames of 16-bit
+	int iCount;
+};
+
+/**
+* The masters cut and flipped to one frame geometry and folded into
+* raw * gain + offset, gain = mean(flat) / flat and offset = -dark * gain,
+* so applying them is a single streaming pass. Prepared once per geometry
+* and master change. For colour sensors the flat mean is taken per Bayer
+* phase to keep the white balance.
+*
+* The flat is used as given; it should have its own bias or flat-dark
+* removed before it is loaded.
+*/
+class PreparedCalibration
+{
+public:
+	PreparedCalibration();
+
+	CalibrationStatus Prepare(const CalibrationMastersPtr& masters, const FrameGeometryPtr& geo, bool bBayer);
+	bool IsPreparedFor(const CalibrationMastersPtr& masters, const FrameGeometryPtr& geo) const { return pMasters == masters && pGeometry == geo; }
+	CalibrationStatus GetStatus() const { return eStatus; }
+
+	// rows [rowBegin, rowEnd) of an SDK frame of the prepared geometry, in place
+	void Apply(unsigned char* pFrame, int rowBegin, int rowEnd) const;
+
+private:
+	CalibrationMastersPtr pMasters;
+	FrameGeometryPtr pGeometry;
+	CalibrationStatus eStatus;
+	std::vector<float> gain, offset;
+};
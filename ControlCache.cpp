@@ -0,0 +1,186 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ControlCache.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Cache of SDK control values, kept current by writes through it
+//                and by a low-priority poller at per-control rates
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "ControlCache.h"
+
+#include <chrono>
+
+#ifdef _WINDOWS
+#include <windows.h>
+#endif
+
+// the poller looks for due controls at least this often
+static const int g_PollTickMs = 100;
+
+static long long NowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long long Pack(long lVal, ASI_BOOL bAuto)
+{
+	return (long long)lVal * 2 + (bAuto == ASI_TRUE ? 1 : 0);
+}
+
+ControlCache::ControlCache() :
+	iCameraId(-1),
+	lWrites(0),
+	bQuit(false),
+	thread(0)
+{
+	for (int i = 0; i < MAX_CONTROLS; i++)
+	{
+		entries[i].packed.store(0, std::memory_order_relaxed);
+		entries[i].readUs.store(0, std::memory_order_relaxed);
+		entries[i].pollMs.store(0, std::memory_order_relaxed);
+	}
+}
+
+ControlCache::~ControlCache()
+{
+	Stop();
+}
+
+void ControlCache::Start(int cameraId, const ASI_CONTROL_CAPS* pCaps, int num)
+{
+	Stop();
+	iCameraId = cameraId;
+	for (int i = 0; i < MAX_CONTROLS; i++)
+		entries[i].readUs.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < num; i++)
+	{
+		if (IsValid(pCaps[i].ControlType))
+			Refresh(pCaps[i].ControlType, -1);
+	}
+	bQuit = false;
+	thread = new ControlPollThread(this);
+	thread->activate();
+}
+
+void ControlCache::Stop()
+{
+	if (thread == 0)
+		return;
+	{
+		std::lock_guard<std::mutex> g(lock);
+		bQuit = true;
+	}
+	wake.notify_all();
+	thread->wait();
+	delete thread;
+	thread = 0;
+}
+
+void ControlCache::SetPollInterval(ASI_CONTROL_TYPE type, int ms)
+{
+	if (IsValid(type))
+		entries[type].pollMs.store(ms, std::memory_order_relaxed);
+}
+
+ASI_ERROR_CODE ControlCache::Get(ASI_CONTROL_TYPE type, long* pVal, ASI_BOOL* pAuto) const
+{
+	if (!IsValid(type) || entries[type].readUs.load(std::memory_order_acquire) == 0)
+	{
+		*pVal = 0;
+		*pAuto = ASI_FALSE;
+		return ASI_ERROR_INVALID_CONTROL_TYPE;
+	}
+	long long p = entries[type].packed.load(std::memory_order_relaxed);
+	*pAuto = (p & 1) ? ASI_TRUE : ASI_FALSE;
+	*pVal = (long)((p - (p & 1)) / 2);
+	return ASI_SUCCESS;
+}
+
+/**
+* The write count goes up between the SDK write and the read back, so a
+* poller read that may have been answered before the write is dropped or
+* overwritten; see Refresh().
+*/
+ASI_ERROR_CODE ControlCache::Set(ASI_CONTROL_TYPE type, long lVal, ASI_BOOL bAuto)
+{
+	ASI_ERROR_CODE err = ASISetControlValue(iCameraId, type, lVal, bAuto);
+	lWrites.fetch_add(1, std::memory_order_acq_rel);
+	if (IsValid(type) && entries[type].readUs.load(std::memory_order_relaxed) != 0)
+		Refresh(type, -1);
+	return err;
+}
+
+double ControlCache::GetAgeMs(ASI_CONTROL_TYPE type) const
+{
+	long long readUs = IsValid(type) ? entries[type].readUs.load(std::memory_order_acquire) : 0;
+	return readUs ? (NowUs() - readUs) / 1000.0 : -1;
+}
+
+/**
+* Reads a control from the SDK into the cache. The poller passes the write
+* count from before its read and drops the value when a Set() came in
+* since: the read may predate that write, and Set() reads the control
+* back itself. If the count is still the same under storeLock, that read
+* back has not been stored yet and will land after this value.
+*/
+void ControlCache::Refresh(int type, long writesBefore)
+{
+	long lVal;
+	ASI_BOOL bAuto;
+	if (ASIGetControlValue(iCameraId, (ASI_CONTROL_TYPE)type, &lVal, &bAuto) != ASI_SUCCESS)
+		return;
+	std::lock_guard<std::mutex> g(storeLock);
+	if (writesBefore >= 0 && lWrites.load(std::memory_order_acquire) != writesBefore)
+		return;
+	entries[type].packed.store(Pack(lVal, bAuto), std::memory_order_relaxed);
+	entries[type].readUs.store(NowUs(), std::memory_order_release);
+}
+
+void ControlCache::PollLoop()
+{
+	std::unique_lock<std::mutex> g(lock);
+	while (!bQuit)
+	{
+		g.unlock();
+		long long now = NowUs();
+		for (int i = 0; i < MAX_CONTROLS; i++)
+		{
+			long long readUs = entries[i].readUs.load(std::memory_order_relaxed);
+			if (readUs == 0)
+				continue;
+			int ms = entries[i].pollMs.load(std::memory_order_relaxed);
+			if (entries[i].packed.load(std::memory_order_relaxed) & 1)
+				ms = ms > 0 && ms < AUTO_POLL_MS ? ms : AUTO_POLL_MS;
+			if (ms > 0 && now - readUs >= ms * 1000LL)
+				Refresh(i, lWrites.load(std::memory_order_acquire));
+		}
+		g.lock();
+		if (!bQuit)
+			wake.wait_for(g, std::chrono::milliseconds(g_PollTickMs));
+	}
+}
+
+int ControlPollThread::svc(void) throw()
+{
+	// telemetry only, behind the grab and insert threads
+#ifdef _WINDOWS
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#endif
+	cache_->PollLoop();
+	return 0;
+}
@@ -0,0 +1,108 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ControlCache.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Cache of SDK control values, kept current by writes through it
+//                and by a low-priority poller at per-control rates
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "ASICamera2.h"
+#include "DeviceThreads.h"
+
+class ControlPollThread;
+
+/**
+* ASIGetControlValue() without the USB round trip. Start() reads every
+* control the camera has once; after that a value changes in the cache
+* when it is written through Set(), which reads the control back since
+* the SDK clamps, and when the poller refreshes it. Controls with a poll
+* interval are refreshed at that rate, controls in auto mode every
+* AUTO_POLL_MS, all others only on writes.
+*
+* Values are packed with their auto flag into one atomic, Get() may run
+* on any thread.
+*/
+class ControlCache
+{
+public:
+	static const int AUTO_POLL_MS = 1000;
+
+	ControlCache();
+	~ControlCache();
+
+	void Start(int cameraId, const ASI_CONTROL_CAPS* pCaps, int num);
+	// before the camera is closed
+	void Stop();
+
+	// 0: refreshed on writes only, unless in auto mode
+	void SetPollInterval(ASI_CONTROL_TYPE type, int ms);
+
+	// same contract as the SDK calls; Get() fails for controls the camera does not have
+	ASI_ERROR_CODE Get(ASI_CONTROL_TYPE type, long* pVal, ASI_BOOL* pAuto) const;
+	ASI_ERROR_CODE Set(ASI_CONTROL_TYPE type, long lVal, ASI_BOOL bAuto);
+
+	// time since the value was last read from the SDK, -1 for none
+	double GetAgeMs(ASI_CONTROL_TYPE type) const;
+
+	// Set() calls so far; unchanged means no control was written in between
+	long GetWriteCount() const { return lWrites.load(std::memory_order_acquire); }
+
+private:
+	ControlCache(const ControlCache&);
+	ControlCache& operator=(const ControlCache&);
+
+	static const int MAX_CONTROLS = 64;
+
+	struct Entry
+	{
+		std::atomic<long long> packed;		// value * 2 + auto
+		std::atomic<long long> readUs;		// steady clock, 0 while not present
+		std::atomic<int> pollMs;
+	};
+
+	friend class ControlPollThread;
+	void PollLoop();
+	void Refresh(int type, long writesBefore);
+	static bool IsValid(int type) { return type >= 0 && type < MAX_CONTROLS; }
+
+	Entry entries[MAX_CONTROLS];
+	int iCameraId;
+	std::atomic<long> lWrites;
+	std::mutex storeLock;			// a poller store and the write count check before it
+
+	std::mutex lock;
+	std::condition_variable wake;
+	bool bQuit;
+	ControlPollThread* thread;
+};
+
+class ControlPollThread : public MMDeviceThreadBase
+{
+public:
+	ControlPollThread(ControlCache* pCache) : cache_(pCache) {}
+
+private:
+	int svc(void) throw();
+	ControlCache* cache_;
+};
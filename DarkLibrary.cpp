@@ -0,0 +1,460 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          DarkLibrary.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   On-disk library of master darks, memory-mapped and selected
+//                by camera settings
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "DarkLibrary.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WINDOWS
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// header of a library file; the samples start at g_DarkDataOffset
+struct DarkFileHeader
+{
+	char Magic[8];
+	int Version;
+	int Width, Height, Bin;
+	int StartX, StartY;
+	int ImgType;
+	int Gain, Offset;
+	int Temperature;
+	long long Exposure;
+	char Camera[64];
+};
+
+static const char g_DarkMagic[8] = "ASIDARK";
+static const int g_DarkVersion = 1;
+static const size_t g_DarkDataOffset = 4096;
+static const size_t g_DarkCacheSize = 4;
+
+///////////////////////////////////////////////////////////////////////////////
+// MappedFile
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WINDOWS
+
+MappedFile::MappedFile() :
+	hFile(INVALID_HANDLE_VALUE),
+	hMapping(0),
+	pData(0),
+	nSize(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	if (pData != 0)
+		UnmapViewOfFile(pData);
+	if (hMapping != 0)
+		CloseHandle(hMapping);
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+}
+
+bool MappedFile::Open(const char* path)
+{
+	hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0)
+		return false;
+	hMapping = CreateFileMappingA(hFile, 0, PAGE_READONLY, 0, 0, 0);
+	if (hMapping == 0)
+		return false;
+	pData = (const unsigned char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	nSize = (size_t)size.QuadPart;
+	return pData != 0;
+}
+
+// PrefetchVirtualMemory is Windows 8 and later, looked up so Windows 7 still loads the DLL
+struct PrefetchRange
+{
+	void* VirtualAddress;
+	SIZE_T NumberOfBytes;
+};
+typedef BOOL (WINAPI* PrefetchFunc)(HANDLE, ULONG_PTR, PrefetchRange*, ULONG);
+
+void MappedFile::Prefetch() const
+{
+	static PrefetchFunc pPrefetch = (PrefetchFunc)GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+	if (pPrefetch == 0 || pData == 0)
+		return;
+	PrefetchRange range;
+	range.VirtualAddress = (void*)pData;
+	range.NumberOfBytes = nSize;
+	pPrefetch(GetCurrentProcess(), 1, &range, 0);
+}
+
+#else
+
+MappedFile::MappedFile() :
+	fd(-1),
+	pData(0),
+	nSize(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	if (pData != 0)
+		munmap((void*)pData, nSize);
+	if (fd >= 0)
+		close(fd);
+}
+
+bool MappedFile::Open(const char* path)
+{
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+		return false;
+	void* p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return false;
+	pData = (const unsigned char*)p;
+	nSize = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::Prefetch() const
+{
+	if (pData != 0)
+		madvise((void*)pData, nSize, MADV_WILLNEED);
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// DarkLibrary
+///////////////////////////////////////////////////////////////////////////////
+
+static std::vector<std::string> ListFiles(const std::string& dir, const char* ext)
+{
+	std::vector<std::string> names;
+	size_t extLen = strlen(ext);
+#ifdef _WINDOWS
+	WIN32_FIND_DATAA fd;
+	HANDLE h = FindFirstFileA((dir + "\\*" + ext).c_str(), &fd);
+	if (h == INVALID_HANDLE_VALUE)
+		return names;
+	do
+	{
+		if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			names.push_back(fd.cFileName);
+	} while (FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	DIR* pDir = opendir(dir.c_str());
+	if (pDir == 0)
+		return names;
+	while (struct dirent* pEnt = readdir(pDir))
+	{
+		size_t len = strlen(pEnt->d_name);
+		if (len > extLen && strcmp(pEnt->d_name + len - extLen, ext) == 0)
+			names.push_back(pEnt->d_name);
+	}
+	closedir(pDir);
+#endif
+	return names;
+}
+
+static bool DirExists(const std::string& dir)
+{
+#ifdef _WINDOWS
+	DWORD attr = GetFileAttributesA(dir.c_str());
+	return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+static std::string JoinPath(const std::string& dir, const std::string& name)
+{
+#ifdef _WINDOWS
+	return dir + "\\" + name;
+#else
+	return dir + "/" + name;
+#endif
+}
+
+// replaces to by from in one step; a mapping of the old file keeps its
+// pages on POSIX, Windows refuses while the old file is mapped
+static bool RenameOver(const std::string& from, const std::string& to)
+{
+#ifdef _WINDOWS
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+DarkLibrary::DarkLibrary() :
+	lTempStep(20),
+	lHits(0),
+	lMisses(0)
+{
+}
+
+/**
+* Indexes the *.asidark files of dir from their headers; no sample data is
+* read. Returns the number of entries, -1 if dir is not a directory.
+*/
+int DarkLibrary::Open(const char* dir)
+{
+	Close();
+	if (!DirExists(dir))
+		return -1;
+	sDir = dir;
+
+	std::vector<std::string> names = ListFiles(sDir, ".asidark");
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		FILE* fp = fopen(JoinPath(sDir, names[i]).c_str(), "rb");
+		if (fp == 0)
+			continue;
+		DarkFileHeader hdr;
+		bool bOk = fread(&hdr, sizeof(hdr), 1, fp) == 1;
+		fseek(fp, 0, SEEK_END);
+		long long size = ftell(fp);
+		fclose(fp);
+		if (!bOk || memcmp(hdr.Magic, g_DarkMagic, sizeof(g_DarkMagic)) != 0 || hdr.Version != g_DarkVersion
+			|| hdr.Width <= 0 || hdr.Height <= 0
+			|| size < (long long)(g_DarkDataOffset + (size_t)hdr.Width * hdr.Height * sizeof(float)))
+			continue;
+
+		Entry e;
+		hdr.Camera[sizeof(hdr.Camera) - 1] = 0;
+		e.Key.Camera = hdr.Camera;
+		e.Key.Exposure = (long)hdr.Exposure;
+		e.Key.Gain = hdr.Gain;
+		e.Key.Offset = hdr.Offset;
+		e.Key.Bin = hdr.Bin;
+		e.Key.ImgType = hdr.ImgType;
+		e.Key.Temperature = hdr.Temperature;
+		e.Name = names[i];
+		e.Width = hdr.Width;
+		e.Height = hdr.Height;
+		e.StartX = hdr.StartX;
+		e.StartY = hdr.StartY;
+		entries.push_back(e);
+	}
+	return (int)entries.size();
+}
+
+void DarkLibrary::Close()
+{
+	sDir.clear();
+	entries.clear();
+	cache.clear();
+}
+
+double DarkLibrary::Cost(const DarkKey& a, const DarkKey& b) const
+{
+	double expA = a.Exposure > 0 ? (double)a.Exposure : 1.0;
+	double expB = b.Exposure > 0 ? (double)b.Exposure : 1.0;
+	long bucketA = (long)floor((double)a.Temperature / lTempStep + 0.5);
+	long bucketB = (long)floor((double)b.Temperature / lTempStep + 0.5);
+	return fabs(log(expA / expB) / log(2.0))
+		+ labs(a.Gain - b.Gain) / 10.0
+		+ labs(a.Offset - b.Offset) / 10.0
+		+ labs(bucketA - bucketB);
+}
+
+/**
+* Nearest dark for key that covers the ROI of geo, with its file name;
+* empty when the library has none.
+*/
+CalibrationFramePtr DarkLibrary::Select(const DarkKey& key, const FrameGeometry& geo, std::string& name)
+{
+	const Entry* pBest = 0;
+	double best = 0.0;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const Entry& e = entries[i];
+		if (e.Key.Camera != key.Camera || e.Key.Bin != key.Bin || e.Key.ImgType != key.ImgType)
+			continue;
+		int x0 = geo.StartX - e.StartX, y0 = geo.StartY - e.StartY;
+		if (x0 < 0 || y0 < 0 || x0 + geo.Width > e.Width || y0 + geo.Height > e.Height)
+			continue;
+		double cost = Cost(key, e.Key);
+		if (pBest == 0 || cost < best)
+		{
+			pBest = &e;
+			best = cost;
+		}
+	}
+	if (pBest == 0)
+	{
+		name.clear();
+		return CalibrationFramePtr();
+	}
+	name = pBest->Name;
+	return Map(*pBest);
+}
+
+// from the cache, or mapped with a prefetch hint so the pages come in
+// before the insert thread prepares the calibration
+CalibrationFramePtr DarkLibrary::Map(const Entry& entry)
+{
+	std::list<std::pair<std::string, CalibrationFramePtr> >::iterator it;
+	for (it = cache.begin(); it != cache.end(); ++it)
+	{
+		if (it->first == entry.Name)
+		{
+			lHits++;
+			cache.splice(cache.begin(), cache, it);
+			return cache.front().second;
+		}
+	}
+	lMisses++;
+
+	std::shared_ptr<MappedFile> pFile(new MappedFile());
+	if (!pFile->Open(JoinPath(sDir, entry.Name).c_str())
+		|| pFile->GetSize() < g_DarkDataOffset + (size_t)entry.Width * entry.Height * sizeof(float))
+		return CalibrationFramePtr();
+	pFile->Prefetch();
+
+	CalibrationFrame* pFrame = new CalibrationFrame();
+	pFrame->Width = entry.Width;
+	pFrame->Height = entry.Height;
+	pFrame->Bin = entry.Key.Bin;
+	pFrame->StartX = entry.StartX;
+	pFrame->StartY = entry.StartY;
+	pFrame->pMapping = pFile;
+	pFrame->pMapped = (const float*)(pFile->GetData() + g_DarkDataOffset);
+	CalibrationFramePtr frame(pFrame);
+
+	cache.push_front(std::make_pair(entry.Name, frame));
+	if (cache.size() > g_DarkCacheSize)
+		cache.pop_back();
+	return frame;
+}
+
+/**
+* Writes dark into the library under a name made from key, replacing a
+* file of the same settings, and indexes it. The file is written under a
+* temporary name and renamed over the old one, which may be mapped: the
+* caller drops its own frames of that file first, the cache entry goes
+* here.
+*/
+bool DarkLibrary::Add(const DarkKey& key, const CalibrationFramePtr& dark, std::string& name)
+{
+	if (!IsOpen())
+		return false;
+
+	std::string camera = key.Camera;
+	for (size_t i = 0; i < camera.size(); i++)
+	{
+		char c = camera[i];
+		if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '-'))
+			camera[i] = '_';
+	}
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%s_type%d_bin%d_exp%ldus_gain%ld_off%ld_temp%ld.asidark",
+		camera.c_str(), key.ImgType, key.Bin, key.Exposure, key.Gain, key.Offset, key.Temperature);
+	name = buf;
+
+	DarkFileHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.Magic, g_DarkMagic, sizeof(g_DarkMagic));
+	hdr.Version = g_DarkVersion;
+	hdr.Width = dark->Width;
+	hdr.Height = dark->Height;
+	hdr.Bin = dark->Bin;
+	hdr.StartX = dark->StartX;
+	hdr.StartY = dark->StartY;
+	hdr.ImgType = key.ImgType;
+	hdr.Gain = (int)key.Gain;
+	hdr.Offset = (int)key.Offset;
+	hdr.Temperature = (int)key.Temperature;
+	hdr.Exposure = key.Exposure;
+	strncpy(hdr.Camera, key.Camera.c_str(), sizeof(hdr.Camera) - 1);
+
+	std::vector<char> head(g_DarkDataOffset, 0);
+	memcpy(&head[0], &hdr, sizeof(hdr));
+	size_t bytes = (size_t)dark->Width * dark->Height * sizeof(float);
+	std::string path = JoinPath(sDir, name);
+	std::string tmpPath = path + ".tmp";
+	FILE* fp = fopen(tmpPath.c_str(), "wb");
+	if (fp == 0)
+		return false;
+	bool bOk = fwrite(&head[0], 1, head.size(), fp) == head.size();
+	bOk = bOk && fwrite(dark->Samples(), 1, bytes, fp) == bytes;
+	if (fclose(fp) != 0 || !bOk)
+	{
+		remove(tmpPath.c_str());
+		return false;
+	}
+
+	// a mapping of the old file must not be reused, nor keep it open
+	std::list<std::pair<std::string, CalibrationFramePtr> >::iterator it;
+	for (it = cache.begin(); it != cache.end(); ++it)
+	{
+		if (it->first == name)
+		{
+			cache.erase(it);
+			break;
+		}
+	}
+	if (!RenameOver(tmpPath, path))
+	{
+		remove(tmpPath.c_str());
+		return false;
+	}
+
+	Entry e;
+	e.Key = key;
+	e.Name = name;
+	e.Width = dark->Width;
+	e.Height = dark->Height;
+	e.StartX = dark->StartX;
+	e.StartY = dark->StartY;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].Name == name)
+		{
+			entries.erase(entries.begin() + i);
+			break;
+		}
+	}
+	entries.push_back(e);
+
+	// the new dark is already in memory
+	cache.push_front(std::make_pair(name, dark));
+	if (cache.size() > g_DarkCacheSize)
+		cache.pop_back();
+	return true;
+}
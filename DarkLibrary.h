@@ -0,0 +1,119 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          DarkLibrary.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   On-disk library of master darks, memory-mapped and selected
+//                by camera settings
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Calibration.h"
+
+/**
+* Read-only view of a whole file. The pages are read on first touch;
+* Prefetch() asks the OS to start reading them in the background.
+*/
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char* path);
+	const unsigned char* GetData() const { return pData; }
+	size_t GetSize() const { return nSize; }
+	void Prefetch() const;
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+#ifdef _WINDOWS
+	void* hFile;
+	void* hMapping;
+#else
+	int fd;
+#endif
+	const unsigned char* pData;
+	size_t nSize;
+};
+
+// settings a dark was taken with
+struct DarkKey
+{
+	std::string Camera;			// serial number, the model name if it has none
+	long Exposure;				// us, as ASI_EXPOSURE
+	long Gain, Offset;			// ASI_GAIN, ASI_BRIGHTNESS
+	int Bin;
+	int ImgType;				// ASI_IMG_TYPE
+	long Temperature;			// ASI_TEMPERATURE, 0.1 C
+};
+
+/**
+* A directory of *.asidark files: a fixed header with the DarkKey and the
+* ROI, then the float samples in native byte order at a page boundary, so
+* a master is used straight from the mapping.
+*
+* Select() only considers entries of the same camera, binning and pixel
+* type that cover the ROI, and picks the one with the lowest cost:
+* a factor of 2 in exposure, 10 gain or offset units and one temperature
+* step each cost 1. The chosen file is mapped on first use and kept in a
+* small cache; hits and misses of that cache are counted.
+*
+* Only used from the MMCore thread.
+*/
+class DarkLibrary
+{
+public:
+	DarkLibrary();
+
+	int Open(const char* dir);
+	void Close();
+	bool IsOpen() const { return !sDir.empty(); }
+	void SetTemperatureStep(long step) { lTempStep = step > 0 ? step : 1; }
+
+	CalibrationFramePtr Select(const DarkKey& key, const FrameGeometry& geo, std::string& name);
+	bool Add(const DarkKey& key, const CalibrationFramePtr& dark, std::string& name);
+
+	int GetEntries() const { return (int)entries.size(); }
+	long GetHits() const { return lHits; }
+	long GetMisses() const { return lMisses; }
+
+private:
+	struct Entry
+	{
+		DarkKey Key;
+		std::string Name;
+		int Width, Height, StartX, StartY;
+	};
+	double Cost(const DarkKey& a, const DarkKey& b) const;
+	CalibrationFramePtr Map(const Entry& entry);
+
+	std::string sDir;
+	std::vector<Entry> entries;
+	std::list<std::pair<std::string, CalibrationFramePtr> > cache;//most recent first
+	long lTempStep;
+	long lHits, lMisses;
+};
@@ -0,0 +1,241 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          Debayer.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Host-side demosaicing of RAW8/RAW16 Bayer frames into the
+//                BGRA layout MMCore uses for RGB32/RGB64
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "Debayer.h"
+#include "PixelKernels.h"
+
+#include <cstdlib>
+#include <vector>
+
+// mirrors around the border pixel, which keeps the Bayer phase for
+// offsets up to 2
+static int Reflect(int i, int n)
+{
+	if (i < 0)
+		i = -i;
+	if (i >= n)
+		i = 2 * (n - 1) - i;
+	if (i < 0)
+		i = 0;
+	if (i >= n)
+		i = n - 1;
+	return i;
+}
+
+// column index table for x in [-2, w + 2), so the pixel loops carry no
+// border branches
+static void ReflectTable(std::vector<int>& table, int w)
+{
+	table.resize(w + 4);
+	for (int x = -2; x < w + 2; x++)
+		table[x + 2] = Reflect(x, w);
+}
+
+static inline int Clamp(int v, int maxV)
+{
+	return v < 0 ? 0 : (v > maxV ? maxV : v);
+}
+
+template <class T>
+static inline void Store(T* pOut, unsigned R, unsigned G, unsigned B)
+{
+	pOut[0] = (T)B;
+	pOut[1] = (T)G;
+	pOut[2] = (T)R;
+	pOut[3] = 0;
+}
+
+static inline void BilinearPairs(const PixelKernels& kernels, const unsigned char* pN, const unsigned char* pC, const unsigned char* pS, unsigned char* pOut, size_t pairs, bool bRedRow)
+{
+	kernels.BilinearPairs8(pN, pC, pS, pOut, pairs, bRedRow);
+}
+
+static inline void BilinearPairs(const PixelKernels& kernels, const unsigned short* pN, const unsigned short* pC, const unsigned short* pS, unsigned short* pOut, size_t pairs, bool bRedRow)
+{
+	kernels.BilinearPairs16(pN, pC, pS, pOut, pairs, bRedRow);
+}
+
+// any site, neighbours l/r already reflected; used for the border columns
+template <class T>
+static void BilinearPixel(const T* pN, const T* pC, const T* pS, int x, int l, int r, bool bRedRow, bool bRedCol, T* pOut)
+{
+	unsigned c = pC[x];
+	if (bRedRow == bRedCol)
+	{
+		unsigned cross = (pN[x] + pS[x] + pC[l] + pC[r] + 2) >> 2;
+		unsigned diag = (pN[l] + pN[r] + pS[l] + pS[r] + 2) >> 2;
+		Store(pOut, bRedRow ? c : diag, cross, bRedRow ? diag : c);
+	}
+	else
+	{
+		unsigned horz = (pC[l] + pC[r] + 1) >> 1;
+		unsigned vert = (pN[x] + pS[x] + 1) >> 1;
+		Store(pOut, bRedRow ? horz : vert, c, bRedRow ? vert : horz);
+	}
+}
+
+/**
+* Interior pixels go to the BilinearPairs kernel a red/blue site and a
+* green site at a time, so it has no per-pixel site test and no border
+* handling.
+*/
+template <class T>
+static void BilinearRows(const DebayerJob& job, int rowBegin, int rowEnd)
+{
+	int w = job.Width, h = job.Height;
+	const T* pSrc = (const T*)job.pSrc;
+	const PixelKernels& kernels = GetPixelKernels();
+	std::vector<int> table;
+	ReflectTable(table, w);
+	const int* xs = &table[2];
+
+	for (int y = rowBegin; y < rowEnd; y++)
+	{
+		const T* pN = pSrc + (size_t)Reflect(y - 1, h) * w;
+		const T* pC = pSrc + (size_t)y * w;
+		const T* pS = pSrc + (size_t)Reflect(y + 1, h) * w;
+		T* pOut = (T*)job.pDst + (size_t)y * w * 4;
+		bool bRedRow = ((y ^ job.RedY) & 1) == 0;
+
+		// the first and last column go through the reflect table, the
+		// interior in pairs of one red/blue-column and one green-column site
+		int phase = (job.RedX ^ (bRedRow ? 0 : 1)) & 1;	// first x of a colour site pair
+		int x = 0;
+		for (; x < w && (x < 1 || ((x ^ phase) & 1) != 0); x++)
+			BilinearPixel(pN, pC, pS, x, xs[x - 1], xs[x + 1], bRedRow, ((x ^ job.RedX) & 1) == 0, pOut + x * 4);
+		// every pair reads one column past its green site
+		int pairs = x + 2 < w ? (w - x - 1) / 2 : 0;
+		BilinearPairs(kernels, pN + x, pC + x, pS + x, pOut + x * 4, pairs, bRedRow);
+		x += pairs * 2;
+		for (; x < w; x++)
+			BilinearPixel(pN, pC, pS, x, xs[x - 1], xs[x + 1], bRedRow, ((x ^ job.RedX) & 1) == 0, pOut + x * 4);
+	}
+}
+
+/**
+* Green for one source row: at red and blue sites it is interpolated along
+* the direction with the smaller gradient, corrected by the Laplacian of
+* the site's own colour (Hamilton-Adams).
+*/
+template <class T>
+static void GreenRow(const DebayerJob& job, const int* xs, int y, int* pG)
+{
+	int w = job.Width, h = job.Height;
+	int maxV = (int)(T)~0;
+	const T* pSrc = (const T*)job.pSrc;
+	const T* pNN = pSrc + (size_t)Reflect(y - 2, h) * w;
+	const T* pN = pSrc + (size_t)Reflect(y - 1, h) * w;
+	const T* pC = pSrc + (size_t)Reflect(y, h) * w;
+	const T* pS = pSrc + (size_t)Reflect(y + 1, h) * w;
+	const T* pSS = pSrc + (size_t)Reflect(y + 2, h) * w;
+	// first red or blue column of this row; green sites sit in between
+	int site = (Reflect(y, h) ^ job.RedY ^ job.RedX) & 1;
+
+	for (int x = site ^ 1; x < w; x += 2)
+		pG[x] = pC[x];
+	for (int x = site; x < w; x += 2)
+	{
+		int c = pC[x];
+		int l = xs[x - 1], r = xs[x + 1], ll = xs[x - 2], rr = xs[x + 2];
+		int lapH = 2 * c - pC[ll] - pC[rr];
+		int lapV = 2 * c - pNN[x] - pSS[x];
+		int dH = abs(pC[l] - pC[r]) + abs(lapH);
+		int dV = abs(pN[x] - pS[x]) + abs(lapV);
+		int gH = (2 * (pC[l] + pC[r]) + lapH + 2) >> 2;
+		int gV = (2 * (pN[x] + pS[x]) + lapV + 2) >> 2;
+		int g = dH < dV ? gH : (dV < dH ? gV : (gH + gV + 1) >> 1);
+		pG[x] = Clamp(g, maxV);
+	}
+}
+
+/**
+* Red and blue are interpolated as differences to the full green plane,
+* which follows edges instead of averaging across them.
+*/
+template <class T>
+static void EdgeAwareRows(const DebayerJob& job, int rowBegin, int rowEnd)
+{
+	int w = job.Width, h = job.Height;
+	int maxV = (int)(T)~0;
+	const T* pSrc = (const T*)job.pSrc;
+	std::vector<int> table;
+	ReflectTable(table, w);
+	const int* xs = &table[2];
+
+	// green for the stripe plus one halo row on each side
+	int rows = rowEnd - rowBegin + 2;
+	std::vector<int> green((size_t)rows * w);
+	for (int i = 0; i < rows; i++)
+		GreenRow<T>(job, xs, rowBegin - 1 + i, &green[(size_t)i * w]);
+
+	for (int y = rowBegin; y < rowEnd; y++)
+	{
+		const T* pN = pSrc + (size_t)Reflect(y - 1, h) * w;
+		const T* pC = pSrc + (size_t)y * w;
+		const T* pS = pSrc + (size_t)Reflect(y + 1, h) * w;
+		const int* gN = &green[(size_t)(y - rowBegin) * w];
+		const int* gC = gN + w;
+		const int* gS = gC + w;
+		T* pOut = (T*)job.pDst + (size_t)y * w * 4;
+		bool bRedRow = ((y ^ job.RedY) & 1) == 0;
+		int site = (y ^ job.RedY ^ job.RedX) & 1;
+
+		// red or blue sites: the other of the two from the diagonals
+		for (int x = site; x < w; x += 2)
+		{
+			int l = xs[x - 1], r = xs[x + 1];
+			int c = pC[x];
+			int g = gC[x];
+			int o = Clamp(g + (((pN[l] - gN[l]) + (pN[r] - gN[r]) + (pS[l] - gS[l]) + (pS[r] - gS[r]) + 2) >> 2), maxV);
+			Store(pOut + x * 4, bRedRow ? c : o, g, bRedRow ? o : c);
+		}
+		// green sites: the row's colour from left/right, the other from above/below
+		for (int x = site ^ 1; x < w; x += 2)
+		{
+			int l = xs[x - 1], r = xs[x + 1];
+			int g = gC[x];
+			int hz = Clamp(g + (((pC[l] - gC[l]) + (pC[r] - gC[r]) + 1) >> 1), maxV);
+			int vt = Clamp(g + (((pN[x] - gN[x]) + (pS[x] - gS[x]) + 1) >> 1), maxV);
+			Store(pOut + x * 4, bRedRow ? hz : vt, g, bRedRow ? vt : hz);
+		}
+	}
+}
+
+void DebayerRows(void* pJob, int rowBegin, int rowEnd)
+{
+	const DebayerJob& job = *(const DebayerJob*)pJob;
+	if (job.Algorithm == DEBAYER_EDGE_AWARE)
+	{
+		if (job.Bytes == 1)
+			EdgeAwareRows<unsigned char>(job, rowBegin, rowEnd);
+		else
+			EdgeAwareRows<unsigned short>(job, rowBegin, rowEnd);
+	}
+	else
+	{
+		if (job.Bytes == 1)
+			BilinearRows<unsigned char>(job, rowBegin, rowEnd);
+		else
+			BilinearRows<unsigned short>(job, rowBegin, rowEnd);
+	}
+}
@@ -0,0 +1,49 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          Debayer.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Host-side demosaicing of RAW8/RAW16 Bayer frames into the
+//                BGRA layout MMCore uses for RGB32/RGB64
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+enum DebayerAlgorithm
+{
+	DEBAYER_BILINEAR = 0,
+	DEBAYER_EDGE_AWARE		// Hamilton-Adams green, colour differences for red/blue
+};
+
+/**
+* One frame to demosaic. Bytes is 1 (RAW8 -> 8-bit BGRA) or 2 (RAW16 ->
+* 16-bit BGRA); alpha is written as 0 like the RGB24 expansion does.
+* RedX/RedY give the red site within a 2x2 cell of this frame, i.e. after
+* ROI offset and flip have been taken into account.
+*/
+struct DebayerJob
+{
+	const unsigned char* pSrc;
+	unsigned char* pDst;
+	int Width, Height;
+	int Bytes;
+	int RedX, RedY;
+	DebayerAlgorithm Algorithm;
+};
+
+// demosaics rows [rowBegin, rowEnd), matches WorkerPool::StripeFunc
+void DebayerRows(void* pJob, int rowBegin, int rowEnd);
@@ -0,0 +1,57 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameGeometry.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Immutable snapshot of the frame geometry and pixel format
+//                the camera is currently configured for
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <memory>
+
+#include "ASICamera2.h"
+
+/**
+* Published by SetROI, ClearROI, OnBinning, OnPixelType, OnFlip and the
+* software binning handlers after the SDK accepted the change. Never modified after publication, so the grab and
+* insert threads can hold on to it for the lifetime of a frame.
+*/
+struct FrameGeometry
+{
+	int Width, Height, Bin;		// ROI as reported by ASIGetROIFormat
+	int StartX, StartY;			// ASIGetStartPos, in binned sensor pixels
+	ASI_IMG_TYPE ImgType;
+	ASI_FLIP_STATUS Flip;
+	bool b12RAW, bRGB48;
+	int PixBytes, Components;	// of the image handed to MMCore
+	int SdkPixBytes;			// of the image as the SDK delivers it
+	int SoftBin;				// software binning on top of Bin, 1 when off
+	bool bSoftBinAverage, bSoftBinWiden;
+	int ImageWidth, ImageHeight;// of the image handed to MMCore
+	bool bDebayer;				// RAW from the SDK, RGB demosaiced on the host
+	int DebayerAlgo;			// DebayerAlgorithm
+	int RedX, RedY;				// red site of the delivered frame, after ROI offset and flip
+
+	unsigned long SdkFrameSize() const { return (unsigned long)Width * Height * SdkPixBytes; }
+	unsigned long FrameSize() const { return (unsigned long)ImageWidth * ImageHeight * PixBytes; }
+	// true when the SDK buffer can be handed to MMCore as is
+	bool IsPassThrough() const { return SoftBin == 1 && !bDebayer && ImgType != ASI_IMG_RGB24 && !(ImgType == ASI_IMG_RAW16 && b12RAW); }
+};
+
+typedef std::shared_ptr<const FrameGeometry> FrameGeometryPtr;
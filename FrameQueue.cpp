@@ -0,0 +1,170 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameQueue.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Bounded single-producer/single-consumer queue of preallocated
+//                frame buffers between the SDK grab thread and the MMCore
+//                insert thread
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "FrameQueue.h"
+
+#include <chrono>
+#include <new>
+
+FrameQueue::FrameQueue() :
+	lFrameSize(0),
+	head(0),
+	tail(0),
+	iHighWater(0),
+	bConsumerWaiting(false)
+{
+}
+
+FrameQueue::~FrameQueue()
+{
+	Release();
+}
+
+/**
+* (Re)allocates depth buffers of frameSize bytes. Existing buffers are kept
+* when the geometry did not change since the last acquisition.
+*/
+bool FrameQueue::Allocate(int depth, unsigned long frameSize)
+{
+	if (depth < 1)
+		return false;
+	if ((int)slots.size() == depth && lFrameSize == frameSize)
+	{
+		Reset();
+		return true;
+	}
+
+	Release();
+	slots.resize(depth);
+	for (int i = 0; i < depth; i++)
+	{
+		slots[i].pData = new (std::nothrow) unsigned char[frameSize];
+		slots[i].lSize = frameSize;
+		slots[i].lFrameNumber = 0;
+		slots[i].lCameraFrame = 0;
+		slots[i].lDroppedSinceLast = 0;
+		slots[i].lSettingsGeneration = 0;
+		slots[i].bSettingsMixed = false;
+		slots[i].dTimestampMs = 0;
+		slots[i].dExposureMs = 0;
+		slots[i].ullSdkReturnUs = 0;
+		slots[i].pGeometry.reset();
+		if (slots[i].pData == 0)
+		{
+			Release();
+			return false;
+		}
+	}
+	lFrameSize = frameSize;
+	Reset();
+	return true;
+}
+
+void FrameQueue::Release()
+{
+	for (size_t i = 0; i < slots.size(); i++)
+		delete[] slots[i].pData;
+	slots.clear();
+	lFrameSize = 0;
+	Reset();
+}
+
+/**
+* Drops every queued frame. Must not race with either thread.
+*/
+void FrameQueue::Reset()
+{
+	head.store(0, std::memory_order_relaxed);
+	tail.store(0, std::memory_order_relaxed);
+	iHighWater.store(0, std::memory_order_relaxed);
+}
+
+/**
+* Returns the next free slot or NULL when every slot is still waiting for
+* the insert thread.
+*/
+FrameSlot* FrameQueue::AcquireWrite()
+{
+	if (slots.empty())
+		return 0;
+	unsigned long h = head.load(std::memory_order_relaxed);
+	unsigned long t = tail.load(std::memory_order_acquire);
+	if (h - t >= slots.size())
+		return 0;
+	return &slots[h % slots.size()];
+}
+
+void FrameQueue::CommitWrite()
+{
+	unsigned long h = head.load(std::memory_order_relaxed) + 1;
+	head.store(h, std::memory_order_seq_cst);
+
+	int used = (int)(h - tail.load(std::memory_order_relaxed));
+	if (used > iHighWater.load(std::memory_order_relaxed))
+		iHighWater.store(used, std::memory_order_relaxed);
+
+	if (bConsumerWaiting.load(std::memory_order_seq_cst))
+	{
+		std::lock_guard<std::mutex> g(wakeLock);
+		wakeCond.notify_one();
+	}
+}
+
+/**
+* Returns the oldest committed frame, waiting up to waitMs for one to arrive.
+* NULL on timeout or after Wake().
+*/
+FrameSlot* FrameQueue::Front(int waitMs)
+{
+	unsigned long t = tail.load(std::memory_order_relaxed);
+	if (head.load(std::memory_order_acquire) == t && waitMs > 0)
+	{
+		std::unique_lock<std::mutex> g(wakeLock);
+		bConsumerWaiting.store(true, std::memory_order_seq_cst);
+		if (head.load(std::memory_order_seq_cst) == t)
+			wakeCond.wait_for(g, std::chrono::milliseconds(waitMs));
+		bConsumerWaiting.store(false, std::memory_order_relaxed);
+	}
+	if (head.load(std::memory_order_acquire) == t)
+		return 0;
+	return &slots[t % slots.size()];
+}
+
+void FrameQueue::PopFront()
+{
+	tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void FrameQueue::Wake()
+{
+	std::lock_guard<std::mutex> g(wakeLock);
+	wakeCond.notify_all();
+}
+
+int FrameQueue::GetOccupancy() const
+{
+	unsigned long t = tail.load(std::memory_order_acquire);
+	unsigned long h = head.load(std::memory_order_acquire);
+	return (int)(h - t);
+}
@@ -0,0 +1,99 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameQueue.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Bounded single-producer/single-consumer queue of preallocated
+//                frame buffers between the SDK grab thread and the MMCore
+//                insert thread
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "FrameGeometry.h"
+#include "FrameStats.h"
+
+/**
+* One preallocated frame buffer. Owned by the grab thread between
+* AcquireWrite() and CommitWrite(), by the insert thread between Front()
+* and PopFront().
+*/
+struct FrameSlot
+{
+	unsigned char* pData;
+	unsigned long lSize;
+	long lFrameNumber;
+	long lCameraFrame;			// counting the frames lost before it, see UpdateTelemetry()
+	long lDroppedSinceLast;		// lost between the previous queued frame and this one
+	long lSettingsGeneration;	// settings transaction the frame was taken with
+	bool bSettingsMixed;		// exposed while a transaction was applied
+	double dTimestampMs;
+	double dExposureMs;
+	unsigned long long ullSdkReturnUs;	// steady clock, 0 unless latency is measured
+	FrameGeometryPtr pGeometry;	// snapshot the frame was grabbed with
+	FrameStatistics Stats;		// of the SDK frame, valid while statistics are on
+};
+
+class FrameQueue
+{
+public:
+	FrameQueue();
+	~FrameQueue();
+
+	bool Allocate(int depth, unsigned long frameSize);
+	void Release();
+	void Reset();
+
+	// producer side, grab thread only
+	FrameSlot* AcquireWrite();
+	void CommitWrite();
+
+	// consumer side, insert thread only
+	FrameSlot* Front(int waitMs);
+	void PopFront();
+	void Wake();
+
+	int GetDepth() const { return (int)slots.size(); }
+	unsigned long GetFrameSize() const { return lFrameSize; }
+	int GetOccupancy() const;
+	int GetHighWaterMark() const { return iHighWater.load(std::memory_order_relaxed); }
+
+private:
+	FrameQueue(const FrameQueue&);
+	FrameQueue& operator=(const FrameQueue&);
+
+	std::vector<FrameSlot> slots;
+	unsigned long lFrameSize;
+
+	// head and tail live on separate cache lines so the two threads do not
+	// invalidate each other on every frame
+	char pad0[64];
+	std::atomic<unsigned long> head;	// next slot the grab thread writes
+	char pad1[64];
+	std::atomic<unsigned long> tail;	// next slot the insert thread reads
+	char pad2[64];
+	std::atomic<int> iHighWater;
+	std::atomic<bool> bConsumerWaiting;
+
+	std::mutex wakeLock;
+	std::condition_variable wakeCond;
+};
@@ -0,0 +1,137 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameStacker.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Accumulates N sequence frames into one (sum, mean, min, max,
+//                sigma-clipped mean) before they reach MMCore
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "FrameStacker.h"
+
+FrameStacker::FrameStacker() :
+	eOp(STACK_MEAN),
+	fKappa(3.0f),
+	nSamples(0),
+	iBytes(1),
+	iCount(0)
+{
+}
+
+/**
+* Starts a new stack. The accumulator keeps its memory between stacks of
+* the same size.
+*/
+void FrameStacker::Begin(StackOperator op, float kappa, size_t samples, int bytes)
+{
+	eOp = op;
+	fKappa = kappa;
+	nSamples = samples;
+	iBytes = bytes;
+	iCount = 0;
+	if (op == STACK_SIGMA_CLIP)
+	{
+		std::vector<unsigned int>().swap(acc);
+		stats.resize(samples * 4);
+	}
+	else
+	{
+		std::vector<float>().swap(stats);
+		acc.resize(samples);
+	}
+}
+
+void FrameStacker::Accumulate(const unsigned char* pFrame, size_t begin, size_t end)
+{
+	if (end <= begin)
+		return;
+	const PixelKernels& kernels = GetPixelKernels();
+	if (eOp == STACK_SIGMA_CLIP)
+	{
+		ClipStats s = GetClipStats(begin);
+		if (iBytes == 1)
+			kernels.ClipAccum8(pFrame + begin, s, end - begin, iCount, fKappa * fKappa);
+		else
+			kernels.ClipAccum16((const unsigned short*)pFrame + begin, s, end - begin, iCount, fKappa * fKappa);
+		return;
+	}
+	int op = STACK_ACC_COPY;
+	if (iCount > 0)
+		op = eOp == STACK_MIN ? STACK_ACC_MIN : (eOp == STACK_MAX ? STACK_ACC_MAX : STACK_ACC_ADD);
+	if (iBytes == 1)
+		kernels.StackAccum8(pFrame + begin, &acc[0] + begin, end - begin, op);
+	else
+		kernels.StackAccum16((const unsigned short*)pFrame + begin, &acc[0] + begin, end - begin, op);
+}
+
+void FrameStacker::Reduce(unsigned char* pOut, size_t begin, size_t end) const
+{
+	if (iBytes == 1)
+		ReduceT(pOut, begin, end);
+	else
+		ReduceT((unsigned short*)pOut, begin, end);
+}
+
+ClipStats FrameStacker::GetClipStats(size_t begin)
+{
+	float* p = &stats[0] + begin;
+	ClipStats s = { p, p + nSamples, p + nSamples * 2, p + nSamples * 3 };
+	return s;
+}
+
+template <class T>
+void FrameStacker::ReduceT(T* pOut, size_t begin, size_t end) const
+{
+	unsigned int maxV = (T)~0;
+	switch (eOp)
+	{
+	case STACK_SUM:
+		for (size_t i = begin; i < end; i++)
+			pOut[i] = (T)(acc[i] > maxV ? maxV : acc[i]);
+		break;
+
+	case STACK_MEAN:
+	{
+		unsigned int n = iCount > 0 ? iCount : 1;
+		for (size_t i = begin; i < end; i++)
+			pOut[i] = (T)((acc[i] + n / 2) / n);
+		break;
+	}
+
+	case STACK_MIN:
+	case STACK_MAX:
+		for (size_t i = begin; i < end; i++)
+			pOut[i] = (T)acc[i];
+		break;
+
+	case STACK_SIGMA_CLIP:
+	{
+		const float* pMean = &stats[0];
+		const float* pSum = pMean + nSamples * 2;
+		const float* pCount = pMean + nSamples * 3;
+		for (size_t i = begin; i < end; i++)
+		{
+			float v = pCount[i] > 0.0f ? pSum[i] / pCount[i] : pMean[i];
+			pOut[i] = (T)(v + 0.5f);
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+}
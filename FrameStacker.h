@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameStacker.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Accumulates N sequence frames into one (sum, mean, min, max,
+//                sigma-clipped mean) before they reach MMCore
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "PixelKernels.h"
+
+enum StackOperator
+{
+	STACK_SUM = 0,		// clamped to the sample range
+	STACK_MEAN,
+	STACK_MIN,
+	STACK_MAX,
+	STACK_SIGMA_CLIP,	// mean of the samples within kappa sigma
+	STACK_OPERATOR_NUM
+};
+
+/**
+* Works on samples of 1 or 2 bytes in the layout MMCore gets, so it sits
+* after conversion, debayering and binning. Sum and mean accumulate into
+* 32-bit integers, min and max keep 32-bit extremes.
+*
+* Sigma clipping runs on per-sample running statistics (Welford) in float:
+* a sample is kept when it lies within kappa sigma of the mean of the
+* frames before it, the first two frames are always kept. This needs no
+* copy of the N input frames. Accumulation goes through the StackAccum and
+* ClipAccum kernels of PixelKernels; the reduction runs once per stack and
+* stays scalar.
+*
+* Accumulate() and Reduce() take a sample range so the caller can split a
+* frame into stripes; EndFrame() must follow once all ranges of a frame
+* are accumulated.
+*/
+class FrameStacker
+{
+public:
+	FrameStacker();
+
+	void Begin(StackOperator op, float kappa, size_t samples, int bytes);
+	void Reset() { iCount = 0; }
+
+	void Accumulate(const unsigned char* pFrame, size_t begin, size_t end);
+	void EndFrame() { iCount++; }
+	void Reduce(unsigned char* pOut, size_t begin, size_t end) const;
+
+	int GetCount() const { return iCount; }
+
+private:
+	template <class T> void ReduceT(T* pOut, size_t begin, size_t end) const;
+	ClipStats GetClipStats(size_t begin);
+
+	StackOperator eOp;
+	float fKappa;
+	size_t nSamples;
+	int iBytes;
+	int iCount;					// frames accumulated so far
+	std::vector<unsigned int> acc;
+	std::vector<float> stats;	// planes of mean, M2, clipped sum, clipped count
+};
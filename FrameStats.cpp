@@ -0,0 +1,187 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameStats.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Per-frame histogram, min/max/mean/standard deviation and
+//                saturation of SDK frames, for the whole frame and regions
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "FrameStats.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+// partial histograms filled round robin, so runs of equal samples do not
+// wait on the increment of the same counter
+static const int g_SubHistograms = 4;
+
+bool ParseStatsRegions(const std::string& text, std::vector<StatsRegion>& regions)
+{
+	regions.clear();
+	size_t pos = 0;
+	while (pos < text.size())
+	{
+		size_t end = text.find(';', pos);
+		if (end == std::string::npos)
+			end = text.size();
+		std::string item = text.substr(pos, end - pos);
+		pos = end + 1;
+		if (item.find_first_not_of(' ') == std::string::npos)
+			continue;
+		StatsRegion r;
+		char tail;
+		if (sscanf(item.c_str(), "%d,%d,%d,%d %c", &r.X, &r.Y, &r.Width, &r.Height, &tail) != 4
+			|| r.X < 0 || r.Y < 0 || r.Width <= 0 || r.Height <= 0)
+			return false;
+		regions.push_back(r);
+	}
+	return true;
+}
+
+FrameStatistics::FrameStatistics() :
+	bValid(false),
+	iBinShift(0)
+{
+	memset(&frame, 0, sizeof(frame));
+	memset(&sums, 0, sizeof(sums));
+}
+
+void FrameStatistics::Compute(const unsigned char* pFrame, const FrameGeometry& geo, const StatsConfig& config)
+{
+	bool b16 = geo.ImgType == ASI_IMG_RAW16;
+	int channels = geo.ImgType == ASI_IMG_RGB24 ? 3 : 1;
+	size_t bins = b16 ? 4096 : 256;
+	iBinShift = b16 ? 4 : 0;
+	if (histogram.size() != bins)
+	{
+		histogram.resize(bins);
+		scratch.resize(bins * g_SubHistograms);
+	}
+	int stride = config.RowStride > 1 ? config.RowStride : 1;
+	int rowSamples = geo.Width * channels;
+
+	StatsRegion all = { 0, 0, geo.Width, geo.Height };
+	regions.resize(config.Regions.size());
+	for (size_t i = 0; i <= config.Regions.size(); i++)
+	{
+		// regions first, the whole frame last so its histogram is the one kept
+		StatsRegion r = i < config.Regions.size() ? config.Regions[i] : all;
+		int x1 = r.X + r.Width < geo.Width ? r.X + r.Width : geo.Width;
+		int y1 = r.Y + r.Height < geo.Height ? r.Y + r.Height : geo.Height;
+		r.Width = x1 > r.X ? x1 - r.X : 0;
+		r.Height = y1 > r.Y ? y1 - r.Y : 0;
+		r.X *= channels;
+		r.Width *= channels;
+
+		sums.Min = 0xFFFF;
+		sums.Max = sums.Sum = sums.SumSq = 0;
+		if (b16)
+			Accumulate((const unsigned short*)pFrame, rowSamples, r, stride, &histogram[0]);
+		else
+			Accumulate(pFrame, rowSamples, r, stride, &histogram[0]);
+		if (i < config.Regions.size())
+			regions[i] = Finish(&histogram[0]);
+		else
+			frame = Finish(&histogram[0]);
+	}
+	bValid = true;
+}
+
+void FrameStatistics::CopyResults(const FrameStatistics& other)
+{
+	bValid = other.bValid;
+	iBinShift = other.iBinShift;
+	histogram = other.histogram;
+	regions = other.regions;
+	frame = other.frame;
+}
+
+template <class T>
+void FrameStatistics::Accumulate(const T* pFrame, int rowSamples, const StatsRegion& r, int stride, unsigned int* pHist)
+{
+	const PixelKernels& kernels = GetPixelKernels();
+	size_t bins = histogram.size();
+	memset(&scratch[0], 0, scratch.size() * sizeof(unsigned int));
+	unsigned int* h0 = &scratch[0];
+	unsigned int* h1 = h0 + bins;
+	unsigned int* h2 = h1 + bins;
+	unsigned int* h3 = h2 + bins;
+	int shift = iBinShift;
+	for (int y = r.Y; y < r.Y + r.Height; y += stride)
+	{
+		const T* p = pFrame + (size_t)y * rowSamples + r.X;
+		int n = r.Width;
+		// the row is still in cache from the kernel when the histogram walks it
+		if (sizeof(T) == 2)
+			kernels.Sums16((const unsigned short*)p, n, &sums);
+		int i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			h0[p[i] >> shift]++;
+			h1[p[i + 1] >> shift]++;
+			h2[p[i + 2] >> shift]++;
+			h3[p[i + 3] >> shift]++;
+		}
+		for (; i < n; i++)
+			h0[p[i] >> shift]++;
+	}
+	for (size_t b = 0; b < bins; b++)
+		pHist[b] = h0[b] + h1[b] + h2[b] + h3[b];
+}
+
+SampleStats FrameStatistics::Finish(const unsigned int* pHist)
+{
+	SampleStats s;
+	memset(&s, 0, sizeof(s));
+	size_t bins = histogram.size();
+	unsigned long long sum = 0, sumSq = 0;
+	for (size_t b = 0; b < bins; b++)
+	{
+		unsigned long long h = pHist[b];
+		s.Count += h;
+		sum += h * b;
+		sumSq += h * b * b;
+	}
+	if (s.Count == 0)
+		return s;
+	s.Saturated = pHist[bins - 1];
+
+	if (iBinShift == 0)
+	{
+		// 8-bit: one bin per value, the histogram is exact
+		size_t lo = 0, hi = bins - 1;
+		while (pHist[lo] == 0)
+			lo++;
+		while (pHist[hi] == 0)
+			hi--;
+		s.Min = (unsigned int)lo;
+		s.Max = (unsigned int)hi;
+	}
+	else
+	{
+		s.Min = sums.Min;
+		s.Max = sums.Max;
+		sum = sums.Sum;
+		sumSq = sums.SumSq;
+	}
+	s.Mean = (double)sum / s.Count;
+	double var = (double)sumSq / s.Count - s.Mean * s.Mean;
+	s.StdDev = var > 0 ? sqrt(var) : 0;
+	return s;
+}
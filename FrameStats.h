@@ -0,0 +1,96 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameStats.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Per-frame histogram, min/max/mean/standard deviation and
+//                saturation of SDK frames, for the whole frame and regions
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FrameGeometry.h"
+#include "PixelKernels.h"
+
+// in pixels of the SDK frame, clipped to it
+struct StatsRegion
+{
+	int X, Y, Width, Height;
+};
+
+// published as a whole, the grab thread picks it up with the next frame
+struct StatsConfig
+{
+	int RowStride;				// every RowStride-th row is counted
+	std::vector<StatsRegion> Regions;
+};
+typedef std::shared_ptr<const StatsConfig> StatsConfigPtr;
+
+// "x,y,w,h;x,y,w,h"; false on anything else, empty is no regions
+bool ParseStatsRegions(const std::string& text, std::vector<StatsRegion>& regions);
+
+struct SampleStats
+{
+	unsigned long long Count;
+	unsigned long long Saturated;	// samples in the top histogram bin
+	unsigned int Min, Max;
+	double Mean, StdDev;
+};
+
+/**
+* Statistics of one SDK frame. RAW8, Y8 and the channels of RGB24 are
+* counted as 8-bit samples into 256 bins, RAW16 into 4096 bins of 16
+* values; the top bin holds the samples at the ADC limit, whatever the
+* bit depth. 8-bit min/max/mean/deviation follow exactly from the
+* histogram, 16-bit ones come from the Sums16 kernel in the same pass.
+*
+* Lives in a frame slot: after the first frame of a pixel type, Compute()
+* allocates nothing.
+*/
+class FrameStatistics
+{
+public:
+	FrameStatistics();
+
+	void Compute(const unsigned char* pFrame, const FrameGeometry& geo, const StatsConfig& config);
+	void Invalidate() { bValid = false; }
+	// the results only, without the scratch space
+	void CopyResults(const FrameStatistics& other);
+	bool IsValid() const { return bValid; }
+
+	const SampleStats& GetFrame() const { return frame; }
+	const std::vector<SampleStats>& GetRegions() const { return regions; }
+	const std::vector<unsigned int>& GetHistogram() const { return histogram; }
+	int GetBinShift() const { return iBinShift; }
+
+private:
+	template <class T>
+	void Accumulate(const T* pFrame, int rowSamples, const StatsRegion& r, int stride, unsigned int* pHist);
+	SampleStats Finish(const unsigned int* pHist);
+
+	bool bValid;
+	int iBinShift;				// sample >> iBinShift is the bin
+	std::vector<unsigned int> histogram;
+	std::vector<unsigned int> scratch;	// interleaved partial histograms
+	std::vector<SampleStats> regions;
+	SampleStats frame;
+	SampleSums sums;			// 16-bit only
+};
@@ -0,0 +1,188 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          HotPixels.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Hot/dead pixel map from a master dark and its correction by
+//                the median of same-colour neighbours
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "HotPixels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+// the statistics come from at most this many samples spread over the dark
+static const size_t g_MaxStatSamples = 1 << 20;
+
+// neighbours of the same colour: mono, Bayer red/blue site, Bayer green site
+static const int g_MonoRing[8][2] = { { -1, -1 }, { 0, -1 }, { 1, -1 }, { -1, 0 }, { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+static const int g_BayerRB[8][2] = { { -2, -2 }, { 0, -2 }, { 2, -2 }, { -2, 0 }, { 2, 0 }, { -2, 2 }, { 0, 2 }, { 2, 2 } };
+static const int g_BayerG[8][2] = { { -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 }, { 0, -2 }, { -2, 0 }, { 2, 0 }, { 0, 2 } };
+
+/**
+* Median and MAD on a regular subsample; 1.4826 * MAD estimates sigma
+* without being pulled up by the defects themselves.
+*/
+HotPixelMapPtr DetectHotPixels(const CalibrationFrame& dark, HotPixelDetection mode, double level)
+{
+	size_t n = (size_t)dark.Width * dark.Height;
+	const float* pData = dark.Samples();
+	size_t step = n / g_MaxStatSamples + 1;
+	std::vector<float> sample;
+	sample.reserve(n / step + 1);
+	for (size_t i = 0; i < n; i += step)
+		sample.push_back(pData[i]);
+
+	std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+	float median = sample[sample.size() / 2];
+	for (size_t i = 0; i < sample.size(); i++)
+		sample[i] = fabs(sample[i] - median);
+	std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+	double sigma = 1.4826 * sample[sample.size() / 2];
+	// 8-bit darks are often flat to the ADU
+	if (sigma < 0.5)
+		sigma = 0.5;
+	double limit = mode == HOTPIX_SIGMA ? level * sigma : level;
+
+	HotPixelMap* pMap = new HotPixelMap();
+	pMap->Width = dark.Width;
+	pMap->Height = dark.Height;
+	pMap->Bin = dark.Bin;
+	pMap->StartX = dark.StartX;
+	pMap->StartY = dark.StartY;
+	for (size_t i = 0; i < n; i++)
+	{
+		if (fabs(pData[i] - median) > limit)
+			pMap->Pixels.push_back((unsigned int)i);
+	}
+	return HotPixelMapPtr(pMap);
+}
+
+bool LoadHotPixelMap(const char* path, HotPixelMap& map)
+{
+	FILE* fp = fopen(path, "r");
+	if (fp == 0)
+		return false;
+	bool bOk = fscanf(fp, "%d %d %d %d %d", &map.Width, &map.Height, &map.Bin, &map.StartX, &map.StartY) == 5
+		&& map.Width > 0 && map.Height > 0;
+	map.Pixels.clear();
+	int x, y;
+	while (bOk && fscanf(fp, "%d %d", &x, &y) == 2)
+	{
+		if (x >= 0 && y >= 0 && x < map.Width && y < map.Height)
+			map.Pixels.push_back((unsigned int)y * map.Width + x);
+	}
+	fclose(fp);
+	std::sort(map.Pixels.begin(), map.Pixels.end());
+	map.Pixels.erase(std::unique(map.Pixels.begin(), map.Pixels.end()), map.Pixels.end());
+	return bOk;
+}
+
+bool SaveHotPixelMap(const char* path, const HotPixelMap& map)
+{
+	FILE* fp = fopen(path, "w");
+	if (fp == 0)
+		return false;
+	fprintf(fp, "%d %d %d %d %d\n", map.Width, map.Height, map.Bin, map.StartX, map.StartY);
+	for (size_t i = 0; i < map.Pixels.size(); i++)
+		fprintf(fp, "%u %u\n", map.Pixels[i] % map.Width, map.Pixels[i] / map.Width);
+	return fclose(fp) == 0;
+}
+
+PreparedHotPixels::PreparedHotPixels() :
+	bBayer(false)
+{
+}
+
+/**
+* False, with nothing to correct, when the map does not fit the frame.
+*/
+bool PreparedHotPixels::Prepare(const HotPixelMapPtr& map, const FrameGeometryPtr& geo, bool bBayerSensor)
+{
+	pMap = map;
+	pGeometry = geo;
+	bBayer = bBayerSensor;
+	pixels.clear();
+	if (!map || geo->ImgType == ASI_IMG_RGB24 || map->Bin != geo->Bin)
+		return false;
+	int x0 = geo->StartX - map->StartX, y0 = geo->StartY - map->StartY;
+	if (x0 < 0 || y0 < 0 || x0 + geo->Width > map->Width || y0 + geo->Height > map->Height)
+		return false;
+
+	int w = geo->Width, h = geo->Height;
+	bool bFlipH = geo->Flip == ASI_FLIP_HORIZ || geo->Flip == ASI_FLIP_BOTH;
+	bool bFlipV = geo->Flip == ASI_FLIP_VERT || geo->Flip == ASI_FLIP_BOTH;
+	for (size_t i = 0; i < map->Pixels.size(); i++)
+	{
+		int sx = (int)(map->Pixels[i] % map->Width) - x0;
+		int sy = (int)(map->Pixels[i] / map->Width) - y0;
+		if (sx < 0 || sy < 0 || sx >= w || sy >= h)
+			continue;
+		int x = bFlipH ? w - 1 - sx : sx;
+		int y = bFlipV ? h - 1 - sy : sy;
+		pixels.push_back((unsigned int)y * w + x);
+	}
+	std::sort(pixels.begin(), pixels.end());
+	return true;
+}
+
+bool PreparedHotPixels::IsDefect(unsigned int index) const
+{
+	return std::binary_search(pixels.begin(), pixels.end(), index);
+}
+
+void PreparedHotPixels::Apply(unsigned char* pFrame) const
+{
+	if (pixels.empty())
+		return;
+	if (pGeometry->SdkPixBytes == 1)
+		ApplyT(pFrame);
+	else
+		ApplyT((unsigned short*)pFrame);
+}
+
+template <class T>
+void PreparedHotPixels::ApplyT(T* pFrame) const
+{
+	const FrameGeometry& geo = *pGeometry;
+	int w = geo.Width, h = geo.Height;
+	for (size_t i = 0; i < pixels.size(); i++)
+	{
+		int x = (int)(pixels[i] % w), y = (int)(pixels[i] / w);
+		const int (*ring)[2] = g_MonoRing;
+		if (bBayer)
+			ring = ((x ^ geo.RedX ^ y ^ geo.RedY) & 1) ? g_BayerG : g_BayerRB;
+
+		T vals[8];
+		int n = 0;
+		for (int k = 0; k < 8; k++)
+		{
+			int nx = x + ring[k][0], ny = y + ring[k][1];
+			if (nx < 0 || ny < 0 || nx >= w || ny >= h)
+				continue;
+			unsigned int index = (unsigned int)ny * w + nx;
+			if (!IsDefect(index))
+				vals[n++] = pFrame[index];
+		}
+		if (n == 0)
+			continue;
+		std::nth_element(vals, vals + n / 2, vals + n);
+		pFrame[pixels[i]] = vals[n / 2];
+	}
+}
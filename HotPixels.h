@@ -0,0 +1,85 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          HotPixels.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Hot/dead pixel map from a master dark and its correction by
+//                the median of same-colour neighbours
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "Calibration.h"
+#include "FrameGeometry.h"
+
+/**
+* Defective pixels as sorted indices y * Width + x in sensor orientation
+* (flip undone), for the binning and ROI the dark was taken with. Like a
+* master it applies to frames of the same binning inside that ROI.
+*/
+struct HotPixelMap
+{
+	int Width, Height, Bin;
+	int StartX, StartY;
+	std::vector<unsigned int> Pixels;
+};
+typedef std::shared_ptr<const HotPixelMap> HotPixelMapPtr;
+
+enum HotPixelDetection
+{
+	HOTPIX_SIGMA = 0,		// further than level robust sigmas from the median
+	HOTPIX_THRESHOLD		// further than level ADU from the median
+};
+
+// hot pixels above, dead pixels below the dark's median
+HotPixelMapPtr DetectHotPixels(const CalibrationFrame& dark, HotPixelDetection mode, double level);
+
+// text file: a "width height bin startX startY" line, then one "x y" line per pixel
+bool LoadHotPixelMap(const char* path, HotPixelMap& map);
+bool SaveHotPixelMap(const char* path, const HotPixelMap& map);
+
+/**
+* The map cut and flipped to one frame geometry, as sorted frame indices.
+* Apply() replaces each listed pixel by the median of its non-defective
+* neighbours of the same colour: the 3x3 ring on mono sensors, the 5x5
+* same-colour sites on Bayer sensors. Its cost follows the number of
+* defects, not the frame size.
+*/
+class PreparedHotPixels
+{
+public:
+	PreparedHotPixels();
+
+	bool Prepare(const HotPixelMapPtr& map, const FrameGeometryPtr& geo, bool bBayer);
+	bool IsPreparedFor(const HotPixelMapPtr& map, const FrameGeometryPtr& geo) const { return pMap == map && pGeometry == geo; }
+	size_t GetCount() const { return pixels.size(); }
+
+	// in place on an SDK frame of the prepared geometry
+	void Apply(unsigned char* pFrame) const;
+
+private:
+	template <class T> void ApplyT(T* pFrame) const;
+	bool IsDefect(unsigned int index) const;
+
+	HotPixelMapPtr pMap;
+	FrameGeometryPtr pGeometry;
+	bool bBayer;
+	std::vector<unsigned int> pixels;
+};
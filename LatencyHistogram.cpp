@@ -0,0 +1,106 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          LatencyHistogram.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free log-bucket histogram of durations, for the latency of
+//                the acquisition stages
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "LatencyHistogram.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+	Reset();
+}
+
+void LatencyHistogram::Record(unsigned long long us)
+{
+	counts[Bucket(us)].fetch_add(1, std::memory_order_relaxed);
+	unsigned long long prev = maxUs.load(std::memory_order_relaxed);
+	while (us > prev && !maxUs.compare_exchange_weak(prev, us, std::memory_order_relaxed))
+		;
+}
+
+void LatencyHistogram::Reset()
+{
+	for (int i = 0; i < BUCKETS; i++)
+		counts[i].store(0, std::memory_order_relaxed);
+	maxUs.store(0, std::memory_order_relaxed);
+}
+
+unsigned long long LatencyHistogram::GetCount() const
+{
+	unsigned long long n = 0;
+	for (int i = 0; i < BUCKETS; i++)
+		n += counts[i].load(std::memory_order_relaxed);
+	return n;
+}
+
+unsigned long long LatencyHistogram::GetPercentile(double q) const
+{
+	unsigned long long snapshot[BUCKETS];
+	unsigned long long n = 0;
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		snapshot[i] = counts[i].load(std::memory_order_relaxed);
+		n += snapshot[i];
+	}
+	if (n == 0)
+		return 0;
+	// the smallest bucket with at least q of the samples at or below it:
+	// rank ceil(q * n), with slack for q * n landing just above an integer
+	double exact = q * n;
+	unsigned long long rank = (unsigned long long)exact;
+	if (exact - rank > 1e-9 * n)
+		rank++;
+	if (rank < 1)
+		rank = 1;
+	unsigned long long seen = 0;
+	int i = 0;
+	for (; i < BUCKETS - 1; i++)
+	{
+		seen += snapshot[i];
+		if (seen >= rank)
+			break;
+	}
+	unsigned long long top = BucketTop(i);
+	unsigned long long max = GetMax();
+	return top < max ? top : max;
+}
+
+// values below 8 get a bucket each, above that the three bits after the
+// leading one pick one of eight buckets in its octave
+int LatencyHistogram::Bucket(unsigned long long us)
+{
+	if (us < SUB_BUCKETS)
+		return (int)us;
+	int msb = 63;
+	while (!(us >> msb))
+		msb--;
+	int bucket = (msb - 2) * SUB_BUCKETS + (int)((us >> (msb - 3)) & (SUB_BUCKETS - 1));
+	return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+unsigned long long LatencyHistogram::BucketTop(int bucket)
+{
+	if (bucket < SUB_BUCKETS)
+		return bucket;
+	int msb = bucket / SUB_BUCKETS + 2;
+	unsigned long long width = 1ULL << (msb - 3);
+	return (SUB_BUCKETS + bucket % SUB_BUCKETS) * width + width - 1;
+}
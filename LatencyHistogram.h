@@ -0,0 +1,56 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          LatencyHistogram.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free log-bucket histogram of durations, for the latency of
+//                the acquisition stages
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <atomic>
+
+/**
+* Durations in microseconds, counted into logarithmic buckets: exact below
+* 8 us, eight per octave above, so a percentile read back is at most 12.5%
+* above the true value. Record() is a relaxed increment and may run on any
+* thread concurrently with the readers. Reset() is not atomic as a whole;
+* samples recorded during it may survive.
+*/
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	void Record(unsigned long long us);
+	void Reset();
+
+	unsigned long long GetCount() const;
+	unsigned long long GetMax() const { return maxUs.load(std::memory_order_relaxed); }
+	// top of the bucket holding quantile q, clamped to the maximum; 0 when empty
+	unsigned long long GetPercentile(double q) const;
+
+private:
+	static const int SUB_BUCKETS = 8;
+	static const int BUCKETS = SUB_BUCKETS * 40;	// up to about 2^41 us
+	static int Bucket(unsigned long long us);
+	static unsigned long long BucketTop(int bucket);
+
+	std::atomic<unsigned long long> counts[BUCKETS];
+	std::atomic<unsigned long long> maxUs;
+};
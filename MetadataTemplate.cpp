@@ -0,0 +1,145 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MetadataTemplate.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Serialized image metadata built once per configuration, with
+//                fixed-width per-frame fields patched in place
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "MetadataTemplate.h"
+
+#include <cstdio>
+#include <cstring>
+
+MetadataTemplate::MetadataTemplate() :
+	bBuilt(false)
+{
+	buffer.push_back(0);
+}
+
+void MetadataTemplate::Clear()
+{
+	fields.clear();
+	buffer.assign(1, 0);
+	bBuilt = false;
+}
+
+/**
+* Registers a per-frame tag and returns its index for SetInt()/SetFloat().
+* Must be called before Build().
+*/
+int MetadataTemplate::AddField(const char* key, int width)
+{
+	Field f;
+	f.key = key;
+	f.width = width < 6 ? 6 : width;
+	f.offset = 0;
+	fields.push_back(f);
+	return (int)fields.size() - 1;
+}
+
+/**
+* Adds a unique placeholder for every field to md, serializes it and keeps
+* the result as the buffer that is patched per frame.
+*/
+bool MetadataTemplate::Build(Metadata& md)
+{
+	std::vector<std::string> placeholders;
+	for (size_t i = 0; i < fields.size(); i++)
+	{
+		char tag[16];
+		snprintf(tag, sizeof(tag), "@@%03d", (int)i);
+		std::string ph(tag);
+		ph.append(fields[i].width - ph.size(), '@');
+		placeholders.push_back(ph);
+		md.put(fields[i].key, ph);
+	}
+
+	std::string serialized = md.Serialize();
+	for (size_t i = 0; i < fields.size(); i++)
+	{
+		size_t pos = serialized.find(placeholders[i]);
+		if (pos == std::string::npos || serialized.find(placeholders[i], pos + 1) != std::string::npos)
+		{
+			bBuilt = false;
+			return false;
+		}
+		fields[i].offset = pos;
+	}
+
+	buffer.assign(serialized.begin(), serialized.end());
+	buffer.push_back(0);
+	for (size_t i = 0; i < fields.size(); i++)
+		SetInt((int)i, 0);
+	bBuilt = true;
+	return true;
+}
+
+void MetadataTemplate::SetInt(int field, long long value)
+{
+	const Field& f = fields[field];
+	char* p = &buffer[f.offset];
+	bool bNeg = value < 0;
+	unsigned long long v = bNeg ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+
+	int i = f.width - 1;
+	for (; i >= (bNeg ? 1 : 0); i--)
+	{
+		p[i] = (char)('0' + v % 10);
+		v /= 10;
+	}
+	if (bNeg)
+		p[0] = '-';
+	if (v != 0)
+		Overflow(f);
+}
+
+void MetadataTemplate::SetFloat(int field, double value, int decimals)
+{
+	const Field& f = fields[field];
+	char tmp[64];
+	int n = snprintf(tmp, sizeof(tmp), "%0*.*f", f.width, decimals, value);
+	if (n != f.width)
+	{
+		Overflow(f);
+		return;
+	}
+	memcpy(&buffer[f.offset], tmp, f.width);
+}
+
+/**
+* Left aligned and padded with blanks; text longer than the field is cut.
+*/
+void MetadataTemplate::SetText(int field, const char* value)
+{
+	const Field& f = fields[field];
+	char* p = &buffer[f.offset];
+	int i = 0;
+	for (; i < f.width && value[i] != 0; i++)
+		p[i] = value[i];
+	for (; i < f.width; i++)
+		p[i] = ' ';
+}
+
+/**
+* Value does not fit: saturate instead of shifting the rest of the buffer.
+*/
+void MetadataTemplate::Overflow(const Field& f)
+{
+	memset(&buffer[f.offset], '9', f.width);
+}
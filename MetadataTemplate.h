@@ -0,0 +1,65 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MetadataTemplate.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Serialized image metadata built once per configuration, with
+//                fixed-width per-frame fields patched in place
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "DeviceBase.h"
+
+/**
+* The static tags are put into a Metadata object by the caller; every
+* per-frame tag is registered with AddField() and gets a placeholder of its
+* fixed width. Build() runs Metadata::Serialize() once and remembers where
+* each placeholder landed, so per frame only the digits are overwritten.
+* Numbers are zero padded to the field width, which MMCore parses as usual.
+*/
+class MetadataTemplate
+{
+public:
+	MetadataTemplate();
+
+	void Clear();
+	int AddField(const char* key, int width);
+	bool Build(Metadata& md);
+	bool IsBuilt() const { return bBuilt; }
+
+	void SetInt(int field, long long value);
+	void SetFloat(int field, double value, int decimals);
+	void SetText(int field, const char* value);
+	const char* c_str() const { return &buffer[0]; }
+
+private:
+	struct Field
+	{
+		std::string key;
+		int width;
+		size_t offset;
+	};
+	std::vector<Field> fields;
+	std::vector<char> buffer;
+	bool bBuilt;
+
+	void Overflow(const Field& f);
+};
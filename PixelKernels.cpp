@@ -0,0 +1,1180 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PixelKernels.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pixel format conversion kernels (scalar, SSSE3, AVX2) with
+//                CPU feature detection at load time
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "PixelKernels.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ASI_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ASI_TARGET(isa)
+#else
+#include <cpuid.h>
+#define ASI_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// scalar
+///////////////////////////////////////////////////////////////////////////////
+
+static void RGB24ToRGBA32_Scalar(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	for (size_t i = 0; i < pixels; i++, pSrc += 3, pDst += 4)
+	{
+		pDst[0] = pSrc[0];
+		pDst[1] = pSrc[1];
+		pDst[2] = pSrc[2];
+		pDst[3] = 0;
+	}
+}
+
+static void RGB24ToRGBA64_Scalar(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	for (size_t i = 0; i < pixels; i++, pSrc += 3, pDst += 8)
+	{
+		pDst[0] = 0;
+		pDst[1] = pSrc[0];
+		pDst[2] = 0;
+		pDst[3] = pSrc[1];
+		pDst[4] = 0;
+		pDst[5] = pSrc[2];
+		pDst[6] = 0;
+		pDst[7] = 0;
+	}
+}
+
+static void Raw16To12_Scalar(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	const unsigned short* pIn = (const unsigned short*)pSrc;
+	unsigned short* pOut = (unsigned short*)pDst;
+	for (size_t i = 0; i < pixels; i++)
+		pOut[i] = pIn[i] >> 4;
+}
+
+static void AccumRow8_Scalar(const unsigned char* pSrc, unsigned short* pAcc, size_t samples)
+{
+	for (size_t i = 0; i < samples; i++)
+		pAcc[i] += pSrc[i];
+}
+
+static void AccumRow16_Scalar(const unsigned char* pSrc, unsigned int* pAcc, size_t samples, int shift)
+{
+	const unsigned short* pIn = (const unsigned short*)pSrc;
+	for (size_t i = 0; i < samples; i++)
+		pAcc[i] += pIn[i] >> shift;
+}
+
+// v is never negative after the clamp, so adding 0.5 and truncating rounds
+// the same way the SIMD versions do
+static inline float CalibrateSample(float raw, float gain, float offset, float maxV)
+{
+	float v = raw * gain + offset;
+	v = v < 0.0f ? 0.0f : (v > maxV ? maxV : v);
+	return v + 0.5f;
+}
+
+static void Calibrate8_Scalar(unsigned char* pData, const float* pGain, const float* pOffset, size_t samples)
+{
+	for (size_t i = 0; i < samples; i++)
+		pData[i] = (unsigned char)CalibrateSample(pData[i], pGain[i], pOffset[i], 255.0f);
+}
+
+static void Calibrate16_Scalar(unsigned short* pData, const float* pGain, const float* pOffset, size_t samples)
+{
+	for (size_t i = 0; i < samples; i++)
+		pData[i] = (unsigned short)CalibrateSample(pData[i], pGain[i], pOffset[i], 65535.0f);
+}
+
+static void Sums16_Scalar(const unsigned short* pSrc, size_t samples, SampleSums* pSums)
+{
+	unsigned int vMin = pSums->Min, vMax = pSums->Max;
+	unsigned long long sum = 0, sumSq = 0;
+	for (size_t i = 0; i < samples; i++)
+	{
+		unsigned int v = pSrc[i];
+		vMin = v < vMin ? v : vMin;
+		vMax = v > vMax ? v : vMax;
+		sum += v;
+		sumSq += (unsigned long long)v * v;
+	}
+	pSums->Min = vMin;
+	pSums->Max = vMax;
+	pSums->Sum += sum;
+	pSums->SumSq += sumSq;
+}
+
+template <class T>
+static void StackAccum_Scalar(const T* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	switch (op)
+	{
+	case STACK_ACC_COPY:
+		for (size_t i = 0; i < samples; i++)
+			pAcc[i] = pSrc[i];
+		break;
+	case STACK_ACC_ADD:
+		for (size_t i = 0; i < samples; i++)
+			pAcc[i] += pSrc[i];
+		break;
+	case STACK_ACC_MIN:
+		for (size_t i = 0; i < samples; i++)
+			pAcc[i] = pSrc[i] < pAcc[i] ? pSrc[i] : pAcc[i];
+		break;
+	case STACK_ACC_MAX:
+		for (size_t i = 0; i < samples; i++)
+			pAcc[i] = pSrc[i] > pAcc[i] ? pSrc[i] : pAcc[i];
+		break;
+	}
+}
+
+static void StackAccum8_Scalar(const unsigned char* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	StackAccum_Scalar(pSrc, pAcc, samples, op);
+}
+
+static void StackAccum16_Scalar(const unsigned short* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	StackAccum_Scalar(pSrc, pAcc, samples, op);
+}
+
+// the SIMD versions evaluate the same float expressions in the same order,
+// so all three give identical planes
+template <class T>
+static void ClipAccum_Scalar(const T* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	if (frames == 0)
+	{
+		for (size_t i = 0; i < samples; i++)
+		{
+			float x = (float)pSrc[i];
+			stats.pMean[i] = x;
+			stats.pM2[i] = 0.0f;
+			stats.pSum[i] = x;
+			stats.pCount[i] = 1.0f;
+		}
+		return;
+	}
+	float n = (float)(frames + 1);
+	for (size_t i = 0; i < samples; i++)
+	{
+		float x = (float)pSrc[i];
+		float d = x - stats.pMean[i];
+		bool bKeep = frames < 2 || d * d <= kappa2 * stats.pM2[i] / (float)(frames - 1);
+		stats.pMean[i] += d / n;
+		stats.pM2[i] += d * (x - stats.pMean[i]);
+		if (bKeep)
+		{
+			stats.pSum[i] += x;
+			stats.pCount[i] += 1.0f;
+		}
+	}
+}
+
+static void ClipAccum8_Scalar(const unsigned char* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	ClipAccum_Scalar(pSrc, stats, samples, frames, kappa2);
+}
+
+static void ClipAccum16_Scalar(const unsigned short* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	ClipAccum_Scalar(pSrc, stats, samples, frames, kappa2);
+}
+
+template <class T>
+static inline void StoreBGR0(T* pDst, unsigned b, unsigned g, unsigned r)
+{
+	pDst[0] = (T)b;
+	pDst[1] = (T)g;
+	pDst[2] = (T)r;
+	pDst[3] = 0;
+}
+
+// the red (bRedRow) or blue site from its own sample, green from the cross
+// and the other colour from the diagonals; the green site from the rows
+// left/right and above/below
+template <class T>
+static void BilinearPairs_Scalar(const T* pN, const T* pC, const T* pS, T* pDst, size_t pairs, bool bRedRow)
+{
+	for (size_t k = 0; k < pairs; k++, pN += 2, pC += 2, pS += 2, pDst += 8)
+	{
+		unsigned site = pC[0];
+		unsigned cross = (pN[0] + pS[0] + pC[-1] + pC[1] + 2) >> 2;
+		unsigned diag = (pN[-1] + pN[1] + pS[-1] + pS[1] + 2) >> 2;
+		unsigned horz = (pC[0] + pC[2] + 1) >> 1;
+		unsigned vert = (pN[1] + pS[1] + 1) >> 1;
+		StoreBGR0(pDst, bRedRow ? diag : site, cross, bRedRow ? site : diag);
+		StoreBGR0(pDst + 4, bRedRow ? vert : horz, pC[1], bRedRow ? horz : vert);
+	}
+}
+
+static void BilinearPairs8_Scalar(const unsigned char* pN, const unsigned char* pC, const unsigned char* pS, unsigned char* pDst, size_t pairs, bool bRedRow)
+{
+	BilinearPairs_Scalar(pN, pC, pS, pDst, pairs, bRedRow);
+}
+
+static void BilinearPairs16_Scalar(const unsigned short* pN, const unsigned short* pC, const unsigned short* pS, unsigned short* pDst, size_t pairs, bool bRedRow)
+{
+	BilinearPairs_Scalar(pN, pC, pS, pDst, pairs, bRedRow);
+}
+
+// the tail of a SIMD run, from sample i on
+static ClipStats OffsetClipStats(const ClipStats& stats, size_t i)
+{
+	ClipStats s = { stats.pMean + i, stats.pM2 + i, stats.pSum + i, stats.pCount + i };
+	return s;
+}
+
+// 32-bit sum lanes take 65536 samples of 0xFFFF each before they could wrap
+static const size_t g_SumsBlock = 65536;
+
+#ifdef ASI_X86
+
+///////////////////////////////////////////////////////////////////////////////
+// SSSE3: 4 pixels per 16-byte load, pshufb does the 3->4 expansion and
+// inserts the zero bytes (mask index with the high bit set)
+///////////////////////////////////////////////////////////////////////////////
+
+ASI_TARGET("ssse3")
+static void RGB24ToRGBA32_SSSE3(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	const __m128i mask = _mm_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128);
+	size_t i = 0;
+	// the load reads 4 bytes past the 4th pixel, stop while that is still inside the frame
+	for (; i + 6 <= pixels; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 3));
+		_mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_shuffle_epi8(v, mask));
+	}
+	RGB24ToRGBA32_Scalar(pSrc + i * 3, pDst + i * 4, pixels - i);
+}
+
+ASI_TARGET("ssse3")
+static void RGB24ToRGBA64_SSSE3(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	const __m128i maskLo = _mm_setr_epi8(-128, 0, -128, 1, -128, 2, -128, -128, -128, 3, -128, 4, -128, 5, -128, -128);
+	const __m128i maskHi = _mm_setr_epi8(-128, 6, -128, 7, -128, 8, -128, -128, -128, 9, -128, 10, -128, 11, -128, -128);
+	size_t i = 0;
+	for (; i + 6 <= pixels; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 3));
+		_mm_storeu_si128((__m128i*)(pDst + i * 8), _mm_shuffle_epi8(v, maskLo));
+		_mm_storeu_si128((__m128i*)(pDst + i * 8 + 16), _mm_shuffle_epi8(v, maskHi));
+	}
+	RGB24ToRGBA64_Scalar(pSrc + i * 3, pDst + i * 8, pixels - i);
+}
+
+ASI_TARGET("ssse3")
+static void Raw16To12_SSSE3(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	size_t i = 0;
+	for (; i + 8 <= pixels; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 2));
+		_mm_storeu_si128((__m128i*)(pDst + i * 2), _mm_srli_epi16(v, 4));
+	}
+	Raw16To12_Scalar(pSrc + i * 2, pDst + i * 2, pixels - i);
+}
+
+ASI_TARGET("ssse3")
+static void AccumRow8_SSSE3(const unsigned char* pSrc, unsigned short* pAcc, size_t samples)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i));
+		__m128i lo = _mm_loadu_si128((const __m128i*)(pAcc + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(pAcc + i + 8));
+		_mm_storeu_si128((__m128i*)(pAcc + i), _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128((__m128i*)(pAcc + i + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero)));
+	}
+	AccumRow8_Scalar(pSrc + i, pAcc + i, samples - i);
+}
+
+ASI_TARGET("ssse3")
+static void AccumRow16_SSSE3(const unsigned char* pSrc, unsigned int* pAcc, size_t samples, int shift)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m128i v = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(pSrc + i * 2)), count);
+		__m128i lo = _mm_loadu_si128((const __m128i*)(pAcc + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(pAcc + i + 4));
+		_mm_storeu_si128((__m128i*)(pAcc + i), _mm_add_epi32(lo, _mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128((__m128i*)(pAcc + i + 4), _mm_add_epi32(hi, _mm_unpackhi_epi16(v, zero)));
+	}
+	AccumRow16_Scalar(pSrc + i * 2, pAcc + i, samples - i, shift);
+}
+
+// 4 samples in float, returned as rounded int32 within [0, maxV]
+ASI_TARGET("ssse3")
+static inline __m128i Calibrate4(__m128i raw, const float* pGain, const float* pOffset, __m128 maxV)
+{
+	__m128 v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(raw), _mm_loadu_ps(pGain)), _mm_loadu_ps(pOffset));
+	v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), maxV);
+	return _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+}
+
+ASI_TARGET("ssse3")
+static void Calibrate8_SSSE3(unsigned char* pData, const float* pGain, const float* pOffset, size_t samples)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 maxV = _mm_set1_ps(255.0f);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pData + i)), zero);
+		__m128i lo = Calibrate4(_mm_unpacklo_epi16(v, zero), pGain + i, pOffset + i, maxV);
+		__m128i hi = Calibrate4(_mm_unpackhi_epi16(v, zero), pGain + i + 4, pOffset + i + 4, maxV);
+		_mm_storel_epi64((__m128i*)(pData + i), _mm_packus_epi16(_mm_packs_epi32(lo, hi), zero));
+	}
+	Calibrate8_Scalar(pData + i, pGain + i, pOffset + i, samples - i);
+}
+
+ASI_TARGET("ssse3")
+static void Calibrate16_SSSE3(unsigned short* pData, const float* pGain, const float* pOffset, size_t samples)
+{
+	// no packusdw before SSE4.1: bias into the signed range, pack, bias back
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias32 = _mm_set1_epi32(0x8000);
+	const __m128i bias16 = _mm_set1_epi16(-0x8000);
+	const __m128 maxV = _mm_set1_ps(65535.0f);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(pData + i));
+		__m128i lo = Calibrate4(_mm_unpacklo_epi16(v, zero), pGain + i, pOffset + i, maxV);
+		__m128i hi = Calibrate4(_mm_unpackhi_epi16(v, zero), pGain + i + 4, pOffset + i + 4, maxV);
+		__m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo, bias32), _mm_sub_epi32(hi, bias32));
+		_mm_storeu_si128((__m128i*)(pData + i), _mm_xor_si128(packed, bias16));
+	}
+	Calibrate16_Scalar(pData + i, pGain + i, pOffset + i, samples - i);
+}
+
+// adds the squares of 4 uint32 lanes to 2 uint64 lanes
+ASI_TARGET("ssse3")
+static inline __m128i AddSquares4(__m128i acc, __m128i v)
+{
+	acc = _mm_add_epi64(acc, _mm_mul_epu32(v, v));
+	__m128i odd = _mm_srli_epi64(v, 32);
+	return _mm_add_epi64(acc, _mm_mul_epu32(odd, odd));
+}
+
+ASI_TARGET("ssse3")
+static void Sums16_SSSE3(const unsigned short* pSrc, size_t samples, SampleSums* pSums)
+{
+	// no unsigned 16-bit min/max before SSE4.1: flip the sign bit and use the signed ones
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias16 = _mm_set1_epi16(-0x8000);
+	__m128i vMin = _mm_set1_epi16((short)(pSums->Min ^ 0x8000));
+	__m128i vMax = _mm_set1_epi16((short)(pSums->Max ^ 0x8000));
+	__m128i sumSq = zero;
+	size_t i = 0;
+	while (i + 8 <= samples)
+	{
+		size_t end = samples - i > g_SumsBlock * 4 ? i + g_SumsBlock * 4 : samples;
+		__m128i sum = zero;
+		for (; i + 8 <= end; i += 8)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i));
+			__m128i s = _mm_xor_si128(v, bias16);
+			vMin = _mm_min_epi16(vMin, s);
+			vMax = _mm_max_epi16(vMax, s);
+			__m128i lo = _mm_unpacklo_epi16(v, zero);
+			__m128i hi = _mm_unpackhi_epi16(v, zero);
+			sum = _mm_add_epi32(sum, _mm_add_epi32(lo, hi));
+			sumSq = AddSquares4(AddSquares4(sumSq, lo), hi);
+		}
+		unsigned int lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, sum);
+		pSums->Sum += (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+	unsigned short mins[8], maxs[8];
+	_mm_storeu_si128((__m128i*)mins, _mm_xor_si128(vMin, bias16));
+	_mm_storeu_si128((__m128i*)maxs, _mm_xor_si128(vMax, bias16));
+	unsigned long long sq[2];
+	_mm_storeu_si128((__m128i*)sq, sumSq);
+	for (int k = 0; k < 8; k++)
+	{
+		pSums->Min = mins[k] < pSums->Min ? mins[k] : pSums->Min;
+		pSums->Max = maxs[k] > pSums->Max ? maxs[k] : pSums->Max;
+	}
+	pSums->SumSq += sq[0] + sq[1];
+	Sums16_Scalar(pSrc + i, samples - i, pSums);
+}
+
+// 8 samples widened to 16 bits
+ASI_TARGET("ssse3")
+static inline __m128i Load8x16(const unsigned char* p)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+}
+
+ASI_TARGET("ssse3")
+static inline __m128i Load8x16(const unsigned short* p)
+{
+	return _mm_loadu_si128((const __m128i*)p);
+}
+
+// accumulators of min and max hold samples only, the signed compare is safe
+template <int op>
+ASI_TARGET("ssse3")
+static inline __m128i StackCombine4(__m128i acc, __m128i v)
+{
+	if (op == STACK_ACC_COPY)
+		return v;
+	if (op == STACK_ACC_ADD)
+		return _mm_add_epi32(acc, v);
+	__m128i take = op == STACK_ACC_MIN ? _mm_cmpgt_epi32(acc, v) : _mm_cmpgt_epi32(v, acc);
+	return _mm_or_si128(_mm_and_si128(take, v), _mm_andnot_si128(take, acc));
+}
+
+template <int op, class T>
+ASI_TARGET("ssse3")
+static void StackAccumOp_SSSE3(const T* pSrc, unsigned int* pAcc, size_t samples)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m128i v = Load8x16(pSrc + i);
+		__m128i lo = _mm_loadu_si128((const __m128i*)(pAcc + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(pAcc + i + 4));
+		_mm_storeu_si128((__m128i*)(pAcc + i), StackCombine4<op>(lo, _mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128((__m128i*)(pAcc + i + 4), StackCombine4<op>(hi, _mm_unpackhi_epi16(v, zero)));
+	}
+	StackAccum_Scalar(pSrc + i, pAcc + i, samples - i, op);
+}
+
+template <class T>
+ASI_TARGET("ssse3")
+static void StackAccum_SSSE3(const T* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	switch (op)
+	{
+	case STACK_ACC_COPY: StackAccumOp_SSSE3<STACK_ACC_COPY>(pSrc, pAcc, samples); break;
+	case STACK_ACC_ADD: StackAccumOp_SSSE3<STACK_ACC_ADD>(pSrc, pAcc, samples); break;
+	case STACK_ACC_MIN: StackAccumOp_SSSE3<STACK_ACC_MIN>(pSrc, pAcc, samples); break;
+	case STACK_ACC_MAX: StackAccumOp_SSSE3<STACK_ACC_MAX>(pSrc, pAcc, samples); break;
+	}
+}
+
+ASI_TARGET("ssse3")
+static void StackAccum8_SSSE3(const unsigned char* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	StackAccum_SSSE3(pSrc, pAcc, samples, op);
+}
+
+ASI_TARGET("ssse3")
+static void StackAccum16_SSSE3(const unsigned short* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	StackAccum_SSSE3(pSrc, pAcc, samples, op);
+}
+
+// one Welford step of 4 samples, bKeepAll for the first two frames
+ASI_TARGET("ssse3")
+static inline void ClipStep4(__m128 x, const ClipStats& stats, size_t i, __m128 n, __m128 kappa2, __m128 prev, bool bKeepAll)
+{
+	__m128 mean = _mm_loadu_ps(stats.pMean + i);
+	__m128 m2 = _mm_loadu_ps(stats.pM2 + i);
+	__m128 d = _mm_sub_ps(x, mean);
+	__m128 keep = bKeepAll ? _mm_castsi128_ps(_mm_set1_epi32(-1))
+		: _mm_cmple_ps(_mm_mul_ps(d, d), _mm_div_ps(_mm_mul_ps(kappa2, m2), prev));
+	mean = _mm_add_ps(mean, _mm_div_ps(d, n));
+	m2 = _mm_add_ps(m2, _mm_mul_ps(d, _mm_sub_ps(x, mean)));
+	_mm_storeu_ps(stats.pMean + i, mean);
+	_mm_storeu_ps(stats.pM2 + i, m2);
+	_mm_storeu_ps(stats.pSum + i, _mm_add_ps(_mm_loadu_ps(stats.pSum + i), _mm_and_ps(keep, x)));
+	_mm_storeu_ps(stats.pCount + i, _mm_add_ps(_mm_loadu_ps(stats.pCount + i), _mm_and_ps(keep, _mm_set1_ps(1.0f))));
+}
+
+template <class T>
+ASI_TARGET("ssse3")
+static void ClipAccum_SSSE3(const T* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	if (frames == 0)
+	{
+		ClipAccum_Scalar(pSrc, stats, samples, frames, kappa2);
+		return;
+	}
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 n = _mm_set1_ps((float)(frames + 1));
+	const __m128 k2 = _mm_set1_ps(kappa2);
+	const __m128 prev = _mm_set1_ps((float)(frames - 1));
+	bool bKeepAll = frames < 2;
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m128i v = Load8x16(pSrc + i);
+		ClipStep4(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), stats, i, n, k2, prev, bKeepAll);
+		ClipStep4(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), stats, i + 4, n, k2, prev, bKeepAll);
+	}
+	ClipAccum_Scalar(pSrc + i, OffsetClipStats(stats, i), samples - i, frames, kappa2);
+}
+
+ASI_TARGET("ssse3")
+static void ClipAccum8_SSSE3(const unsigned char* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	ClipAccum_SSSE3(pSrc, stats, samples, frames, kappa2);
+}
+
+ASI_TARGET("ssse3")
+static void ClipAccum16_SSSE3(const unsigned short* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	ClipAccum_SSSE3(pSrc, stats, samples, frames, kappa2);
+}
+
+// one site pair of 8-bit (16-bit) samples per 16-bit (32-bit) lane, the
+// red or blue site in the low half and its green in the high half
+ASI_TARGET("ssse3")
+static inline __m128i LowHalf(__m128i v, const unsigned char*)
+{
+	return _mm_and_si128(v, _mm_set1_epi16(0xFF));
+}
+
+ASI_TARGET("ssse3")
+static inline __m128i LowHalf(__m128i v, const unsigned short*)
+{
+	return _mm_and_si128(v, _mm_set1_epi32(0xFFFF));
+}
+
+ASI_TARGET("ssse3")
+static inline __m128i HighHalf(__m128i v, const unsigned char*)
+{
+	return _mm_srli_epi16(v, 8);
+}
+
+ASI_TARGET("ssse3")
+static inline __m128i HighHalf(__m128i v, const unsigned short*)
+{
+	return _mm_srli_epi32(v, 16);
+}
+
+// (a + b + c + d + 2) >> 2 per lane
+ASI_TARGET("ssse3")
+static inline __m128i Average4(__m128i a, __m128i b, __m128i c, __m128i d, const unsigned char*)
+{
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, d));
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+ASI_TARGET("ssse3")
+static inline __m128i Average4(__m128i a, __m128i b, __m128i c, __m128i d, const unsigned short*)
+{
+	__m128i sum = _mm_add_epi32(_mm_add_epi32(a, b), _mm_add_epi32(c, d));
+	return _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), 2);
+}
+
+/**
+* B, G, R of the site and of the green pixel of each pair in the lanes.
+* The loads one sample to the left put the green of the pair before into
+* the low half, the one to the right the next site into the high half.
+* pavgw rounds (a + b + 1) >> 1 like the scalar code; on 32-bit lanes the
+* high halves are zero and stay zero.
+*/
+template <class T>
+ASI_TARGET("ssse3")
+static inline void BilinearPlanes_SSSE3(const T* pN, const T* pC, const T* pS, bool bRedRow, __m128i site[3], __m128i green[3])
+{
+	__m128i c = _mm_loadu_si128((const __m128i*)pC);
+	__m128i n = _mm_loadu_si128((const __m128i*)pN);
+	__m128i s = _mm_loadu_si128((const __m128i*)pS);
+	__m128i cLeft = LowHalf(_mm_loadu_si128((const __m128i*)(pC - 1)), pC);
+	__m128i nLeft = LowHalf(_mm_loadu_si128((const __m128i*)(pN - 1)), pC);
+	__m128i sLeft = LowHalf(_mm_loadu_si128((const __m128i*)(pS - 1)), pC);
+	__m128i cRight = HighHalf(_mm_loadu_si128((const __m128i*)(pC + 1)), pC);
+	__m128i cSite = LowHalf(c, pC), cGreen = HighHalf(c, pC);
+	__m128i nGreen = HighHalf(n, pC), sGreen = HighHalf(s, pC);
+
+	__m128i cross = Average4(LowHalf(n, pC), LowHalf(s, pC), cLeft, cGreen, pC);
+	__m128i diag = Average4(nLeft, nGreen, sLeft, sGreen, pC);
+	__m128i horz = _mm_avg_epu16(cSite, cRight);
+	__m128i vert = _mm_avg_epu16(nGreen, sGreen);
+	site[0] = bRedRow ? diag : cSite;
+	site[1] = cross;
+	site[2] = bRedRow ? cSite : diag;
+	green[0] = bRedRow ? vert : horz;
+	green[1] = cGreen;
+	green[2] = bRedRow ? horz : vert;
+}
+
+ASI_TARGET("ssse3")
+static void BilinearPairs8_SSSE3(const unsigned char* pN, const unsigned char* pC, const unsigned char* pS, unsigned char* pDst, size_t pairs, bool bRedRow)
+{
+	size_t k = 0;
+	// 8 pairs per step, the loads reach pC[16] like the last scalar pair
+	for (; k + 8 <= pairs; k += 8)
+	{
+		__m128i site[3], green[3];
+		BilinearPlanes_SSSE3(pN + k * 2, pC + k * 2, pS + k * 2, bRedRow, site, green);
+		// B | G << 8 and R | A << 8 per lane, then 32-bit pixels
+		__m128i siteBG = _mm_or_si128(site[0], _mm_slli_epi16(site[1], 8));
+		__m128i greenBG = _mm_or_si128(green[0], _mm_slli_epi16(green[1], 8));
+		__m128i siteLo = _mm_unpacklo_epi16(siteBG, site[2]), siteHi = _mm_unpackhi_epi16(siteBG, site[2]);
+		__m128i greenLo = _mm_unpacklo_epi16(greenBG, green[2]), greenHi = _mm_unpackhi_epi16(greenBG, green[2]);
+		unsigned char* pOut = pDst + k * 8;
+		_mm_storeu_si128((__m128i*)pOut, _mm_unpacklo_epi32(siteLo, greenLo));
+		_mm_storeu_si128((__m128i*)(pOut + 16), _mm_unpackhi_epi32(siteLo, greenLo));
+		_mm_storeu_si128((__m128i*)(pOut + 32), _mm_unpacklo_epi32(siteHi, greenHi));
+		_mm_storeu_si128((__m128i*)(pOut + 48), _mm_unpackhi_epi32(siteHi, greenHi));
+	}
+	BilinearPairs8_Scalar(pN + k * 2, pC + k * 2, pS + k * 2, pDst + k * 8, pairs - k, bRedRow);
+}
+
+ASI_TARGET("ssse3")
+static void BilinearPairs16_SSSE3(const unsigned short* pN, const unsigned short* pC, const unsigned short* pS, unsigned short* pDst, size_t pairs, bool bRedRow)
+{
+	size_t k = 0;
+	for (; k + 4 <= pairs; k += 4)
+	{
+		__m128i site[3], green[3];
+		BilinearPlanes_SSSE3(pN + k * 2, pC + k * 2, pS + k * 2, bRedRow, site, green);
+		__m128i siteBG = _mm_or_si128(site[0], _mm_slli_epi32(site[1], 16));
+		__m128i greenBG = _mm_or_si128(green[0], _mm_slli_epi32(green[1], 16));
+		__m128i siteLo = _mm_unpacklo_epi32(siteBG, site[2]), siteHi = _mm_unpackhi_epi32(siteBG, site[2]);
+		__m128i greenLo = _mm_unpacklo_epi32(greenBG, green[2]), greenHi = _mm_unpackhi_epi32(greenBG, green[2]);
+		unsigned short* pOut = pDst + k * 8;
+		_mm_storeu_si128((__m128i*)pOut, _mm_unpacklo_epi64(siteLo, greenLo));
+		_mm_storeu_si128((__m128i*)(pOut + 8), _mm_unpackhi_epi64(siteLo, greenLo));
+		_mm_storeu_si128((__m128i*)(pOut + 16), _mm_unpacklo_epi64(siteHi, greenHi));
+		_mm_storeu_si128((__m128i*)(pOut + 24), _mm_unpackhi_epi64(siteHi, greenHi));
+	}
+	BilinearPairs16_Scalar(pN + k * 2, pC + k * 2, pS + k * 2, pDst + k * 8, pairs - k, bRedRow);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AVX2: vpshufb works per 128-bit lane, so each lane gets its own 4 pixels
+///////////////////////////////////////////////////////////////////////////////
+
+ASI_TARGET("avx2")
+static inline __m256i Load8RGB24(const unsigned char* p)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i*)p);
+	__m128i hi = _mm_loadu_si128((const __m128i*)(p + 12));
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+ASI_TARGET("avx2")
+static void RGB24ToRGBA32_AVX2(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128,
+		0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128);
+	size_t i = 0;
+	// the second load reads 4 bytes past the 8th pixel
+	for (; i + 10 <= pixels; i += 8)
+	{
+		__m256i v = Load8RGB24(pSrc + i * 3);
+		_mm256_storeu_si256((__m256i*)(pDst + i * 4), _mm256_shuffle_epi8(v, mask));
+	}
+	RGB24ToRGBA32_SSSE3(pSrc + i * 3, pDst + i * 4, pixels - i);
+}
+
+ASI_TARGET("avx2")
+static void RGB24ToRGBA64_AVX2(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	const __m256i maskLo = _mm256_setr_epi8(
+		-128, 0, -128, 1, -128, 2, -128, -128, -128, 3, -128, 4, -128, 5, -128, -128,
+		-128, 0, -128, 1, -128, 2, -128, -128, -128, 3, -128, 4, -128, 5, -128, -128);
+	const __m256i maskHi = _mm256_setr_epi8(
+		-128, 6, -128, 7, -128, 8, -128, -128, -128, 9, -128, 10, -128, 11, -128, -128,
+		-128, 6, -128, 7, -128, 8, -128, -128, -128, 9, -128, 10, -128, 11, -128, -128);
+	size_t i = 0;
+	for (; i + 10 <= pixels; i += 8)
+	{
+		__m256i v = Load8RGB24(pSrc + i * 3);
+		__m256i a = _mm256_shuffle_epi8(v, maskLo);	// pixels 0,1 | 4,5
+		__m256i b = _mm256_shuffle_epi8(v, maskHi);	// pixels 2,3 | 6,7
+		_mm256_storeu_si256((__m256i*)(pDst + i * 8), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i*)(pDst + i * 8 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	RGB24ToRGBA64_SSSE3(pSrc + i * 3, pDst + i * 8, pixels - i);
+}
+
+ASI_TARGET("avx2")
+static void Raw16To12_AVX2(const unsigned char* pSrc, unsigned char* pDst, size_t pixels)
+{
+	size_t i = 0;
+	for (; i + 16 <= pixels; i += 16)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(pSrc + i * 2));
+		_mm256_storeu_si256((__m256i*)(pDst + i * 2), _mm256_srli_epi16(v, 4));
+	}
+	Raw16To12_SSSE3(pSrc + i * 2, pDst + i * 2, pixels - i);
+}
+
+ASI_TARGET("avx2")
+static void AccumRow8_AVX2(const unsigned char* pSrc, unsigned short* pAcc, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		__m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pSrc + i)));
+		__m256i a = _mm256_loadu_si256((const __m256i*)(pAcc + i));
+		_mm256_storeu_si256((__m256i*)(pAcc + i), _mm256_add_epi16(a, v));
+	}
+	AccumRow8_Scalar(pSrc + i, pAcc + i, samples - i);
+}
+
+ASI_TARGET("avx2")
+static void AccumRow16_AVX2(const unsigned char* pSrc, unsigned int* pAcc, size_t samples, int shift)
+{
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m128i v = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(pSrc + i * 2)), count);
+		__m256i a = _mm256_loadu_si256((const __m256i*)(pAcc + i));
+		_mm256_storeu_si256((__m256i*)(pAcc + i), _mm256_add_epi32(a, _mm256_cvtepu16_epi32(v)));
+	}
+	AccumRow16_Scalar(pSrc + i * 2, pAcc + i, samples - i, shift);
+}
+
+// 8 samples in float, returned as rounded int32 within [0, maxV]
+ASI_TARGET("avx2")
+static inline __m256i Calibrate8x32(__m256i raw, const float* pGain, const float* pOffset, __m256 maxV)
+{
+	__m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(raw), _mm256_loadu_ps(pGain)), _mm256_loadu_ps(pOffset));
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), maxV);
+	return _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_set1_ps(0.5f)));
+}
+
+ASI_TARGET("avx2")
+static void Calibrate8_AVX2(unsigned char* pData, const float* pGain, const float* pOffset, size_t samples)
+{
+	const __m256 maxV = _mm256_set1_ps(255.0f);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pData + i)));
+		__m256i r = Calibrate8x32(v, pGain + i, pOffset + i, maxV);
+		__m128i w = _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+		_mm_storel_epi64((__m128i*)(pData + i), _mm_packus_epi16(w, w));
+	}
+	Calibrate8_Scalar(pData + i, pGain + i, pOffset + i, samples - i);
+}
+
+ASI_TARGET("avx2")
+static void Calibrate16_AVX2(unsigned short* pData, const float* pGain, const float* pOffset, size_t samples)
+{
+	const __m256 maxV = _mm256_set1_ps(65535.0f);
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(pData + i)));
+		__m256i r = Calibrate8x32(v, pGain + i, pOffset + i, maxV);
+		_mm_storeu_si128((__m128i*)(pData + i), _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+	}
+	Calibrate16_Scalar(pData + i, pGain + i, pOffset + i, samples - i);
+}
+
+ASI_TARGET("avx2")
+static inline __m256i AddSquares8(__m256i acc, __m256i v)
+{
+	acc = _mm256_add_epi64(acc, _mm256_mul_epu32(v, v));
+	__m256i odd = _mm256_srli_epi64(v, 32);
+	return _mm256_add_epi64(acc, _mm256_mul_epu32(odd, odd));
+}
+
+ASI_TARGET("avx2")
+static void Sums16_AVX2(const unsigned short* pSrc, size_t samples, SampleSums* pSums)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i vMin = _mm256_set1_epi16((short)pSums->Min);
+	__m256i vMax = _mm256_set1_epi16((short)pSums->Max);
+	__m256i sumSq = zero;
+	size_t i = 0;
+	while (i + 16 <= samples)
+	{
+		size_t end = samples - i > g_SumsBlock * 8 ? i + g_SumsBlock * 8 : samples;
+		__m256i sum = zero;
+		for (; i + 16 <= end; i += 16)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i*)(pSrc + i));
+			vMin = _mm256_min_epu16(vMin, v);
+			vMax = _mm256_max_epu16(vMax, v);
+			__m256i lo = _mm256_unpacklo_epi16(v, zero);
+			__m256i hi = _mm256_unpackhi_epi16(v, zero);
+			sum = _mm256_add_epi32(sum, _mm256_add_epi32(lo, hi));
+			sumSq = AddSquares8(AddSquares8(sumSq, lo), hi);
+		}
+		unsigned int lanes[8];
+		_mm256_storeu_si256((__m256i*)lanes, sum);
+		for (int k = 0; k < 8; k++)
+			pSums->Sum += lanes[k];
+	}
+	unsigned short mins[16], maxs[16];
+	_mm256_storeu_si256((__m256i*)mins, vMin);
+	_mm256_storeu_si256((__m256i*)maxs, vMax);
+	unsigned long long sq[4];
+	_mm256_storeu_si256((__m256i*)sq, sumSq);
+	for (int k = 0; k < 16; k++)
+	{
+		pSums->Min = mins[k] < pSums->Min ? mins[k] : pSums->Min;
+		pSums->Max = maxs[k] > pSums->Max ? maxs[k] : pSums->Max;
+	}
+	pSums->SumSq += sq[0] + sq[1] + sq[2] + sq[3];
+	Sums16_SSSE3(pSrc + i, samples - i, pSums);
+}
+
+// 8 samples widened to 32 bits
+ASI_TARGET("avx2")
+static inline __m256i Load8x32(const unsigned char* p)
+{
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p));
+}
+
+ASI_TARGET("avx2")
+static inline __m256i Load8x32(const unsigned short* p)
+{
+	return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));
+}
+
+template <int op>
+ASI_TARGET("avx2")
+static inline __m256i StackCombine8(__m256i acc, __m256i v)
+{
+	if (op == STACK_ACC_COPY)
+		return v;
+	if (op == STACK_ACC_ADD)
+		return _mm256_add_epi32(acc, v);
+	return op == STACK_ACC_MIN ? _mm256_min_epu32(acc, v) : _mm256_max_epu32(acc, v);
+}
+
+template <int op, class T>
+ASI_TARGET("avx2")
+static void StackAccumOp_AVX2(const T* pSrc, unsigned int* pAcc, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		__m256i lo = _mm256_loadu_si256((const __m256i*)(pAcc + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i*)(pAcc + i + 8));
+		_mm256_storeu_si256((__m256i*)(pAcc + i), StackCombine8<op>(lo, Load8x32(pSrc + i)));
+		_mm256_storeu_si256((__m256i*)(pAcc + i + 8), StackCombine8<op>(hi, Load8x32(pSrc + i + 8)));
+	}
+	StackAccum_SSSE3(pSrc + i, pAcc + i, samples - i, op);
+}
+
+template <class T>
+ASI_TARGET("avx2")
+static void StackAccum_AVX2(const T* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	switch (op)
+	{
+	case STACK_ACC_COPY: StackAccumOp_AVX2<STACK_ACC_COPY>(pSrc, pAcc, samples); break;
+	case STACK_ACC_ADD: StackAccumOp_AVX2<STACK_ACC_ADD>(pSrc, pAcc, samples); break;
+	case STACK_ACC_MIN: StackAccumOp_AVX2<STACK_ACC_MIN>(pSrc, pAcc, samples); break;
+	case STACK_ACC_MAX: StackAccumOp_AVX2<STACK_ACC_MAX>(pSrc, pAcc, samples); break;
+	}
+}
+
+ASI_TARGET("avx2")
+static void StackAccum8_AVX2(const unsigned char* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	StackAccum_AVX2(pSrc, pAcc, samples, op);
+}
+
+ASI_TARGET("avx2")
+static void StackAccum16_AVX2(const unsigned short* pSrc, unsigned int* pAcc, size_t samples, int op)
+{
+	StackAccum_AVX2(pSrc, pAcc, samples, op);
+}
+
+ASI_TARGET("avx2")
+static inline void ClipStep8(__m256 x, const ClipStats& stats, size_t i, __m256 n, __m256 kappa2, __m256 prev, bool bKeepAll)
+{
+	__m256 mean = _mm256_loadu_ps(stats.pMean + i);
+	__m256 m2 = _mm256_loadu_ps(stats.pM2 + i);
+	__m256 d = _mm256_sub_ps(x, mean);
+	__m256 keep = bKeepAll ? _mm256_castsi256_ps(_mm256_set1_epi32(-1))
+		: _mm256_cmp_ps(_mm256_mul_ps(d, d), _mm256_div_ps(_mm256_mul_ps(kappa2, m2), prev), _CMP_LE_OQ);
+	mean = _mm256_add_ps(mean, _mm256_div_ps(d, n));
+	m2 = _mm256_add_ps(m2, _mm256_mul_ps(d, _mm256_sub_ps(x, mean)));
+	_mm256_storeu_ps(stats.pMean + i, mean);
+	_mm256_storeu_ps(stats.pM2 + i, m2);
+	_mm256_storeu_ps(stats.pSum + i, _mm256_add_ps(_mm256_loadu_ps(stats.pSum + i), _mm256_and_ps(keep, x)));
+	_mm256_storeu_ps(stats.pCount + i, _mm256_add_ps(_mm256_loadu_ps(stats.pCount + i), _mm256_and_ps(keep, _mm256_set1_ps(1.0f))));
+}
+
+template <class T>
+ASI_TARGET("avx2")
+static void ClipAccum_AVX2(const T* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	if (frames == 0)
+	{
+		ClipAccum_Scalar(pSrc, stats, samples, frames, kappa2);
+		return;
+	}
+	const __m256 n = _mm256_set1_ps((float)(frames + 1));
+	const __m256 k2 = _mm256_set1_ps(kappa2);
+	const __m256 prev = _mm256_set1_ps((float)(frames - 1));
+	bool bKeepAll = frames < 2;
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+		ClipStep8(_mm256_cvtepi32_ps(Load8x32(pSrc + i)), stats, i, n, k2, prev, bKeepAll);
+	ClipAccum_Scalar(pSrc + i, OffsetClipStats(stats, i), samples - i, frames, kappa2);
+}
+
+ASI_TARGET("avx2")
+static void ClipAccum8_AVX2(const unsigned char* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	ClipAccum_AVX2(pSrc, stats, samples, frames, kappa2);
+}
+
+ASI_TARGET("avx2")
+static void ClipAccum16_AVX2(const unsigned short* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2)
+{
+	ClipAccum_AVX2(pSrc, stats, samples, frames, kappa2);
+}
+
+ASI_TARGET("avx2")
+static inline __m256i LowHalf(__m256i v, const unsigned char*)
+{
+	return _mm256_and_si256(v, _mm256_set1_epi16(0xFF));
+}
+
+ASI_TARGET("avx2")
+static inline __m256i LowHalf(__m256i v, const unsigned short*)
+{
+	return _mm256_and_si256(v, _mm256_set1_epi32(0xFFFF));
+}
+
+ASI_TARGET("avx2")
+static inline __m256i HighHalf(__m256i v, const unsigned char*)
+{
+	return _mm256_srli_epi16(v, 8);
+}
+
+ASI_TARGET("avx2")
+static inline __m256i HighHalf(__m256i v, const unsigned short*)
+{
+	return _mm256_srli_epi32(v, 16);
+}
+
+ASI_TARGET("avx2")
+static inline __m256i Average4(__m256i a, __m256i b, __m256i c, __m256i d, const unsigned char*)
+{
+	__m256i sum = _mm256_add_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, d));
+	return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+ASI_TARGET("avx2")
+static inline __m256i Average4(__m256i a, __m256i b, __m256i c, __m256i d, const unsigned short*)
+{
+	__m256i sum = _mm256_add_epi32(_mm256_add_epi32(a, b), _mm256_add_epi32(c, d));
+	return _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(2)), 2);
+}
+
+template <class T>
+ASI_TARGET("avx2")
+static inline void BilinearPlanes_AVX2(const T* pN, const T* pC, const T* pS, bool bRedRow, __m256i site[3], __m256i green[3])
+{
+	__m256i c = _mm256_loadu_si256((const __m256i*)pC);
+	__m256i n = _mm256_loadu_si256((const __m256i*)pN);
+	__m256i s = _mm256_loadu_si256((const __m256i*)pS);
+	__m256i cLeft = LowHalf(_mm256_loadu_si256((const __m256i*)(pC - 1)), pC);
+	__m256i nLeft = LowHalf(_mm256_loadu_si256((const __m256i*)(pN - 1)), pC);
+	__m256i sLeft = LowHalf(_mm256_loadu_si256((const __m256i*)(pS - 1)), pC);
+	__m256i cRight = HighHalf(_mm256_loadu_si256((const __m256i*)(pC + 1)), pC);
+	__m256i cSite = LowHalf(c, pC), cGreen = HighHalf(c, pC);
+	__m256i nGreen = HighHalf(n, pC), sGreen = HighHalf(s, pC);
+
+	__m256i cross = Average4(LowHalf(n, pC), LowHalf(s, pC), cLeft, cGreen, pC);
+	__m256i diag = Average4(nLeft, nGreen, sLeft, sGreen, pC);
+	__m256i horz = _mm256_avg_epu16(cSite, cRight);
+	__m256i vert = _mm256_avg_epu16(nGreen, sGreen);
+	site[0] = bRedRow ? diag : cSite;
+	site[1] = cross;
+	site[2] = bRedRow ? cSite : diag;
+	green[0] = bRedRow ? vert : horz;
+	green[1] = cGreen;
+	green[2] = bRedRow ? horz : vert;
+}
+
+// the unpacks interleave within each 128-bit lane: a and b hold the first
+// half of the pixels in their low lanes and the second in their high ones
+ASI_TARGET("avx2")
+static inline void StoreLanePairs(unsigned char* pOut, __m256i a, __m256i b, __m256i c, __m256i d)
+{
+	_mm256_storeu_si256((__m256i*)pOut, _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i*)(pOut + 32), _mm256_permute2x128_si256(c, d, 0x20));
+	_mm256_storeu_si256((__m256i*)(pOut + 64), _mm256_permute2x128_si256(a, b, 0x31));
+	_mm256_storeu_si256((__m256i*)(pOut + 96), _mm256_permute2x128_si256(c, d, 0x31));
+}
+
+ASI_TARGET("avx2")
+static void BilinearPairs8_AVX2(const unsigned char* pN, const unsigned char* pC, const unsigned char* pS, unsigned char* pDst, size_t pairs, bool bRedRow)
+{
+	size_t k = 0;
+	for (; k + 16 <= pairs; k += 16)
+	{
+		__m256i site[3], green[3];
+		BilinearPlanes_AVX2(pN + k * 2, pC + k * 2, pS + k * 2, bRedRow, site, green);
+		__m256i siteBG = _mm256_or_si256(site[0], _mm256_slli_epi16(site[1], 8));
+		__m256i greenBG = _mm256_or_si256(green[0], _mm256_slli_epi16(green[1], 8));
+		__m256i siteLo = _mm256_unpacklo_epi16(siteBG, site[2]), siteHi = _mm256_unpackhi_epi16(siteBG, site[2]);
+		__m256i greenLo = _mm256_unpacklo_epi16(greenBG, green[2]), greenHi = _mm256_unpackhi_epi16(greenBG, green[2]);
+		StoreLanePairs(pDst + k * 8,
+			_mm256_unpacklo_epi32(siteLo, greenLo), _mm256_unpackhi_epi32(siteLo, greenLo),
+			_mm256_unpacklo_epi32(siteHi, greenHi), _mm256_unpackhi_epi32(siteHi, greenHi));
+	}
+	BilinearPairs8_SSSE3(pN + k * 2, pC + k * 2, pS + k * 2, pDst + k * 8, pairs - k, bRedRow);
+}
+
+ASI_TARGET("avx2")
+static void BilinearPairs16_AVX2(const unsigned short* pN, const unsigned short* pC, const unsigned short* pS, unsigned short* pDst, size_t pairs, bool bRedRow)
+{
+	size_t k = 0;
+	for (; k + 8 <= pairs; k += 8)
+	{
+		__m256i site[3], green[3];
+		BilinearPlanes_AVX2(pN + k * 2, pC + k * 2, pS + k * 2, bRedRow, site, green);
+		__m256i siteBG = _mm256_or_si256(site[0], _mm256_slli_epi32(site[1], 16));
+		__m256i greenBG = _mm256_or_si256(green[0], _mm256_slli_epi32(green[1], 16));
+		__m256i siteLo = _mm256_unpacklo_epi32(siteBG, site[2]), siteHi = _mm256_unpackhi_epi32(siteBG, site[2]);
+		__m256i greenLo = _mm256_unpacklo_epi32(greenBG, green[2]), greenHi = _mm256_unpackhi_epi32(greenBG, green[2]);
+		StoreLanePairs((unsigned char*)(pDst + k * 8),
+			_mm256_unpacklo_epi64(siteLo, greenLo), _mm256_unpackhi_epi64(siteLo, greenLo),
+			_mm256_unpacklo_epi64(siteHi, greenHi), _mm256_unpackhi_epi64(siteHi, greenHi));
+	}
+	BilinearPairs16_SSSE3(pN + k * 2, pC + k * 2, pS + k * 2, pDst + k * 8, pairs - k, bRedRow);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CPU feature detection
+///////////////////////////////////////////////////////////////////////////////
+
+static void CpuId(int leaf, int subLeaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+	int r[4];
+	__cpuidex(r, leaf, subLeaf);
+	for (int i = 0; i < 4; i++)
+		regs[i] = (unsigned int)r[i];
+#else
+	__cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long XGetBV()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+static bool HasSSSE3()
+{
+	unsigned int regs[4];
+	CpuId(1, 0, regs);
+	return (regs[2] & (1u << 9)) != 0;
+}
+
+static bool HasAVX2()
+{
+	unsigned int regs[4];
+	CpuId(0, 0, regs);
+	if (regs[0] < 7)
+		return false;
+	CpuId(1, 0, regs);
+	// AVX and OSXSAVE, and the OS saves the YMM registers
+	if ((regs[2] & (1u << 27)) == 0 || (regs[2] & (1u << 28)) == 0)
+		return false;
+	if ((XGetBV() & 6) != 6)
+		return false;
+	CpuId(7, 0, regs);
+	return (regs[1] & (1u << 5)) != 0;
+}
+
+#endif // ASI_X86
+
+static const PixelKernels g_ScalarKernels = {
+	"scalar",
+	RGB24ToRGBA32_Scalar, RGB24ToRGBA64_Scalar, Raw16To12_Scalar,
+	AccumRow8_Scalar, AccumRow16_Scalar,
+	Calibrate8_Scalar, Calibrate16_Scalar,
+	Sums16_Scalar,
+	StackAccum8_Scalar, StackAccum16_Scalar,
+	ClipAccum8_Scalar, ClipAccum16_Scalar,
+	BilinearPairs8_Scalar, BilinearPairs16_Scalar
+};
+#ifdef ASI_X86
+static const PixelKernels g_SSSE3Kernels = {
+	"SSSE3",
+	RGB24ToRGBA32_SSSE3, RGB24ToRGBA64_SSSE3, Raw16To12_SSSE3,
+	AccumRow8_SSSE3, AccumRow16_SSSE3,
+	Calibrate8_SSSE3, Calibrate16_SSSE3,
+	Sums16_SSSE3,
+	StackAccum8_SSSE3, StackAccum16_SSSE3,
+	ClipAccum8_SSSE3, ClipAccum16_SSSE3,
+	BilinearPairs8_SSSE3, BilinearPairs16_SSSE3
+};
+static const PixelKernels g_AVX2Kernels = {
+	"AVX2",
+	RGB24ToRGBA32_AVX2, RGB24ToRGBA64_AVX2, Raw16To12_AVX2,
+	AccumRow8_AVX2, AccumRow16_AVX2,
+	Calibrate8_AVX2, Calibrate16_AVX2,
+	Sums16_AVX2,
+	StackAccum8_AVX2, StackAccum16_AVX2,
+	ClipAccum8_AVX2, ClipAccum16_AVX2,
+	BilinearPairs8_AVX2, BilinearPairs16_AVX2
+};
+#endif
+
+int GetSupportedPixelKernels(const PixelKernels** ppKernels, int maxNum)
+{
+	int n = 0;
+	if (n < maxNum)
+		ppKernels[n++] = &g_ScalarKernels;
+#ifdef ASI_X86
+	if (HasSSSE3() && n < maxNum)
+		ppKernels[n++] = &g_SSSE3Kernels;
+	if (HasSSSE3() && HasAVX2() && n < maxNum)
+		ppKernels[n++] = &g_AVX2Kernels;
+#endif
+	return n;
+}
+
+static const PixelKernels* SelectPixelKernels()
+{
+	const PixelKernels* pKernels[3];
+	int n = GetSupportedPixelKernels(pKernels, 3);
+	return pKernels[n - 1];
+}
+
+// resolved during DLL load, before any camera is created
+static const PixelKernels* g_pKernels = SelectPixelKernels();
+
+const PixelKernels& GetPixelKernels()
+{
+	return *g_pKernels;
+}
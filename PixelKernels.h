@@ -0,0 +1,109 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PixelKernels.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pixel format conversion kernels (scalar, SSSE3, AVX2) with
+//                CPU feature detection at load time
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+
+/**
+* One set of conversion kernels. All of them work on a run of whole pixels,
+* so a caller may pass a full frame or a stripe of rows.
+*
+* RGB24ToRGBA32: 3 bytes in, the same 3 bytes plus a zero byte out.
+* RGB24ToRGBA64: every 8-bit channel becomes a 16-bit little-endian value
+*                with the data in the high byte, alpha is zero.
+* Raw16To12:     16-bit samples shifted right by 4 into 12-bit range.
+* AccumRow8/16:  adds one row of 8-bit (16-bit, shifted right first)
+*                samples to a wider accumulator row, used by binning.
+* Calibrate8/16: raw * gain + offset per sample, rounded and clamped to the
+*                sample range, in place; used by dark/flat calibration.
+* Sums16:        min, max, sum and sum of squares of 16-bit samples, merged
+*                into a SampleSums; used by frame statistics.
+* StackAccum8/16: combines a run of samples into 32-bit accumulators by one
+*                of the StackAccumOp operations; used by frame stacking.
+* ClipAccum8/16: adds a run of samples to the running statistics of
+*                sigma-clipped stacking; frames is the number of frames
+*                already in them.
+* BilinearPairs8/16: bilinear demosaicing of pairs of a red or blue site
+*                at pC[0] and the green site right of it, with the rows
+*                above and below; reads pC[-1] to pC[2 * pairs] and writes
+*                2 * pairs BGRA pixels. Used by debayering.
+*
+* Apart from the in-place calibration, source and destination never
+* overlap: the conversion doubles as the copy out of the SDK buffer.
+*/
+// running totals of Sums16, start with Min = 0xFFFF and the rest zero
+struct SampleSums
+{
+	unsigned int Min, Max;
+	unsigned long long Sum, SumSq;
+};
+
+// the accumulator is only ever compared with samples, so min and max
+// accumulators stay within 16 bits
+enum StackAccumOp
+{
+	STACK_ACC_COPY = 0,
+	STACK_ACC_ADD,
+	STACK_ACC_MIN,
+	STACK_ACC_MAX
+};
+
+/**
+* Per-sample planes of sigma-clipped stacking, Welford's mean and sum of
+* squared deviations over all frames, and sum and count of the samples
+* within kappa sigma of the frames before them. A sample is always kept
+* from the first two frames.
+*/
+struct ClipStats
+{
+	float* pMean;
+	float* pM2;
+	float* pSum;
+	float* pCount;
+};
+
+struct PixelKernels
+{
+	const char* Name;
+	void (*RGB24ToRGBA32)(const unsigned char* pSrc, unsigned char* pDst, size_t pixels);
+	void (*RGB24ToRGBA64)(const unsigned char* pSrc, unsigned char* pDst, size_t pixels);
+	void (*Raw16To12)(const unsigned char* pSrc, unsigned char* pDst, size_t pixels);
+	void (*AccumRow8)(const unsigned char* pSrc, unsigned short* pAcc, size_t samples);
+	void (*AccumRow16)(const unsigned char* pSrc, unsigned int* pAcc, size_t samples, int shift);
+	void (*Calibrate8)(unsigned char* pData, const float* pGain, const float* pOffset, size_t samples);
+	void (*Calibrate16)(unsigned short* pData, const float* pGain, const float* pOffset, size_t samples);
+	void (*Sums16)(const unsigned short* pSrc, size_t samples, SampleSums* pSums);
+	void (*StackAccum8)(const unsigned char* pSrc, unsigned int* pAcc, size_t samples, int op);
+	void (*StackAccum16)(const unsigned short* pSrc, unsigned int* pAcc, size_t samples, int op);
+	void (*ClipAccum8)(const unsigned char* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2);
+	void (*ClipAccum16)(const unsigned short* pSrc, const ClipStats& stats, size_t samples, int frames, float kappa2);
+	void (*BilinearPairs8)(const unsigned char* pN, const unsigned char* pC, const unsigned char* pS, unsigned char* pDst, size_t pairs, bool bRedRow);
+	void (*BilinearPairs16)(const unsigned short* pN, const unsigned short* pC, const unsigned short* pS, unsigned short* pDst, size_t pairs, bool bRedRow);
+};
+
+// best kernel set the running CPU supports, chosen once when the DLL loads
+const PixelKernels& GetPixelKernels();
+
+// every kernel set the running CPU supports, scalar first
+int GetSupportedPixelKernels(const PixelKernels** ppKernels, int maxNum);
@@ -25,30 +25,15 @@
 
 #include "ASICamera.h"
 
-inline static void OutputDbgPrint(const char* strOutPutString, ...)
-{
-#ifdef _DEBUG
-	char strBuf[128] = {0};
-	sprintf(strBuf, "<%s> ", "MM_ASI");
-	va_list vlArgs;
-	va_start(vlArgs, strOutPutString);
-	vsnprintf((char*)(strBuf+strlen(strBuf)), sizeof(strBuf)-strlen(strBuf), strOutPutString, vlArgs);
-	va_end(vlArgs);
-
-#ifdef _WINDOWS
-	OutputDebugStringA(strBuf);
-#elif defined _LIN
-	printf("%s",strBuf);
-#endif
-
-#endif
-}
+#include <cassert>
+
 SequenceThread::SequenceThread(ASICamera* pCam)
-   :intervalMs_(100.0),
+   :camera_(pCam),
+   stop_(true),
+   active_(false),
    numImages_(0),
    imageCounter_(0),
-   stop_(true),
-   camera_(pCam)
+   intervalMs_(100.0)
 {};
 
 SequenceThread::~SequenceThread() {};
@@ -59,29 +44,39 @@ void SequenceThread::Stop() {
 
 void SequenceThread::Start(long numImages, double intervalMs)
 {
+   Join();//a previous run may have ended by itself
    numImages_= numImages;
    intervalMs_=intervalMs;
    imageCounter_=0;
    stop_ = false;
-   OutputDbgPrint("bf act\n");
+   active_ = true;
+   ASI_LOG_DEBUG("bf act");
    activate();//ʼ߳
-   OutputDbgPrint("af act\n");
+   ASI_LOG_DEBUG("af act");
 }
 
 bool SequenceThread::IsStopped(){
    return stop_;
 }
 
+/**
+* Waits for the thread to exit, whether it was stopped or ended by itself.
+* Does nothing when there is no run to join.
+*/
+void SequenceThread::Join()
+{
+   if (!active_)
+      return;
+   wait();
+   active_ = false;
+}
+
 
 int SequenceThread::svc(void) throw()
 {
    int ret=DEVICE_ERR;
-   if(camera_->uc_pImg == 0)
-   {
-	   	camera_->iBufSize = camera_->GetImageBufferSize();
-		camera_->uc_pImg = new unsigned char[camera_->iBufSize];
-		OutputDbgPrint("buf %d\n", camera_->iBufSize);
-   }
+   // StartSequenceAcquisition() sizes the buffer for the SDK layout before the start
+   assert(camera_->uc_pImg != 0);
 
  
 	 
@@ -90,7 +85,97 @@ int SequenceThread::svc(void) throw()
          ret = camera_->RunSequenceOnThread(0);//startTime_
       } while (!IsStopped() );//DEVICE_OK == ret &&           && imageCounter_++ < numImages_-1
 	  ASIStopVideoCapture(camera_->ASICameraInfo.CameraID);
-   camera_->OnThreadExiting();
+   // the insert thread drains what is left in the queue and reports the end
+   camera_->insThd_->Finish();
    Stop();
    return ret;
+}
+
+InsertThread::InsertThread(ASICamera* pCam)
+   :camera_(pCam),
+   finish_(false),
+   stop_(true)
+{};
+
+InsertThread::~InsertThread() {};
+
+void InsertThread::Start()
+{
+   Stop();//joins a run that ended on overflow
+   finish_ = false;
+   stop_ = false;
+   activate();
+}
+
+/**
+* Tells the thread no more frames will be committed. Does not block.
+*/
+void InsertThread::Finish()
+{
+   finish_ = true;
+   camera_->frameQueue.Wake();
+}
+
+/**
+* Drains the queue and waits for the thread to exit.
+*/
+void InsertThread::Stop()
+{
+   if (stop_)
+      return;
+   Finish();
+   wait();
+   stop_ = true;
+}
+
+bool InsertThread::IsStopped(){
+   return stop_;
+}
+
+ArmedSnapThread::ArmedSnapThread(ASICamera* pCam)
+   :camera_(pCam)
+{};
+
+ArmedSnapThread::~ArmedSnapThread() {};
+
+void ArmedSnapThread::Start()
+{
+   activate();
+}
+
+int ArmedSnapThread::svc(void) throw()
+{
+   camera_->ExposeSingleSnap(camera_->armedSnap);
+   return DEVICE_OK;
+}
+
+int InsertThread::svc(void) throw()
+{
+   int ret = DEVICE_OK;
+   bool bDiscard = false;
+   for (;;)
+   {
+      FrameSlot* pSlot = camera_->frameQueue.Front(20);
+      if (pSlot == 0)
+      {
+         if (finish_ && camera_->frameQueue.GetOccupancy() == 0)
+            break;
+         continue;
+      }
+      if (!bDiscard)
+      {
+         ret = camera_->InsertImage(*pSlot);
+         if (ret == DEVICE_BUFFER_OVERFLOW)
+         {
+            // stop-on-overflow: nothing more goes to the core, the grab
+            // thread stops and Finish()es us once the SDK is stopped
+            bDiscard = true;
+            camera_->thd_->Stop();
+         }
+      }
+      camera_->frameQueue.PopFront();
+   }
+   // Status stays with StopSequenceAcquisition() on the owner thread
+   camera_->OnThreadExiting();
+   return ret;
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SoftBinning.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Software binning of SDK frames, on its own or on top of the
+//                SDK (hardware) binning
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "SoftBinning.h"
+#include "PixelKernels.h"
+
+#include <cstring>
+#include <vector>
+
+// the Bin source rows of an output row are added up column-wise with the
+// SIMD kernels; that pass touches every input sample. The horizontal pass
+// then only sees 1/Bin of the data.
+static void AccumRows(const SoftBinJob& job, const unsigned char* pRow, size_t stride, size_t samples, unsigned short* pAcc)
+{
+	const PixelKernels& kernels = GetPixelKernels();
+	memset(pAcc, 0, samples * sizeof(unsigned short));
+	for (int j = 0; j < job.Bin; j++)
+		kernels.AccumRow8(pRow + j * stride, pAcc, samples);
+}
+
+static void AccumRows(const SoftBinJob& job, const unsigned char* pRow, size_t stride, size_t samples, unsigned int* pAcc)
+{
+	const PixelKernels& kernels = GetPixelKernels();
+	memset(pAcc, 0, samples * sizeof(unsigned int));
+	for (int j = 0; j < job.Bin; j++)
+		kernels.AccumRow16(pRow + j * stride, pAcc, samples, job.Shift);
+}
+
+template <class Acc>
+static void BinRows(const SoftBinJob& job, int rowBegin, int rowEnd)
+{
+	int outWidth = job.SrcWidth / job.Bin;
+	int ch = job.Channels;
+	size_t samples = (size_t)outWidth * job.Bin * ch;	// used columns only
+	size_t srcStride = (size_t)job.SrcWidth * ch * job.InBytes;
+	size_t dstStride = (size_t)outWidth * ch * job.OutBytes;
+	unsigned int n = job.Bin * job.Bin;
+	unsigned int maxOut = job.OutBytes == 1 ? 0xFF : 0xFFFF;
+
+	std::vector<Acc> acc(samples);
+	for (int y = rowBegin; y < rowEnd; y++)
+	{
+		AccumRows(job, job.pSrc + (size_t)y * job.Bin * srcStride, srcStride, samples, &acc[0]);
+
+		unsigned char* pOut8 = job.pDst + (size_t)y * dstStride;
+		unsigned short* pOut16 = (unsigned short*)pOut8;
+		const Acc* pAcc = &acc[0];
+		for (int x = 0; x < outWidth; x++, pAcc += job.Bin * ch)
+		{
+			for (int c = 0; c < ch; c++)
+			{
+				unsigned int sum = 0;
+				for (int i = 0; i < job.Bin; i++)
+					sum += pAcc[i * ch + c];
+				if (job.bAverage)
+					sum = (sum + n / 2) / n;
+				else if (sum > maxOut)
+					sum = maxOut;
+				if (job.OutBytes == 1)
+					*pOut8++ = (unsigned char)sum;
+				else
+					*pOut16++ = (unsigned short)sum;
+			}
+		}
+	}
+}
+
+void SoftBinRows(void* pJob, int rowBegin, int rowEnd)
+{
+	const SoftBinJob& job = *(const SoftBinJob*)pJob;
+	if (job.InBytes == 1)
+		BinRows<unsigned short>(job, rowBegin, rowEnd);
+	else
+		BinRows<unsigned int>(job, rowBegin, rowEnd);
+}
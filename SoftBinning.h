@@ -0,0 +1,48 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SoftBinning.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Software binning of SDK frames, on its own or on top of the
+//                SDK (hardware) binning
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+/**
+* Bins Bin x Bin blocks of an interleaved frame, every channel separately.
+* Columns and rows that do not fill a whole block are dropped.
+*
+* InBytes is 1 or 2; 16-bit samples are shifted right by Shift before they
+* are added, which folds the 12-bit conversion into the same pass. The
+* result is either the rounded average or the sum, clamped to the range of
+* OutBytes (1 or 2).
+*/
+struct SoftBinJob
+{
+	const unsigned char* pSrc;
+	unsigned char* pDst;
+	int SrcWidth;		// pixels per source row
+	int Channels;
+	int InBytes, OutBytes;
+	int Shift;
+	int Bin;
+	bool bAverage;
+};
+
+// bins output rows [rowBegin, rowEnd), matches WorkerPool::StripeFunc
+void SoftBinRows(void* pJob, int rowBegin, int rowEnd);
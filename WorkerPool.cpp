@@ -0,0 +1,277 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WorkerPool.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Persistent worker threads that process a frame in row stripes,
+//                with work stealing between the participants
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "WorkerPool.h"
+
+#ifdef _WINDOWS
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static unsigned long long Pack(unsigned int begin, unsigned int end)
+{
+	return ((unsigned long long)begin << 32) | end;
+}
+
+static unsigned int Begin(unsigned long long range)
+{
+	return (unsigned int)(range >> 32);
+}
+
+static unsigned int End(unsigned long long range)
+{
+	return (unsigned int)range;
+}
+
+static unsigned int Left(unsigned long long range)
+{
+	return Begin(range) < End(range) ? End(range) - Begin(range) : 0;
+}
+
+WorkerPool::WorkerPool() :
+	pShares(0),
+	generation(0),
+	iBusyWorkers(0),
+	bQuit(false),
+	jobFunc(0),
+	pJobCtx(0),
+	iJobRows(0),
+	iJobStripeRows(1)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	Stop();
+}
+
+/**
+* (Re)creates the workers. numThreads counts the thread calling Run(), so
+* 1 means no workers and every Run() executes inline. Worker i is pinned to
+* the i-th set bit of affinityMask (wrapping), 0 leaves them to the OS.
+*/
+void WorkerPool::Start(int numThreads, unsigned long long affinityMask)
+{
+	Stop();
+	if (numThreads < 1)
+		numThreads = 1;
+
+	std::vector<int> cpus;
+	for (int i = 0; i < 64; i++)
+	{
+		if (affinityMask & (1ULL << i))
+			cpus.push_back(i);
+	}
+
+	pShares = new Share[numThreads];
+	for (int i = 0; i < numThreads; i++)
+		pShares[i].range.store(0, std::memory_order_relaxed);
+	bQuit = false;
+	generation = 0;
+	iBusyWorkers = 0;
+
+	for (int i = 0; i < numThreads - 1; i++)
+	{
+		WorkerThread* pThd = new WorkerThread(this, i, cpus.empty() ? -1 : cpus[i % cpus.size()]);
+		threads.push_back(pThd);
+		pThd->activate();
+	}
+}
+
+void WorkerPool::Stop()
+{
+	std::lock_guard<std::mutex> run(runLock);
+	{
+		std::lock_guard<std::mutex> lk(wakeLock);
+		bQuit = true;
+	}
+	wakeCond.notify_all();
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i]->wait();
+		delete threads[i];
+	}
+	threads.clear();
+	delete[] pShares;
+	pShares = 0;
+}
+
+/**
+* Calls func for every stripe of stripeRows rows in [0, rows) and returns
+* when all of them are done. The calling thread works too.
+*/
+void WorkerPool::Run(int rows, int stripeRows, StripeFunc func, void* pCtx)
+{
+	if (rows <= 0)
+		return;
+	if (stripeRows < 1)
+		stripeRows = 1;
+
+	std::lock_guard<std::mutex> run(runLock);
+	unsigned int stripes = (unsigned int)((rows + stripeRows - 1) / stripeRows);
+	if (threads.empty() || stripes < 2)
+	{
+		func(pCtx, 0, rows);
+		return;
+	}
+
+	// no participant is inside a job here, so the shares can be reset freely
+	unsigned int participants = (unsigned int)threads.size() + 1;
+	for (unsigned int i = 0; i < participants; i++)
+		pShares[i].range.store(Pack(stripes * i / participants, stripes * (i + 1) / participants), std::memory_order_relaxed);
+	jobFunc = func;
+	pJobCtx = pCtx;
+	iJobRows = rows;
+	iJobStripeRows = stripeRows;
+	{
+		std::lock_guard<std::mutex> lk(wakeLock);
+		iBusyWorkers = (int)threads.size();
+		generation++;
+	}
+	wakeCond.notify_all();
+
+	Participate(participants - 1);
+
+	std::unique_lock<std::mutex> lk(wakeLock);
+	while (iBusyWorkers != 0)
+		doneCond.wait(lk);
+}
+
+void WorkerPool::WorkerLoop(int index)
+{
+	unsigned long seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lk(wakeLock);
+			while (!bQuit && generation == seen)
+				wakeCond.wait(lk);
+			if (bQuit)
+				return;
+			seen = generation;
+		}
+
+		Participate(index);
+
+		std::lock_guard<std::mutex> lk(wakeLock);
+		if (--iBusyWorkers == 0)
+			doneCond.notify_one();
+	}
+}
+
+void WorkerPool::Participate(int index)
+{
+	unsigned int stripe;
+	while (NextStripe(index, stripe))
+	{
+		int rowBegin = (int)stripe * iJobStripeRows;
+		int rowEnd = rowBegin + iJobStripeRows;
+		if (rowEnd > iJobRows)
+			rowEnd = iJobRows;
+		jobFunc(pJobCtx, rowBegin, rowEnd);
+	}
+}
+
+/**
+* Takes the next stripe from the front of our own share. When that is empty,
+* steals the back half of the fullest share and keeps all but its first
+* stripe as our new share. Stripes never return to a share once taken, so a
+* stale range seen by another thief can never compare equal again.
+*/
+bool WorkerPool::NextStripe(int index, unsigned int& stripe)
+{
+	int participants = (int)threads.size() + 1;
+	std::atomic<unsigned long long>& own = pShares[index].range;
+	for (;;)
+	{
+		unsigned long long r = own.load(std::memory_order_acquire);
+		while (Left(r) > 0)
+		{
+			if (own.compare_exchange_weak(r, Pack(Begin(r) + 1, End(r)), std::memory_order_acq_rel))
+			{
+				stripe = Begin(r);
+				return true;
+			}
+		}
+
+		int victim = -1;
+		unsigned int most = 0;
+		unsigned long long victimRange = 0;
+		for (int i = 0; i < participants; i++)
+		{
+			if (i == index)
+				continue;
+			unsigned long long vr = pShares[i].range.load(std::memory_order_acquire);
+			if (Left(vr) > most)
+			{
+				most = Left(vr);
+				victim = i;
+				victimRange = vr;
+			}
+		}
+		if (victim < 0)
+			return false;
+
+		// the victim keeps [begin, mid), we take [mid, end)
+		unsigned int mid = Begin(victimRange) + most / 2;
+		if (!pShares[victim].range.compare_exchange_strong(victimRange, Pack(Begin(victimRange), mid), std::memory_order_acq_rel))
+			continue;
+		own.store(Pack(mid + 1, End(victimRange)), std::memory_order_release);
+		stripe = mid;
+		return true;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WorkerThread
+///////////////////////////////////////////////////////////////////////////////
+
+WorkerThread::WorkerThread(WorkerPool* pPool, int index, int cpu) :
+	pool_(pPool),
+	index_(index),
+	cpu_(cpu)
+{
+}
+
+WorkerThread::~WorkerThread()
+{
+}
+
+int WorkerThread::svc(void) throw()
+{
+	if (cpu_ >= 0)
+	{
+#ifdef _WINDOWS
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu_);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu_, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+	}
+	pool_->WorkerLoop(index_);
+	return 0;
+}
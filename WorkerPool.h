@@ -0,0 +1,104 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WorkerPool.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Persistent worker threads that process a frame in row stripes,
+//                with work stealing between the participants
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "DeviceThreads.h"
+
+class WorkerThread;
+
+/**
+* Run() splits [0, rows) into stripes and hands every participant (the
+* workers plus the calling thread) a contiguous share of them. A participant
+* takes stripes from the front of its own share; once that is empty it
+* steals the back half of the largest remaining share, so a stripe that
+* runs long on one core does not leave the others idle.
+*
+* The threads are created by Start() and sleep between frames. Run() may be
+* called from any thread, concurrent calls are serialized.
+*/
+class WorkerPool
+{
+public:
+	typedef void (*StripeFunc)(void* pCtx, int rowBegin, int rowEnd);
+
+	WorkerPool();
+	~WorkerPool();
+
+	void Start(int numThreads, unsigned long long affinityMask);
+	void Stop();
+	// threads working on a Run(), the caller included
+	int GetParallelism() const { return (int)threads.size() + 1; }
+
+	void Run(int rows, int stripeRows, StripeFunc func, void* pCtx);
+
+private:
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+
+	friend class WorkerThread;
+	void WorkerLoop(int index);
+	void Participate(int index);
+	bool NextStripe(int index, unsigned int& stripe);
+
+	// [begin, end) of one participant's stripes, packed so that taking from
+	// the front and stealing from the back are single CAS operations
+	struct Share
+	{
+		std::atomic<unsigned long long> range;
+		char pad[64 - sizeof(std::atomic<unsigned long long>)];
+	};
+
+	std::vector<WorkerThread*> threads;
+	Share* pShares;					// one per worker, the caller uses the last
+
+	std::mutex runLock;				// one Run() at a time
+	std::mutex wakeLock;
+	std::condition_variable wakeCond, doneCond;
+	unsigned long generation;		// bumped for every job, under wakeLock
+	int iBusyWorkers;				// workers still inside the current job
+	bool bQuit;
+
+	// current job, written before generation is bumped
+	StripeFunc jobFunc;
+	void* pJobCtx;
+	int iJobRows, iJobStripeRows;
+};
+
+class WorkerThread : public MMDeviceThreadBase
+{
+public:
+	WorkerThread(WorkerPool* pPool, int index, int cpu);
+	~WorkerThread();
+
+private:
+	int svc(void) throw();
+	WorkerPool* pool_;
+	int index_;
+	int cpu_;						// core to pin to, -1 for no affinity
+};
@@ -0,0 +1,259 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AsyncLogTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Ring wrap, drops when full, concurrent writers and the per-site
+//                rate limit of the asynchronous log
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "AsyncLog.h"
+#include "TestCheck.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// AsyncLog::LOG_RING_SIZE and LOG_TEXT_SIZE
+static const int g_RingSize = 1024;
+static const size_t g_TextSize = 232;
+static const char* g_LogFile = "ASICamera_mg_log.txt";
+
+struct LogLine
+{
+	std::string Tag;
+	std::string Text;
+};
+
+/**
+* The lines written since the last call, split into level tag and text;
+* "N log messages dropped" lines only add to *pDropped. The flush thread
+* runs only between Acquire() and Release(), so after Release() the file
+* is complete.
+*/
+static std::vector<LogLine> TakeLog(long* pDropped)
+{
+	std::vector<LogLine> lines;
+	FILE* fp = fopen(g_LogFile, "r");
+	if (fp == 0)
+		return lines;
+	char buf[1024];
+	while (fgets(buf, sizeof(buf), fp))
+	{
+		buf[strcspn(buf, "\n")] = 0;
+		long n;
+		if (sscanf(buf, "<MM_ASI> %ld log messages dropped", &n) == 1)
+		{
+			*pDropped += n;
+			continue;
+		}
+		const char* p = strstr(buf, " <MM_ASI> ");
+		if (p == 0 || p - buf < 6)
+			continue;
+		LogLine l;
+		l.Tag.assign(p - 5, 5);
+		l.Text = p + strlen(" <MM_ASI> ");
+		lines.push_back(l);
+	}
+	fclose(fp);
+	remove(g_LogFile);
+	return lines;
+}
+
+static void Flush()
+{
+	AsyncLog::Acquire();
+	AsyncLog::Release();
+}
+
+// positions run past the ring size several times; nothing is lost and
+// the order is kept
+static void CheckWrap()
+{
+	int next = 0;
+	for (int round = 0; round < 5; round++)
+	{
+		int first = next;
+		for (int i = 0; i < 700; i++)
+			AsyncLog::Write(LOG_INFO, 0, "wrap %d", next++);
+		Flush();
+		long dropped = 0;
+		std::vector<LogLine> lines = TakeLog(&dropped);
+		CHECK_AT(dropped == 0, "round %d", round);
+		CHECK_AT(lines.size() == 700, "round %d lines %zu", round, lines.size());
+		for (size_t i = 0; i < lines.size(); i++)
+		{
+			char want[32];
+			snprintf(want, sizeof(want), "wrap %d", first + (int)i);
+			CHECK_AT(lines[i].Text == want && lines[i].Tag == "INFO ", "round %d line %zu: %s", round, i, lines[i].Text.c_str());
+		}
+	}
+}
+
+// with no flush thread a full ring drops the newest messages and says how many
+static void CheckDrops()
+{
+	for (int i = 0; i < g_RingSize + 300; i++)
+		AsyncLog::Write(LOG_ERROR, 0, "fill %d", i);
+	Flush();
+	long dropped = 0;
+	std::vector<LogLine> lines = TakeLog(&dropped);
+	CHECK_AT(dropped == 300, "dropped %ld", dropped);
+	CHECK_AT(lines.size() == (size_t)g_RingSize, "lines %zu", lines.size());
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		char want[32];
+		snprintf(want, sizeof(want), "fill %d", (int)i);
+		CHECK_AT(lines[i].Text == want && lines[i].Tag == "ERROR", "line %zu: %s", i, lines[i].Text.c_str());
+	}
+
+	// the ring takes messages again once flushed
+	AsyncLog::Write(LOG_WARNING, 0, "after");
+	Flush();
+	dropped = 0;
+	lines = TakeLog(&dropped);
+	CHECK(dropped == 0 && lines.size() == 1 && lines[0].Text == "after" && lines[0].Tag == "WARN ");
+}
+
+// trailing newlines go, long text is cut to the slot, suppressed counts are appended
+static void CheckFormat()
+{
+	std::string longText(500, 'x');
+	AsyncLog::Write(LOG_INFO, 0, "trimmed\n\n");
+	AsyncLog::Write(LOG_INFO, 0, "%s", longText.c_str());
+	AsyncLog::Write(LOG_INFO, 3, "held back");
+	Flush();
+	long dropped = 0;
+	std::vector<LogLine> lines = TakeLog(&dropped);
+	CHECK(lines.size() == 3);
+	if (lines.size() == 3)
+	{
+		CHECK(lines[0].Text == "trimmed");
+		CHECK(lines[1].Text == std::string(g_TextSize - 1, 'x'));
+		CHECK(lines[2].Text == "held back (3 similar suppressed)");
+	}
+}
+
+static const int g_Writers = 4;
+static const int g_PerWriter = 5000;
+
+static void WriteMany(int writer)
+{
+	for (int i = 0; i < g_PerWriter; i++)
+	{
+		AsyncLog::Write(LOG_INFO, 0, "t%d %d", writer, i);
+		if (i % 64 == 0)
+			std::this_thread::yield();
+	}
+}
+
+/**
+* Writers race for slots while the flush thread drains the ring. Every
+* message is either in the file exactly once or counted as dropped, and
+* each writer's messages keep their order.
+*/
+static void CheckConcurrentWriters()
+{
+	AsyncLog::Acquire();
+	std::vector<std::thread> thds;
+	for (int t = 0; t < g_Writers; t++)
+		thds.push_back(std::thread(WriteMany, t));
+	for (size_t i = 0; i < thds.size(); i++)
+		thds[i].join();
+	AsyncLog::Release();
+
+	long dropped = 0;
+	std::vector<LogLine> lines = TakeLog(&dropped);
+	int last[g_Writers];
+	for (int t = 0; t < g_Writers; t++)
+		last[t] = -1;
+	bool bOrdered = true;
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		int t, n;
+		if (sscanf(lines[i].Text.c_str(), "t%d %d", &t, &n) != 2 || t < 0 || t >= g_Writers || n <= last[t])
+		{
+			bOrdered = false;
+			break;
+		}
+		last[t] = n;
+	}
+	CHECK(bOrdered);
+	CHECK_AT((long)lines.size() + dropped == (long)g_Writers * g_PerWriter, "lines %zu dropped %ld", lines.size(), dropped);
+}
+
+static long long SteadySecond()
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// LOG_SITE_BURST messages a second get through, the next one let through
+// carries the count of those held back
+static void CheckRateLimit()
+{
+	static LogRateLimit limit;
+	int suppressed = -1;
+	// start at the beginning of a second, so the burst cannot straddle two
+	long long s = SteadySecond();
+	while (SteadySecond() == s)
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	int allowed = 0;
+	for (int i = 0; i < LogRateLimit::LOG_SITE_BURST + 5; i++)
+	{
+		if (limit.Allow(suppressed))
+		{
+			allowed++;
+			CHECK_AT(suppressed == 0, "message %d suppressed %d", i, suppressed);
+		}
+	}
+	CHECK_AT(allowed == LogRateLimit::LOG_SITE_BURST, "allowed %d", allowed);
+	s = SteadySecond();
+	while (SteadySecond() == s)
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	CHECK(limit.Allow(suppressed));
+	CHECK_AT(suppressed == 5, "suppressed %d", suppressed);
+}
+
+static void CheckLevel()
+{
+	AsyncLog::SetLevel(LOG_WARNING);
+	CHECK(AsyncLog::IsEnabled(LOG_ERROR));
+	CHECK(AsyncLog::IsEnabled(LOG_WARNING));
+	CHECK(!AsyncLog::IsEnabled(LOG_INFO));
+	ASI_LOG_INFO("not written");
+	ASI_LOG_WARNING("written %d", 1);
+	Flush();
+	long dropped = 0;
+	std::vector<LogLine> lines = TakeLog(&dropped);
+	CHECK(lines.size() == 1 && lines[0].Text == "written 1");
+	AsyncLog::SetLevel(LOG_DEBUG);
+}
+
+int main()
+{
+	remove(g_LogFile);
+	CheckWrap();
+	CheckDrops();
+	CheckFormat();
+	CheckConcurrentWriters();
+	CheckLevel();
+	CheckRateLimit();
+	return TestResult("AsyncLogTest");
+}
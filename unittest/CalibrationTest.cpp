@@ -0,0 +1,292 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CalibrationTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Calibration Prepare/Apply with flip, ROI offset and per-Bayer-phase
+//                flat levels; master building and FITS round trip
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "Calibration.h"
+#include "TestCheck.h"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static FrameGeometryPtr MakeGeometry(int w, int h, int startX, int startY, ASI_FLIP_STATUS flip, ASI_IMG_TYPE type)
+{
+	FrameGeometry* pGeo = new FrameGeometry();
+	pGeo->Width = pGeo->ImageWidth = w;
+	pGeo->Height = pGeo->ImageHeight = h;
+	pGeo->Bin = 1;
+	pGeo->StartX = startX;
+	pGeo->StartY = startY;
+	pGeo->ImgType = type;
+	pGeo->Flip = flip;
+	pGeo->SdkPixBytes = pGeo->PixBytes = type == ASI_IMG_RAW16 ? 2 : 1;
+	return FrameGeometryPtr(pGeo);
+}
+
+static CalibrationFrame* MakeMaster(int w, int h, int startX, int startY)
+{
+	CalibrationFrame* pFrame = new CalibrationFrame();
+	pFrame->Width = w;
+	pFrame->Height = h;
+	pFrame->StartX = startX;
+	pFrame->StartY = startY;
+	pFrame->Data.resize((size_t)w * h);
+	return pFrame;
+}
+
+static CalibrationMastersPtr MakeMasters(CalibrationFrame* pDark, CalibrationFrame* pFlat)
+{
+	CalibrationMasters* pMasters = new CalibrationMasters();
+	pMasters->Dark.reset(pDark);
+	pMasters->Flat.reset(pFlat);
+	return CalibrationMastersPtr(pMasters);
+}
+
+static bool FlipsH(ASI_FLIP_STATUS flip) { return flip == ASI_FLIP_HORIZ || flip == ASI_FLIP_BOTH; }
+static bool FlipsV(ASI_FLIP_STATUS flip) { return flip == ASI_FLIP_VERT || flip == ASI_FLIP_BOTH; }
+
+static unsigned int GetSample(const std::vector<unsigned char>& frame, int bytes, size_t i)
+{
+	return bytes == 1 ? frame[i] : ((const unsigned short*)&frame[0])[i];
+}
+
+static void SetSample(std::vector<unsigned char>& frame, int bytes, size_t i, unsigned int v)
+{
+	if (bytes == 1)
+		frame[i] = (unsigned char)v;
+	else
+		((unsigned short*)&frame[0])[i] = (unsigned short)v;
+}
+
+// a dark-only master subtracts the dark sample under each delivered pixel:
+// the ROI sits inside the master at an offset and the frame is flipped
+static void CheckDark(ASI_FLIP_STATUS flip, int bytes, TestRandom& rnd)
+{
+	const int mw = 40, mh = 30, mx = 4, my = 2;
+	const int w = 10, h = 8, x0 = 10, y0 = 5;
+	unsigned int maxV = bytes == 1 ? 0xFF : 0xFFFF;
+	CalibrationFrame* pDark = MakeMaster(mw, mh, mx, my);
+	for (size_t i = 0; i < pDark->Data.size(); i++)
+		pDark->Data[i] = (float)rnd.Uniform(0.0, bytes == 1 ? 60.0 : 3000.0);
+	CalibrationMastersPtr masters = MakeMasters(pDark, 0);
+	FrameGeometryPtr geo = MakeGeometry(w, h, x0, y0, flip, bytes == 1 ? ASI_IMG_RAW8 : ASI_IMG_RAW16);
+
+	PreparedCalibration cal;
+	CHECK(cal.Prepare(masters, geo, true) == CAL_APPLIED);
+	CHECK(cal.IsPreparedFor(masters, geo));
+
+	std::vector<unsigned char> frame((size_t)w * h * bytes);
+	for (size_t i = 0; i < (size_t)w * h; i++)
+		SetSample(frame, bytes, i, rnd.Next() % (maxV + 1));
+	std::vector<unsigned char> raw = frame;
+	// in two stripes, as the insert thread splits it
+	cal.Apply(&frame[0], 0, 3);
+	cal.Apply(&frame[0], 3, h);
+
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			int sx = FlipsH(flip) ? w - 1 - x : x;
+			int sy = FlipsV(flip) ? h - 1 - y : y;
+			float d = pDark->Data[(size_t)(y0 - my + sy) * mw + x0 - mx + sx];
+			float v = (float)GetSample(raw, bytes, (size_t)y * w + x) - d;
+			v = v < 0.0f ? 0.0f : (v > maxV ? (float)maxV : v);
+			unsigned int want = (unsigned int)(v + 0.5f);
+			unsigned int got = GetSample(frame, bytes, (size_t)y * w + x);
+			CHECK_AT(got == want, "dark flip=%d bytes=%d x=%d y=%d got %u want %u", (int)flip, bytes, x, y, got, want);
+		}
+	}
+}
+
+// four Bayer phases at different levels under a common vignetting, the ROI
+// at an odd offset: a frame of the flat itself must come out as the flat
+// level of each pixel's own phase, so the white balance survives
+static void CheckFlat(ASI_FLIP_STATUS flip, bool bBayer, TestRandom& rnd)
+{
+	const int mw = 16, mh = 12, mx = 1, my = 0;
+	const int w = 6, h = 4, x0 = 4, y0 = 3;
+	const double levels[4] = { 1000.0, 2000.0, 3000.0, 4000.0 };
+	CalibrationFrame* pFlat = MakeMaster(mw, mh, mx, my);
+	double sums[4] = { 0.0, 0.0, 0.0, 0.0 }, total = 0.0;
+	int counts[4] = { 0, 0, 0, 0 };
+	for (int y = 0; y < mh; y++)
+	{
+		for (int x = 0; x < mw; x++)
+		{
+			int ph = (((my + y) & 1) << 1) | ((mx + x) & 1);
+			double vignetting = 1.2 - 0.4 * (x + y) / (mw + mh) + rnd.Uniform(-0.01, 0.01);
+			float f = (float)floor(levels[ph] * vignetting);
+			pFlat->Data[(size_t)y * mw + x] = f;
+			sums[ph] += f;
+			counts[ph]++;
+			total += f;
+		}
+	}
+	// a dead pixel inside the ROI keeps its raw value
+	const int deadX = x0 - mx + 2, deadY = y0 - my + 1;
+	float deadF = pFlat->Data[(size_t)deadY * mw + deadX];
+	pFlat->Data[(size_t)deadY * mw + deadX] = 0.0f;
+	int deadPh = (((my + deadY) & 1) << 1) | ((mx + deadX) & 1);
+	sums[deadPh] -= deadF;
+	total -= deadF;
+
+	CalibrationMastersPtr masters = MakeMasters(0, pFlat);
+	FrameGeometryPtr geo = MakeGeometry(w, h, x0, y0, flip, ASI_IMG_RAW16);
+	PreparedCalibration cal;
+	CHECK(cal.Prepare(masters, geo, bBayer) == CAL_APPLIED);
+
+	std::vector<unsigned short> frame((size_t)w * h);
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			int sx = FlipsH(flip) ? w - 1 - x : x;
+			int sy = FlipsV(flip) ? h - 1 - y : y;
+			int fx = x0 - mx + sx, fy = y0 - my + sy;
+			float f = pFlat->Data[(size_t)fy * mw + fx];
+			frame[(size_t)y * w + x] = (unsigned short)(f > 0.0f ? f : 500.0f);
+		}
+	}
+	cal.Apply((unsigned char*)&frame[0], 0, h);
+
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			int sx = FlipsH(flip) ? w - 1 - x : x;
+			int sy = FlipsV(flip) ? h - 1 - y : y;
+			int fx = x0 - mx + sx, fy = y0 - my + sy;
+			int ph = (((my + fy) & 1) << 1) | ((mx + fx) & 1);
+			double want = bBayer ? sums[ph] / counts[ph] : total / (mw * mh);
+			if (fx == deadX && fy == deadY)
+				want = 500.0;
+			unsigned int got = frame[(size_t)y * w + x];
+			CHECK_AT(fabs(got - want) <= 1.0, "flat flip=%d bayer=%d x=%d y=%d got %u want %.1f", (int)flip, (int)bBayer, x, y, got, want);
+		}
+	}
+}
+
+// frames the masters do not apply to are left alone
+static void CheckStatus()
+{
+	CalibrationFrame* pDark = MakeMaster(20, 10, 2, 2);
+	pDark->Data.assign(pDark->Data.size(), 50.0f);
+	CalibrationMastersPtr masters = MakeMasters(pDark, 0);
+	PreparedCalibration cal;
+	CHECK(cal.GetStatus() == CAL_NO_MASTER);
+
+	CHECK(cal.Prepare(CalibrationMastersPtr(), MakeGeometry(4, 4, 2, 2, ASI_FLIP_NONE, ASI_IMG_RAW8), false) == CAL_NO_MASTER);
+	CHECK(cal.Prepare(MakeMasters(0, 0), MakeGeometry(4, 4, 2, 2, ASI_FLIP_NONE, ASI_IMG_RAW8), false) == CAL_NO_MASTER);
+	CHECK(cal.Prepare(masters, MakeGeometry(4, 4, 2, 2, ASI_FLIP_NONE, ASI_IMG_RGB24), false) == CAL_PIXEL_TYPE);
+
+	FrameGeometry* pBinned = new FrameGeometry(*MakeGeometry(4, 4, 2, 2, ASI_FLIP_NONE, ASI_IMG_RAW8));
+	pBinned->Bin = 2;
+	CHECK(cal.Prepare(masters, FrameGeometryPtr(pBinned), false) == CAL_BINNING);
+
+	// left of, above, and reaching past the right and bottom edge of the master
+	CHECK(cal.Prepare(masters, MakeGeometry(4, 4, 1, 2, ASI_FLIP_NONE, ASI_IMG_RAW8), false) == CAL_ROI);
+	CHECK(cal.Prepare(masters, MakeGeometry(4, 4, 2, 1, ASI_FLIP_NONE, ASI_IMG_RAW8), false) == CAL_ROI);
+	CHECK(cal.Prepare(masters, MakeGeometry(4, 4, 19, 2, ASI_FLIP_NONE, ASI_IMG_RAW8), false) == CAL_ROI);
+	CHECK(cal.Prepare(masters, MakeGeometry(4, 4, 2, 9, ASI_FLIP_NONE, ASI_IMG_RAW8), false) == CAL_ROI);
+	CHECK(cal.GetStatus() == CAL_ROI);
+	std::vector<unsigned char> frame(16, 200);
+	cal.Apply(&frame[0], 0, 4);
+	CHECK(frame == std::vector<unsigned char>(16, 200));
+
+	// the last fitting ROI
+	CHECK(cal.Prepare(masters, MakeGeometry(4, 4, 18, 8, ASI_FLIP_NONE, ASI_IMG_RAW8), false) == CAL_APPLIED);
+	cal.Apply(&frame[0], 0, 4);
+	CHECK(frame == std::vector<unsigned char>(16, 150));
+}
+
+// the master comes out in sensor orientation whatever the flip it was taken with
+static void CheckMasterBuilder()
+{
+	const int w = 7, h = 5;
+	MasterBuilder builder;
+	CHECK(!builder.Begin(MakeGeometry(w, h, 3, 1, ASI_FLIP_NONE, ASI_IMG_RGB24)));
+	ASI_FLIP_STATUS flips[] = { ASI_FLIP_NONE, ASI_FLIP_HORIZ, ASI_FLIP_VERT, ASI_FLIP_BOTH };
+	for (int k = 0; k < 4; k++)
+	{
+		CHECK(builder.Begin(MakeGeometry(w, h, 3, 1, flips[k], ASI_IMG_RAW16)));
+		std::vector<unsigned short> a((size_t)w * h), b((size_t)w * h);
+		for (size_t i = 0; i < a.size(); i++)
+		{
+			a[i] = (unsigned short)(i * 100);
+			b[i] = (unsigned short)(i * 100 + 51);
+		}
+		builder.Add((const unsigned char*)&a[0]);
+		builder.Add((const unsigned char*)&b[0]);
+		CalibrationFramePtr master = builder.Finish();
+		CHECK(master->Width == w && master->Height == h && master->Bin == 1);
+		CHECK(master->StartX == 3 && master->StartY == 1);
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				int sx = FlipsH(flips[k]) ? w - 1 - x : x;
+				int sy = FlipsV(flips[k]) ? h - 1 - y : y;
+				float want = (float)((y * w + x) * 100) + 25.5f;
+				CHECK_AT(master->Samples()[(size_t)sy * w + sx] == want, "builder flip=%d x=%d y=%d", (int)flips[k], x, y);
+			}
+		}
+	}
+}
+
+// what SaveCalibrationFrame writes, LoadCalibrationFrame reads back
+static void CheckFitsRoundTrip(TestRandom& rnd)
+{
+	const char* path = "CalibrationTest.fits";
+	CalibrationFrame* pFrame = MakeMaster(33, 21, 5, 7);
+	CalibrationFramePtr frame(pFrame);
+	for (size_t i = 0; i < pFrame->Data.size(); i++)
+		pFrame->Data[i] = (float)rnd.Uniform(0.0, 65535.0);
+	CHECK(SaveCalibrationFrame(path, *frame, "Dark Frame"));
+	CalibrationFrame loaded;
+	std::string error;
+	CHECK_AT(LoadCalibrationFrame(path, loaded, error), "load: %s", error.c_str());
+	CHECK(loaded.Width == 33 && loaded.Height == 21 && loaded.Bin == 1);
+	CHECK(loaded.StartX == 5 && loaded.StartY == 7);
+	CHECK(loaded.Data == pFrame->Data);
+	remove(path);
+
+	CHECK(!LoadCalibrationFrame(path, loaded, error));
+	CHECK(!error.empty());
+}
+
+int main()
+{
+	TestRandom rnd(11);
+	ASI_FLIP_STATUS flips[] = { ASI_FLIP_NONE, ASI_FLIP_HORIZ, ASI_FLIP_VERT, ASI_FLIP_BOTH };
+	for (int k = 0; k < 4; k++)
+	{
+		CheckDark(flips[k], 1, rnd);
+		CheckDark(flips[k], 2, rnd);
+		CheckFlat(flips[k], true, rnd);
+		CheckFlat(flips[k], false, rnd);
+	}
+	CheckStatus();
+	CheckMasterBuilder();
+	CheckFitsRoundTrip(rnd);
+	return TestResult("CalibrationTest");
+}
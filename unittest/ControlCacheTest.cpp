@@ -0,0 +1,301 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ControlCacheTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Value packing, write-through and polling of the control cache, and a
+//                poller read racing with Set(), against a fake SDK
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "ControlCache.h"
+#include "TestCheck.h"
+
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+static const int g_CameraId = 3;
+
+/**
+* The two SDK calls the cache makes, over a table of controls. A read
+* from any thread but the test's own can be held: with g_HoldPoller set
+* the poller's next read takes its value and then waits for
+* g_ReleasePoller, so a Set() can be put between the read and its store.
+*/
+struct FakeControl
+{
+	bool bPresent;
+	long lVal;
+	ASI_BOOL bAuto;
+	long lMin;
+	long lMax;
+};
+
+static FakeControl g_Controls[ASI_ANTI_DEW_HEATER + 1];
+static std::mutex g_SdkLock;
+static std::condition_variable g_SdkWake;
+static std::thread::id g_TestThread;
+static bool g_HoldPoller = false;
+static bool g_ReleasePoller = false;
+static int g_PollerHeld = 0;		// poller reads that got to the hold
+
+ASI_ERROR_CODE ASIGetControlValue(int iCameraID, ASI_CONTROL_TYPE ControlType, long* plValue, ASI_BOOL* pbAuto)
+{
+	std::unique_lock<std::mutex> g(g_SdkLock);
+	if (iCameraID != g_CameraId || ControlType < 0 || ControlType > ASI_ANTI_DEW_HEATER || !g_Controls[ControlType].bPresent)
+		return ASI_ERROR_INVALID_CONTROL_TYPE;
+	*plValue = g_Controls[ControlType].lVal;
+	*pbAuto = g_Controls[ControlType].bAuto;
+	if (g_HoldPoller && std::this_thread::get_id() != g_TestThread)
+	{
+		g_HoldPoller = false;
+		g_PollerHeld++;
+		g_SdkWake.notify_all();
+		while (!g_ReleasePoller)
+			g_SdkWake.wait(g);
+		g_ReleasePoller = false;
+	}
+	return ASI_SUCCESS;
+}
+
+ASI_ERROR_CODE ASISetControlValue(int iCameraID, ASI_CONTROL_TYPE ControlType, long lValue, ASI_BOOL bAuto)
+{
+	std::lock_guard<std::mutex> g(g_SdkLock);
+	if (iCameraID != g_CameraId || ControlType < 0 || ControlType > ASI_ANTI_DEW_HEATER || !g_Controls[ControlType].bPresent)
+		return ASI_ERROR_INVALID_CONTROL_TYPE;
+	FakeControl& c = g_Controls[ControlType];
+	c.lVal = lValue < c.lMin ? c.lMin : lValue > c.lMax ? c.lMax : lValue;
+	c.bAuto = bAuto;
+	return ASI_SUCCESS;
+}
+
+// behind the cache's back, as the camera does for auto and sensor values
+static void SetInCamera(ASI_CONTROL_TYPE type, long lVal, ASI_BOOL bAuto)
+{
+	std::lock_guard<std::mutex> g(g_SdkLock);
+	g_Controls[type].lVal = lVal;
+	g_Controls[type].bAuto = bAuto;
+}
+
+static int g_NumCaps = 0;
+static ASI_CONTROL_CAPS g_Caps[ASI_ANTI_DEW_HEATER + 1];
+
+static void ResetCamera()
+{
+	std::lock_guard<std::mutex> g(g_SdkLock);
+	g_NumCaps = 0;
+	for (int i = 0; i <= ASI_ANTI_DEW_HEATER; i++)
+	{
+		g_Controls[i].bPresent = false;
+		g_Controls[i].lVal = 0;
+		g_Controls[i].bAuto = ASI_FALSE;
+		g_Controls[i].lMin = LONG_MIN;
+		g_Controls[i].lMax = LONG_MAX;
+	}
+	g_HoldPoller = false;
+	g_ReleasePoller = false;
+	g_PollerHeld = 0;
+}
+
+static void AddControl(ASI_CONTROL_TYPE type, long lVal, ASI_BOOL bAuto, long lMin = LONG_MIN, long lMax = LONG_MAX)
+{
+	std::lock_guard<std::mutex> g(g_SdkLock);
+	FakeControl& c = g_Controls[type];
+	c.bPresent = true;
+	c.lVal = lVal;
+	c.bAuto = bAuto;
+	c.lMin = lMin;
+	c.lMax = lMax;
+	g_Caps[g_NumCaps].ControlType = type;
+	g_Caps[g_NumCaps].MinValue = lMin;
+	g_Caps[g_NumCaps].MaxValue = lMax;
+	g_NumCaps++;
+}
+
+static bool Holds(const ControlCache& cache, ASI_CONTROL_TYPE type, long lVal, ASI_BOOL bAuto)
+{
+	long v;
+	ASI_BOOL a;
+	return cache.Get(type, &v, &a) == ASI_SUCCESS && v == lVal && a == bAuto;
+}
+
+// value and auto flag share one word; signs and the ends of the range survive
+static void CheckPacking()
+{
+	ResetCamera();
+	const long values[] = { 0, 1, -1, 2, -2, 12345, -12345, INT_MAX, INT_MIN, INT_MAX - 1, INT_MIN + 1 };
+	const int n = sizeof(values) / sizeof(values[0]);
+	for (int i = 0; i < n; i++)
+		for (int a = 0; a < 2; a++)
+			AddControl((ASI_CONTROL_TYPE)(i * 2 + a), values[i], a ? ASI_TRUE : ASI_FALSE);
+
+	ControlCache cache;
+	cache.Start(g_CameraId, g_Caps, g_NumCaps);
+	for (int i = 0; i < n; i++)
+		for (int a = 0; a < 2; a++)
+			CHECK_AT(Holds(cache, (ASI_CONTROL_TYPE)(i * 2 + a), values[i], a ? ASI_TRUE : ASI_FALSE), "value %ld auto %d", values[i], a);
+	cache.Stop();
+}
+
+// a control the camera does not have, or no control at all, fails and clears the outputs
+static void CheckMissing()
+{
+	ResetCamera();
+	AddControl(ASI_GAIN, 100, ASI_TRUE);
+	ControlCache cache;
+	const ASI_CONTROL_TYPE types[] = { ASI_GAIN, ASI_EXPOSURE, (ASI_CONTROL_TYPE)-1, (ASI_CONTROL_TYPE)64, (ASI_CONTROL_TYPE)1000 };
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+	{
+		long v = 77;
+		ASI_BOOL a = ASI_TRUE;
+		// nothing is cached before Start()
+		CHECK_AT(cache.Get(types[i], &v, &a) == ASI_ERROR_INVALID_CONTROL_TYPE && v == 0 && a == ASI_FALSE, "type %d", (int)types[i]);
+		CHECK_AT(cache.GetAgeMs(types[i]) == -1, "type %d", (int)types[i]);
+	}
+	cache.Start(g_CameraId, g_Caps, g_NumCaps);
+	CHECK(Holds(cache, ASI_GAIN, 100, ASI_TRUE));
+	CHECK(cache.GetAgeMs(ASI_GAIN) >= 0);
+	for (size_t i = 1; i < sizeof(types) / sizeof(types[0]); i++)
+	{
+		long v = 77;
+		ASI_BOOL a = ASI_TRUE;
+		CHECK_AT(cache.Get(types[i], &v, &a) == ASI_ERROR_INVALID_CONTROL_TYPE && v == 0 && a == ASI_FALSE, "type %d", (int)types[i]);
+		CHECK_AT(cache.GetAgeMs(types[i]) == -1, "type %d", (int)types[i]);
+	}
+	cache.Stop();
+}
+
+// Set() goes to the SDK, the cache holds what the SDK made of it
+static void CheckSet()
+{
+	ResetCamera();
+	AddControl(ASI_GAIN, 100, ASI_FALSE, 0, 500);
+	AddControl(ASI_OFFSET, 10, ASI_FALSE, 0, 50);
+	ControlCache cache;
+	cache.Start(g_CameraId, g_Caps, g_NumCaps);
+	long writes = cache.GetWriteCount();
+
+	CHECK(cache.Set(ASI_GAIN, 300, ASI_TRUE) == ASI_SUCCESS);
+	CHECK(Holds(cache, ASI_GAIN, 300, ASI_TRUE));
+	CHECK(cache.Set(ASI_GAIN, 1000, ASI_FALSE) == ASI_SUCCESS);
+	CHECK(Holds(cache, ASI_GAIN, 500, ASI_FALSE));
+	CHECK(cache.Set(ASI_OFFSET, -5, ASI_FALSE) == ASI_SUCCESS);
+	CHECK(Holds(cache, ASI_OFFSET, 0, ASI_FALSE));
+	CHECK(Holds(cache, ASI_GAIN, 500, ASI_FALSE));
+
+	// the SDK error comes back, the write still counts and nothing gets cached
+	CHECK(cache.Set(ASI_EXPOSURE, 1000, ASI_FALSE) == ASI_ERROR_INVALID_CONTROL_TYPE);
+	long v;
+	ASI_BOOL a;
+	CHECK(cache.Get(ASI_EXPOSURE, &v, &a) == ASI_ERROR_INVALID_CONTROL_TYPE);
+	CHECK_AT(cache.GetWriteCount() == writes + 4, "writes %ld", cache.GetWriteCount() - writes);
+	cache.Stop();
+}
+
+static bool WaitFor(const ControlCache& cache, ASI_CONTROL_TYPE type, long lVal, ASI_BOOL bAuto, int ms)
+{
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	while (!Holds(cache, type, lVal, bAuto))
+	{
+		if (std::chrono::steady_clock::now() > end)
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return true;
+}
+
+/**
+* Values the camera changes on its own are picked up at the poll interval,
+* or every AUTO_POLL_MS in auto mode; the rest only changes through Set().
+*/
+static void CheckPolling()
+{
+	ResetCamera();
+	AddControl(ASI_TEMPERATURE, 250, ASI_FALSE);
+	AddControl(ASI_EXPOSURE, 1000, ASI_TRUE);
+	AddControl(ASI_GAIN, 100, ASI_FALSE);
+	ControlCache cache;
+	cache.SetPollInterval(ASI_TEMPERATURE, 50);
+	cache.Start(g_CameraId, g_Caps, g_NumCaps);
+
+	SetInCamera(ASI_TEMPERATURE, 240, ASI_FALSE);
+	SetInCamera(ASI_EXPOSURE, 2000, ASI_TRUE);
+	SetInCamera(ASI_GAIN, 200, ASI_FALSE);
+	CHECK(WaitFor(cache, ASI_TEMPERATURE, 240, ASI_FALSE, ControlCache::AUTO_POLL_MS));
+	CHECK(WaitFor(cache, ASI_EXPOSURE, 2000, ASI_TRUE, ControlCache::AUTO_POLL_MS * 3));
+	CHECK(Holds(cache, ASI_GAIN, 100, ASI_FALSE));
+	CHECK(cache.GetAgeMs(ASI_TEMPERATURE) < ControlCache::AUTO_POLL_MS);
+	cache.Stop();
+}
+
+/**
+* The poller reads the old value, a Set() writes and reads back the new
+* one, then the poller's store comes last. It must be dropped. The
+* poller's next read is held until the end, so what Get() returns by
+* then is settled.
+*/
+static void CheckSetRacingPoller()
+{
+	ResetCamera();
+	AddControl(ASI_TEMPERATURE, 10, ASI_FALSE);
+	ControlCache cache;
+	cache.SetPollInterval(ASI_TEMPERATURE, 1);
+	{
+		std::lock_guard<std::mutex> g(g_SdkLock);
+		g_HoldPoller = true;
+	}
+	cache.Start(g_CameraId, g_Caps, g_NumCaps);
+	{
+		std::unique_lock<std::mutex> g(g_SdkLock);
+		while (g_PollerHeld < 1)
+			g_SdkWake.wait(g);
+	}
+
+	CHECK(cache.Set(ASI_TEMPERATURE, 20, ASI_FALSE) == ASI_SUCCESS);
+	CHECK(Holds(cache, ASI_TEMPERATURE, 20, ASI_FALSE));
+	{
+		std::unique_lock<std::mutex> g(g_SdkLock);
+		g_HoldPoller = true;
+		g_ReleasePoller = true;
+		g_SdkWake.notify_all();
+		// held again: the stale read is through Refresh()
+		while (g_PollerHeld < 2)
+			g_SdkWake.wait(g);
+	}
+	CHECK(Holds(cache, ASI_TEMPERATURE, 20, ASI_FALSE));
+
+	{
+		std::lock_guard<std::mutex> g(g_SdkLock);
+		g_ReleasePoller = true;
+	}
+	g_SdkWake.notify_all();
+	cache.Stop();
+	CHECK(Holds(cache, ASI_TEMPERATURE, 20, ASI_FALSE));
+}
+
+int main()
+{
+	g_TestThread = std::this_thread::get_id();
+	CheckPacking();
+	CheckMissing();
+	CheckSet();
+	CheckPolling();
+	CheckSetRacingPoller();
+	return TestResult("ControlCacheTest");
+}
@@ -0,0 +1,222 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          DarkLibraryTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Dark library nearest-match selection, ROI coverage and replacing a
+//                mapped dark
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "DarkLibrary.h"
+#include "TestCheck.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifdef _WINDOWS
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+static const char* g_Dir = "DarkLibraryTest.dir";
+static std::vector<std::string> g_Files;
+
+static DarkKey MakeKey(long exposure, long gain, long temperature)
+{
+	DarkKey key;
+	key.Camera = "ABC123";
+	key.Exposure = exposure;
+	key.Gain = gain;
+	key.Offset = 10;
+	key.Bin = 1;
+	key.ImgType = ASI_IMG_RAW16;
+	key.Temperature = temperature;
+	return key;
+}
+
+// a dark whose samples all hold level, so a selection tells which one it is
+static CalibrationFramePtr MakeDark(int w, int h, int startX, int startY, float level)
+{
+	CalibrationFrame* pFrame = new CalibrationFrame();
+	pFrame->Width = w;
+	pFrame->Height = h;
+	pFrame->StartX = startX;
+	pFrame->StartY = startY;
+	pFrame->Data.assign((size_t)w * h, level);
+	return CalibrationFramePtr(pFrame);
+}
+
+static FrameGeometry MakeGeometry(int w, int h, int startX, int startY)
+{
+	FrameGeometry geo = FrameGeometry();
+	geo.Width = w;
+	geo.Height = h;
+	geo.Bin = 1;
+	geo.StartX = startX;
+	geo.StartY = startY;
+	geo.ImgType = ASI_IMG_RAW16;
+	return geo;
+}
+
+static void Add(DarkLibrary& lib, const DarkKey& key, const CalibrationFramePtr& dark)
+{
+	std::string name;
+	CHECK_AT(lib.Add(key, dark, name), "add %s", name.c_str());
+	g_Files.push_back(name);
+}
+
+// level of the dark selected for key and geo, -1 when there is none
+static float Selected(DarkLibrary& lib, const DarkKey& key, const FrameGeometry& geo)
+{
+	std::string name;
+	CalibrationFramePtr dark = lib.Select(key, geo, name);
+	if (!dark)
+	{
+		CHECK(name.empty());
+		return -1.0f;
+	}
+	CHECK(!name.empty());
+	return dark->Samples()[0];
+}
+
+// a full-frame set over exposure, gain and temperature, one small dark
+// that matches a key exactly, and darks of other cameras and formats
+static void Fill(DarkLibrary& lib)
+{
+	Add(lib, MakeKey(1000, 0, 0), MakeDark(64, 48, 0, 0, 1.0f));
+	Add(lib, MakeKey(4000, 0, 0), MakeDark(64, 48, 0, 0, 2.0f));
+	Add(lib, MakeKey(16000, 0, 0), MakeDark(64, 48, 0, 0, 3.0f));
+	Add(lib, MakeKey(4000, 100, 0), MakeDark(64, 48, 0, 0, 4.0f));
+	Add(lib, MakeKey(4000, 0, -100), MakeDark(64, 48, 0, 0, 5.0f));
+	Add(lib, MakeKey(1500, 0, 0), MakeDark(16, 16, 8, 8, 6.0f));
+
+	DarkKey other = MakeKey(2000, 0, 0);
+	other.Camera = "XYZ789";
+	Add(lib, other, MakeDark(64, 48, 0, 0, 7.0f));
+	other = MakeKey(2000, 0, 0);
+	other.Bin = 2;
+	CalibrationFrame* pBinned = new CalibrationFrame(*MakeDark(32, 24, 0, 0, 8.0f));
+	pBinned->Bin = 2;
+	Add(lib, other, CalibrationFramePtr(pBinned));
+	other = MakeKey(2000, 0, 0);
+	other.ImgType = ASI_IMG_RAW8;
+	Add(lib, other, MakeDark(64, 48, 0, 0, 9.0f));
+}
+
+// exposure counts in factors of 2, gain and offset in steps of 10, the
+// temperature in steps of SetTemperatureStep()
+static void CheckNearest(DarkLibrary& lib)
+{
+	FrameGeometry full = MakeGeometry(64, 48, 0, 0);
+	CHECK(Selected(lib, MakeKey(1000, 0, 0), full) == 1.0f);
+	CHECK(Selected(lib, MakeKey(3000, 0, 0), full) == 2.0f);	// 0.42 against 1.58
+	CHECK(Selected(lib, MakeKey(1500, 0, 0), full) == 1.0f);	// 0.58 against 1.42
+	CHECK(Selected(lib, MakeKey(1000000, 0, 0), full) == 3.0f);
+	CHECK(Selected(lib, MakeKey(4000, 60, 0), full) == 4.0f);	// 4 against 6
+	CHECK(Selected(lib, MakeKey(4000, 40, 0), full) == 2.0f);
+	CHECK(Selected(lib, MakeKey(4000, 0, -70), full) == 5.0f);	// 2 steps of 2 C from -10 C, 3 from 0 C
+	CHECK(Selected(lib, MakeKey(4000, 0, -30), full) == 2.0f);
+
+	lib.SetTemperatureStep(100);
+	CHECK(Selected(lib, MakeKey(4000, 0, -70), full) == 5.0f);	// rounds to -10 C like -10 C
+	CHECK(Selected(lib, MakeKey(4000, 0, -40), full) == 2.0f);	// rounds to 0 C
+	lib.SetTemperatureStep(20);
+
+	DarkKey key = MakeKey(2000, 0, 0);
+	key.Camera = "NONE";
+	CHECK(Selected(lib, key, full) == -1.0f);
+	key = MakeKey(2000, 0, 0);
+	key.Bin = 2;
+	CHECK(Selected(lib, key, MakeGeometry(32, 24, 0, 0)) == 8.0f);
+	key.Bin = 3;
+	CHECK(Selected(lib, key, MakeGeometry(16, 16, 0, 0)) == -1.0f);
+	key = MakeKey(2000, 0, 0);
+	key.ImgType = ASI_IMG_RAW8;
+	CHECK(Selected(lib, key, full) == 9.0f);
+}
+
+// a dark applies only to ROIs inside its own
+static void CheckCoverage(DarkLibrary& lib)
+{
+	DarkKey key = MakeKey(1500, 0, 0);
+	CHECK(Selected(lib, key, MakeGeometry(16, 16, 8, 8)) == 6.0f);
+	CHECK(Selected(lib, key, MakeGeometry(8, 4, 16, 20)) == 6.0f);
+	// one pixel outside on either side goes to the nearest full frame
+	CHECK(Selected(lib, key, MakeGeometry(16, 16, 7, 8)) == 1.0f);
+	CHECK(Selected(lib, key, MakeGeometry(16, 16, 8, 7)) == 1.0f);
+	CHECK(Selected(lib, key, MakeGeometry(16, 16, 9, 8)) == 1.0f);
+	CHECK(Selected(lib, key, MakeGeometry(16, 16, 8, 9)) == 1.0f);
+	CHECK(Selected(lib, key, MakeGeometry(64, 48, 0, 0)) == 1.0f);
+	CHECK(Selected(lib, key, MakeGeometry(64, 48, 1, 0)) == -1.0f);
+	CHECK(Selected(lib, key, MakeGeometry(65, 48, 0, 0)) == -1.0f);
+}
+
+// a library opened on the directory finds the same darks in the mapped
+// files; replacing a dark leaves a mapping of the old file readable
+static void CheckReopen()
+{
+	DarkLibrary lib;
+	CHECK(lib.Open(g_Dir) == (int)g_Files.size());
+	CheckNearest(lib);
+	CheckCoverage(lib);
+
+	std::string name;
+	FrameGeometry full = MakeGeometry(64, 48, 0, 0);
+	long misses = lib.GetMisses(), hits = lib.GetHits();
+	CalibrationFramePtr old = lib.Select(MakeKey(16000, 0, 0), full, name);
+	CHECK(old && old->pMapped != 0 && old->pMapping);
+	CHECK(lib.GetMisses() == misses + 1);
+	CHECK(lib.Select(MakeKey(16000, 0, 0), full, name) == old);
+	CHECK(lib.GetHits() == hits + 1);
+
+	std::string replaced;
+	CHECK(lib.Add(MakeKey(16000, 0, 0), MakeDark(64, 48, 0, 0, 10.0f), replaced));
+	CHECK(replaced == name);
+	CHECK(old->Samples()[0] == 3.0f && old->Samples()[64 * 48 - 1] == 3.0f);
+	CHECK(Selected(lib, MakeKey(16000, 0, 0), full) == 10.0f);
+	CHECK(lib.GetEntries() == (int)g_Files.size());
+
+	DarkLibrary again;
+	CHECK(again.Open(g_Dir) == (int)g_Files.size());
+	CHECK(Selected(again, MakeKey(16000, 0, 0), full) == 10.0f);
+}
+
+int main()
+{
+	std::string dir = g_Dir;
+#ifdef _WINDOWS
+	_mkdir(g_Dir);
+#else
+	mkdir(g_Dir, 0755);
+#endif
+	DarkLibrary lib;
+	CHECK(lib.Open("DarkLibraryTest.missing") == -1 && !lib.IsOpen());
+	CHECK(lib.Open(g_Dir) == 0);
+	lib.SetTemperatureStep(20);
+	Fill(lib);
+	CHECK(lib.GetEntries() == (int)g_Files.size());
+	CheckNearest(lib);
+	CheckCoverage(lib);
+	CheckReopen();
+
+	for (size_t i = 0; i < g_Files.size(); i++)
+		remove((dir + "/" + g_Files[i]).c_str());
+	remove(g_Dir);
+	return TestResult("DarkLibraryTest");
+}
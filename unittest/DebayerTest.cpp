@@ -0,0 +1,195 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          DebayerTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Host debayering against a per-pixel reference, uniform colour
+//                fields and stripe splits
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "Debayer.h"
+#include "TestCheck.h"
+
+#include <vector>
+
+// mirrors around the border pixel like the adapter, n >= 2
+static int Mirror(int i, int n)
+{
+	return i < 0 ? -i : (i >= n ? 2 * (n - 1) - i : i);
+}
+
+template <class T>
+static std::vector<T> Run(const std::vector<T>& mosaic, int w, int h, int redX, int redY, DebayerAlgorithm algo, const std::vector<int>& cuts)
+{
+	std::vector<T> out((size_t)w * h * 4, (T)0x5A);
+	DebayerJob job = { (const unsigned char*)&mosaic[0], (unsigned char*)&out[0], w, h, (int)sizeof(T), redX, redY, algo };
+	int row = 0;
+	for (size_t i = 0; i <= cuts.size(); i++)
+	{
+		int end = i < cuts.size() ? cuts[i] : h;
+		DebayerRows(&job, row, end);
+		row = end;
+	}
+	return out;
+}
+
+/**
+* Bilinear straight from the definition, one pixel at a time: the site's
+* own colour, the average of the cross for the missing green and of the
+* diagonals for the other colour at red and blue sites, the two horizontal
+* and two vertical neighbours at green sites.
+*/
+template <class T>
+static std::vector<T> NaiveBilinear(const std::vector<T>& m, int w, int h, int redX, int redY)
+{
+	std::vector<T> out((size_t)w * h * 4);
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			int n = Mirror(y - 1, h), s = Mirror(y + 1, h), l = Mirror(x - 1, w), r = Mirror(x + 1, w);
+			unsigned c = m[(size_t)y * w + x];
+			unsigned cross = (m[(size_t)n * w + x] + m[(size_t)s * w + x] + m[(size_t)y * w + l] + m[(size_t)y * w + r] + 2) >> 2;
+			unsigned diag = (m[(size_t)n * w + l] + m[(size_t)n * w + r] + m[(size_t)s * w + l] + m[(size_t)s * w + r] + 2) >> 2;
+			unsigned horz = (m[(size_t)y * w + l] + m[(size_t)y * w + r] + 1) >> 1;
+			unsigned vert = (m[(size_t)n * w + x] + m[(size_t)s * w + x] + 1) >> 1;
+			bool bRedRow = ((y ^ redY) & 1) == 0, bRedCol = ((x ^ redX) & 1) == 0;
+			unsigned R, G, B;
+			if (bRedRow && bRedCol)
+				R = c, G = cross, B = diag;
+			else if (!bRedRow && !bRedCol)
+				R = diag, G = cross, B = c;
+			else
+				R = bRedRow ? horz : vert, G = c, B = bRedRow ? vert : horz;
+			T* p = &out[((size_t)y * w + x) * 4];
+			p[0] = (T)B;
+			p[1] = (T)G;
+			p[2] = (T)R;
+			p[3] = 0;
+		}
+	}
+	return out;
+}
+
+template <class T>
+static std::vector<T> RandomMosaic(int w, int h, TestRandom& rnd)
+{
+	std::vector<T> m((size_t)w * h);
+	for (size_t i = 0; i < m.size(); i++)
+		m[i] = (T)rnd.Next();
+	return m;
+}
+
+// widths around the SIMD steps of both sample sizes and the border columns
+static const int g_Widths[] = { 2, 3, 4, 5, 8, 17, 18, 19, 33, 34, 35, 67, 130 };
+static const int g_Heights[] = { 2, 3, 7, 16 };
+
+template <class T>
+static void CheckBilinear()
+{
+	TestRandom rnd(sizeof(T));
+	std::vector<int> whole;
+	for (size_t wi = 0; wi < sizeof(g_Widths) / sizeof(g_Widths[0]); wi++)
+	{
+		for (size_t hi = 0; hi < sizeof(g_Heights) / sizeof(g_Heights[0]); hi++)
+		{
+			int w = g_Widths[wi], h = g_Heights[hi];
+			std::vector<T> m = RandomMosaic<T>(w, h, rnd);
+			for (int phase = 0; phase < 4; phase++)
+			{
+				int redX = phase & 1, redY = phase >> 1;
+				std::vector<T> got = Run(m, w, h, redX, redY, DEBAYER_BILINEAR, whole);
+				CHECK_AT(got == NaiveBilinear(m, w, h, redX, redY), "bilinear %zu-bit %dx%d red %d,%d", sizeof(T) * 8, w, h, redX, redY);
+			}
+		}
+	}
+}
+
+// a mosaic of one colour has to come back as that colour everywhere,
+// borders included, with either algorithm
+template <class T>
+static void CheckUniform()
+{
+	const unsigned maxV = (T)~0;
+	const unsigned colours[][3] = { { 0, 0, 0 }, { maxV, maxV, maxV }, { maxV, 0, maxV / 3 }, { 7, maxV - 1, 100 }, { maxV / 2, maxV / 5, 0 } };
+	std::vector<int> whole;
+	for (size_t ci = 0; ci < sizeof(colours) / sizeof(colours[0]); ci++)
+	{
+		unsigned R = colours[ci][0], G = colours[ci][1], B = colours[ci][2];
+		for (int phase = 0; phase < 4; phase++)
+		{
+			int redX = phase & 1, redY = phase >> 1;
+			int w = 37, h = 12;
+			std::vector<T> m((size_t)w * h);
+			for (int y = 0; y < h; y++)
+			{
+				for (int x = 0; x < w; x++)
+				{
+					bool bRedRow = ((y ^ redY) & 1) == 0, bRedCol = ((x ^ redX) & 1) == 0;
+					m[(size_t)y * w + x] = (T)(bRedRow && bRedCol ? R : (!bRedRow && !bRedCol ? B : G));
+				}
+			}
+			std::vector<T> want((size_t)w * h * 4);
+			for (size_t i = 0; i < want.size(); i += 4)
+			{
+				want[i] = (T)B;
+				want[i + 1] = (T)G;
+				want[i + 2] = (T)R;
+				want[i + 3] = 0;
+			}
+			for (int algo = DEBAYER_BILINEAR; algo <= DEBAYER_EDGE_AWARE; algo++)
+				CHECK_AT(Run(m, w, h, redX, redY, (DebayerAlgorithm)algo, whole) == want, "uniform %zu-bit colour %zu red %d,%d algo %d", sizeof(T) * 8, ci, redX, redY, algo);
+		}
+	}
+}
+
+// stripes of any height, odd and even starts, must give the frame of a
+// single call; the edge-aware green needs its halo rows right for that
+template <class T>
+static void CheckStripes()
+{
+	TestRandom rnd(10 + sizeof(T));
+	int w = 45, h = 23;
+	std::vector<T> m = RandomMosaic<T>(w, h, rnd);
+	std::vector<int> whole;
+	for (int algo = DEBAYER_BILINEAR; algo <= DEBAYER_EDGE_AWARE; algo++)
+	{
+		for (int phase = 0; phase < 4; phase++)
+		{
+			int redX = phase & 1, redY = phase >> 1;
+			std::vector<T> want = Run(m, w, h, redX, redY, (DebayerAlgorithm)algo, whole);
+			for (int split = 0; split < 20; split++)
+			{
+				std::vector<int> cuts;
+				for (int row = 1 + (int)(rnd.Next() % 3); row < h; row += 1 + (int)(rnd.Next() % 5))
+					cuts.push_back(row);
+				CHECK_AT(Run(m, w, h, redX, redY, (DebayerAlgorithm)algo, cuts) == want, "stripes %zu-bit algo %d red %d,%d split %d", sizeof(T) * 8, algo, redX, redY, split);
+			}
+		}
+	}
+}
+
+int main()
+{
+	CheckBilinear<unsigned char>();
+	CheckBilinear<unsigned short>();
+	CheckUniform<unsigned char>();
+	CheckUniform<unsigned short>();
+	CheckStripes<unsigned char>();
+	CheckStripes<unsigned short>();
+	return TestResult("DebayerTest");
+}
@@ -0,0 +1,163 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameStackerTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Stacking operators against per-sample references, sigma-clip
+//                rejection of outliers
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "FrameStacker.h"
+#include "TestCheck.h"
+
+#include <cmath>
+#include <vector>
+
+static const int g_Frames = 9;
+static const size_t g_Samples = 1001;	// not a multiple of any SIMD width
+
+// frames of noise around a level; in frame 5 every 7th sample is saturated
+static std::vector<std::vector<unsigned int> > MakeFrames(int bytes, TestRandom& rnd)
+{
+	unsigned int maxV = bytes == 1 ? 0xFF : 0xFFFF;
+	unsigned int level = bytes == 1 ? 100 : 30000;
+	std::vector<std::vector<unsigned int> > frames(g_Frames, std::vector<unsigned int>(g_Samples));
+	for (int f = 0; f < g_Frames; f++)
+	{
+		for (size_t i = 0; i < g_Samples; i++)
+		{
+			frames[f][i] = level - 10 + rnd.Next() % 21;
+			if (f == 5 && i % 7 == 0)
+				frames[f][i] = maxV;
+		}
+	}
+	return frames;
+}
+
+// runs the frames through the stacker in three uneven stripes
+static std::vector<unsigned int> Stack(StackOperator op, int bytes, const std::vector<std::vector<unsigned int> >& frames)
+{
+	FrameStacker stacker;
+	stacker.Begin(op, 3.0f, g_Samples, bytes);
+	std::vector<unsigned char> in(g_Samples * bytes), out(g_Samples * bytes);
+	const size_t cuts[] = { 0, 13, 600, g_Samples };
+	for (size_t f = 0; f < frames.size(); f++)
+	{
+		for (size_t i = 0; i < g_Samples; i++)
+		{
+			if (bytes == 1)
+				in[i] = (unsigned char)frames[f][i];
+			else
+				((unsigned short*)&in[0])[i] = (unsigned short)frames[f][i];
+		}
+		for (int s = 0; s < 3; s++)
+			stacker.Accumulate(&in[0], cuts[s], cuts[s + 1]);
+		stacker.EndFrame();
+	}
+	CHECK(stacker.GetCount() == (int)frames.size());
+	stacker.Reduce(&out[0], 0, g_Samples);
+	std::vector<unsigned int> result(g_Samples);
+	for (size_t i = 0; i < g_Samples; i++)
+		result[i] = bytes == 1 ? out[i] : ((unsigned short*)&out[0])[i];
+	return result;
+}
+
+static void CheckSimpleOperators(int bytes, TestRandom& rnd)
+{
+	unsigned int maxV = bytes == 1 ? 0xFF : 0xFFFF;
+	std::vector<std::vector<unsigned int> > frames = MakeFrames(bytes, rnd);
+	std::vector<unsigned int> sum = Stack(STACK_SUM, bytes, frames);
+	std::vector<unsigned int> mean = Stack(STACK_MEAN, bytes, frames);
+	std::vector<unsigned int> vMin = Stack(STACK_MIN, bytes, frames);
+	std::vector<unsigned int> vMax = Stack(STACK_MAX, bytes, frames);
+	for (size_t i = 0; i < g_Samples; i++)
+	{
+		unsigned int s = 0, lo = maxV, hi = 0;
+		for (int f = 0; f < g_Frames; f++)
+		{
+			s += frames[f][i];
+			lo = frames[f][i] < lo ? frames[f][i] : lo;
+			hi = frames[f][i] > hi ? frames[f][i] : hi;
+		}
+		CHECK_AT(sum[i] == (s > maxV ? maxV : s), "sum bytes=%d i=%zu", bytes, i);
+		CHECK_AT(mean[i] == (s + g_Frames / 2) / g_Frames, "mean bytes=%d i=%zu", bytes, i);
+		CHECK_AT(vMin[i] == lo, "min bytes=%d i=%zu", bytes, i);
+		CHECK_AT(vMax[i] == hi, "max bytes=%d i=%zu", bytes, i);
+	}
+}
+
+// the saturated samples of frame 5 are far outside 3 sigma of the frames
+// before them and must not pull the clipped mean; elsewhere the clipped
+// mean is the plain mean
+static void CheckSigmaClip(int bytes, TestRandom& rnd)
+{
+	std::vector<std::vector<unsigned int> > frames = MakeFrames(bytes, rnd);
+	std::vector<unsigned int> clipped = Stack(STACK_SIGMA_CLIP, bytes, frames);
+	std::vector<unsigned int> mean = Stack(STACK_MEAN, bytes, frames);
+	for (size_t i = 0; i < g_Samples; i++)
+	{
+		double s = 0;
+		int n = 0;
+		for (int f = 0; f < g_Frames; f++)
+		{
+			if (f == 5 && i % 7 == 0)
+				continue;
+			s += frames[f][i];
+			n++;
+		}
+		double want = s / n;
+		// a noise sample near 3 sigma may be clipped too, which moves the mean by a little
+		CHECK_AT(fabs(clipped[i] - want) <= 4.0, "sigma clip bytes=%d i=%zu got %u want %.1f", bytes, i, clipped[i], want);
+		if (i % 7 == 0)
+			CHECK_AT(mean[i] > clipped[i] + 10, "outlier not rejected bytes=%d i=%zu", bytes, i);
+	}
+
+	// with two frames nothing is clipped, however far apart they are
+	std::vector<std::vector<unsigned int> > two(frames.begin() + 4, frames.begin() + 6);
+	std::vector<unsigned int> twoClipped = Stack(STACK_SIGMA_CLIP, bytes, two);
+	std::vector<unsigned int> twoMean = Stack(STACK_MEAN, bytes, two);
+	for (size_t i = 0; i < g_Samples; i++)
+		CHECK_AT(twoClipped[i] == twoMean[i], "two frames bytes=%d i=%zu", bytes, i);
+}
+
+// a stacker keeps its memory across Begin() and starts from scratch
+static void CheckRestart()
+{
+	FrameStacker stacker;
+	std::vector<unsigned char> in(16, 200), out(16);
+	stacker.Begin(STACK_SUM, 3.0f, 16, 1);
+	stacker.Accumulate(&in[0], 0, 16);
+	stacker.EndFrame();
+	stacker.Reset();
+	in.assign(16, 7);
+	stacker.Accumulate(&in[0], 0, 16);
+	stacker.EndFrame();
+	stacker.Reduce(&out[0], 0, 16);
+	CHECK(out == in);
+}
+
+int main()
+{
+	TestRandom rnd(10);
+	for (int bytes = 1; bytes <= 2; bytes++)
+	{
+		CheckSimpleOperators(bytes, rnd);
+		CheckSigmaClip(bytes, rnd);
+	}
+	CheckRestart();
+	return TestResult("FrameStackerTest");
+}
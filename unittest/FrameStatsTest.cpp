@@ -0,0 +1,209 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameStatsTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Frame and region statistics and histograms against a per-sample
+//                reference, region parsing
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "FrameStats.h"
+#include "TestCheck.h"
+
+#include <cmath>
+#include <vector>
+
+static const int g_Width = 173, g_Height = 61;	// odd, no SIMD-friendly row length
+
+static FrameGeometry MakeGeometry(ASI_IMG_TYPE type)
+{
+	FrameGeometry geo = FrameGeometry();
+	geo.Width = geo.ImageWidth = g_Width;
+	geo.Height = geo.ImageHeight = g_Height;
+	geo.Bin = 1;
+	geo.ImgType = type;
+	geo.SdkPixBytes = type == ASI_IMG_RAW16 ? 2 : (type == ASI_IMG_RGB24 ? 3 : 1);
+	return geo;
+}
+
+// noise over the whole range, with runs at the ADC limit and, for 16-bit,
+// values just below it that share the top bin
+static std::vector<unsigned char> MakeFrame(const FrameGeometry& geo, TestRandom& rnd)
+{
+	bool b16 = geo.ImgType == ASI_IMG_RAW16;
+	size_t samples = (size_t)geo.Width * geo.Height * (geo.ImgType == ASI_IMG_RGB24 ? 3 : 1);
+	std::vector<unsigned char> frame(samples * (b16 ? 2 : 1));
+	for (size_t i = 0; i < samples; i++)
+	{
+		unsigned int v = rnd.Next();
+		if (i % 97 < 5)
+			v = 0xFFFF;
+		else if (i % 89 == 0)
+			v = 0xFFF0 + i % 15;
+		if (b16)
+			((unsigned short*)&frame[0])[i] = (unsigned short)v;
+		else
+			frame[i] = (unsigned char)v;
+	}
+	return frame;
+}
+
+struct Reference
+{
+	SampleStats Stats;
+	std::vector<unsigned int> Histogram;
+};
+
+// every sample of the region's counted rows, one by one
+static Reference Naive(const std::vector<unsigned char>& frame, const FrameGeometry& geo, StatsRegion r, int stride)
+{
+	bool b16 = geo.ImgType == ASI_IMG_RAW16;
+	int channels = geo.ImgType == ASI_IMG_RGB24 ? 3 : 1;
+	int shift = b16 ? 4 : 0;
+	Reference ref;
+	ref.Histogram.assign(b16 ? 4096 : 256, 0);
+	SampleStats& s = ref.Stats;
+	s.Count = s.Saturated = 0;
+	s.Min = s.Max = 0;
+	s.Mean = s.StdDev = 0.0;
+	unsigned int vMin = ~0u;
+	double sum = 0.0, sumSq = 0.0;
+	int x1 = r.X + r.Width < geo.Width ? r.X + r.Width : geo.Width;
+	int y1 = r.Y + r.Height < geo.Height ? r.Y + r.Height : geo.Height;
+	for (int y = r.Y; y < y1; y += stride)
+	{
+		for (int x = r.X * channels; x < x1 * channels; x++)
+		{
+			size_t i = (size_t)y * geo.Width * channels + x;
+			unsigned int v = b16 ? ((const unsigned short*)&frame[0])[i] : frame[i];
+			ref.Histogram[v >> shift]++;
+			s.Count++;
+			if ((v >> shift) == ref.Histogram.size() - 1)
+				s.Saturated++;
+			vMin = v < vMin ? v : vMin;
+			s.Max = v > s.Max ? v : s.Max;
+			sum += v;
+			sumSq += (double)v * v;
+		}
+	}
+	if (s.Count == 0)
+		return ref;
+	s.Min = vMin;
+	s.Mean = sum / s.Count;
+	s.StdDev = sqrt(sumSq / s.Count - s.Mean * s.Mean);
+	return ref;
+}
+
+static void Compare(const SampleStats& got, const SampleStats& want, const char* what, int type, int stride)
+{
+	CHECK_AT(got.Count == want.Count, "%s type=%d stride=%d count %llu want %llu", what, type, stride, got.Count, want.Count);
+	CHECK_AT(got.Saturated == want.Saturated, "%s type=%d stride=%d saturated %llu want %llu", what, type, stride, got.Saturated, want.Saturated);
+	CHECK_AT(got.Min == want.Min && got.Max == want.Max, "%s type=%d stride=%d min/max %u/%u want %u/%u", what, type, stride, got.Min, got.Max, want.Min, want.Max);
+	CHECK_AT(fabs(got.Mean - want.Mean) <= 1e-9 * (want.Mean + 1.0), "%s type=%d stride=%d mean %f want %f", what, type, stride, got.Mean, want.Mean);
+	CHECK_AT(fabs(got.StdDev - want.StdDev) <= 1e-6 * (want.StdDev + 1.0), "%s type=%d stride=%d deviation %f want %f", what, type, stride, got.StdDev, want.StdDev);
+}
+
+// the whole frame and regions inside, across the edge, outside and of one
+// pixel, every row and every third
+static void CheckAgainstNaive(ASI_IMG_TYPE type, TestRandom& rnd)
+{
+	FrameGeometry geo = MakeGeometry(type);
+	std::vector<unsigned char> frame = MakeFrame(geo, rnd);
+	StatsRegion regions[] = {
+		{ 10, 5, 40, 20 },
+		{ 150, 50, 100, 100 },		// clipped to the frame
+		{ g_Width, 0, 10, 10 },		// outside
+		{ 7, 3, 1, 1 },
+		{ 0, 0, g_Width, g_Height }
+	};
+	StatsConfig config;
+	config.Regions.assign(regions, regions + sizeof(regions) / sizeof(regions[0]));
+
+	FrameStatistics stats;
+	int strides[] = { 0, 1, 3 };
+	for (int k = 0; k < 3; k++)
+	{
+		config.RowStride = strides[k];
+		int stride = strides[k] > 1 ? strides[k] : 1;
+		stats.Compute(&frame[0], geo, config);
+		CHECK(stats.IsValid());
+		CHECK(stats.GetBinShift() == (type == ASI_IMG_RAW16 ? 4 : 0));
+		StatsRegion all = { 0, 0, g_Width, g_Height };
+		Reference ref = Naive(frame, geo, all, stride);
+		Compare(stats.GetFrame(), ref.Stats, "frame", (int)type, stride);
+		CHECK_AT(stats.GetHistogram() == ref.Histogram, "histogram type=%d stride=%d", (int)type, stride);
+		CHECK(stats.GetRegions().size() == config.Regions.size());
+		for (size_t i = 0; i < config.Regions.size() && i < stats.GetRegions().size(); i++)
+			Compare(stats.GetRegions()[i], Naive(frame, geo, config.Regions[i], stride).Stats, "region", (int)type, stride);
+	}
+	CHECK(stats.GetRegions()[2].Count == 0);
+	CHECK(stats.GetRegions()[3].Count == (type == ASI_IMG_RGB24 ? 3u : 1u));	// samples, not pixels
+}
+
+// one object across pixel types, and the results copied out of it
+static void CheckReuse(TestRandom& rnd)
+{
+	FrameStatistics stats, copy;
+	StatsConfig config;
+	config.RowStride = 1;
+	FrameGeometry geo16 = MakeGeometry(ASI_IMG_RAW16), geo8 = MakeGeometry(ASI_IMG_RAW8);
+	std::vector<unsigned char> frame16 = MakeFrame(geo16, rnd), frame8 = MakeFrame(geo8, rnd);
+	StatsRegion all = { 0, 0, g_Width, g_Height };
+	stats.Compute(&frame16[0], geo16, config);
+	stats.Compute(&frame8[0], geo8, config);
+	Compare(stats.GetFrame(), Naive(frame8, geo8, all, 1).Stats, "8 after 16", ASI_IMG_RAW8, 1);
+	stats.Compute(&frame16[0], geo16, config);
+	Compare(stats.GetFrame(), Naive(frame16, geo16, all, 1).Stats, "16 after 8", ASI_IMG_RAW16, 1);
+
+	copy.CopyResults(stats);
+	CHECK(copy.IsValid());
+	CHECK(copy.GetBinShift() == 4);
+	CHECK(copy.GetHistogram() == stats.GetHistogram());
+	Compare(copy.GetFrame(), stats.GetFrame(), "copy", ASI_IMG_RAW16, 1);
+	stats.Invalidate();
+	CHECK(!stats.IsValid() && copy.IsValid());
+}
+
+static void CheckParse()
+{
+	std::vector<StatsRegion> regions;
+	CHECK(ParseStatsRegions("", regions) && regions.empty());
+	CHECK(ParseStatsRegions("1,2,3,4", regions) && regions.size() == 1);
+	CHECK(regions[0].X == 1 && regions[0].Y == 2 && regions[0].Width == 3 && regions[0].Height == 4);
+	CHECK(ParseStatsRegions(" 10, 20, 30, 40 ;5,6,7,8;", regions) && regions.size() == 2);
+	CHECK(regions[0].X == 10 && regions[0].Height == 40 && regions[1].X == 5 && regions[1].Height == 8);
+	CHECK(ParseStatsRegions("0,0,1,1; ;2,2,1,1", regions) && regions.size() == 2);
+
+	CHECK(!ParseStatsRegions("1,2,3", regions) && regions.empty());
+	CHECK(!ParseStatsRegions("1,2,3,4x", regions));
+	CHECK(!ParseStatsRegions("1,2,3,4;a", regions));
+	CHECK(!ParseStatsRegions("-1,2,3,4", regions));
+	CHECK(!ParseStatsRegions("1,2,0,4", regions));
+	CHECK(!ParseStatsRegions("1,2,3,0", regions));
+}
+
+int main()
+{
+	TestRandom rnd(14);
+	CheckAgainstNaive(ASI_IMG_RAW8, rnd);
+	CheckAgainstNaive(ASI_IMG_Y8, rnd);
+	CheckAgainstNaive(ASI_IMG_RGB24, rnd);
+	CheckAgainstNaive(ASI_IMG_RAW16, rnd);
+	CheckReuse(rnd);
+	CheckParse();
+	return TestResult("FrameStatsTest");
+}
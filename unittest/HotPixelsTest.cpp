@@ -0,0 +1,306 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          HotPixelsTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Hot pixel detection by sigma and threshold, median replacement on
+//                mono and Bayer frames against a reference
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "HotPixels.h"
+#include "TestCheck.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <set>
+#include <vector>
+
+static FrameGeometryPtr MakeGeometry(int w, int h, int startX, int startY, ASI_FLIP_STATUS flip, int bytes, int redX, int redY)
+{
+	FrameGeometry* pGeo = new FrameGeometry();
+	pGeo->Width = pGeo->ImageWidth = w;
+	pGeo->Height = pGeo->ImageHeight = h;
+	pGeo->Bin = 1;
+	pGeo->StartX = startX;
+	pGeo->StartY = startY;
+	pGeo->ImgType = bytes == 1 ? ASI_IMG_RAW8 : ASI_IMG_RAW16;
+	pGeo->Flip = flip;
+	pGeo->SdkPixBytes = pGeo->PixBytes = bytes;
+	pGeo->RedX = redX;
+	pGeo->RedY = redY;
+	return FrameGeometryPtr(pGeo);
+}
+
+// noise in [-8, 8] around 100, then hot, warm and dead pixels at known places
+static void CheckDetection()
+{
+	const int w = 200, h = 150;
+	TestRandom rnd(13);
+	CalibrationFrame dark;
+	dark.Width = w;
+	dark.Height = h;
+	dark.Bin = 2;
+	dark.StartX = 6;
+	dark.StartY = 4;
+	dark.Data.resize((size_t)w * h);
+	for (size_t i = 0; i < dark.Data.size(); i++)
+		dark.Data[i] = (float)rnd.Uniform(92.0, 108.0);
+	std::set<unsigned int> hot, warm, dead;
+	for (int k = 0; k < 40; k++)
+	{
+		unsigned int i = rnd.Next() % (w * h);
+		if (hot.count(i) || warm.count(i) || dead.count(i))
+			continue;
+		if (k % 3 == 0)
+		{
+			dark.Data[i] = 300.0f;
+			hot.insert(i);
+		}
+		else if (k % 3 == 1)
+		{
+			dark.Data[i] = 140.0f;
+			warm.insert(i);
+		}
+		else
+		{
+			dark.Data[i] = 10.0f;
+			dead.insert(i);
+		}
+	}
+
+	// the robust sigma of the noise is about 6, so 5 sigma finds the warm
+	// pixels too; 50 ADU only the hot and the dead ones
+	std::vector<unsigned int> all(hot.begin(), hot.end());
+	all.insert(all.end(), warm.begin(), warm.end());
+	all.insert(all.end(), dead.begin(), dead.end());
+	std::sort(all.begin(), all.end());
+	HotPixelMapPtr map = DetectHotPixels(dark, HOTPIX_SIGMA, 5.0);
+	CHECK(map->Pixels == all);
+	CHECK(map->Width == w && map->Height == h && map->Bin == 2);
+	CHECK(map->StartX == 6 && map->StartY == 4);
+
+	std::vector<unsigned int> far(hot.begin(), hot.end());
+	far.insert(far.end(), dead.begin(), dead.end());
+	std::sort(far.begin(), far.end());
+	CHECK(DetectHotPixels(dark, HOTPIX_THRESHOLD, 50.0)->Pixels == far);
+	CHECK(DetectHotPixels(dark, HOTPIX_SIGMA, 100.0)->Pixels.empty());
+
+	// a dark flat to the ADU still flags a pixel 2 ADU off at 3 sigma, not one 1 ADU off
+	dark.Data.assign(dark.Data.size(), 20.0f);
+	dark.Data[77] = 22.0f;
+	dark.Data[78] = 21.0f;
+	dark.Data[79] = 18.0f;
+	HotPixelMapPtr flat = DetectHotPixels(dark, HOTPIX_SIGMA, 3.0);
+	CHECK(flat->Pixels.size() == 2 && flat->Pixels[0] == 77 && flat->Pixels[1] == 79);
+}
+
+// what SaveHotPixelMap writes, LoadHotPixelMap reads back
+static void CheckFileRoundTrip()
+{
+	const char* path = "HotPixelsTest.hotpix";
+	HotPixelMap map;
+	map.Width = 40;
+	map.Height = 30;
+	map.Bin = 2;
+	map.StartX = 3;
+	map.StartY = 5;
+	map.Pixels.push_back(0);
+	map.Pixels.push_back(41);
+	map.Pixels.push_back(1199);
+	CHECK(SaveHotPixelMap(path, map));
+	HotPixelMap loaded;
+	CHECK(LoadHotPixelMap(path, loaded));
+	CHECK(loaded.Width == 40 && loaded.Height == 30 && loaded.Bin == 2);
+	CHECK(loaded.StartX == 3 && loaded.StartY == 5);
+	CHECK(loaded.Pixels == map.Pixels);
+	remove(path);
+	CHECK(!LoadHotPixelMap(path, loaded));
+}
+
+typedef int RingOffsets[8][2];
+
+// the eight same-colour neighbours of frame pixel (x, y)
+static const RingOffsets& Ring(int x, int y, bool bBayer, const FrameGeometry& geo)
+{
+	static const RingOffsets mono = { { -1, -1 }, { 0, -1 }, { 1, -1 }, { -1, 0 }, { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+	static const RingOffsets redBlue = { { -2, -2 }, { 0, -2 }, { 2, -2 }, { -2, 0 }, { 2, 0 }, { -2, 2 }, { 0, 2 }, { 2, 2 } };
+	static const RingOffsets green = { { -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 }, { 0, -2 }, { -2, 0 }, { 2, 0 }, { 0, 2 } };
+	bool bGreen = ((x + geo.RedX + y + geo.RedY) & 1) != 0;
+	return !bBayer ? mono : (bGreen ? green : redBlue);
+}
+
+// colour of frame pixel (x, y): 0 red, 1 green, 2 blue
+static int Colour(int x, int y, const FrameGeometry& geo)
+{
+	bool bRedRow = ((y ^ geo.RedY) & 1) == 0, bRedCol = ((x ^ geo.RedX) & 1) == 0;
+	return bRedRow == bRedCol ? (bRedRow ? 0 : 2) : 1;
+}
+
+/**
+* A map with isolated defects, a 3x3 cluster and the frame corners,
+* applied to a frame inside its ROI under a flip. Every defect must get
+* the median of its non-defective same-colour neighbours, every other
+* pixel must stay as it was. Colours sit in separate value bands, so a
+* neighbour of the wrong colour would show.
+*/
+template <class T>
+static void CheckReplacement(ASI_FLIP_STATUS flip, bool bBayer, TestRandom& rnd)
+{
+	const int mw = 48, mh = 40, mx = 2, my = 3;
+	const int w = 30, h = 22, x0 = 9, y0 = 8;	// frame inside the map at (7, 5)
+	int bytes = (int)sizeof(T);
+	FrameGeometryPtr geo = MakeGeometry(w, h, x0, y0, flip, bytes, 1, 0);
+	bool bFlipH = flip == ASI_FLIP_HORIZ || flip == ASI_FLIP_BOTH;
+	bool bFlipV = flip == ASI_FLIP_VERT || flip == ASI_FLIP_BOTH;
+
+	HotPixelMap* pMap = new HotPixelMap();
+	pMap->Width = mw;
+	pMap->Height = mh;
+	pMap->Bin = 1;
+	pMap->StartX = mx;
+	pMap->StartY = my;
+	std::set<unsigned int> sensor;
+	for (int k = 0; k < 25; k++)
+		sensor.insert(rnd.Next() % (mw * mh));
+	for (int dy = 0; dy < 3; dy++)
+		for (int dx = 0; dx < 3; dx++)
+			sensor.insert((unsigned int)(y0 - my + 10 + dy) * mw + x0 - mx + 12 + dx);
+	int corners[4][2] = { { 0, 0 }, { w - 1, 0 }, { 0, h - 1 }, { w - 1, h - 1 } };
+	for (int k = 0; k < 4; k++)
+		sensor.insert((unsigned int)(y0 - my + corners[k][1]) * mw + x0 - mx + corners[k][0]);
+	pMap->Pixels.assign(sensor.begin(), sensor.end());
+	HotPixelMapPtr map(pMap);
+
+	// defects in frame coordinates
+	std::vector<bool> bDefect((size_t)w * h, false);
+	size_t defects = 0;
+	for (std::set<unsigned int>::const_iterator it = sensor.begin(); it != sensor.end(); ++it)
+	{
+		int sx = (int)(*it % mw) - (x0 - mx), sy = (int)(*it / mw) - (y0 - my);
+		if (sx < 0 || sy < 0 || sx >= w || sy >= h)
+			continue;
+		int x = bFlipH ? w - 1 - sx : sx, y = bFlipV ? h - 1 - sy : sy;
+		bDefect[(size_t)y * w + x] = true;
+		defects++;
+	}
+
+	unsigned int band = bytes == 1 ? 60 : 15000;
+	std::vector<T> frame((size_t)w * h);
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			unsigned int base = bBayer ? Colour(x, y, *geo) * band : 0;
+			unsigned int v = base + rnd.Next() % (bBayer ? band / 2 : band * 3);
+			if (bDefect[(size_t)y * w + x])
+				v = (T)~0;
+			frame[(size_t)y * w + x] = (T)v;
+		}
+	}
+
+	std::vector<T> want = frame;
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			if (!bDefect[(size_t)y * w + x])
+				continue;
+			const RingOffsets& ring = Ring(x, y, bBayer, *geo);
+			std::vector<T> vals;
+			for (int k = 0; k < 8; k++)
+			{
+				int nx = x + ring[k][0], ny = y + ring[k][1];
+				if (nx >= 0 && ny >= 0 && nx < w && ny < h && !bDefect[(size_t)ny * w + nx])
+					vals.push_back(frame[(size_t)ny * w + nx]);
+			}
+			if (vals.empty())
+				continue;
+			std::sort(vals.begin(), vals.end());
+			want[(size_t)y * w + x] = vals[vals.size() / 2];
+		}
+	}
+
+	PreparedHotPixels hot;
+	CHECK(hot.Prepare(map, geo, bBayer));
+	CHECK(hot.IsPreparedFor(map, geo));
+	CHECK(hot.GetCount() == defects);
+	hot.Apply((unsigned char*)&frame[0]);
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			size_t i = (size_t)y * w + x;
+			CHECK_AT(frame[i] == want[i], "replace flip=%d bayer=%d bytes=%d x=%d y=%d got %u want %u",
+				(int)flip, (int)bBayer, bytes, x, y, (unsigned int)frame[i], (unsigned int)want[i]);
+			if (bBayer && bDefect[i] && frame[i] != (T)~0)
+				CHECK_AT(frame[i] / band == (unsigned int)Colour(x, y, *geo), "colour x=%d y=%d", x, y);
+		}
+	}
+}
+
+// maps that do not fit the frame correct nothing
+static void CheckMismatch()
+{
+	HotPixelMap* pMap = new HotPixelMap();
+	pMap->Width = 20;
+	pMap->Height = 10;
+	pMap->Bin = 1;
+	pMap->StartX = 2;
+	pMap->StartY = 2;
+	pMap->Pixels.push_back(3 * 20 + 4);
+	HotPixelMapPtr map(pMap);
+
+	PreparedHotPixels hot;
+	std::vector<unsigned char> frame(16, 9);
+	frame[1 * 4 + 2] = 255;
+	std::vector<unsigned char> orig = frame;
+	CHECK(!hot.Prepare(HotPixelMapPtr(), MakeGeometry(4, 4, 4, 4, ASI_FLIP_NONE, 1, 0, 0), false));
+	CHECK(!hot.Prepare(map, MakeGeometry(4, 4, 1, 4, ASI_FLIP_NONE, 1, 0, 0), false));
+	CHECK(!hot.Prepare(map, MakeGeometry(4, 4, 4, 9, ASI_FLIP_NONE, 1, 0, 0), false));
+	FrameGeometry* pBinned = new FrameGeometry(*MakeGeometry(4, 4, 4, 4, ASI_FLIP_NONE, 1, 0, 0));
+	pBinned->Bin = 2;
+	CHECK(!hot.Prepare(map, FrameGeometryPtr(pBinned), false));
+	FrameGeometry* pRgb = new FrameGeometry(*MakeGeometry(4, 4, 4, 4, ASI_FLIP_NONE, 1, 0, 0));
+	pRgb->ImgType = ASI_IMG_RGB24;
+	CHECK(!hot.Prepare(map, FrameGeometryPtr(pRgb), false));
+	CHECK(hot.GetCount() == 0);
+	hot.Apply(&frame[0]);
+	CHECK(frame == orig);
+
+	// the same map inside the ROI does fix the pixel
+	CHECK(hot.Prepare(map, MakeGeometry(4, 4, 4, 4, ASI_FLIP_NONE, 1, 0, 0), false));
+	hot.Apply(&frame[0]);
+	CHECK(frame == std::vector<unsigned char>(16, 9));
+}
+
+int main()
+{
+	TestRandom rnd(13);
+	CheckDetection();
+	CheckFileRoundTrip();
+	ASI_FLIP_STATUS flips[] = { ASI_FLIP_NONE, ASI_FLIP_HORIZ, ASI_FLIP_VERT, ASI_FLIP_BOTH };
+	for (int k = 0; k < 4; k++)
+	{
+		for (int bayer = 0; bayer < 2; bayer++)
+		{
+			CheckReplacement<unsigned char>(flips[k], bayer != 0, rnd);
+			CheckReplacement<unsigned short>(flips[k], bayer != 0, rnd);
+		}
+	}
+	CheckMismatch();
+	return TestResult("HotPixelsTest");
+}
@@ -0,0 +1,138 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          LatencyHistogramTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Bucket bounds, percentile ranks and concurrent recording of the
+//                latency histograms
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "LatencyHistogram.h"
+#include "TestCheck.h"
+
+#include <thread>
+#include <vector>
+
+// top of the bucket v falls into: alone with a larger sample, p50 lands in
+// v's bucket and the clamp to the maximum does not apply
+static unsigned long long Top(unsigned long long v)
+{
+	LatencyHistogram h;
+	h.Record(v);
+	h.Record(1ULL << 40);
+	return h.GetPercentile(0.5);
+}
+
+/**
+* Buckets tile the range without gaps: every value lies in a bucket whose
+* top is at most 12.5% above it (exact below 8), the top of a bucket is in
+* that bucket, and the value after a top starts the next one.
+*/
+static void CheckBuckets()
+{
+	unsigned long long prevTop = 0;
+	for (unsigned long long v = 0; v < (1 << 16); v++)
+	{
+		unsigned long long top = Top(v);
+		CHECK_AT(top >= v, "v=%llu top=%llu", v, top);
+		CHECK_AT(v < 8 ? top == v : top - v < v / 8, "v=%llu top=%llu", v, top);
+		CHECK_AT(v == 0 || top == prevTop || prevTop == v - 1, "v=%llu top=%llu prev=%llu", v, top, prevTop);
+		prevTop = top;
+	}
+	TestRandom rnd(1);
+	for (int i = 0; i < 20000; i++)
+	{
+		int bits = 16 + (int)(rnd.Next() % 24);
+		unsigned long long v = ((unsigned long long)rnd.Next() << 32 | rnd.Next()) >> (64 - bits);
+		unsigned long long top = Top(v);
+		CHECK_AT(top >= v && top - v <= v / 8, "v=%llu top=%llu", v, top);
+		CHECK_AT(Top(top) == top, "v=%llu top=%llu", v, top);
+		CHECK_AT(Top(top + 1) > top, "v=%llu top=%llu", v, top);
+	}
+}
+
+// ranks are ceil(q * n): p50 of three samples is the second
+static void CheckPercentiles()
+{
+	LatencyHistogram h;
+	CHECK(h.GetPercentile(0.5) == 0);
+	CHECK(h.GetCount() == 0);
+
+	h.Record(1);
+	h.Record(2);
+	h.Record(3);
+	CHECK(h.GetPercentile(0.5) == 2);
+	CHECK(h.GetPercentile(0.0) == 1);
+	CHECK(h.GetPercentile(0.34) == 2);
+	CHECK(h.GetPercentile(0.67) == 3);
+	CHECK(h.GetPercentile(1.0) == 3);
+	CHECK(h.GetMax() == 3);
+
+	// k of 100 samples at 1 and the rest at 2: pk is 1, p(k+1) is 2, even
+	// where k / 100.0 * 100 comes out a little above k
+	for (int k = 1; k < 100; k++)
+	{
+		h.Reset();
+		for (int i = 0; i < 100; i++)
+			h.Record(i < k ? 1 : 2);
+		CHECK_AT(h.GetPercentile(k / 100.0) == 1, "p%d", k);
+		CHECK_AT(h.GetPercentile((k + 1) / 100.0) == 2, "p%d", k + 1);
+	}
+
+	// a percentile is never above the largest sample
+	h.Reset();
+	h.Record(1000);
+	CHECK(h.GetPercentile(0.5) == 1000);
+	CHECK(h.GetPercentile(0.999) == 1000);
+	h.Record(5);
+	CHECK(h.GetPercentile(0.5) == 5);
+	CHECK(h.GetPercentile(1.0) == 1000);
+	CHECK(h.GetCount() == 2);
+
+	h.Reset();
+	CHECK(h.GetCount() == 0);
+	CHECK(h.GetMax() == 0);
+	CHECK(h.GetPercentile(0.99) == 0);
+}
+
+static void RecordMany(LatencyHistogram* pHist, int thread, int num)
+{
+	for (int i = 0; i < num; i++)
+		pHist->Record((unsigned long long)(i % 1000) + thread);
+}
+
+// relaxed increments from several threads lose nothing
+static void CheckConcurrentRecord()
+{
+	LatencyHistogram h;
+	const int threads = 4, num = 200000;
+	std::vector<std::thread> thds;
+	for (int t = 0; t < threads; t++)
+		thds.push_back(std::thread(RecordMany, &h, t, num));
+	for (size_t i = 0; i < thds.size(); i++)
+		thds[i].join();
+	CHECK(h.GetCount() == (unsigned long long)threads * num);
+	CHECK(h.GetMax() == 999 + threads - 1);
+}
+
+int main()
+{
+	CheckBuckets();
+	CheckPercentiles();
+	CheckConcurrentRecord();
+	return TestResult("LatencyHistogramTest");
+}
@@ -0,0 +1,302 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PixelKernelsTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Every SIMD kernel set against the scalar one, bit for bit, for
+//                run lengths 0..N and unaligned sources and destinations
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "PixelKernels.h"
+#include "TestCheck.h"
+
+#include <cstring>
+#include <vector>
+
+// longer than any SIMD step and its remainder loop
+static const size_t g_MaxRun = 200;
+// bytes either side of a destination that no kernel may touch
+static const size_t g_Guard = 64;
+static const unsigned char g_GuardByte = 0xA5;
+
+static void Fill(std::vector<unsigned char>& buf, TestRandom& rnd)
+{
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = (unsigned char)(rnd.Next() >> 24);
+}
+
+static bool GuardIntact(const std::vector<unsigned char>& buf, size_t offset, size_t bytes)
+{
+	for (size_t i = 0; i < offset; i++)
+		if (buf[i] != g_GuardByte)
+			return false;
+	for (size_t i = offset + bytes; i < buf.size(); i++)
+		if (buf[i] != g_GuardByte)
+			return false;
+	return true;
+}
+
+typedef void (*ConvertFn)(const unsigned char* pSrc, unsigned char* pDst, size_t pixels);
+
+// the same source through both kernels, at every alignment of the source
+// (step srcAlign) and of the destination
+static void CheckConvert(const char* kernel, const char* set, ConvertFn ref, ConvertFn fn, size_t srcBpp, size_t dstBpp, size_t srcAlign)
+{
+	TestRandom rnd(1);
+	for (size_t n = 0; n <= g_MaxRun; n++)
+	{
+		for (size_t so = 0; so < 32; so += srcAlign)
+		{
+			size_t dso = (so / srcAlign) % 4 * srcAlign;
+			std::vector<unsigned char> src(n * srcBpp + so + g_Guard);
+			Fill(src, rnd);
+			std::vector<unsigned char> want(n * dstBpp + g_Guard * 2, g_GuardByte);
+			std::vector<unsigned char> got(want.size() + dso, g_GuardByte);
+			ref(&src[so], &want[g_Guard], n);
+			fn(&src[so], &got[g_Guard + dso], n);
+			CHECK_AT(memcmp(&want[g_Guard], &got[g_Guard + dso], n * dstBpp) == 0, "%s %s n=%zu src+%zu", kernel, set, n, so);
+			CHECK_AT(GuardIntact(got, g_Guard + dso, n * dstBpp), "%s %s n=%zu src+%zu", kernel, set, n, so);
+		}
+	}
+}
+
+static void CheckAccumRows(const PixelKernels& ref, const PixelKernels& k)
+{
+	TestRandom rnd(2);
+	for (size_t n = 0; n <= g_MaxRun; n++)
+	{
+		for (size_t so = 0; so < 32; so += 2)
+		{
+			std::vector<unsigned char> src(n * 2 + so + g_Guard);
+			Fill(src, rnd);
+
+			std::vector<unsigned short> acc8(n + 8);
+			for (size_t i = 0; i < acc8.size(); i++)
+				acc8[i] = (unsigned short)(rnd.Next() & 0x7FFF);
+			std::vector<unsigned short> want8(acc8), got8(acc8);
+			ref.AccumRow8(&src[so], &want8[1], n);
+			k.AccumRow8(&src[so], &got8[1], n);
+			CHECK_AT(want8 == got8, "AccumRow8 %s n=%zu src+%zu", k.Name, n, so);
+
+			for (int shift = 0; shift <= 4; shift++)
+			{
+				std::vector<unsigned int> acc16(n + 8);
+				for (size_t i = 0; i < acc16.size(); i++)
+					acc16[i] = rnd.Next() & 0x7FFFFFF;
+				std::vector<unsigned int> want16(acc16), got16(acc16);
+				ref.AccumRow16(&src[so], &want16[1], n, shift);
+				k.AccumRow16(&src[so], &got16[1], n, shift);
+				CHECK_AT(want16 == got16, "AccumRow16 %s n=%zu src+%zu shift=%d", k.Name, n, so, shift);
+			}
+		}
+	}
+}
+
+// gains and offsets that push some samples below zero and past the top,
+// and some exactly onto the rounding boundary
+static void FillCalibration(std::vector<float>& gain, std::vector<float>& offset, TestRandom& rnd, float range)
+{
+	for (size_t i = 0; i < gain.size(); i++)
+	{
+		gain[i] = (float)rnd.Uniform(0.25, 2.5);
+		offset[i] = (float)rnd.Uniform(-0.3 * range, 0.3 * range);
+		if (i % 7 == 0)
+		{
+			gain[i] = 1.0f;
+			offset[i] = 0.5f;
+		}
+	}
+}
+
+static void CheckCalibrate(const PixelKernels& ref, const PixelKernels& k)
+{
+	TestRandom rnd(3);
+	for (size_t n = 0; n <= g_MaxRun; n++)
+	{
+		for (size_t o = 0; o < 16; o++)
+		{
+			std::vector<float> gain(n + o + 1), offset(n + o + 1);
+			FillCalibration(gain, offset, rnd, 255.0f);
+			std::vector<unsigned char> data8(n + o + g_Guard);
+			Fill(data8, rnd);
+			std::vector<unsigned char> want8(data8), got8(data8);
+			ref.Calibrate8(&want8[o], &gain[o], &offset[o], n);
+			k.Calibrate8(&got8[o], &gain[o], &offset[o], n);
+			CHECK_AT(want8 == got8, "Calibrate8 %s n=%zu +%zu", k.Name, n, o);
+
+			FillCalibration(gain, offset, rnd, 65535.0f);
+			std::vector<unsigned short> data16(n + o + g_Guard);
+			for (size_t i = 0; i < data16.size(); i++)
+				data16[i] = (unsigned short)rnd.Next();
+			std::vector<unsigned short> want16(data16), got16(data16);
+			ref.Calibrate16(&want16[o], &gain[o], &offset[o], n);
+			k.Calibrate16(&got16[o], &gain[o], &offset[o], n);
+			CHECK_AT(want16 == got16, "Calibrate16 %s n=%zu +%zu", k.Name, n, o);
+		}
+	}
+}
+
+static bool SameSums(const SampleSums& a, const SampleSums& b)
+{
+	return a.Min == b.Min && a.Max == b.Max && a.Sum == b.Sum && a.SumSq == b.SumSq;
+}
+
+static void CheckSums(const PixelKernels& ref, const PixelKernels& k)
+{
+	TestRandom rnd(4);
+	for (size_t n = 0; n <= g_MaxRun; n++)
+	{
+		for (size_t o = 0; o < 16; o++)
+		{
+			std::vector<unsigned short> data(n + o);
+			for (size_t i = 0; i < data.size(); i++)
+				data[i] = (unsigned short)rnd.Next();
+			SampleSums want = { 0xFFFF, 0, 0, 0 }, got = { 0xFFFF, 0, 0, 0 };
+			ref.Sums16(data.empty() ? 0 : &data[o], n, &want);
+			k.Sums16(data.empty() ? 0 : &data[o], n, &got);
+			CHECK_AT(SameSums(want, got), "Sums16 %s n=%zu +%zu", k.Name, n, o);
+		}
+	}
+	// saturated runs long enough to wrap a 32-bit lane that is not flushed in time
+	size_t n = (1 << 20) + 13;
+	std::vector<unsigned short> data(n, 0xFFFF);
+	data[n / 2] = 3;
+	SampleSums want = { 0xFFFF, 0, 0, 0 }, got = { 0xFFFF, 0, 0, 0 };
+	ref.Sums16(&data[0], n, &want);
+	k.Sums16(&data[0], n, &got);
+	CHECK_AT(SameSums(want, got), "Sums16 %s n=%zu saturated", k.Name, n);
+	// running totals carry over between calls
+	SampleSums first = { 0xFFFF, 0, 0, 0 };
+	k.Sums16(&data[0], n / 3, &first);
+	k.Sums16(&data[n / 3], n - n / 3, &first);
+	CHECK_AT(SameSums(want, first), "Sums16 %s split", k.Name);
+}
+
+template <class T>
+static void CheckStackAccum(const char* kernel, const char* set,
+	void (*ref)(const T*, unsigned int*, size_t, int), void (*fn)(const T*, unsigned int*, size_t, int))
+{
+	TestRandom rnd(5);
+	unsigned int maxV = (T)~0;
+	for (size_t n = 0; n <= g_MaxRun; n++)
+	{
+		for (size_t o = 0; o < 16; o++)
+		{
+			std::vector<T> src(n + o + 1);
+			for (size_t i = 0; i < src.size(); i++)
+				src[i] = (T)rnd.Next();
+			for (int op = STACK_ACC_COPY; op <= STACK_ACC_MAX; op++)
+			{
+				std::vector<unsigned int> acc(n + o + 1);
+				for (size_t i = 0; i < acc.size(); i++)
+					acc[i] = op == STACK_ACC_ADD ? rnd.Next() >> 1 : rnd.Next() % (maxV + 1);
+				std::vector<unsigned int> want(acc), got(acc);
+				ref(&src[o], &want[o], n, op);
+				fn(&src[o], &got[o], n, op);
+				CHECK_AT(want == got, "%s %s n=%zu +%zu op=%d", kernel, set, n, o, op);
+			}
+		}
+	}
+}
+
+// several frames into both sets of planes, which must stay identical bit
+// for bit; every 5th sample jumps far out in one frame to be clipped
+template <class T>
+static void CheckClipAccum(const char* kernel, const char* set,
+	void (*ref)(const T*, const ClipStats&, size_t, int, float), void (*fn)(const T*, const ClipStats&, size_t, int, float))
+{
+	TestRandom rnd(6);
+	float maxV = (float)(T)~0;
+	const int frames = 7;
+	for (size_t n = 0; n <= g_MaxRun; n += 3)
+	{
+		for (size_t o = 0; o < 8; o++)
+		{
+			std::vector<float> want((n + o) * 4 + 1), got(want.size());
+			size_t len = n + o;
+			ClipStats sw = { &want[o], &want[len + o], &want[len * 2 + o], &want[len * 3 + o] };
+			ClipStats sg = { &got[o], &got[len + o], &got[len * 2 + o], &got[len * 3 + o] };
+			std::vector<T> src(n + o + 1);
+			for (int f = 0; f < frames; f++)
+			{
+				for (size_t i = 0; i < src.size(); i++)
+				{
+					float base = maxV * 0.4f + (float)(rnd.Next() % 32);
+					src[i] = (T)(f == 4 && i % 5 == 0 ? maxV : base);
+				}
+				ref(&src[o], sw, n, f, 2.5f * 2.5f);
+				fn(&src[o], sg, n, f, 2.5f * 2.5f);
+			}
+			CHECK_AT(memcmp(&want[0], &got[0], want.size() * sizeof(float)) == 0, "%s %s n=%zu +%zu", kernel, set, n, o);
+		}
+	}
+}
+
+// random rows around every run, the kernels read one sample either side
+template <class T>
+static void CheckBilinearPairs(const char* kernel, const char* set,
+	void (*ref)(const T*, const T*, const T*, T*, size_t, bool), void (*fn)(const T*, const T*, const T*, T*, size_t, bool))
+{
+	TestRandom rnd(7);
+	for (size_t n = 0; n <= g_MaxRun / 2; n++)
+	{
+		for (size_t o = 1; o < 17; o++)
+		{
+			size_t len = n * 2 + o + 1;
+			std::vector<T> rows(len * 3);
+			for (size_t i = 0; i < rows.size(); i++)
+				rows[i] = (T)rnd.Next();
+			for (int red = 0; red < 2; red++)
+			{
+				std::vector<T> want(n * 8 + 8, (T)g_GuardByte), got(want);
+				ref(&rows[o], &rows[len + o], &rows[len * 2 + o], &want[4], n, red != 0);
+				fn(&rows[o], &rows[len + o], &rows[len * 2 + o], &got[4], n, red != 0);
+				CHECK_AT(want == got, "%s %s n=%zu +%zu red=%d", kernel, set, n, o, red);
+			}
+		}
+	}
+}
+
+int main()
+{
+	const PixelKernels* pKernels[8];
+	int num = GetSupportedPixelKernels(pKernels, 8);
+	CHECK(num >= 1);
+	CHECK(strcmp(pKernels[0]->Name, "scalar") == 0);
+	CHECK(&GetPixelKernels() == pKernels[num - 1]);
+	const PixelKernels& ref = *pKernels[0];
+	for (int i = 1; i < num; i++)
+	{
+		const PixelKernels& k = *pKernels[i];
+		printf("checking %s kernels\n", k.Name);
+		CheckConvert("RGB24ToRGBA32", k.Name, ref.RGB24ToRGBA32, k.RGB24ToRGBA32, 3, 4, 1);
+		CheckConvert("RGB24ToRGBA64", k.Name, ref.RGB24ToRGBA64, k.RGB24ToRGBA64, 3, 8, 1);
+		CheckConvert("Raw16To12", k.Name, ref.Raw16To12, k.Raw16To12, 2, 2, 2);
+		CheckAccumRows(ref, k);
+		CheckCalibrate(ref, k);
+		CheckSums(ref, k);
+		CheckStackAccum("StackAccum8", k.Name, ref.StackAccum8, k.StackAccum8);
+		CheckStackAccum("StackAccum16", k.Name, ref.StackAccum16, k.StackAccum16);
+		CheckClipAccum("ClipAccum8", k.Name, ref.ClipAccum8, k.ClipAccum8);
+		CheckClipAccum("ClipAccum16", k.Name, ref.ClipAccum16, k.ClipAccum16);
+		CheckBilinearPairs("BilinearPairs8", k.Name, ref.BilinearPairs8, k.BilinearPairs8);
+		CheckBilinearPairs("BilinearPairs16", k.Name, ref.BilinearPairs16, k.BilinearPairs16);
+	}
+	if (num == 1)
+		printf("only scalar kernels on this CPU, nothing to compare\n");
+	return TestResult("PixelKernelsTest");
+}
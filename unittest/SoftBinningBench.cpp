@@ -0,0 +1,112 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SoftBinningBench.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Throughput of software binning next to the transfer time SDK
+//                binning saves, for typical sensor sizes
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "SoftBinning.h"
+#include "PixelKernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+* SDK binning needs a camera, so its side of the comparison is what it
+* saves: the USB transfer of the unbinned frame against the binned one,
+* at the USB3 rate the adapter assumes for its readout estimate. Software
+* binning pays the full transfer and then the host time measured here,
+* single threaded; the adapter spreads it over the worker pool.
+*
+* Not part of "make check"; build with "make unittest/SoftBinningBench"
+* and pass a repeat count to change the default of 20.
+*/
+static const double g_Usb3BytesPerMs = 350e3;
+
+struct BenchCase
+{
+	const char* Name;
+	int Width, Height;
+	int Channels, InBytes, OutBytes, Shift;
+	int Bin;
+	bool bAverage;
+};
+
+static double MedianMs(std::vector<double>& times)
+{
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+int main(int argc, char** argv)
+{
+	int repeats = argc > 1 ? atoi(argv[1]) : 20;
+	if (repeats < 1)
+		repeats = 1;
+	const BenchCase cases[] = {
+		{ "3096x2080 RAW8  bin2 avg", 3096, 2080, 1, 1, 1, 0, 2, true },
+		{ "3096x2080 RAW16 bin2 avg", 3096, 2080, 1, 2, 2, 0, 2, true },
+		{ "3096x2080 RAW16 bin2 sum", 3096, 2080, 1, 2, 2, 0, 2, false },
+		{ "3096x2080 RAW12 bin4 avg", 3096, 2080, 1, 2, 2, 4, 4, true },
+		{ "3096x2080 RGB24 bin2 avg", 3096, 2080, 3, 1, 1, 0, 2, true },
+		{ "6248x4176 RAW16 bin2 avg", 6248, 4176, 1, 2, 2, 0, 2, true },
+		{ "6248x4176 RAW16 bin3 avg", 6248, 4176, 1, 2, 2, 0, 3, true },
+		{ "6248x4176 RAW16 bin4 avg", 6248, 4176, 1, 2, 2, 0, 4, true },
+	};
+	printf("kernels: %s, median of %d runs\n", GetPixelKernels().Name, repeats);
+	printf("%-26s %10s %10s %10s %12s %12s\n", "case", "soft ms", "Mpix/s", "max fps", "USB full ms", "USB bin ms");
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		const BenchCase& b = cases[c];
+		size_t srcBytes = (size_t)b.Width * b.Height * b.Channels * b.InBytes;
+		size_t dstBytes = (size_t)(b.Width / b.Bin) * (b.Height / b.Bin) * b.Channels * b.OutBytes;
+		std::vector<unsigned char> src(srcBytes), dst(dstBytes);
+		for (size_t i = 0; i < srcBytes; i++)
+			src[i] = (unsigned char)(i * 2654435761u >> 24);
+
+		SoftBinJob job;
+		job.pSrc = &src[0];
+		job.pDst = &dst[0];
+		job.SrcWidth = b.Width;
+		job.Channels = b.Channels;
+		job.InBytes = b.InBytes;
+		job.OutBytes = b.OutBytes;
+		job.Shift = b.Shift;
+		job.Bin = b.Bin;
+		job.bAverage = b.bAverage;
+
+		SoftBinRows(&job, 0, b.Height / b.Bin);//warm up caches and page in dst
+		std::vector<double> times;
+		for (int r = 0; r < repeats; r++)
+		{
+			std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			SoftBinRows(&job, 0, b.Height / b.Bin);
+			std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+			times.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+		}
+		double ms = MedianMs(times);
+		printf("%-26s %10.2f %10.1f %10.1f %12.2f %12.2f\n", b.Name, ms,
+			(double)b.Width * b.Height / ms / 1e3, 1000.0 / ms,
+			srcBytes / g_Usb3BytesPerMs, dstBytes / g_Usb3BytesPerMs);
+	}
+	return 0;
+}
@@ -0,0 +1,124 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SoftBinningTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Software binning against a naive per-pixel reference
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "SoftBinning.h"
+#include "TestCheck.h"
+
+#include <vector>
+
+static unsigned int ReadSample(const SoftBinJob& job, const std::vector<unsigned char>& src, size_t index)
+{
+	if (job.InBytes == 1)
+		return src[index];
+	return (src[index * 2] | (src[index * 2 + 1] << 8)) >> job.Shift;
+}
+
+// straight from the definition: one output sample at a time
+static std::vector<unsigned char> NaiveBin(const SoftBinJob& job, const std::vector<unsigned char>& src, int srcHeight)
+{
+	int outWidth = job.SrcWidth / job.Bin, outHeight = srcHeight / job.Bin;
+	unsigned int n = job.Bin * job.Bin;
+	unsigned int maxOut = job.OutBytes == 1 ? 0xFF : 0xFFFF;
+	std::vector<unsigned char> dst((size_t)outWidth * outHeight * job.Channels * job.OutBytes);
+	size_t o = 0;
+	for (int y = 0; y < outHeight; y++)
+	{
+		for (int x = 0; x < outWidth; x++)
+		{
+			for (int c = 0; c < job.Channels; c++)
+			{
+				unsigned int sum = 0;
+				for (int j = 0; j < job.Bin; j++)
+					for (int i = 0; i < job.Bin; i++)
+						sum += ReadSample(job, src, ((size_t)(y * job.Bin + j) * job.SrcWidth + x * job.Bin + i) * job.Channels + c);
+				if (job.bAverage)
+					sum = (sum + n / 2) / n;
+				else if (sum > maxOut)
+					sum = maxOut;
+				dst[o++] = (unsigned char)sum;
+				if (job.OutBytes == 2)
+					dst[o++] = (unsigned char)(sum >> 8);
+			}
+		}
+	}
+	return dst;
+}
+
+static void CheckCase(TestRandom& rnd, int width, int height, int channels, int inBytes, int outBytes, int shift, int bin, bool bAverage)
+{
+	std::vector<unsigned char> src((size_t)width * height * channels * inBytes);
+	for (size_t i = 0; i < src.size(); i++)
+		src[i] = (unsigned char)(rnd.Next() >> 24);
+	// a saturated corner so sums clamp
+	for (size_t i = 0; i < src.size() / 8; i++)
+		src[i] = 0xFF;
+
+	SoftBinJob job;
+	job.pSrc = &src[0];
+	job.SrcWidth = width;
+	job.Channels = channels;
+	job.InBytes = inBytes;
+	job.OutBytes = outBytes;
+	job.Shift = shift;
+	job.Bin = bin;
+	job.bAverage = bAverage;
+	std::vector<unsigned char> want = NaiveBin(job, src, height);
+
+	int outHeight = height / bin;
+	std::vector<unsigned char> got(want.size() + 1, 0xA5);
+	job.pDst = &got[0];
+	SoftBinRows(&job, 0, outHeight);
+	CHECK_AT(std::vector<unsigned char>(got.begin(), got.end() - 1) == want,
+		"%dx%d ch=%d in=%d out=%d shift=%d bin=%d avg=%d", width, height, channels, inBytes, outBytes, shift, bin, (int)bAverage);
+	CHECK_AT(got.back() == 0xA5, "%dx%d bin=%d overrun", width, height, bin);
+
+	// stripes the way WorkerPool hands them out give the same frame
+	std::vector<unsigned char> striped(want.size() + 1, 0xA5);
+	job.pDst = &striped[0];
+	for (int y = 0; y < outHeight; y += 3)
+		SoftBinRows(&job, y, y + 3 < outHeight ? y + 3 : outHeight);
+	CHECK_AT(striped == got, "%dx%d bin=%d striped", width, height, bin);
+}
+
+int main()
+{
+	TestRandom rnd(8);
+	const int sizes[][2] = { { 8, 8 }, { 37, 23 }, { 64, 48 }, { 131, 67 } };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		for (int bin = 1; bin <= 4; bin++)
+		{
+			for (int channels = 1; channels <= 3; channels += 2)
+			{
+				for (int avg = 0; avg <= 1; avg++)
+				{
+					CheckCase(rnd, sizes[s][0], sizes[s][1], channels, 1, 1, 0, bin, avg != 0);
+					CheckCase(rnd, sizes[s][0], sizes[s][1], channels, 1, 2, 0, bin, avg != 0);
+					CheckCase(rnd, sizes[s][0], sizes[s][1], channels, 2, 2, 0, bin, avg != 0);
+					CheckCase(rnd, sizes[s][0], sizes[s][1], channels, 2, 2, 4, bin, avg != 0);
+					CheckCase(rnd, sizes[s][0], sizes[s][1], channels, 2, 1, 8, bin, avg != 0);
+				}
+			}
+		}
+	}
+	return TestResult("SoftBinningTest");
+}
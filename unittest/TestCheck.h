@@ -0,0 +1,79 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          TestCheck.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Minimal checks shared by the unit test programs
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#pragma once
+
+#include <cstdio>
+
+/**
+* Each test program checks one module on its own: no Micro-Manager core,
+* no SDK library, no camera. A failed CHECK is reported with its file and
+* line, the program carries on and exits non-zero from TestResult().
+*/
+static int g_TestFailures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			if (g_TestFailures++ < 20) \
+				fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		} \
+	} while (0)
+
+// CHECK with the loop state that led to the failure
+#define CHECK_AT(cond, fmt, ...) \
+	do { \
+		if (!(cond)) \
+		{ \
+			if (g_TestFailures++ < 20) \
+				fprintf(stderr, "%s:%d: CHECK(%s) failed at " fmt "\n", __FILE__, __LINE__, #cond, __VA_ARGS__); \
+		} \
+	} while (0)
+
+static int TestResult(const char* name)
+{
+	if (g_TestFailures)
+		fprintf(stderr, "%s: %d checks failed\n", name, g_TestFailures);
+	else
+		printf("%s: ok\n", name);
+	return g_TestFailures ? 1 : 0;
+}
+
+// xorshift32, fixed seeds so a failure reproduces
+class TestRandom
+{
+public:
+	TestRandom(unsigned int seed) : state(seed ? seed : 1) {}
+	unsigned int Next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+	// uniform in [lo, hi)
+	double Uniform(double lo, double hi) { return lo + (hi - lo) * (Next() >> 8) / 16777216.0; }
+
+private:
+	unsigned int state;
+};
@@ -0,0 +1,129 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WorkerPoolBench.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Scaling of the RGB24 expansion and 16->12 bit conversion over
+//                1..8 worker pool threads
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "WorkerPool.h"
+#include "PixelKernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+/**
+* The same stripes as ASICamera::ConvertStripe on the same pool set-up as
+* ASICamera::RunStripes: about four stripes per thread, at least 8 rows.
+* Speed-up is against one thread with the same kernels; on a frame that
+* does not fit the caches it levels off where memory bandwidth runs out.
+*
+* Not part of "make check"; build with "make unittest/WorkerPoolBench"
+* and pass a repeat count to change the default of 20. Threads are not
+* pinned, so close other load and compare runs on the same machine.
+*/
+struct ConvertJob
+{
+	void (*Kernel)(const unsigned char* pSrc, unsigned char* pDst, size_t pixels);
+	const unsigned char* pSrc;
+	unsigned char* pDst;
+	size_t SrcLineBytes, DstLineBytes;
+	int Width;
+};
+
+static void ConvertStripe(void* pCtx, int rowBegin, int rowEnd)
+{
+	const ConvertJob* pJob = (const ConvertJob*)pCtx;
+	pJob->Kernel(pJob->pSrc + rowBegin * pJob->SrcLineBytes, pJob->pDst + rowBegin * pJob->DstLineBytes,
+		(size_t)(rowEnd - rowBegin) * pJob->Width);
+}
+
+struct BenchCase
+{
+	const char* Name;
+	int Width, Height;
+	int SrcBpp, DstBpp;
+	int Kernel;				// 0 RGB24ToRGBA32, 1 RGB24ToRGBA64, 2 Raw16To12
+};
+
+static double MedianMs(std::vector<double>& times)
+{
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+int main(int argc, char** argv)
+{
+	int repeats = argc > 1 ? atoi(argv[1]) : 20;
+	if (repeats < 1)
+		repeats = 1;
+	const int maxThreads = 8;
+	const BenchCase cases[] = {
+		{ "3096x2080 RGB24->RGBA32", 3096, 2080, 3, 4, 0 },
+		{ "3096x2080 RGB24->RGBA64", 3096, 2080, 3, 8, 1 },
+		{ "3096x2080 RAW16->12", 3096, 2080, 2, 2, 2 },
+		{ "6248x4176 RGB24->RGBA32", 6248, 4176, 3, 4, 0 },
+		{ "6248x4176 RAW16->12", 6248, 4176, 2, 2, 2 },
+	};
+	const PixelKernels& kernels = GetPixelKernels();
+	printf("kernels: %s, hardware threads: %u, median of %d runs\n", kernels.Name, std::thread::hardware_concurrency(), repeats);
+	printf("%-24s %7s %10s %10s %9s\n", "case", "threads", "ms", "MB/s out", "speed-up");
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		const BenchCase& b = cases[c];
+		std::vector<unsigned char> src((size_t)b.Width * b.Height * b.SrcBpp), dst((size_t)b.Width * b.Height * b.DstBpp);
+		for (size_t i = 0; i < src.size(); i++)
+			src[i] = (unsigned char)(i * 2654435761u >> 24);
+
+		ConvertJob job;
+		job.Kernel = b.Kernel == 0 ? kernels.RGB24ToRGBA32 : (b.Kernel == 1 ? kernels.RGB24ToRGBA64 : kernels.Raw16To12);
+		job.pSrc = &src[0];
+		job.pDst = &dst[0];
+		job.SrcLineBytes = (size_t)b.Width * b.SrcBpp;
+		job.DstLineBytes = (size_t)b.Width * b.DstBpp;
+		job.Width = b.Width;
+
+		double oneThreadMs = 0;
+		for (int threads = 1; threads <= maxThreads; threads++)
+		{
+			WorkerPool pool;
+			pool.Start(threads, 0);
+			int stripeRows = b.Height / (threads * 4);
+			stripeRows = stripeRows < 8 ? 8 : stripeRows;
+			pool.Run(b.Height, stripeRows, ConvertStripe, &job);	// wakes the workers and pages in dst
+			std::vector<double> times;
+			for (int r = 0; r < repeats; r++)
+			{
+				std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+				pool.Run(b.Height, stripeRows, ConvertStripe, &job);
+				std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+				times.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+			}
+			double ms = MedianMs(times);
+			if (threads == 1)
+				oneThreadMs = ms;
+			printf("%-24s %7d %10.2f %10.0f %9.2f\n", threads == 1 ? b.Name : "", threads, ms,
+				dst.size() / ms / 1e3, oneThreadMs / ms);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,175 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WorkerPoolTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Every row of a Run() exactly once for 1..9 threads, stealing
+//                from a slow share and concurrent Run() calls
+//
+// AUTHOR:        Mikhail Latyshov
+//
+// COPYRIGHT:     2024 Mikhail Latyshov
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include "WorkerPool.h"
+#include "TestCheck.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/**
+* Counts the visits of every row and remembers which thread ran each
+* stripe. Rows before SlowRows sleep, which makes the shares uneven even
+* on a single core: the owner of the first share is still busy when the
+* others run out.
+*/
+struct RowJob
+{
+	std::vector<std::atomic<int> > Visits;		// rows plus a guard row that must stay 0
+	std::vector<std::thread::id> Runner;		// per row, written by the stripe that has it
+	int SlowRows;
+	int SpinRows;
+
+	RowJob(int rows) : Visits(rows + 1), Runner(rows + 1), SlowRows(0), SpinRows(0)
+	{
+		for (size_t i = 0; i < Visits.size(); i++)
+			Visits[i].store(0);
+	}
+};
+
+static void VisitRows(void* pCtx, int rowBegin, int rowEnd)
+{
+	RowJob* pJob = (RowJob*)pCtx;
+	for (int y = rowBegin; y < rowEnd; y++)
+	{
+		pJob->Visits[y].fetch_add(1);
+		pJob->Runner[y] = std::this_thread::get_id();
+		if (y < pJob->SlowRows)
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		// uneven cost that does not sleep: rows get dearer towards the end
+		volatile unsigned int spin = 0;
+		for (int i = 0; i < (y % pJob->SpinRows + 1) * 50; i++)
+			spin = spin + i;
+	}
+}
+
+static bool EveryRowOnce(const RowJob& job, int rows)
+{
+	for (int y = 0; y < rows; y++)
+		if (job.Visits[y].load() != 1)
+			return false;
+	return job.Visits[rows].load() == 0;
+}
+
+static void CheckEveryRowOnce()
+{
+	const int rowCounts[] = { 1, 2, 7, 64, 97, 1000, 2080 };
+	const int stripeRows[] = { 0, 1, 3, 8, 64, 5000 };
+	for (int threads = 1; threads <= 9; threads++)
+	{
+		WorkerPool pool;
+		pool.Start(threads, 0);
+		CHECK_AT(pool.GetParallelism() == threads, "threads=%d", threads);
+		for (size_t r = 0; r < sizeof(rowCounts) / sizeof(rowCounts[0]); r++)
+		{
+			for (size_t s = 0; s < sizeof(stripeRows) / sizeof(stripeRows[0]); s++)
+			{
+				int rows = rowCounts[r];
+				RowJob job(rows);
+				job.SpinRows = 13;
+				pool.Run(rows, stripeRows[s], VisitRows, &job);
+				CHECK_AT(EveryRowOnce(job, rows), "threads=%d rows=%d stripe=%d", threads, rows, stripeRows[s]);
+			}
+		}
+		// nothing to do is not a job
+		RowJob empty(0);
+		empty.SpinRows = 1;
+		pool.Run(0, 8, VisitRows, &empty);
+		CHECK_AT(empty.Visits[0].load() == 0, "threads=%d empty", threads);
+	}
+}
+
+/**
+* The first share sleeps through each of its rows, so the other
+* participants finish theirs and have to steal from it. More than one
+* thread must end up running rows of that share, and still each row once.
+*/
+static void CheckStealing()
+{
+	for (int threads = 2; threads <= 9; threads++)
+	{
+		WorkerPool pool;
+		pool.Start(threads, 0);
+		const int stripes = threads * 8, rows = stripes * 2;
+		RowJob job(rows);
+		job.SlowRows = rows / threads;
+		job.SpinRows = 1;
+		pool.Run(rows, 2, VisitRows, &job);
+		CHECK_AT(EveryRowOnce(job, rows), "threads=%d", threads);
+		std::vector<std::thread::id> runners(job.Runner.begin(), job.Runner.begin() + job.SlowRows);
+		std::sort(runners.begin(), runners.end());
+		size_t distinct = std::unique(runners.begin(), runners.end()) - runners.begin();
+		CHECK_AT(distinct >= 2, "threads=%d runners=%zu", threads, distinct);
+	}
+}
+
+static const int g_ConcurrentRows = 301;
+
+static void RunMany(WorkerPool* pPool, int caller, std::atomic<int>* pFailures)
+{
+	for (int r = 0; r < 50; r++)
+	{
+		RowJob job(g_ConcurrentRows);
+		job.SpinRows = 5 + caller;
+		pPool->Run(g_ConcurrentRows, 4 + caller, VisitRows, &job);
+		if (!EveryRowOnce(job, g_ConcurrentRows))
+			pFailures->fetch_add(1);
+	}
+}
+
+// Run() from several threads at once is serialized, no job loses or
+// repeats a row and the pool keeps working afterwards
+static void CheckConcurrentRuns()
+{
+	WorkerPool pool;
+	pool.Start(4, 0);
+	std::atomic<int> failures(0);
+	std::vector<std::thread> callers;
+	for (int c = 0; c < 3; c++)
+		callers.push_back(std::thread(RunMany, &pool, c, &failures));
+	for (size_t i = 0; i < callers.size(); i++)
+		callers[i].join();
+	CHECK_AT(failures.load() == 0, "failed runs=%d", failures.load());
+
+	// restarted with another size, and stopped twice
+	const int rows = g_ConcurrentRows;
+	pool.Start(2, 0);
+	RowJob job(rows);
+	job.SpinRows = 3;
+	pool.Run(rows, 7, VisitRows, &job);
+	CHECK(EveryRowOnce(job, rows));
+	pool.Stop();
+	pool.Stop();
+	CHECK(pool.GetParallelism() == 1);
+}
+
+int main()
+{
+	CheckEveryRowOnce();
+	CheckStealing();
+	CheckConcurrentRuns();
+	return TestResult("WorkerPoolTest");
+}